@@ -0,0 +1,163 @@
+//////////////////////////////////////////////////////////////////////////
+//
+//  Copyright (c) 2018, Toolchefs Ltd. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      * Redistributions of source code must retain the above
+//        copyright notice, this list of conditions and the following
+//        disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following
+//        disclaimer in the documentation and/or other materials provided with
+//        the distribution.
+//
+//      * Neither the name of John Haddon nor the names of
+//        any other contributors to this software may be used to endorse or
+//        promote products derived from this software without specific prior
+//        written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+//  IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+//  THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+//  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+//  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+//  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//////////////////////////////////////////////////////////////////////////
+
+
+#ifndef ATOMSGAFFER_ATOMSAGENTPAGER_H
+#define ATOMSGAFFER_ATOMSAGENTPAGER_H
+
+#include "IECore/CompoundData.h"
+#include "IECore/IndexedIO.h"
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace AtomsGaffer
+{
+
+// Pages the per agent data of the "atoms:agents" payload in and out of a scratch
+// file. When the crowd reader runs out of core, the payload only contains an index
+// pointing at the scratch file, and the agents are loaded on demand one chunk at a
+// time. The loaded chunks are shared by the whole process and are evicted in least
+// recently used order once the memory limit is reached.
+class AtomsAgentPager
+{
+
+    public:
+
+        // Writes the agents of a payload to a scratch file. The agents must be
+        // added in ascending id order. The file is unlinked as soon as it is
+        // created and only accessed through its open descriptor, so the system
+        // reclaims it when the process exits, even if it crashes. It is only
+        // registered under its name by commit(), so a registered file is always
+        // complete and can be reused.
+        class ChunkWriter
+        {
+
+            public:
+
+                ChunkWriter( const std::string& fileName );
+                ~ChunkWriter();
+
+                void addAgent( int agentId, const IECore::ConstCompoundDataPtr& agentData );
+
+                void commit();
+
+            private:
+
+                void flush();
+
+                std::string m_fileName;
+                int m_fd;
+                IECore::IndexedIOPtr m_io;
+                IECore::CompoundDataPtr m_chunk;
+                std::vector<int> m_chunkFirstIds;
+                int m_lastAgentId;
+
+        };
+
+        // Number of agents stored in a single chunk of the scratch file
+        static const size_t chunkSize = 1024;
+
+        static AtomsAgentPager& instance();
+
+        // Returns the data of a single agent from an "atoms:agents" payload, loading
+        // it from the scratch file if the payload has been paged out. Returns null if
+        // the agent doesn't exist.
+        IECore::ConstCompoundDataPtr agentData( const IECore::CompoundData* agents, const std::string& agentId );
+
+        // Returns true if a scratch file has been committed under this name
+        bool hasFile( const std::string& fileName ) const;
+
+        // Fills an "atoms:agents" payload with the index of a committed scratch file
+        void addIndex( const std::string& fileName, IECore::CompoundData* agents );
+
+        static bool isPaged( const IECore::CompoundData* agents );
+
+        void setMemoryLimit( size_t bytes );
+        size_t getMemoryLimit() const;
+
+        // The memory currently used by the resident chunks
+        size_t memoryUsage() const;
+
+        // Evicts all the resident chunks
+        void clear();
+
+    private:
+
+        AtomsAgentPager();
+
+        ~AtomsAgentPager();
+
+        AtomsAgentPager( const AtomsAgentPager& ) = delete;
+
+        AtomsAgentPager& operator=( const AtomsAgentPager& ) = delete;
+
+        IECore::ConstCompoundDataPtr chunk( const std::string& fileName, size_t chunkIndex );
+
+        // Takes ownership of the descriptor of a committed scratch file
+        void registerFile( const std::string& fileName, int fd );
+
+        // Returns the path the open descriptor of a committed scratch file can be read from
+        std::string filePath( const std::string& fileName ) const;
+
+        void evict();
+
+    private:
+
+        typedef std::pair<std::string, size_t> ChunkKey;
+
+        struct Chunk
+        {
+            IECore::ConstCompoundDataPtr data;
+            size_t cost;
+            std::list<ChunkKey>::iterator lruIt;
+        };
+
+        mutable std::mutex m_mutex;
+        std::map<ChunkKey, Chunk> m_chunks;
+        std::list<ChunkKey> m_lru;
+        std::map<std::string, int> m_files;
+        size_t m_memoryUsage;
+        size_t m_memoryLimit;
+
+};
+
+}
+
+#endif //ATOMSGAFFER_ATOMSAGENTPAGER_H
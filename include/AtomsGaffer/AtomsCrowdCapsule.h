@@ -0,0 +1,100 @@
+//////////////////////////////////////////////////////////////////////////
+//
+//  Copyright (c) 2018, Toolchefs Ltd. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      * Redistributions of source code must retain the above
+//        copyright notice, this list of conditions and the following
+//        disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following
+//        disclaimer in the documentation and/or other materials provided with
+//        the distribution.
+//
+//      * Neither the name of John Haddon nor the names of
+//        any other contributors to this software may be used to endorse or
+//        promote products derived from this software without specific prior
+//        written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+//  IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+//  THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+//  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+//  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+//  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#ifndef ATOMSGAFFER_ATOMSCROWDCAPSULE_H
+#define ATOMSGAFFER_ATOMSCROWDCAPSULE_H
+
+#include "AtomsGaffer/TypeIds.h"
+
+#include "GafferScene/Private/IECoreScenePreview/Procedural.h"
+#include "GafferScene/ScenePlug.h"
+
+#include "Gaffer/Context.h"
+
+namespace AtomsGaffer
+{
+
+class AtomsCrowdGenerator;
+
+// Procedural output by the AtomsCrowdGenerator in place of the agents of an
+// agent type or variation location. At render time it deforms the agents in
+// parallel and outputs their meshes straight to the renderer, rather than
+// going through the hash and compute of every location of the crowd.
+//
+// Like the GafferScene::Capsule, it references the generator and so must not
+// outlive it. It can't be saved to disk.
+class AtomsCrowdCapsule : public IECoreScenePreview::Procedural
+{
+
+	public :
+
+		AtomsCrowdCapsule();
+		AtomsCrowdCapsule(
+			const AtomsCrowdGenerator *generator,
+			const GafferScene::ScenePlug::ScenePath &parentPath,
+			const GafferScene::ScenePlug::ScenePath &branchPath,
+			const Gaffer::Context &context,
+			const IECore::MurmurHash &hash,
+			const Imath::Box3f &bound
+		);
+		~AtomsCrowdCapsule() override;
+
+		IE_CORE_DECLAREEXTENSIONOBJECT( AtomsGaffer::AtomsCrowdCapsule, TypeId::AtomsCrowdCapsuleTypeId, IECoreScenePreview::Procedural );
+
+		Imath::Box3f bound() const override;
+		void render( IECoreScenePreview::Renderer *renderer ) const override;
+
+		const AtomsCrowdGenerator *generator() const;
+		const GafferScene::ScenePlug::ScenePath &parentPath() const;
+		const GafferScene::ScenePlug::ScenePath &branchPath() const;
+		const Gaffer::Context *context() const;
+
+	private :
+
+		IECore::MurmurHash m_hash;
+		Imath::Box3f m_bound;
+		const AtomsCrowdGenerator *m_generator;
+		GafferScene::ScenePlug::ScenePath m_parentPath;
+		GafferScene::ScenePlug::ScenePath m_branchPath;
+		Gaffer::ConstContextPtr m_context;
+
+};
+
+IE_CORE_DECLAREPTR( AtomsCrowdCapsule )
+
+} // namespace AtomsGaffer
+
+#endif // ATOMSGAFFER_ATOMSCROWDCAPSULE_H
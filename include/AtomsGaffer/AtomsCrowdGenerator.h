@@ -45,6 +45,14 @@
 
 #include "Gaffer/PlugType.h"
 #include "Gaffer/StringPlug.h"
+#include "Gaffer/TypedObjectPlug.h"
+
+namespace IECoreScenePreview
+{
+
+class Renderer;
+
+} // namespace IECoreScenePreview
 
 namespace AtomsGaffer
 {
@@ -74,12 +82,49 @@ class AtomsCrowdGenerator : public GafferScene::BranchCreator
         GafferScene::ScenePlug *clothCachePlug();
         const GafferScene::ScenePlug *clothCachePlug() const;
 
+		Gaffer::FloatPlug *poseTolerancePlug();
+		const Gaffer::FloatPlug *poseTolerancePlug() const;
+
+		Gaffer::StringPlug *poseToleranceCameraPlug();
+		const Gaffer::StringPlug *poseToleranceCameraPlug() const;
+
+		/// Outputs an AtomsCrowdCapsule in place of the agents of every agent
+		/// type (1) or variation (2) location, or the agent locations (0).
+		Gaffer::IntPlug *encapsulatePlug();
+		const Gaffer::IntPlug *encapsulatePlug() const;
+
+		/// Replaces the agents of every variation by a single mesh merging all their
+		/// meshes (1), or by one merged mesh per set of mesh attributes (2), or outputs
+		/// the agent locations (0).
+		Gaffer::IntPlug *mergeMeshesPlug();
+		const Gaffer::IntPlug *mergeMeshesPlug() const;
+
+		/// Replaces the agents of every variation by a single proxy object drawing
+		/// the bound of every agent (1), its skeleton as line curves (2) or a point
+		/// at its root (3), or outputs the agent locations (0).
+		Gaffer::IntPlug *displayModePlug();
+		const Gaffer::IntPlug *displayModePlug() const;
+
+		/// Adds a "velocity" primitive variable to the skinned meshes, holding the
+		/// motion of every point towards the next frame in units per second.
+		Gaffer::BoolPlug *velocityPlug();
+		const Gaffer::BoolPlug *velocityPlug() const;
+
+		/// Returns the number of deformed agent mesh locations hashed ("requests"), and how
+		/// many of them had to be deformed ("misses") or reused a mesh deformed for another
+		/// agent or frame ("hits"). A location is only hashed again once its hash has left
+		/// Gaffer's hash cache, so these count cache lookups rather than every use of a mesh.
+		/// Meshes are only shared when useInstances is on.
+		static IECore::CompoundDataPtr deformedMeshStatistics();
+		static void resetDeformedMeshStatistics();
+
 		void affects( const Gaffer::Plug *input, AffectedPlugsContainer &outputs ) const override;
 
 	protected:
 
 		void hash( const Gaffer::ValuePlug *output, const Gaffer::Context *context, IECore::MurmurHash &h ) const override;
 		void compute( Gaffer::ValuePlug *output, const Gaffer::Context *context ) const override;
+		Gaffer::ValuePlug::CachePolicy computeCachePolicy( const Gaffer::ValuePlug *output ) const override;
 
 		void hashBranchBound( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, IECore::MurmurHash &h ) const override;
 		Imath::Box3f computeBranchBound( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const override;
@@ -104,12 +149,97 @@ class AtomsCrowdGenerator : public GafferScene::BranchCreator
 
 	private :
 
+		friend class AtomsCrowdCapsule;
+
 		Gaffer::AtomicCompoundDataPlug *agentChildNamesPlug();
 		const Gaffer::AtomicCompoundDataPlug *agentChildNamesPlug() const;
 
 		IECore::ConstCompoundDataPtr agentChildNames( const ScenePath &parentPath, const Gaffer::Context *context ) const;
 		void agentChildNamesHash( const ScenePath &parentPath, const Gaffer::Context *context, IECore::MurmurHash &h ) const;
 
+		Gaffer::AtomicCompoundDataPlug *agentIdToPointIndexPlug();
+		const Gaffer::AtomicCompoundDataPlug *agentIdToPointIndexPlug() const;
+
+		// Returns the index of the input point holding the agent, or -1 if there is none.
+		int agentPointIndex( const ScenePath &parentPath, int agentId, const Gaffer::Context *context ) const;
+
+		Gaffer::ObjectPlug *agentAttributesPlug();
+		const Gaffer::ObjectPlug *agentAttributesPlug() const;
+
+		IECore::ConstCompoundObjectPtr agentAttributes( const ScenePath &parentPath, const Gaffer::Context *context ) const;
+
+		// Holds one hash per input point, covering the agent data and the "atoms:"
+		// prim vars of its agent. Evaluated with scene:path holding the parent path.
+		Gaffer::AtomicCompoundDataPlug *agentHashesPlug();
+		const Gaffer::AtomicCompoundDataPlug *agentHashesPlug() const;
+
+		// Appends the hash of the input crowd data used by a single agent, in place of
+		// the hashes of the whole input crowd, so that editing an agent doesn't dirty
+		// the locations of the others.
+		void agentContentHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, IECore::MurmurHash &h ) const;
+
+		Gaffer::AtomicCompoundDataPlug *poseClustersPlug();
+		const Gaffer::AtomicCompoundDataPlug *poseClustersPlug() const;
+
+		// Holds the bind space bounds of the points skinned by every joint, merged for
+		// all the meshes of every variation.
+		Gaffer::AtomicCompoundDataPlug *jointBoundsPlug();
+		const Gaffer::AtomicCompoundDataPlug *jointBoundsPlug() const;
+
+		// Holds the blend shapes of a variation mesh compiled into sparse deltas,
+		// evaluated in the context of an AgentScope.
+		Gaffer::AtomicCompoundDataPlug *blendShapesPlug();
+		const Gaffer::AtomicCompoundDataPlug *blendShapesPlug() const;
+
+		Gaffer::AtomicCompoundDataPlug *containerBoundsPlug();
+		const Gaffer::AtomicCompoundDataPlug *containerBoundsPlug() const;
+
+		// Returns the bound of the agents under "/agents" or the agent type or variation at
+		// branchPath, all reduced at once by the containerBoundsPlug.
+		Imath::Box3f containerBound( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const;
+		void containerBoundHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, IECore::MurmurHash &h ) const;
+
+		// Returns the branch path of the agent whose meshes are shared by the agent of
+		// branchPath, which is branchPath itself when the agent isn't part of a pose cluster.
+		ScenePath poseRepresentative( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const;
+
+		// Returns the joint moving the whole mesh of branchPath when it is rigid, in which case the
+		// variation mesh is output untouched and transformed by the joint, or -1 if it must be skinned.
+		int rigidJoint( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const;
+		void rigidJointHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, IECore::MurmurHash &h ) const;
+
+		// Returns the size of the branch paths output as capsules, or 0 if there are none.
+		size_t capsuleDepth() const;
+		// Returns the branch paths of the agents under the agent type or variation at branchPath.
+		std::vector<ScenePath> locationAgents( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const;
+
+		// Returns true when the variations hold merged meshes rather than agents.
+		bool mergingMeshes() const;
+		// Returns the locations of the meshes of the variation at branchPath, relative to
+		// it, grouped by merged mesh, and the attributes of every merged mesh.
+		void mergedMeshGroups( const ScenePath &branchPath, std::vector<std::vector<ScenePath>> &groups, std::vector<IECore::ConstCompoundObjectPtr> &groupAttributes ) const;
+		void mergedMeshGroupsHash( const ScenePath &branchPath, IECore::MurmurHash &h ) const;
+
+		void mergedMeshHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, IECore::MurmurHash &h ) const;
+		IECore::ConstObjectPtr mergedMesh( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const;
+
+		// Returns the display mode of the variations, or 0 when they hold the agents.
+		int proxyMode() const;
+		// Returns the proxy object standing for all the agents of the variation at branchPath.
+		void agentProxiesHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, IECore::MurmurHash &h ) const;
+		IECore::ConstObjectPtr agentProxies( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const;
+
+		// Called by the AtomsCrowdCapsule to output its agents to the renderer.
+		void renderCapsule( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, IECoreScenePreview::Renderer *renderer ) const;
+		// The parent transforms are sampled at parentTimes, and the shutters are null
+		// when the deformation or the transform blur are off.
+		void renderCapsuleLocation(
+			const ScenePath &parentPath, const ScenePath &branchPath, const IECore::CompoundObject *parentAttributes,
+			const std::vector<Imath::M44f> &parentTransforms, const std::vector<float> &parentTimes,
+			const Imath::V2f *deformationShutter, const Imath::V2f *transformShutter,
+			const Gaffer::Context *context, IECoreScenePreview::Renderer *renderer
+		) const;
+
 		void atomsPoseHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, IECore::MurmurHash &h) const;
 
         IECore::ConstCompoundDataPtr agentCacheData(const ScenePath &branchPath) const;
@@ -123,12 +253,32 @@ class AtomsCrowdGenerator : public GafferScene::BranchCreator
                 IECoreScene::MeshPrimitivePtr& result,
                 IECoreScene::ConstMeshPrimitivePtr& meshPrim,
                 IECore::ConstCompoundObjectPtr& meshAttributes,
-                const std::vector<Imath::M44d>& worldMatrices
+                const std::vector<Imath::M44d>& worldMatrices,
+                const std::vector<Imath::M44d>* nextWorldMatrices = nullptr,
+                float velocityScale = 1.0f
         		) const;
 
+        void applySkinDeformerSamples(
+                const ScenePath &branchPath,
+                std::vector<IECoreScene::MeshPrimitivePtr>& samples,
+                const IECore::CompoundObject* meshAttributes,
+                const std::vector<std::vector<Imath::M44d>>& worldMatrices
+        		) const;
+
+		// Returns the deformed mesh of branchPath at all the times at once, or a single
+		// sample when it isn't deformed by the skeleton.
+		std::vector<IECore::ConstObjectPtr> deformedMeshSamples( const ScenePath &parentPath, const ScenePath &branchPath, const std::vector<float> &times, const Gaffer::Context *context ) const;
+		// Returns the transform of branchPath at all the times, or a single sample when it
+		// doesn't move during the shutter.
+		std::vector<Imath::M44f> transformSamples( const ScenePath &parentPath, const ScenePath &branchPath, const std::vector<float> &times, const Gaffer::Context *context ) const;
+
+		// Returns the data of the agent at another frame, or null if it doesn't exist then.
+		IECore::ConstCompoundDataPtr agentDataAtFrame( const ScenePath &parentPath, const ScenePath &branchPath, float frame, const Gaffer::Context *context ) const;
+
         void applyBlendShapesDeformer(
                 const ScenePath &branchPath,
                 IECoreScene::MeshPrimitivePtr& result,
+                const IECore::CompoundData* blendShapes,
                 const IECore::CompoundData* metadataData,
                 const IECore::CompoundDataMap& pointVariablesData,
                 const int agentIdPointIndex
@@ -141,6 +291,10 @@ class AtomsCrowdGenerator : public GafferScene::BranchCreator
 				const Imath::M44f rootMatrix
 				) const;
 
+		// Returns the bound of the agent in its own space, from its joints and its cloth.
+		Imath::Box3f agentBound( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const;
+		void agentBoundHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, IECore::MurmurHash &h ) const;
+
         Imath::M44f agentRootMatrix( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const;
 
 		struct AgentScope : public Gaffer::Context::EditableScope
@@ -44,6 +44,8 @@
 #include "Gaffer/StringPlug.h"
 #include "Gaffer/NumericPlug.h"
 
+#include "IECore/CompoundData.h"
+
 namespace AtomsGaffer
 {
 
@@ -76,6 +78,37 @@ class AtomsCrowdReader : public GafferScene::ObjectSource
 		Gaffer::ObjectPlug *enginePlug();
 		const Gaffer::ObjectPlug *enginePlug() const;
 
+		Gaffer::BoolPlug *outOfCorePlug();
+		const Gaffer::BoolPlug *outOfCorePlug() const;
+
+		Gaffer::StringPlug *scratchDirectoryPlug();
+		const Gaffer::StringPlug *scratchDirectoryPlug() const;
+
+		Gaffer::FloatPlug *previewFractionPlug();
+		const Gaffer::FloatPlug *previewFractionPlug() const;
+
+		Gaffer::BoolPlug *previewStratifiedPlug();
+		const Gaffer::BoolPlug *previewStratifiedPlug() const;
+
+		/// Sets the memory budget shared by all the out of core crowds of the process.
+		/// Chunks of agents are evicted in least recently used order once it is exceeded.
+		static void setOutOfCoreMemoryLimit( size_t bytes );
+		static size_t getOutOfCoreMemoryLimit();
+
+		/// Sets the memory budget of the engines shared by all the readers of the process,
+		/// including the agent data they hold. The least recently used engines are released
+		/// once it is exceeded. Defaults to 4GB.
+		static void setSharedEngineMemoryLimit( size_t bytes );
+		static size_t getSharedEngineMemoryLimit();
+		/// Returns the memory currently accounted for by the shared engines.
+		static size_t sharedEngineMemoryUsage();
+		/// Releases all the shared engines.
+		static void clearSharedEngines();
+
+		/// Returns the estimated memory footprint of the engine for the
+		/// current context, broken down by component, in bytes.
+		IECore::CompoundDataPtr engineMemoryUsage() const;
+
 		void affects( const Gaffer::Plug *input, AffectedPlugsContainer &outputs ) const override;
 
 	protected:
@@ -90,6 +123,7 @@ class AtomsCrowdReader : public GafferScene::ObjectSource
 
 		void hash( const Gaffer::ValuePlug *output, const Gaffer::Context *context, IECore::MurmurHash &h ) const override;
 		void compute( Gaffer::ValuePlug *output, const Gaffer::Context *context ) const override;
+		Gaffer::ValuePlug::CachePolicy computeCachePolicy( const Gaffer::ValuePlug *output ) const override;
 
 	private:
 
@@ -0,0 +1,184 @@
+//////////////////////////////////////////////////////////////////////////
+//
+//  Copyright (c) 2018, Toolchefs Ltd. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      * Redistributions of source code must retain the above
+//        copyright notice, this list of conditions and the following
+//        disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following
+//        disclaimer in the documentation and/or other materials provided with
+//        the distribution.
+//
+//      * Neither the name of John Haddon nor the names of
+//        any other contributors to this software may be used to endorse or
+//        promote products derived from this software without specific prior
+//        written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+//  IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+//  THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+//  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+//  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+//  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#ifndef ATOMSGAFFER_ATOMSSKINNING_H
+#define ATOMSGAFFER_ATOMSSKINNING_H
+
+#include "ImathMatrix.h"
+#include "ImathVec.h"
+
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+#include "tbb/task_arena.h"
+#include "tbb/task_group.h"
+
+#include <vector>
+
+namespace AtomsGaffer
+{
+
+// Linear blend skinning of the agent meshes.
+//
+// The default kernel works in single precision on 3x4 affine matrices. For
+// every point it blends the matrices of its influences and applies the result,
+// so the blended matrices are reused by all the face varying normals of the
+// point. The kernel is written for the compiler to vectorise the blend of the
+// 12 matrix components.
+//
+// The reference kernel is the original double precision implementation, kept
+// to validate the default kernel against.
+namespace Skinning
+{
+
+// Meshes with at least this many points or normals are deformed in parallel
+// chunks, while smaller ones stay serial. Every point is deformed on its own,
+// so the result doesn't depend on the chunking.
+const size_t parallelThreshold = 16384;
+const size_t parallelGrainSize = 4096;
+
+// Calls f( begin, end ) over the range [0, size), in parallel chunks when size
+// reaches the parallelThreshold. Computes calling this must use the TaskIsolation
+// cache policy.
+//
+// The chunks run in an isolated region, so a thread waiting for them can't pick
+// up the outer tasks of the caller, such as the other agents of a merged mesh or
+// of a capsule. Those would skin another mesh on the same thread, reusing the
+// scratch buffers of the mesh being skinned.
+template<typename F>
+void forEachPointRange( size_t size, const F &f )
+{
+	if( size < parallelThreshold )
+	{
+		f( 0, size );
+		return;
+	}
+
+	tbb::this_task_arena::isolate(
+		[size, &f]
+		{
+			tbb::task_group_context taskGroupContext( tbb::task_group_context::isolated );
+			tbb::parallel_for(
+				tbb::blocked_range<size_t>( 0, size, parallelGrainSize ),
+				[&f]( const tbb::blocked_range<size_t> &range )
+				{
+					f( range.begin(), range.end() );
+				},
+				taskGroupContext
+			);
+		}
+	);
+}
+
+// Skins the points in place, using the influences described by the joint
+// index count, joint indices and joint weights streams. When normals are
+// given they are skinned with the blended matrices of the points, and
+// normalPointIds maps every normal to its point. A null normalPointIds
+// means the normals are per point.
+void skin(
+	const std::vector<Imath::M44d> &worldMatrices,
+	const std::vector<int> &jointIndexCount,
+	const std::vector<int> &jointIndices,
+	const std::vector<float> &jointWeights,
+	std::vector<Imath::V3f> &points,
+	std::vector<Imath::V3f> *normals = nullptr,
+	const std::vector<int> *normalPointIds = nullptr
+);
+
+// As skin(), also blending nextWorldMatrices, the skinning matrices of the
+// agent at a later time, in the same pass over the influences. The
+// displacement of every point between the two poses, multiplied by
+// velocityScale, is stored in velocities.
+void skinWithVelocity(
+	const std::vector<Imath::M44d> &worldMatrices,
+	const std::vector<Imath::M44d> &nextWorldMatrices,
+	float velocityScale,
+	const std::vector<int> &jointIndexCount,
+	const std::vector<int> &jointIndices,
+	const std::vector<float> &jointWeights,
+	std::vector<Imath::V3f> &points,
+	std::vector<Imath::V3f> &velocities,
+	std::vector<Imath::V3f> *normals = nullptr,
+	const std::vector<int> *normalPointIds = nullptr
+);
+
+// Skins several motion samples of the same mesh, the points and normals of
+// sample i being skinned with worldMatrices[i]. The influences of every point
+// are read once for all the samples. All the samples must have the same
+// number of points, normals and matrices.
+void skinSamples(
+	const std::vector<const std::vector<Imath::M44d> *> &worldMatrices,
+	const std::vector<int> &jointIndexCount,
+	const std::vector<int> &jointIndices,
+	const std::vector<float> &jointWeights,
+	const std::vector<std::vector<Imath::V3f> *> &points,
+	const std::vector<std::vector<Imath::V3f> *> *normals = nullptr,
+	const std::vector<int> *normalPointIds = nullptr
+);
+
+// As above, using the reference kernel.
+void skinReference(
+	const std::vector<Imath::M44d> &worldMatrices,
+	const std::vector<int> &jointIndexCount,
+	const std::vector<int> &jointIndices,
+	const std::vector<float> &jointWeights,
+	std::vector<Imath::V3f> &points,
+	std::vector<Imath::V3f> *normals = nullptr,
+	const std::vector<int> *normalPointIds = nullptr
+);
+
+// Writes the points transformed by the matrix to out, with the kernel used by
+// skin(). The cloth meshes use it to move their simulated points into the space
+// of the agent.
+void transformPoints(
+	const Imath::M44f &matrix,
+	const std::vector<Imath::V3f> &points,
+	std::vector<Imath::V3f> &out
+);
+
+// Writes the normals transformed by the matrix and normalised to out. When
+// normalIds is given, out[i] is the transformed normals[( *normalIds )[i]].
+void transformNormals(
+	const Imath::M44f &matrix,
+	const std::vector<Imath::V3f> &normals,
+	std::vector<Imath::V3f> &out,
+	const std::vector<int> *normalIds = nullptr
+);
+
+} // namespace Skinning
+
+} // namespace AtomsGaffer
+
+#endif // ATOMSGAFFER_ATOMSSKINNING_H
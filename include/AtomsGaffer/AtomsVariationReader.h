@@ -81,6 +81,10 @@ class AtomsVariationReader : public GafferScene::SceneNode
         Gaffer::ObjectPlug *enginePlug();
         const Gaffer::ObjectPlug *enginePlug() const;
 
+		/// Returns the memory footprint of the loaded meshes for the
+		/// current context, broken down by component, in bytes.
+		IECore::CompoundDataPtr engineMemoryUsage() const;
+
 		void affects( const Gaffer::Plug *input, AffectedPlugsContainer &outputs ) const override;
 
 	protected:
@@ -51,6 +51,7 @@ enum class TypeId
 	AtomsMetadataTypeId = 120004,
     AtomsAttributesTypeId = 120005,
 	AtomsCrowdClothReaderTypeId = 120006,
+	AtomsCrowdCapsuleTypeId = 120007,
 
 	LastTypeId = 120499,
 };
@@ -77,6 +77,8 @@ class AtomsCrowdClothReaderTest( GafferSceneTest.SceneTestCase ) :
 		self.assertEqual( len(flag_data["P"]), 121 )
 		self.assertTrue( "N" in flag_data )
 		self.assertEqual( len(flag_data["N"]), 121 )
+		self.assertTrue( isinstance( flag_data["P"], IECore.V3fVectorData ) )
+		self.assertTrue( isinstance( flag_data["N"], IECore.V3fVectorData ) )
 		self.assertTrue( "stackOrder" in flag_data )
 		self.assertEqual( flag_data["stackOrder"].value, "last" )
 		self.assertTrue( "boundingBox" in flag_data )
@@ -40,6 +40,7 @@ import imath
 import IECore
 import IECoreScene
 
+import Gaffer
 import GafferScene
 
 import GafferTest
@@ -142,6 +143,40 @@ class AtomsCrowdGeneratorTest( GafferSceneTest.SceneTestCase ) :
 		self.assertEqual( len(names), 1 )
 		self.assertTrue( "RobotBody" in names)
 
+	def testAgentGroupingAcrossChunks( self ) :
+
+		# Enough agents to be grouped in several parallel chunks
+		numAgents = 40000
+		ids = list( reversed( range( numAgents ) ) )
+		variations = [ "Robot1" if i % 3 else "Robot2" for i in range( numAgents ) ]
+		lods = [ "A" if i % 2 else "" for i in range( numAgents ) ]
+
+		points = IECoreScene.PointsPrimitive( IECore.V3fVectorData( [ imath.V3f( 0 ) ] * numAgents ) )
+		points["atoms:agentId"] = IECoreScene.PrimitiveVariable( IECoreScene.PrimitiveVariable.Interpolation.Vertex, IECore.IntVectorData( ids ) )
+		points["atoms:agentType"] = IECoreScene.PrimitiveVariable( IECoreScene.PrimitiveVariable.Interpolation.Constant, IECore.StringData( "atomsRobot" ) )
+		points["atoms:variation"] = IECoreScene.PrimitiveVariable( IECoreScene.PrimitiveVariable.Interpolation.Vertex, IECore.StringVectorData( variations ) )
+		points["atoms:lod"] = IECoreScene.PrimitiveVariable( IECoreScene.PrimitiveVariable.Interpolation.Vertex, IECore.StringVectorData( lods ) )
+
+		objectToScene = GafferScene.ObjectToScene()
+		objectToScene["object"].setValue( points )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["in"].setInput( objectToScene["out"] )
+
+		with Gaffer.Context() as context :
+			context["scene:path"] = IECore.InternedStringVectorData( [ "object" ] )
+			childNames = node["__agentChildNames"].getValue()
+
+		# The agents of every variation keep the order of the points
+		expected = {}
+		for agentId, variation, lod in zip( ids, variations, lods ) :
+			name = variation + ":" + lod if lod else variation
+			expected.setdefault( name, [] ).append( str( agentId ) )
+
+		self.assertEqual( sorted( childNames["atomsRobot"].keys() ), sorted( expected.keys() ) )
+		for name, agentNames in expected.items() :
+			self.assertEqual( list( childNames["atomsRobot"][name] ), agentNames )
+
 	def testAttributes( self ) :
 		variations_data = buildVariationTest()
 
@@ -308,7 +343,7 @@ class AtomsCrowdGeneratorTest( GafferSceneTest.SceneTestCase ) :
 		obj = node["out"].object( "/crowd/agents/atomsRobot/Robot1/0/robot1_head" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 920 )
-		self.assertEqual( len(obj["N"].data), 3480 )
+		self.assertEqual( len(obj["N"].indices), 3480 )
 		self.assertEqual( len(obj["uv"].data), 3480 )
 		self.assertEqual( len(obj["map1"].data), 3480 )
 		self.assertTrue( "blendShape_0_P" not in obj )
@@ -319,28 +354,28 @@ class AtomsCrowdGeneratorTest( GafferSceneTest.SceneTestCase ) :
 		obj = node["out"].object( "/crowd/agents/atomsRobot/Robot1/0/robot1_body" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 635 )
-		self.assertEqual( len(obj["N"].data), 2356 )
+		self.assertEqual( len(obj["N"].indices), 2356 )
 		self.assertEqual( len(obj["uv"].data), 2356 )
 		self.assertEqual( len(obj["map1"].data), 2356 )
 
 		obj = node["out"].object( "/crowd/agents/atomsRobot/Robot1/0/robot1_arms" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 960 )
-		self.assertEqual( len(obj["N"].data), 3424 )
+		self.assertEqual( len(obj["N"].indices), 3424 )
 		self.assertEqual( len(obj["uv"].data), 3424 )
 		self.assertEqual( len(obj["map1"].data), 3424 )
 
 		obj = node["out"].object( "/crowd/agents/atomsRobot/Robot1/0/robot1_legs" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 904 )
-		self.assertEqual( len(obj["N"].data), 3312 )
+		self.assertEqual( len(obj["N"].indices), 3312 )
 		self.assertEqual( len(obj["uv"].data), 3312 )
 		self.assertEqual( len(obj["map1"].data), 3312 )
 
 		obj = node["out"].object( "/crowd/agents/atomsRobot/Robot1/0/pole" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 1022 )
-		self.assertEqual( len(obj["N"].data), 4120 )
+		self.assertEqual( len(obj["N"].indices), 4120 )
 		self.assertEqual( len(obj["uv"].data), 4120 )
 		self.assertEqual( len(obj["map1"].data), 4120 )
 
@@ -357,7 +392,7 @@ class AtomsCrowdGeneratorTest( GafferSceneTest.SceneTestCase ) :
 		obj = node["out"].object( "/crowd/agents/atomsRobot/Robot2/1/robot2_body" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 16944 )
-		self.assertEqual( len(obj["N"].data), 16944 )
+		self.assertEqual( len(obj["N"].indices), 16944 )
 		self.assertEqual( len(obj["uv"].data), 16944 )
 
 		obj = node["out"].object( "/crowd/agents/atoms2Robot/RedRobot/5" )
@@ -369,7 +404,7 @@ class AtomsCrowdGeneratorTest( GafferSceneTest.SceneTestCase ) :
 		obj = node["out"].object( "/crowd/agents/atoms2Robot/RedRobot/5/Body/RobotBody" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 28149 )
-		self.assertEqual( len(obj["N"].data), 111930 )
+		self.assertEqual( len(obj["N"].indices), 111930 )
 		self.assertEqual( len(obj["uv"].data), 111930 )
 
 		obj = node["out"].object( "/crowd/agents/atoms2Robot/PurpleRobot/12" )
@@ -381,8 +416,754 @@ class AtomsCrowdGeneratorTest( GafferSceneTest.SceneTestCase ) :
 		obj = node["out"].object( "/crowd/agents/atoms2Robot/PurpleRobot/12/Body/RobotBody" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 28149 )
-		self.assertEqual( len(obj["N"].data), 111930 )
+		self.assertEqual( len(obj["N"].indices), 111930 )
 		self.assertEqual( len(obj["uv"].data), 111930 )
 
+	def testAgentPointLookup( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+
+		# Every agent location must pick up the primitive variables of its own point,
+		# regardless of the order of the points or of the gaps between the ids.
+		for agentIds in ( "", "12,5,0", "1-3,12" ) :
+			crowd_input["agentIds"].setValue( agentIds )
+			for agentType in node["out"].childNames( "/crowd/agents" ) :
+				typePath = "/crowd/agents/" + str( agentType )
+				for variation in node["out"].childNames( typePath ) :
+					variationPath = typePath + "/" + str( variation )
+					for agent in node["out"].childNames( variationPath ) :
+						attributes = node["out"].attributes( variationPath + "/" + str( agent ) )
+						self.assertEqual( attributes["user:atoms:agentId"].value, int( str( agent ) ) )
+
+	def testAgentAttributesIndependentOfCrowd( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+
+		# The attributes of all the agents are converted together, so make sure
+		# an agent gets the same attributes whatever the rest of the crowd is.
+		path = "/crowd/agents/atoms2Robot/RedRobot/5"
+		attributes = node["out"].attributes( path )
+		self.assertTrue( "user:atoms:agentType" in attributes )
+
+		crowd_input["agentIds"].setValue( "5" )
+		self.assertEqual( node["out"].attributes( path ), attributes )
+
+		crowd_input["agentIds"].setValue( "12,5" )
+		self.assertEqual( node["out"].attributes( path ), attributes )
+
+	def testSkinningMatchesReference( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+
+		agents = crowd_input["out"].attributes( "/crowd" )["atoms:agents"].blindData()
+
+		paths = [
+			"/crowd/agents/atomsRobot/Robot1/0/robot1_body",
+			"/crowd/agents/atomsRobot/Robot2/1/robot2_body",
+			"/crowd/agents/atoms2Robot/RedRobot/5/Body/RobotBody",
+		]
+
+		for path in paths :
+
+			# Skin the variation mesh with both kernels, using the pose of the agent
+			agentPath = path.split( "/" )
+			meshPath = "/" + "/".join( agentPath[3:5] + agentPath[6:] )
+			mesh = variations["out"].object( meshPath )
+			attributes = variations["out"].attributes( meshPath )
+			worldMatrices = agents[agentPath[5]]["poseWorldMatrices"]
+
+			normals = mesh["N"].expandedData() if mesh["N"].interpolation == IECoreScene.PrimitiveVariable.Interpolation.FaceVarying else mesh["N"].data
+			normalPointIds = mesh.vertexIds if mesh["N"].interpolation == IECoreScene.PrimitiveVariable.Interpolation.FaceVarying else None
+
+			skinned = [ mesh["P"].data.copy(), normals.copy() ]
+			reference = [ mesh["P"].data.copy(), normals.copy() ]
+			influences = ( worldMatrices, attributes["jointIndexCount"], attributes["jointIndices"], attributes["jointWeights"] )
+			AtomsGaffer.skin( *( influences + ( skinned[0], skinned[1], normalPointIds ) ) )
+			AtomsGaffer.skinReference( *( influences + ( reference[0], reference[1], normalPointIds ) ) )
+
+			self.assertNotEqual( skinned[0], mesh["P"].data )
+			for data, referenceData in zip( skinned, reference ) :
+				self.assertEqual( len( data ), len( referenceData ) )
+				for v, r in zip( data, referenceData ) :
+					self.assertTrue( v.equalWithAbsError( r, 1e-3 ) )
+
+			# And the generator deforms its meshes with the default kernel
+			if "rigidJointIndex" not in attributes :
+				for p, v in zip( node["out"].object( path )["P"].data, skinned[0] ) :
+					self.assertTrue( p.equalWithAbsError( v, 1e-5 ) )
+
+		# Influences that don't match the points are rejected
+		with self.assertRaises( Exception ) :
+			AtomsGaffer.skin( worldMatrices, IECore.IntVectorData( [ 1 ] ), IECore.IntVectorData( [ len( worldMatrices ) ] ), IECore.FloatVectorData( [ 1 ] ), IECore.V3fVectorData( [ imath.V3f( 0 ) ] ) )
+
+		# And so are negative influence counts, even when the others match the influences
+		with self.assertRaises( Exception ) :
+			AtomsGaffer.skin( worldMatrices, IECore.IntVectorData( [ 1, -1 ] ), IECore.IntVectorData( [ 0 ] ), IECore.FloatVectorData( [ 1 ] ), IECore.V3fVectorData( [ imath.V3f( 0 ), imath.V3f( 1 ) ] ) )
+
+	def testParallelDeformationIsDeterministic( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+
+		# This mesh is big enough to be deformed in parallel chunks
+		path = "/crowd/agents/atoms2Robot/RedRobot/5/Body/RobotBody"
+		mesh = node["out"].object( path )
+		self.assertGreater( len( mesh["P"].data ), 16384 )
+
+		for i in range( 0, 4 ) :
+			Gaffer.ValuePlug.clearCache()
+			self.assertEqual( node["out"].object( path ), mesh )
+
+	def testMergeBigMeshes( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+
+		# The agents are merged in parallel, while their body mesh is big enough to
+		# be skinned in parallel chunks as well
+		variationPath = "/crowd/agents/atoms2Robot/RedRobot"
+		agents = node["out"].childNames( variationPath )
+		self.assertGreater( len( agents ), 1 )
+		self.assertGreater( len( node["out"].object( "{}/{}/Body/RobotBody".format( variationPath, agents[0] ) )["P"].data ), 16384 )
+
+		numPoints = 0
+		bound = imath.Box3f()
+		toVariation = node["out"].fullTransform( variationPath ).inverse()
+		for agent in agents :
+			toVisit = [ "{}/{}".format( variationPath, agent ) ]
+			while toVisit :
+				path = toVisit.pop()
+				toVisit.extend( path + "/" + str( c ) for c in node["out"].childNames( path ) )
+				obj = node["out"].object( path )
+				if not isinstance( obj, IECoreScene.MeshPrimitive ) :
+					continue
+				numPoints += len( obj["P"].data )
+				matrix = node["out"].fullTransform( path ) * toVariation
+				for p in obj["P"].data :
+					bound.extendBy( p * matrix )
+
+		node["mergeMeshes"].setValue( 1 )
+		merged = node["out"].object( variationPath + "/merged0" )
+		self.assertEqual( len( merged["P"].data ), numPoints )
+		self.assertTrue( merged.bound().min().equalWithAbsError( bound.min(), 1e-3 ) )
+		self.assertTrue( merged.bound().max().equalWithAbsError( bound.max(), 1e-3 ) )
+
+		for i in range( 0, 4 ) :
+			Gaffer.ValuePlug.clearCache()
+			self.assertEqual( node["out"].object( variationPath + "/merged0" ), merged )
+
+	def testInstancedMeshesShareDeformation( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+
+		path = "/crowd/agents/atomsRobot/Robot1/0/robot1_body"
+		mesh = node["out"].object( path )
+
+		# The instanced meshes must match the per agent ones
+		node["useInstances"].setValue( True )
+		Gaffer.ValuePlug.clearCache()
+		AtomsGaffer.AtomsCrowdGenerator.resetDeformedMeshStatistics()
+		self.assertEqual( node["out"].object( path ), mesh )
+
+		statistics = AtomsGaffer.AtomsCrowdGenerator.deformedMeshStatistics()
+		self.assertEqual( statistics["misses"].value, 1 )
+
+		# Requesting the same pose again reuses the deformed mesh
+		with Gaffer.Context() as context :
+			context["atomsGaffer:unused"] = 1
+			node["out"].object( path )
+
+		statistics = AtomsGaffer.AtomsCrowdGenerator.deformedMeshStatistics()
+		self.assertEqual( statistics["misses"].value, 1 )
+		self.assertEqual( statistics["requests"].value, statistics["hits"].value + statistics["misses"].value )
+
+	def testPoseClustering( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+		node["useInstances"].setValue( True )
+
+		variationPath = "/crowd/agents/atoms2Robot/RedRobot"
+		agents = node["out"].childNames( variationPath )
+		self.assertGreater( len( agents ), 1 )
+
+		def meshes() :
+			return [ node["out"].object( "{}/{}/Body/RobotBody".format( variationPath, a ) ) for a in agents ]
+
+		exact = meshes()
+		self.assertNotEqual( exact[0], exact[1] )
+
+		# A huge tolerance puts all the agents of a variation in the same cluster
+		node["poseTolerance"].setValue( 1e6 )
+		clustered = meshes()
+		for mesh in clustered :
+			self.assertEqual( mesh, clustered[0] )
+		self.assertEqual( clustered[0], exact[0] )
+
+		# A tiny tolerance leaves the agents with their own poses
+		node["poseTolerance"].setValue( 1e-7 )
+		self.assertEqual( meshes(), exact )
+
+		# A missing camera falls back to the constant tolerance, with a warning
+		node["poseToleranceCamera"].setValue( "/missingCamera" )
+		with IECore.CapturingMessageHandler() as mh :
+			self.assertEqual( meshes(), exact )
+		self.assertTrue( any( m.level == IECore.Msg.Level.Warning for m in mh.messages ) )
+
+	def testRigidMeshes( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+
+		# Meshes weighted to a single joint are output untouched and moved by the joint
+		variationPath = "/atomsRobot/Robot1"
+		for mesh in variations["out"].childNames( variationPath ) :
+			meshPath = variationPath + "/" + str( mesh )
+			path = "/crowd/agents/atomsRobot/Robot1/0/" + str( mesh )
+			if "rigidJointIndex" in variations["out"].attributes( meshPath ) :
+				self.assertEqual( node["out"].object( path ), variations["out"].object( meshPath ) )
+				self.assertNotEqual( node["out"].transform( path ), imath.M44f() )
+				self.assertEqual( node["out"].bound( path ), variations["out"].bound( meshPath ) )
+			else :
+				self.assertEqual( node["out"].transform( path ), variations["out"].transform( meshPath ) )
+			self.assertFalse( "rigidJointIndex" in node["out"].attributes( path ) )
+
+	def testEncapsulate( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+
+		typePath = "/crowd/agents/atomsRobot"
+		variationPath = typePath + "/Robot1"
+		typeBound = node["out"].bound( typePath )
+		variationBound = node["out"].bound( variationPath )
+		variationNames = node["out"].childNames( typePath )
+
+		node["encapsulate"].setValue( 2 )
+		self.assertEqual( node["out"].childNames( typePath ), variationNames )
+		self.assertEqual( node["out"].childNames( variationPath ), IECore.InternedStringVectorData() )
+		self.assertEqual( node["out"].object( variationPath ).typeName(), "AtomsGaffer::AtomsCrowdCapsule" )
+		self.assertEqual( node["out"].object( variationPath ).bound(), variationBound )
+		self.assertEqual( node["out"].bound( variationPath ), variationBound )
+		self.assertEqual( node["out"].bound( typePath ), typeBound )
+
+		node["encapsulate"].setValue( 1 )
+		self.assertEqual( node["out"].childNames( typePath ), IECore.InternedStringVectorData() )
+		self.assertEqual( node["out"].object( typePath ).typeName(), "AtomsGaffer::AtomsCrowdCapsule" )
+		self.assertEqual( node["out"].bound( typePath ), typeBound )
+
+		node["encapsulate"].setValue( 0 )
+		self.assertEqual( node["out"].childNames( typePath ), variationNames )
+		self.assertEqual( node["out"].object( typePath ), IECore.NullObject() )
+
+	def testRenderCapsule( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		options = GafferScene.StandardOptions()
+		options["in"].setInput( crowd_input["out"] )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		expanded = AtomsGaffer.AtomsCrowdGenerator()
+		expanded["parent"].setValue( "/crowd" )
+		expanded["in"].setInput( options["out"] )
+		expanded["variations"].setInput( variations["out"] )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( options["out"] )
+		node["variations"].setInput( variations["out"] )
+		node["encapsulate"].setValue( 2 )
+
+		variationPath = "/crowd/agents/atomsRobot/Robot1"
+
+		def objectPaths( path ) :
+			result = []
+			for name in expanded["out"].childNames( path ) :
+				childPath = path + "/" + str( name )
+				if not isinstance( expanded["out"].object( childPath ), IECore.NullObject ) :
+					result.append( childPath )
+				result += objectPaths( childPath )
+			return result
+
+		def render() :
+			renderer = GafferScene.Private.IECoreScenePreview.CapturingRenderer(
+				GafferScene.Private.IECoreScenePreview.Renderer.RenderType.Batch
+			)
+			node["out"].object( variationPath ).render( renderer )
+			return renderer
+
+		# The objects are output relative to the capsule
+		def assertTransform( transform, path, frame ) :
+			with Gaffer.Context( Gaffer.Context.current() ) as c :
+				c.setFrame( frame )
+				expected = expanded["out"].fullTransform( path ) * expanded["out"].fullTransform( variationPath ).inverse()
+			self.assertTrue( transform.equalWithAbsError( expected, 1e-4 ) )
+
+		def assertPoints( sample, path, frame ) :
+			with Gaffer.Context( Gaffer.Context.current() ) as c :
+				c.setFrame( frame )
+				expected = expanded["out"].object( path )
+			self.assertEqual( sample.verticesPerFace, expected.verticesPerFace )
+			for p, e in zip( sample["P"].data, expected["P"].data ) :
+				self.assertTrue( p.equalWithAbsError( e, 1e-4 ) )
+
+		with Gaffer.Context() as c :
+			c.setFrame( 5 )
+
+			paths = objectPaths( variationPath )
+			self.assertTrue( paths )
+
+			# Without motion blur, every location of the expanded scene is output at the frame
+			renderer = render()
+			for path in paths :
+				captured = renderer.capturedObject( path )
+				self.assertTrue( captured is not None )
+				self.assertEqual( captured.capturedSamples(), [ expanded["out"].object( path ) ] )
+				self.assertEqual( len( captured.capturedTransforms() ), 1 )
+				assertTransform( captured.capturedTransforms()[0], path, 5 )
+
+			# With motion blur, the deformed meshes and the transforms are sampled over the shutter
+			options["options"]["deformationBlur"]["enabled"].setValue( True )
+			options["options"]["deformationBlur"]["value"].setValue( True )
+			options["options"]["transformBlur"]["enabled"].setValue( True )
+			options["options"]["transformBlur"]["value"].setValue( True )
+			options["options"]["shutter"]["enabled"].setValue( True )
+			options["options"]["shutter"]["value"].setValue( imath.V2f( -0.25, 0.25 ) )
+
+			times = [ 4.75, 5.25 ]
+			AtomsGaffer.AtomsCrowdGenerator.resetDeformedMeshStatistics()
+			renderer = render()
+			statistics = AtomsGaffer.AtomsCrowdGenerator.deformedMeshStatistics()
+			self.assertGreater( statistics["misses"].value, 0 )
+			self.assertEqual( statistics["requests"].value, statistics["hits"].value + statistics["misses"].value )
+			deformed = 0
+			moving = 0
+			for path in paths :
+				captured = renderer.capturedObject( path )
+				self.assertTrue( captured is not None )
+
+				samples = captured.capturedSamples()
+				if len( samples ) > 1 :
+					deformed += 1
+					self.assertEqual( captured.capturedSampleTimes(), times )
+					for sample, time in zip( samples, times ) :
+						assertPoints( sample, path, time )
+				else :
+					self.assertEqual( samples, [ expanded["out"].object( path ) ] )
+
+				transforms = captured.capturedTransforms()
+				if len( transforms ) > 1 :
+					moving += 1
+					self.assertEqual( captured.capturedTransformTimes(), times )
+					for transform, time in zip( transforms, times ) :
+						assertTransform( transform, path, time )
+				else :
+					assertTransform( transforms[0], path, 5 )
+
+			self.assertGreater( deformed, 0 )
+			self.assertGreater( moving, 0 )
+
+			# Transform blur alone still moves the agents
+			options["options"]["deformationBlur"]["value"].setValue( False )
+			renderer = render()
+			for path in paths :
+				self.assertEqual( len( renderer.capturedObject( path ).capturedSamples() ), 1 )
+			self.assertEqual( len( [ p for p in paths if len( renderer.capturedObject( p ).capturedTransforms() ) > 1 ] ), moving )
+
+	def testMergeMeshes( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+
+		variationPath = "/crowd/agents/atomsRobot/Robot1"
+		agentIds = set( int( str( a ) ) for a in node["out"].childNames( variationPath ) )
+
+		numFaces = 0
+		for agent in node["out"].childNames( variationPath ) :
+			for mesh in variations["out"].childNames( "/atomsRobot/Robot1" ) :
+				obj = node["out"].object( "{}/{}/{}".format( variationPath, agent, mesh ) )
+				if isinstance( obj, IECoreScene.MeshPrimitive ) :
+					numFaces += obj.numFaces()
+
+		node["mergeMeshes"].setValue( 1 )
+		self.assertEqual( node["out"].childNames( variationPath ), IECore.InternedStringVectorData( [ "merged0" ] ) )
+		merged = node["out"].object( variationPath + "/merged0" )
+		self.assertTrue( merged.arePrimitiveVariablesValid() )
+		self.assertEqual( merged.numFaces(), numFaces )
+		self.assertEqual( merged["atoms:agentId"].interpolation, IECoreScene.PrimitiveVariable.Interpolation.Uniform )
+		self.assertEqual( set( merged["atoms:agentId"].data ), agentIds )
+
+		# Grouping the meshes by attributes splits the faces between the merged meshes
+		node["mergeMeshes"].setValue( 2 )
+		names = node["out"].childNames( variationPath )
+		self.assertGreaterEqual( len( names ), 1 )
+		self.assertEqual( sum( node["out"].object( variationPath + "/" + str( n ) ).numFaces() for n in names ), numFaces )
+
+		node["mergeMeshes"].setValue( 0 )
+		self.assertEqual( set( int( str( a ) ) for a in node["out"].childNames( variationPath ) ), agentIds )
+
+	def testMergeClothMeshes( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		cloth = AtomsGaffer.AtomsCrowdClothReader()
+		cloth["atomsClothFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cloth_cache/cloth_sim.clothcache" )
+		cloth["in"].setInput( crowd_input["out"] )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+		node["clothCache"].setInput( cloth["out"] )
+
+		# The cloth meshes have their simulated normals unindexed, while the
+		# normals of the other meshes are indexed
+		variationPath = "/crowd/agents/atomsRobot/Robot1"
+		indexed = set()
+		for agent in node["out"].childNames( variationPath ) :
+			for mesh in variations["out"].childNames( "/atomsRobot/Robot1" ) :
+				obj = node["out"].object( "{}/{}/{}".format( variationPath, agent, mesh ) )
+				if isinstance( obj, IECoreScene.MeshPrimitive ) and "N" in obj :
+					indexed.add( obj["N"].indices is not None )
+		self.assertEqual( indexed, { True, False } )
+
+		# Merging them keeps the normals rather than dropping them
+		node["mergeMeshes"].setValue( 1 )
+		merged = node["out"].object( variationPath + "/merged0" )
+		self.assertTrue( merged.arePrimitiveVariablesValid() )
+		self.assertIn( "N", merged )
+		self.assertEqual( merged["N"].interpolation, IECoreScene.PrimitiveVariable.Interpolation.FaceVarying )
+
+	def testDisplayMode( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+
+		variationPath = "/crowd/agents/atomsRobot/Robot1"
+		agents = node["out"].childNames( variationPath )
+		agentIds = set( int( str( a ) ) for a in agents )
+		self.assertGreater( len( agents ), 0 )
+		rootPositions = { int( str( a ) ) : node["out"].transform( "{}/{}".format( variationPath, a ) ).translation() for a in agents }
+
+		node["displayMode"].setValue( 1 )
+		self.assertEqual( node["out"].childNames( variationPath ), IECore.InternedStringVectorData() )
+		boxes = node["out"].object( variationPath )
+		self.assertTrue( isinstance( boxes, IECoreScene.MeshPrimitive ) )
+		self.assertTrue( boxes.arePrimitiveVariablesValid() )
+		self.assertEqual( boxes.numFaces(), 6 * len( agents ) )
+		self.assertEqual( set( boxes["atoms:agentId"].data ), agentIds )
+		self.assertEqual( node["out"].bound( variationPath ), boxes.bound() )
+
+		node["displayMode"].setValue( 2 )
+		skeletons = node["out"].object( variationPath )
+		self.assertTrue( isinstance( skeletons, IECoreScene.CurvesPrimitive ) )
+		self.assertTrue( skeletons.arePrimitiveVariablesValid() )
+		self.assertGreater( skeletons.numCurves(), len( agents ) )
+		self.assertEqual( set( skeletons.verticesPerCurve() ), { 2 } )
+		self.assertEqual( set( skeletons["atoms:agentId"].data ), agentIds )
+
+		node["displayMode"].setValue( 3 )
+		points = node["out"].object( variationPath )
+		self.assertTrue( isinstance( points, IECoreScene.PointsPrimitive ) )
+		self.assertEqual( points.numPoints, len( agents ) )
+		for i, agentId in enumerate( points["atoms:agentId"].data ) :
+			self.assertEqual( points["P"].data[i], rootPositions[agentId] )
+
+		# The capsules take precedence over the proxies
+		node["encapsulate"].setValue( 2 )
+		self.assertEqual( node["out"].object( variationPath ).typeName(), "AtomsGaffer::AtomsCrowdCapsule" )
+		node["encapsulate"].setValue( 0 )
+
+		node["displayMode"].setValue( 0 )
+		self.assertEqual( node["out"].childNames( variationPath ), agents )
+
+	def testContainerBounds( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+		node["boundingBoxPadding"].setValue( 0.5 )
+
+		agentsPath = "/crowd/agents"
+		agentsBound = imath.Box3f()
+		for typeName in node["out"].childNames( agentsPath ) :
+			typePath = "{}/{}".format( agentsPath, typeName )
+			typeBound = imath.Box3f()
+			for variationName in node["out"].childNames( typePath ) :
+				variationPath = "{}/{}".format( typePath, variationName )
+				variationBound = node["out"].bound( variationPath )
+				for agent in node["out"].childNames( variationPath ) :
+					agentPath = "{}/{}".format( variationPath, agent )
+					agentBound = node["out"].bound( agentPath ) * node["out"].transform( agentPath )
+					self.assertTrue( IECore.BoxAlgo.contains( variationBound, agentBound ) )
+				typeBound.extendBy( variationBound )
+			self.assertEqual( node["out"].bound( typePath ), typeBound )
+			agentsBound.extendBy( typeBound )
+
+		self.assertEqual( node["out"].bound( agentsPath ), agentsBound )
+		self.assertTrue( IECore.BoxAlgo.contains( node["out"].bound( "/crowd" ), agentsBound ) )
+
+		# The padding is taken into account by the container bounds
+		node["boundingBoxPadding"].setValue( 1.5 )
+		self.assertTrue( IECore.BoxAlgo.contains( node["out"].bound( agentsPath ), agentsBound ) )
+		self.assertNotEqual( node["out"].bound( agentsPath ), agentsBound )
+
+	def testTightAgentBounds( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+
+		# The agent bounds hold all their skinned meshes, the tiny padding only
+		# absorbing the rounding of the skinning
+		node["boundingBoxPadding"].setValue( 0.001 )
+		variationPath = "/crowd/agents/atomsRobot/Robot1"
+		for agent in list( node["out"].childNames( variationPath ) )[:5] :
+			agentPath = "{}/{}".format( variationPath, agent )
+			agentBound = node["out"].bound( agentPath )
+			for mesh in node["out"].childNames( agentPath ) :
+				meshPath = "{}/{}".format( agentPath, mesh )
+				meshBound = node["out"].object( meshPath ).bound() * node["out"].transform( meshPath )
+				self.assertTrue( IECore.BoxAlgo.contains( agentBound, meshBound ) )
+
+	def testVelocity( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variations["out"] )
+
+		path = "/crowd/agents/atomsRobot/Robot1/0/robot1_body"
+		self.assertNotIn( "velocity", node["out"].object( path ) )
+
+		node["velocity"].setValue( True )
+
+		def worldPoints( frame ) :
+			with Gaffer.Context() as context :
+				context.setFrame( frame )
+				mesh = node["out"].object( path )
+				matrix = node["out"].fullTransform( path )
+			return mesh, matrix, [ p * matrix for p in mesh["P"].data ]
+
+		mesh, matrix, points = worldPoints( 1 )
+		nextMesh, nextMatrix, nextPoints = worldPoints( 2 )
+
+		self.assertIn( "velocity", mesh )
+		self.assertEqual( mesh["velocity"].interpolation, IECoreScene.PrimitiveVariable.Interpolation.Vertex )
+		self.assertEqual( len( mesh["velocity"].data ), len( mesh["P"].data ) )
+
+		# The velocities hold the motion of the skinned points towards the next frame
+		fps = Gaffer.Context().getFramesPerSecond()
+		for v, p, nextP in zip( mesh["velocity"].data, points, nextPoints ) :
+			self.assertTrue( matrix.multDirMatrix( v ).equalWithAbsError( ( nextP - p ) * fps, 1e-2 ) )
+
+	def testSets( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		variationsFilter = GafferScene.PathFilter()
+		variationsFilter["paths"].setValue( IECore.StringVectorData( [ "/atomsRobot/Robot1/robot1_head" ] ) )
+
+		variationsSet = GafferScene.Set()
+		variationsSet["in"].setInput( variations["out"] )
+		variationsSet["name"].setValue( "heads" )
+		variationsSet["filter"].setInput( variationsFilter["out"] )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( crowd_input["out"] )
+		node["variations"].setInput( variationsSet["out"] )
+
+		variationPath = "/crowd/agents/atomsRobot/Robot1"
+		expected = [ "{}/{}/robot1_head".format( variationPath, agent ) for agent in node["out"].childNames( variationPath ) ]
+		self.assertNotEqual( expected, [] )
+
+		self.assertIn( "heads", node["out"]["setNames"].getValue() )
+		self.assertEqual( sorted( node["out"].set( "heads" ).value.paths() ), sorted( expected ) )
+
+		# The merged meshes holding the members stand for them
+		node["mergeMeshes"].setValue( 1 )
+		self.assertEqual( node["out"].childNames( variationPath ), IECore.InternedStringVectorData( [ "merged0" ] ) )
+		self.assertEqual( node["out"].set( "heads" ).value.paths(), [ variationPath + "/merged0" ] )
+
+		# And so do the variations holding the proxies
+		node["mergeMeshes"].setValue( 0 )
+		node["displayMode"].setValue( 1 )
+		self.assertEqual( node["out"].set( "heads" ).value.paths(), [ variationPath ] )
+
+		node["displayMode"].setValue( 0 )
+		self.assertEqual( sorted( node["out"].set( "heads" ).value.paths() ), sorted( expected ) )
+
+	def testEditingAnAgentKeepsOtherAgentHashes( self ) :
+
+		crowd_input = AtomsGaffer.AtomsCrowdReader()
+		crowd_input["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		metadata = AtomsGaffer.AtomsMetadata()
+		metadata["in"].setInput( crowd_input["out"] )
+		tint = metadata["metadata"].addMember( "tint", IECore.V3fData( imath.V3f( 1.0, 0.0, 0.0 ) ) )
+
+		node = AtomsGaffer.AtomsCrowdGenerator()
+		node["parent"].setValue( "/crowd" )
+		node["in"].setInput( metadata["out"] )
+		node["variations"].setInput( variations["out"] )
+
+		variationPath = "/crowd/agents/atomsRobot/Robot1"
+		agents = node["out"].childNames( variationPath )
+		self.assertGreater( len( agents ), 1 )
+		editedPath = "{}/{}".format( variationPath, agents[0] )
+		otherPath = "{}/{}".format( variationPath, agents[1] )
+		metadata["agentIds"].setValue( str( agents[0] ) )
+
+		def hashes( path ) :
+			meshPath = path + "/robot1_body"
+			return (
+				node["out"].attributesHash( path ),
+				node["out"].transformHash( path ),
+				node["out"].boundHash( path ),
+				node["out"].objectHash( meshPath ),
+				node["out"].boundHash( meshPath ),
+			)
+
+		editedHashes = hashes( editedPath )
+		otherHashes = hashes( otherPath )
+		otherAttributes = node["out"].attributes( otherPath )
+
+		tint["value"].setValue( imath.V3f( 0.0, 1.0, 0.0 ) )
+
+		# Only the edited agent is dirtied, the other locations keep their hashes
+		# and so reuse their cached values
+		self.assertNotEqual( hashes( editedPath )[0], editedHashes[0] )
+		self.assertEqual( node["out"].attributes( editedPath )["user:atoms:tint"].value, imath.V3f( 0.0, 1.0, 0.0 ) )
+		self.assertEqual( hashes( otherPath ), otherHashes )
+		self.assertEqual( node["out"].attributes( otherPath ), otherAttributes )
+
 if __name__ == "__main__":
 	unittest.main()
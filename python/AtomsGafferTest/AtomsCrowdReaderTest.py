@@ -34,12 +34,14 @@
 #
 ##########################################################################
 
+import os
 import unittest
 import imath
 
 import IECore
 import IECoreScene
 
+import Gaffer
 import GafferTest
 import GafferSceneTest
 
@@ -246,6 +248,194 @@ class AtomsCrowdReaderTest( GafferSceneTest.SceneTestCase ) :
 
 			self.assertTrue( "boundingBox" in agent_data )
 
+			self.assertEqual( len( agent_data["jointPositions"] ), 68 )
+			self.assertEqual( len( agent_data["jointParents"] ), 68 )
+			self.assertEqual( agent_data["jointParents"][0], -1 )
+			for joint, parent in enumerate( agent_data["jointParents"] ) :
+				self.assertLess( parent, 68 )
+				self.assertNotEqual( parent, joint )
+
+	def testMemoryUsage( self ) :
+
+		a = AtomsGaffer.AtomsCrowdReader()
+		a["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		usage = a.engineMemoryUsage()
+		for key in ( "agentPoses", "agentMetadata", "agentTypes", "agentIds" ) :
+			self.assertTrue( key in usage )
+			self.assertGreater( usage[key].value, 0 )
+
+		self.assertEqual( usage["total"].value, sum( usage[k].value for k in usage.keys() if k != "total" ) )
+
+		# The payload must account for the skinning matrices of every agent
+		agents = a["out"].attributes( "/crowd" )["atoms:agents"]
+		numMatrices = sum( len( v["poseWorldMatrices"] ) for k, v in agents.blindData().items() if k != "frameOffset" )
+		self.assertGreater( agents.memoryUsage(), numMatrices * 2 * 16 * 8 )
+
+		a["atomsSimFile"].setValue( "" )
+		self.assertEqual( a.engineMemoryUsage()["agentPoses"].value, 0 )
+
+	def testCancellation( self ) :
+
+		a = AtomsGaffer.AtomsCrowdReader()
+		a["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		canceller = IECore.Canceller()
+		canceller.cancel()
+		with Gaffer.Context( Gaffer.Context(), canceller ) :
+			self.assertRaises( IECore.Cancelled, a["out"].attributes, "/crowd" )
+
+		# A cancelled compute must not poison the cache
+		self.assertTrue( "atoms:agents" in a["out"].attributes( "/crowd" ) )
+
+	def testOutOfCore( self ) :
+
+		a = AtomsGaffer.AtomsCrowdReader()
+		a["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+		inCoreAgents = a["out"].attributes( "/crowd" )["atoms:agents"].blindData()
+
+		a["outOfCore"].setValue( True )
+		a["scratchDirectory"].setValue( self.temporaryDirectory() )
+		outOfCoreAgents = a["out"].attributes( "/crowd" )["atoms:agents"].blindData()
+
+		# The payload only holds the index of the scratch file
+		self.assertTrue( "outOfCore:file" in outOfCoreAgents )
+		self.assertFalse( "0" in outOfCoreAgents )
+		self.assertEqual( outOfCoreAgents["frameOffset"], inCoreAgents["frameOffset"] )
+		self.assertLess( outOfCoreAgents.memoryUsage(), inCoreAgents.memoryUsage() )
+
+		# And the generated agents are identical, even when every chunk has to be paged back in
+		variations = AtomsGaffer.AtomsVariationReader()
+		variations["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		generator = AtomsGaffer.AtomsCrowdGenerator()
+		generator["parent"].setValue( "/crowd" )
+		generator["in"].setInput( a["out"] )
+		generator["variations"].setInput( variations["out"] )
+
+		path = "/crowd/agents/atomsRobot/Robot1/0/robot1_head"
+		limit = AtomsGaffer.AtomsCrowdReader.getOutOfCoreMemoryLimit()
+		AtomsGaffer.AtomsCrowdReader.setOutOfCoreMemoryLimit( 0 )
+		try :
+			outOfCoreTransform = generator["out"].fullTransform( path )
+			outOfCoreObject = generator["out"].object( path )
+		finally :
+			AtomsGaffer.AtomsCrowdReader.setOutOfCoreMemoryLimit( limit )
+
+		a["outOfCore"].setValue( False )
+		self.assertEqual( generator["out"].fullTransform( path ), outOfCoreTransform )
+		self.assertEqual( generator["out"].object( path ), outOfCoreObject )
+
+	def testScratchFile( self ) :
+
+		a = AtomsGaffer.AtomsCrowdReader()
+		a["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+		a["outOfCore"].setValue( True )
+		a["scratchDirectory"].setValue( self.temporaryDirectory() )
+
+		# The scratch file is private to this process, and unlinked as soon as it's created so
+		# nothing is left behind, even if the process crashes
+		fileName = a["out"].attributes( "/crowd" )["atoms:agents"].blindData()["outOfCore:file"].value
+		self.assertEqual( os.listdir( self.temporaryDirectory() ), [] )
+		self.assertTrue( fileName.endswith( ".fio" ) )
+		self.assertTrue( "_{}_".format( os.getpid() ) in os.path.basename( fileName ) )
+
+		# And it's reused by the same process for the same frame
+		Gaffer.ValuePlug.clearCache()
+		self.assertEqual( a["out"].attributes( "/crowd" )["atoms:agents"].blindData()["outOfCore:file"].value, fileName )
+
+	def testPreviewFraction( self ) :
+
+		a = AtomsGaffer.AtomsCrowdReader()
+		a["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		def agentIds() :
+			return set( a["out"].object( "/crowd" )["atoms:agentId"].data )
+
+		allIds = agentIds()
+
+		a["previewFraction"].setValue( 0.5 )
+		halfIds = agentIds()
+		self.assertTrue( halfIds < allIds )
+		self.assertTrue( len( halfIds ) > 0 )
+
+		# The selection is stable and nested
+		self.assertEqual( agentIds(), halfIds )
+		a["previewFraction"].setValue( 0.25 )
+		self.assertTrue( agentIds() <= halfIds )
+
+		# Only the selected agents are in the payload
+		agents = a["out"].attributes( "/crowd" )["atoms:agents"].blindData()
+		self.assertEqual( set( int( k ) for k in agents.keys() if k != "frameOffset" ), agentIds() )
+
+		a["previewFraction"].setValue( 0 )
+		self.assertEqual( agentIds(), set() )
+
+		# Stratified previews keep every agent type
+		a["previewFraction"].setValue( 1 )
+		allTypes = set( a["out"].object( "/crowd" )["atoms:agentType"].data )
+		a["previewFraction"].setValue( 0.01 )
+		a["previewStratified"].setValue( True )
+		self.assertEqual( set( a["out"].object( "/crowd" )["atoms:agentType"].data ), allTypes )
+
+	def testSharedEngine( self ) :
+
+		a = AtomsGaffer.AtomsCrowdReader()
+		a["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		b = AtomsGaffer.AtomsCrowdReader()
+		b["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+		b["timeOffset"].setValue( 1 )
+
+		def agent( reader, agentId ) :
+			return reader["out"].attributes( "/crowd", _copy = False )["atoms:agents"].blindData()[agentId]
+
+		# Readers evaluating the same frame share the decoded agents
+		with Gaffer.Context() as c :
+			c.setFrame( 2 )
+			agentA = agent( a, "0" )
+			c.setFrame( 1 )
+			self.assertTrue( agent( b, "0" ).isSame( agentA ) )
+
+			# But not when they filter the agents differently
+			b["agentIds"].setValue( "0-5" )
+			self.assertFalse( agent( b, "0" ).isSame( agentA ) )
+			self.assertEqual( agent( b, "0" ), agentA )
+
+	def testSharedEngineMemoryLimit( self ) :
+
+		a = AtomsGaffer.AtomsCrowdReader()
+		a["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+
+		Gaffer.ValuePlug.clearCache()
+		AtomsGaffer.AtomsCrowdReader.clearSharedEngines()
+		self.assertEqual( AtomsGaffer.AtomsCrowdReader.sharedEngineMemoryUsage(), 0 )
+
+		a["out"].object( "/crowd" )
+		engineUsage = AtomsGaffer.AtomsCrowdReader.sharedEngineMemoryUsage()
+		self.assertGreater( engineUsage, 0 )
+
+		# The agents decoded by the engine after it was shared count towards the limit
+		a["out"].attributes( "/crowd" )
+		self.assertGreater( AtomsGaffer.AtomsCrowdReader.sharedEngineMemoryUsage(), engineUsage )
+
+		# Only the most recently used engine is kept once the limit is exceeded
+		b = AtomsGaffer.AtomsCrowdReader()
+		b["atomsSimFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/cache/test_sim.atoms" )
+		b["agentIds"].setValue( "0-5" )
+
+		limit = AtomsGaffer.AtomsCrowdReader.getSharedEngineMemoryLimit()
+		AtomsGaffer.AtomsCrowdReader.setSharedEngineMemoryLimit( 1 )
+		try :
+			self.assertEqual( AtomsGaffer.AtomsCrowdReader.getSharedEngineMemoryLimit(), 1 )
+			b["out"].object( "/crowd" )
+			self.assertLess( AtomsGaffer.AtomsCrowdReader.sharedEngineMemoryUsage(), engineUsage )
+		finally :
+			AtomsGaffer.AtomsCrowdReader.setSharedEngineMemoryLimit( limit )
+
+		AtomsGaffer.AtomsCrowdReader.clearSharedEngines()
+		self.assertEqual( AtomsGaffer.AtomsCrowdReader.sharedEngineMemoryUsage(), 0 )
+
 	def testAffects( self ) :
 
 		a = AtomsGaffer.AtomsCrowdReader()
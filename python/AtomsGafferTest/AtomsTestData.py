@@ -82,6 +82,8 @@ def buildTestAttributes():
             "rootMatrix": IECore.M44dData( imath.M44d().translate( imath.V3d( 0.0, 0.0, 0.0 ) ) ),
             "poseNormalWorldMatrices": IECore.M44dVectorData( [ imath.M44d() ] ),
             "poseWorldMatrices": IECore.M44dVectorData( [ imath.M44d() ] ),
+            "jointPositions": IECore.V3fVectorData( [ imath.V3f( 0.0 ), imath.V3f( 0.0, 1.0, 0.0 ) ] ),
+            "jointParents": IECore.IntVectorData( [ -1, 0 ] ),
         },
         "1": {
             "agentType": IECore.StringData( "atomsRobot" ),
@@ -93,6 +95,8 @@ def buildTestAttributes():
             "rootMatrix": IECore.M44dData( imath.M44d().translate( imath.V3d( 1.0, 0.0, 0.0 ) ) ),
             "poseNormalWorldMatrices": IECore.M44dVectorData( [ imath.M44d() ] ),
             "poseWorldMatrices": IECore.M44dVectorData( [ imath.M44d() ] ),
+            "jointPositions": IECore.V3fVectorData( [ imath.V3f( 0.0 ), imath.V3f( 0.0, 1.0, 0.0 ) ] ),
+            "jointParents": IECore.IntVectorData( [ -1, 0 ] ),
         },
         "2": {
             "agentType": IECore.StringData( "atomsRobot" ),
@@ -104,6 +108,8 @@ def buildTestAttributes():
             "rootMatrix": IECore.M44dData( imath.M44d().translate( imath.V3d( 2.0, 0.0, 0.0 ) ) ),
             "poseNormalWorldMatrices": IECore.M44dVectorData( [ imath.M44d() ]),
             "poseWorldMatrices": IECore.M44dVectorData( [ imath.M44d() ]),
+            "jointPositions": IECore.V3fVectorData( [ imath.V3f( 0.0 ), imath.V3f( 0.0, 1.0, 0.0 ) ] ),
+            "jointParents": IECore.IntVectorData( [ -1, 0 ] ),
         },
         "3": {
             "agentType": IECore.StringData( "atomsRobot" ),
@@ -115,6 +121,8 @@ def buildTestAttributes():
             "rootMatrix": IECore.M44dData( imath.M44d().translate( imath.V3d( 3.0, 0.0, 0.0 ) ) ),
             "poseNormalWorldMatrices": IECore.M44dVectorData( [ imath.M44d() ]),
             "poseWorldMatrices": IECore.M44dVectorData( [ imath.M44d() ]),
+            "jointPositions": IECore.V3fVectorData( [ imath.V3f( 0.0 ), imath.V3f( 0.0, 1.0, 0.0 ) ] ),
+            "jointParents": IECore.IntVectorData( [ -1, 0 ] ),
         },
         "frameOffset": IECore.FloatData( 0 ),
     }
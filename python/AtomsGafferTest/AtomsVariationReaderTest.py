@@ -143,140 +143,142 @@ class AtomsVariationReaderTest( GafferSceneTest.SceneTestCase ) :
 		obj = node["out"].object( "/atomsRobot/Robot1/robot1_head" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 920 )
-		self.assertEqual( len(obj["N"].data), 3480 )
+		self.assertEqual( len(obj["N"].indices), 3480 )
+		self.assertLess( len(obj["N"].data), 3480 )
+		self.assertEqual( len(obj["blendShape_0_N"].data), len(obj["N"].data) )
 		self.assertEqual( len(obj["uv"].data), 3480 )
 		self.assertEqual( len(obj["map1"].data), 3480 )
 		self.assertEqual( len(obj["blendShape_0_P"].data), 920 )
-		self.assertEqual( len(obj["blendShape_0_N"].data), 3480 )
+		self.assertEqual( len(obj["blendShape_0_N"].indices), 3480 )
 		self.assertEqual( len(obj["blendShape_1_P"].data), 920 )
-		self.assertEqual( len(obj["blendShape_1_N"].data), 3480 )
+		self.assertEqual( len(obj["blendShape_1_N"].indices), 3480 )
 		self.assertEqual( obj["blendShapeCount"].data.value, 2 )
 
 		obj = node["out"].object( "/atomsRobot/Robot1/robot1_body" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 635 )
-		self.assertEqual( len(obj["N"].data), 2356 )
+		self.assertEqual( len(obj["N"].indices), 2356 )
 		self.assertEqual( len(obj["uv"].data), 2356 )
 		self.assertEqual( len(obj["map1"].data), 2356 )
 
 		obj = node["out"].object( "/atomsRobot/Robot1/robot1_arms" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 960 )
-		self.assertEqual( len(obj["N"].data), 3424 )
+		self.assertEqual( len(obj["N"].indices), 3424 )
 		self.assertEqual( len(obj["uv"].data), 3424 )
 		self.assertEqual( len(obj["map1"].data), 3424 )
 
 		obj = node["out"].object( "/atomsRobot/Robot1/robot1_legs" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 904 )
-		self.assertEqual( len(obj["N"].data), 3312 )
+		self.assertEqual( len(obj["N"].indices), 3312 )
 		self.assertEqual( len(obj["uv"].data), 3312 )
 		self.assertEqual( len(obj["map1"].data), 3312 )
 
 		obj = node["out"].object( "/atomsRobot/Robot1:A/robot1_head" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 920 )
-		self.assertEqual( len(obj["N"].data), 3480 )
+		self.assertEqual( len(obj["N"].indices), 3480 )
 		self.assertEqual( len(obj["uv"].data), 3480 )
 		self.assertEqual( len(obj["map1"].data), 3480 )
 		self.assertEqual( len(obj["blendShape_0_P"].data), 920 )
-		self.assertEqual( len(obj["blendShape_0_N"].data), 3480 )
+		self.assertEqual( len(obj["blendShape_0_N"].indices), 3480 )
 		self.assertEqual( len(obj["blendShape_1_P"].data), 920 )
-		self.assertEqual( len(obj["blendShape_1_N"].data), 3480 )
+		self.assertEqual( len(obj["blendShape_1_N"].indices), 3480 )
 		self.assertEqual( obj["blendShapeCount"].data.value, 2 )
 
 		obj = node["out"].object( "/atomsRobot/Robot1:A/flag" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 121 )
-		self.assertEqual( len(obj["N"].data), 400 )
+		self.assertEqual( len(obj["N"].indices), 400 )
 		self.assertEqual( len(obj["uv"].data), 400 )
 		self.assertEqual( len(obj["map1"].data), 400 )
 
 		obj = node["out"].object( "/atomsRobot/Robot1:A/pole" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 1022 )
-		self.assertEqual( len(obj["N"].data), 4120 )
+		self.assertEqual( len(obj["N"].indices), 4120 )
 		self.assertEqual( len(obj["uv"].data), 4120 )
 		self.assertEqual( len(obj["map1"].data), 4120 )
 
 		obj = node["out"].object( "/atomsRobot/Robot1:A/robot1_body" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 635 )
-		self.assertEqual( len(obj["N"].data), 2356 )
+		self.assertEqual( len(obj["N"].indices), 2356 )
 		self.assertEqual( len(obj["uv"].data), 2356 )
 		self.assertEqual( len(obj["map1"].data), 2356 )
 
 		obj = node["out"].object( "/atomsRobot/Robot1:B/robot1_body" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 635 )
-		self.assertEqual( len(obj["N"].data), 2356 )
+		self.assertEqual( len(obj["N"].indices), 2356 )
 		self.assertEqual( len(obj["uv"].data), 2356 )
 		self.assertEqual( len(obj["map1"].data), 2356 )
 
 		obj = node["out"].object( "/atomsRobot/Robot2/robot2_head" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 5874 )
-		self.assertEqual( len(obj["N"].data), 5874 )
+		self.assertEqual( len(obj["N"].indices), 5874 )
 		self.assertEqual( len(obj["uv"].data), 5874 )
 
 		obj = node["out"].object( "/atomsRobot/Robot2/robot2_body" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 16944 )
-		self.assertEqual( len(obj["N"].data), 16944 )
+		self.assertEqual( len(obj["N"].indices), 16944 )
 		self.assertEqual( len(obj["uv"].data), 16944 )
 
 		obj = node["out"].object( "/atomsRobot/Robot2/robot2_arms" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 6288 )
-		self.assertEqual( len(obj["N"].data), 6288 )
+		self.assertEqual( len(obj["N"].indices), 6288 )
 		self.assertEqual( len(obj["uv"].data), 6288 )
 
 		obj = node["out"].object( "/atomsRobot/Robot2/robot2_legs" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 7200 )
-		self.assertEqual( len(obj["N"].data), 7200 )
+		self.assertEqual( len(obj["N"].indices), 7200 )
 		self.assertEqual( len(obj["uv"].data), 7200 )
 
 		obj = node["out"].object( "/atomsRobot/Robot2:A/robot2_head" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 5874 )
-		self.assertEqual( len(obj["N"].data), 5874 )
+		self.assertEqual( len(obj["N"].indices), 5874 )
 		self.assertEqual( len(obj["uv"].data), 5874 )
 
 		obj = node["out"].object( "/atomsRobot/Robot2:A/robot2_body" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 16944 )
-		self.assertEqual( len(obj["N"].data), 16944 )
+		self.assertEqual( len(obj["N"].indices), 16944 )
 		self.assertEqual( len(obj["uv"].data), 16944 )
 
 		obj = node["out"].object( "/atomsRobot/Robot2:B/robot2_body" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 16944 )
-		self.assertEqual( len(obj["N"].data), 16944 )
+		self.assertEqual( len(obj["N"].indices), 16944 )
 		self.assertEqual( len(obj["uv"].data), 16944 )
 
 		obj = node["out"].object( "/atoms2Robot/YellowRobot/Body/RobotBody" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 28149 )
-		self.assertEqual( len(obj["N"].data), 111930 )
+		self.assertEqual( len(obj["N"].indices), 111930 )
 		self.assertEqual( len(obj["uv"].data), 111930 )
 
 		obj = node["out"].object( "/atoms2Robot/RedRobot/Body/RobotBody" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 28149 )
-		self.assertEqual( len(obj["N"].data), 111930 )
+		self.assertEqual( len(obj["N"].indices), 111930 )
 		self.assertEqual( len(obj["uv"].data), 111930 )
 
 		obj = node["out"].object( "/atoms2Robot/RedRobot:A/Body/RobotBody" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 28149 )
-		self.assertEqual( len(obj["N"].data), 111930 )
+		self.assertEqual( len(obj["N"].indices), 111930 )
 		self.assertEqual( len(obj["uv"].data), 111930 )
 
 		obj = node["out"].object( "/atoms2Robot/PurpleRobot/Body/RobotBody" )
 		self.assertEqual( obj.typeName(), IECoreScene.MeshPrimitive.staticTypeName() )
 		self.assertEqual( len(obj["P"].data), 28149 )
-		self.assertEqual( len(obj["N"].data), 111930 )
+		self.assertEqual( len(obj["N"].indices), 111930 )
 		self.assertEqual( len(obj["uv"].data), 111930 )
 
 	def testAttributes( self ) :
@@ -297,6 +299,8 @@ class AtomsVariationReaderTest( GafferSceneTest.SceneTestCase ) :
 		self.assertEqual( len( attributes["jointIndices"] ), 920 )
 		self.assertTrue( "jointWeights" in attributes )
 		self.assertEqual( len( attributes["jointWeights"] ), 920 )
+		# The blend shapes deform the head, so it can't be treated as rigid
+		self.assertFalse( "rigidJointIndex" in attributes )
 
 		attributes = node["out"].attributes( "/atomsRobot/Robot1/robot1_body" )
 		self.assertTrue( "ai:polymesh:subdiv_adaptive_space" in attributes )
@@ -325,6 +329,7 @@ class AtomsVariationReaderTest( GafferSceneTest.SceneTestCase ) :
 		self.assertEqual( len( attributes["jointIndices"] ), 1344 )
 		self.assertTrue( "jointWeights" in attributes )
 		self.assertEqual( len( attributes["jointWeights"] ), 1344 )
+		self.assertFalse( "rigidJointIndex" in attributes )
 
 		attributes = node["out"].attributes( "/atomsRobot/Robot1/robot1_legs" )
 		self.assertTrue( "ai:polymesh:subdiv_adaptive_space" in attributes )
@@ -551,5 +556,42 @@ class AtomsVariationReaderTest( GafferSceneTest.SceneTestCase ) :
 		self.assertTrue( "jointWeights" in attributes )
 		self.assertEqual( len( attributes["jointWeights"] ), 40309 )
 
+	def testJointBounds( self ) :
+
+		node = AtomsGaffer.AtomsVariationReader()
+		node["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+
+		for mesh in node["out"].childNames( "/atomsRobot/Robot1" ) :
+			path = "/atomsRobot/Robot1/" + str( mesh )
+			attributes = node["out"].attributes( path )
+			if "jointIndexCount" not in attributes :
+				continue
+
+			# Every bind point lies in the bounds of the joints skinning it
+			jointBounds = attributes["jointBounds"]
+			points = node["out"].object( path )["P"].data
+			offset = 0
+			for pointIndex, count in enumerate( attributes["jointIndexCount"] ) :
+				for i in range( offset, offset + count ) :
+					if attributes["jointWeights"][i] > 0 :
+						self.assertTrue( jointBounds[attributes["jointIndices"][i]].intersects( points[pointIndex] ) )
+				offset += count
+
+	def testMemoryUsage( self ) :
+
+		node = AtomsGaffer.AtomsVariationReader()
+		self.assertEqual( node.engineMemoryUsage()["total"].value, 0 )
+
+		node["atomsVariationFile"].setValue( "${ATOMS_GAFFER_ROOT}/examples/assets/atomsRobot/atomsRobot.json" )
+		usage = node.engineMemoryUsage()
+		for key in ( "meshes", "skinWeights" ) :
+			self.assertGreater( usage[key].value, 0 )
+
+		self.assertEqual( usage["total"].value, sum( usage[k].value for k in usage.keys() if k != "total" ) )
+
+		# At the very least the engine holds the points of every loaded mesh
+		obj = node["out"].object( "/atomsRobot/Robot1/robot1_head" )
+		self.assertGreater( usage["meshes"].value, obj["P"].data.memoryUsage() )
+
 if __name__ == "__main__":
 	unittest.main()
@@ -104,7 +104,107 @@ Gaffer.Metadata.registerNode(
 
             "description",
             """
-            Turn on agent instancing. Agents with the same pose and metadata values are instanced.
+            Turn on agent instancing. Agents with the same variation, pose and blend shape
+            weights share the same deformed meshes, across the crowd and across frames.
+            Meshes deformed by a cloth cache are never shared.
+            """,
+
+        ],
+
+        "poseTolerance" : [
+
+            "description",
+            """
+            Turns on approximate instancing when useInstances is on. Agents of the same
+            type and variation whose skinning matrices and blend shape weights differ by
+            less than this tolerance share the deformed meshes of a single agent. 0 only
+            shares the meshes of agents with the same pose.
+            """,
+
+        ],
+
+        "poseToleranceCamera" : [
+
+            "description",
+            """
+            The location of a camera in the input scene. When set, the pose tolerance is
+            multiplied by the distance of each agent from the camera, so distant agents
+            are instanced more aggressively than close ones.
+            """,
+            "label", "Pose Tolerance Camera",
+
+        ],
+
+        "encapsulate" : [
+
+            "description",
+            """
+            Outputs a capsule in place of the agents of every agent type or variation.
+            At render time the capsules deform their agents in parallel and output them
+            straight to the renderer, which is much quicker for big crowds than going
+            through every agent location of the scene. The agents are no longer visible
+            in the scene hierarchy, and only the bound of the capsules is drawn in the
+            viewer.
+            """,
+
+            "preset:None", 0,
+            "preset:Agent Types", 1,
+            "preset:Variations", 2,
+
+            "plugValueWidget:type", "GafferUI.PresetsPlugValueWidget",
+
+        ],
+
+        "mergeMeshes" : [
+
+            "description",
+            """
+            Replaces the agents of every variation by merged meshes, for the renderers and
+            exporters dealing badly with many small objects. All the agent meshes of a
+            variation are merged into a single mesh, or into one mesh per set of mesh
+            attributes, so the meshes with different shaders stay apart. The "atoms:agentId"
+            uniform primitive variable holds the agent of every face. Ignored when the
+            agents are encapsulated.
+            """,
+
+            "preset:None", 0,
+            "preset:Variations", 1,
+            "preset:Attributes", 2,
+
+            "plugValueWidget:type", "GafferUI.PresetsPlugValueWidget",
+
+        ],
+
+        "displayMode" : [
+
+            "description",
+            """
+            Replaces the agents of every variation by a cheap proxy, so big crowds can
+            be scrubbed interactively in the viewer. The proxy is a single object holding
+            a box for the bound of every agent, line curves drawing the agent skeletons,
+            or a point at the root of every agent. The "atoms:agentId" primitive variable
+            holds the agent of every element. Ignored when the agents are encapsulated,
+            and takes precedence over the merged meshes.
+            """,
+
+            "preset:Meshes", 0,
+            "preset:Bounds", 1,
+            "preset:Skeleton", 2,
+            "preset:Points", 3,
+
+            "plugValueWidget:type", "GafferUI.PresetsPlugValueWidget",
+
+        ],
+
+        "velocity" : [
+
+            "description",
+            """
+            Adds a "velocity" primitive variable to the skinned agent meshes, holding
+            the motion of every point towards the next frame in units per second, for
+            the renderers supporting vector motion blur. All the meshes are skinned to
+            compute it, so the rigid meshes and the meshes of the agents sharing a pose
+            aren't instanced anymore. The cloth meshes have no velocity.
             """,
 
         ],
@@ -111,6 +111,64 @@ Gaffer.Metadata.registerNode(
             "layout:index", 1,
         ],
 
+        "previewFraction" : [
+
+            "description",
+            """
+            The fraction of the crowd to load, for fast interactive
+            previews of big crowds. The agents are picked from their
+            id, so the selection is stable from frame to frame and a
+            smaller fraction is always a subset of a larger one. The
+            agents which are left out are never decoded.
+            """,
+
+            "layout:section", "Preview",
+            "label", "Fraction",
+        ],
+
+        "previewStratified" : [
+
+            "description",
+            """
+            Picks the same fraction of agents from every agent type,
+            keeping at least one agent per type, so the preview stays
+            representative of the whole crowd.
+            """,
+
+            "layout:section", "Preview",
+            "label", "Stratified",
+        ],
+
+        "outOfCore" : [
+
+            "description",
+            """
+            Streams the evaluated agents to a scratch file instead of
+            keeping them all in memory. Agents are then paged back in
+            on demand, one chunk at a time, within the memory budget
+            set by AtomsCrowdReader.setOutOfCoreMemoryLimit(). Use this
+            to render crowds that don't fit in memory.
+            """,
+
+            "layout:section", "Out Of Core",
+            "label", "Out Of Core",
+        ],
+
+        "scratchDirectory" : [
+
+            "description",
+            """
+            The directory where the out of core scratch files are
+            written. Defaults to $TMPDIR, or /tmp if it isn't set.
+            This should be on a fast local disk.
+            """,
+
+            "plugValueWidget:type", "GafferUI.FileSystemPathPlugValueWidget",
+            "path:leaf", False,
+            "layout:section", "Out Of Core",
+            "label", "Scratch Directory",
+        ],
+
     },
 
 )
@@ -0,0 +1,336 @@
+//////////////////////////////////////////////////////////////////////////
+//
+//  Copyright (c) 2018, Toolchefs Ltd. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      * Redistributions of source code must retain the above
+//        copyright notice, this list of conditions and the following
+//        disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following
+//        disclaimer in the documentation and/or other materials provided with
+//        the distribution.
+//
+//      * Neither the name of John Haddon nor the names of
+//        any other contributors to this software may be used to endorse or
+//        promote products derived from this software without specific prior
+//        written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+//  IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+//  THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+//  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+//  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+//  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//////////////////////////////////////////////////////////////////////////
+
+
+#include "AtomsGaffer/AtomsAgentPager.h"
+
+#include "IECore/FileIndexedIO.h"
+#include "IECore/Exception.h"
+#include "IECore/SimpleTypedData.h"
+#include "IECore/VectorTypedData.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <unistd.h>
+
+using namespace IECore;
+using namespace AtomsGaffer;
+
+namespace
+{
+
+const InternedString g_fileKey( "outOfCore:file" );
+const InternedString g_chunkFirstIdsKey( "outOfCore:chunkFirstIds" );
+const IndexedIO::EntryID g_chunkFirstIdsEntry( "chunkFirstIds" );
+
+IndexedIO::EntryID chunkEntry( size_t chunkIndex )
+{
+    return IndexedIO::EntryID( "chunk" + std::to_string( chunkIndex ) );
+}
+
+// The path an open descriptor can be reopened from, even once its file has been unlinked
+std::string descriptorPath( int fd )
+{
+    return "/proc/self/fd/" + std::to_string( fd );
+}
+
+} // namespace
+
+AtomsAgentPager::ChunkWriter::ChunkWriter( const std::string& fileName ):
+        m_fileName( fileName ),
+        m_fd( -1 ),
+        m_chunk( new CompoundData ),
+        m_lastAgentId( 0 )
+{
+    std::string tempFileName = fileName + ".XXXXXX";
+    m_fd = mkstemp( &tempFileName[0] );
+    if ( m_fd < 0 )
+    {
+        throw IOException( "AtomsAgentPager : Unable to create the scratch file " + fileName );
+    }
+    unlink( tempFileName.c_str() );
+
+    try
+    {
+        m_io = new FileIndexedIO( descriptorPath( m_fd ), IndexedIO::rootPath, IndexedIO::Write );
+    }
+    catch ( ... )
+    {
+        close( m_fd );
+        throw;
+    }
+}
+
+AtomsAgentPager::ChunkWriter::~ChunkWriter()
+{
+    // The writer has been abandoned before the commit, most likely because the compute has been cancelled
+    m_io = nullptr;
+    if ( m_fd >= 0 )
+    {
+        close( m_fd );
+    }
+}
+
+void AtomsAgentPager::ChunkWriter::addAgent( int agentId, const ConstCompoundDataPtr& agentData )
+{
+    if ( !m_chunkFirstIds.empty() && agentId <= m_lastAgentId )
+    {
+        throw InvalidArgumentException( "AtomsAgentPager : Agents must be added in ascending id order" );
+    }
+
+    if ( m_chunk->readable().empty() )
+    {
+        m_chunkFirstIds.push_back( agentId );
+    }
+
+    m_chunk->writable()[std::to_string( agentId )] = boost::const_pointer_cast<CompoundData>( agentData );
+    m_lastAgentId = agentId;
+    if ( m_chunk->readable().size() >= chunkSize )
+    {
+        flush();
+    }
+}
+
+void AtomsAgentPager::ChunkWriter::flush()
+{
+    if ( m_chunk->readable().empty() )
+    {
+        return;
+    }
+
+    m_chunk->save( m_io, chunkEntry( m_chunkFirstIds.size() - 1 ) );
+    m_chunk = new CompoundData;
+}
+
+void AtomsAgentPager::ChunkWriter::commit()
+{
+    flush();
+
+    IntVectorDataPtr chunkFirstIds = new IntVectorData( m_chunkFirstIds );
+    chunkFirstIds->save( m_io, g_chunkFirstIdsEntry );
+
+    // Close the writer so the file is complete before it can be read
+    m_io = nullptr;
+    AtomsAgentPager::instance().registerFile( m_fileName, m_fd );
+    m_fd = -1;
+}
+
+AtomsAgentPager::AtomsAgentPager():
+        m_memoryUsage( 0 ),
+        m_memoryLimit( 1024 * 1024 * 1024 )
+{
+}
+
+AtomsAgentPager::~AtomsAgentPager()
+{
+    clear();
+
+    // The scratch files are already unlinked, so closing them releases their space
+    for ( const auto& file : m_files )
+    {
+        close( file.second );
+    }
+}
+
+AtomsAgentPager& AtomsAgentPager::instance()
+{
+    static AtomsAgentPager pager;
+    return pager;
+}
+
+ConstCompoundDataPtr AtomsAgentPager::agentData( const CompoundData* agents, const std::string& agentId )
+{
+    if ( !agents )
+    {
+        return nullptr;
+    }
+
+    ConstCompoundDataPtr result = agents->member<const CompoundData>( agentId );
+    if ( result )
+    {
+        return result;
+    }
+
+    auto fileData = agents->member<const StringData>( g_fileKey );
+    auto chunkFirstIdsData = agents->member<const IntVectorData>( g_chunkFirstIdsKey );
+    if ( !fileData || !chunkFirstIdsData )
+    {
+        return nullptr;
+    }
+
+    char *end = nullptr;
+    const long id = std::strtol( agentId.c_str(), &end, 10 );
+    if ( agentId.empty() || *end != '\0' )
+    {
+        return nullptr;
+    }
+
+    // Find the chunk containing the agent, the chunks are sorted by their first agent id
+    const auto& chunkFirstIds = chunkFirstIdsData->readable();
+    auto chunkIt = std::upper_bound( chunkFirstIds.begin(), chunkFirstIds.end(), id );
+    if ( chunkIt == chunkFirstIds.begin() )
+    {
+        return nullptr;
+    }
+
+    ConstCompoundDataPtr chunkData = chunk( fileData->readable(), chunkIt - chunkFirstIds.begin() - 1 );
+    return chunkData->member<const CompoundData>( agentId );
+}
+
+bool AtomsAgentPager::hasFile( const std::string& fileName ) const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_files.count( fileName );
+}
+
+void AtomsAgentPager::addIndex( const std::string& fileName, CompoundData* agents )
+{
+    IndexedIOPtr io = new FileIndexedIO( filePath( fileName ), IndexedIO::rootPath, IndexedIO::Read );
+    IntVectorDataPtr chunkFirstIds = runTimeCast<IntVectorData>( Object::load( io, g_chunkFirstIdsEntry ) );
+    if ( !chunkFirstIds )
+    {
+        throw IOException( "AtomsAgentPager : Invalid scratch file " + fileName );
+    }
+
+    agents->writable()[g_fileKey] = new StringData( fileName );
+    agents->writable()[g_chunkFirstIdsKey] = chunkFirstIds;
+}
+
+bool AtomsAgentPager::isPaged( const CompoundData* agents )
+{
+    return agents && agents->member<const StringData>( g_fileKey );
+}
+
+void AtomsAgentPager::setMemoryLimit( size_t bytes )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_memoryLimit = bytes;
+    evict();
+}
+
+size_t AtomsAgentPager::getMemoryLimit() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_memoryLimit;
+}
+
+size_t AtomsAgentPager::memoryUsage() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_memoryUsage;
+}
+
+void AtomsAgentPager::clear()
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_chunks.clear();
+    m_lru.clear();
+    m_memoryUsage = 0;
+}
+
+ConstCompoundDataPtr AtomsAgentPager::chunk( const std::string& fileName, size_t chunkIndex )
+{
+    const ChunkKey key( fileName, chunkIndex );
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        auto chunkIt = m_chunks.find( key );
+        if ( chunkIt != m_chunks.end() )
+        {
+            m_lru.splice( m_lru.begin(), m_lru, chunkIt->second.lruIt );
+            return chunkIt->second.data;
+        }
+    }
+
+    // Load outside of the lock, so other threads can keep reading the resident chunks
+    IndexedIOPtr io = new FileIndexedIO( filePath( fileName ), IndexedIO::rootPath, IndexedIO::Read );
+    ConstCompoundDataPtr data = runTimeCast<const CompoundData>( Object::load( io, chunkEntry( chunkIndex ) ) );
+    if ( !data )
+    {
+        throw IOException( "AtomsAgentPager : Invalid chunk " + std::to_string( chunkIndex ) + " in scratch file " + fileName );
+    }
+
+    std::lock_guard<std::mutex> lock( m_mutex );
+    auto inserted = m_chunks.insert( std::make_pair( key, Chunk() ) );
+    if ( !inserted.second )
+    {
+        // Another thread loaded the same chunk in the meantime
+        return inserted.first->second.data;
+    }
+
+    m_lru.push_front( key );
+    Chunk& chunk = inserted.first->second;
+    chunk.data = data;
+    chunk.cost = data->memoryUsage();
+    chunk.lruIt = m_lru.begin();
+    m_memoryUsage += chunk.cost;
+    evict();
+
+    return data;
+}
+
+void AtomsAgentPager::registerFile( const std::string& fileName, int fd )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    if ( !m_files.insert( std::make_pair( fileName, fd ) ).second )
+    {
+        // Another reader committed the same file in the meantime
+        close( fd );
+    }
+}
+
+std::string AtomsAgentPager::filePath( const std::string& fileName ) const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    auto fileIt = m_files.find( fileName );
+    if ( fileIt == m_files.end() )
+    {
+        throw IOException( "AtomsAgentPager : Unknown scratch file " + fileName );
+    }
+    return descriptorPath( fileIt->second );
+}
+
+void AtomsAgentPager::evict()
+{
+    // Always keep the most recent chunk resident, even if it exceeds the limit on its own
+    while ( m_memoryUsage > m_memoryLimit && m_lru.size() > 1 )
+    {
+        auto chunkIt = m_chunks.find( m_lru.back() );
+        m_memoryUsage -= chunkIt->second.cost;
+        m_chunks.erase( chunkIt );
+        m_lru.pop_back();
+    }
+}
@@ -0,0 +1,150 @@
+//////////////////////////////////////////////////////////////////////////
+//
+//  Copyright (c) 2018, Toolchefs Ltd. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      * Redistributions of source code must retain the above
+//        copyright notice, this list of conditions and the following
+//        disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following
+//        disclaimer in the documentation and/or other materials provided with
+//        the distribution.
+//
+//      * Neither the name of John Haddon nor the names of
+//        any other contributors to this software may be used to endorse or
+//        promote products derived from this software without specific prior
+//        written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+//  IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+//  THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+//  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+//  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+//  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "AtomsGaffer/AtomsCrowdCapsule.h"
+#include "AtomsGaffer/AtomsCrowdGenerator.h"
+
+#include "IECore/MessageHandler.h"
+
+using namespace IECore;
+using namespace Gaffer;
+using namespace GafferScene;
+using namespace AtomsGaffer;
+
+IE_CORE_DEFINEOBJECTTYPEDESCRIPTION( AtomsCrowdCapsule );
+
+AtomsCrowdCapsule::AtomsCrowdCapsule()
+	:	m_generator( nullptr )
+{
+}
+
+AtomsCrowdCapsule::AtomsCrowdCapsule(
+	const AtomsCrowdGenerator *generator,
+	const ScenePlug::ScenePath &parentPath,
+	const ScenePlug::ScenePath &branchPath,
+	const Gaffer::Context &context,
+	const IECore::MurmurHash &hash,
+	const Imath::Box3f &bound
+)
+	:	m_hash( hash ), m_bound( bound ), m_generator( generator ), m_parentPath( parentPath ), m_branchPath( branchPath ), m_context( new Context( context ) )
+{
+}
+
+AtomsCrowdCapsule::~AtomsCrowdCapsule()
+{
+}
+
+bool AtomsCrowdCapsule::isEqualTo( const IECore::Object *other ) const
+{
+	if( !Procedural::isEqualTo( other ) )
+	{
+		return false;
+	}
+
+	const AtomsCrowdCapsule *capsule = static_cast<const AtomsCrowdCapsule *>( other );
+	return m_hash == capsule->m_hash;
+}
+
+void AtomsCrowdCapsule::hash( IECore::MurmurHash &h ) const
+{
+	Procedural::hash( h );
+	h.append( m_hash );
+}
+
+void AtomsCrowdCapsule::copyFrom( const IECore::Object *other, IECore::Object::CopyContext *context )
+{
+	Procedural::copyFrom( other, context );
+	const AtomsCrowdCapsule *capsule = static_cast<const AtomsCrowdCapsule *>( other );
+	m_hash = capsule->m_hash;
+	m_bound = capsule->m_bound;
+	m_generator = capsule->m_generator;
+	m_parentPath = capsule->m_parentPath;
+	m_branchPath = capsule->m_branchPath;
+	m_context = capsule->m_context;
+}
+
+void AtomsCrowdCapsule::save( IECore::Object::SaveContext *context ) const
+{
+	Procedural::save( context );
+	IECore::msg( IECore::Msg::Warning, "AtomsCrowdCapsule::save", "Not implemented" );
+}
+
+void AtomsCrowdCapsule::load( IECore::Object::LoadContextPtr context )
+{
+	Procedural::load( context );
+	IECore::msg( IECore::Msg::Warning, "AtomsCrowdCapsule::load", "Not implemented" );
+}
+
+void AtomsCrowdCapsule::memoryUsage( IECore::Object::MemoryAccumulator &accumulator ) const
+{
+	Procedural::memoryUsage( accumulator );
+	accumulator.accumulate( sizeof( AtomsCrowdCapsule ) );
+}
+
+Imath::Box3f AtomsCrowdCapsule::bound() const
+{
+	return m_bound;
+}
+
+void AtomsCrowdCapsule::render( IECoreScenePreview::Renderer *renderer ) const
+{
+	if( !m_generator )
+	{
+		throw IECore::Exception( "AtomsCrowdCapsule : No generator" );
+	}
+
+	m_generator->renderCapsule( m_parentPath, m_branchPath, m_context.get(), renderer );
+}
+
+const AtomsCrowdGenerator *AtomsCrowdCapsule::generator() const
+{
+	return m_generator;
+}
+
+const ScenePlug::ScenePath &AtomsCrowdCapsule::parentPath() const
+{
+	return m_parentPath;
+}
+
+const ScenePlug::ScenePath &AtomsCrowdCapsule::branchPath() const
+{
+	return m_branchPath;
+}
+
+const Gaffer::Context *AtomsCrowdCapsule::context() const
+{
+	return m_context.get();
+}
@@ -40,6 +40,7 @@
 
 #include "IECore/NullObject.h"
 #include "IECore/BlindDataHolder.h"
+#include "IECore/Canceller.h"
 
 #include "AtomsUtils/PathSolver.h"
 #include "AtomsUtils/Utils.h"
@@ -179,6 +180,8 @@ ConstObjectPtr AtomsCrowdClothReader::computeObject( const ScenePath &path, cons
     auto& clothData = clothCompound->writable();
     for (auto agentId: agentIds )
     {
+        Canceller::check( context->canceller() );
+
         CompoundDataPtr agentCompound = new CompoundData;
         auto& agentData = agentCompound->writable();
 
@@ -200,17 +203,27 @@ ConstObjectPtr AtomsCrowdClothReader::computeObject( const ScenePath &path, cons
             }
         }
 
+        // The cache is loaded in double precision, but the meshes are deformed
+        // in float, so the points and normals are stored as float
+        std::vector<Imath::V3d> cacheP;
+        std::vector<Imath::V3d> cacheN;
         for( const auto& meshName: meshNames )
         {
             CompoundDataPtr meshCompound = new CompoundData;
             auto& meshData = meshCompound->writable();
 
-            V3dVectorDataPtr p = new V3dVectorData;
-            V3dVectorDataPtr n = new V3dVectorData;
+            V3fVectorDataPtr p = new V3fVectorData;
+            p->setInterpretation( GeometricData::Point );
+            V3fVectorDataPtr n = new V3fVectorData;
+            n->setInterpretation( GeometricData::Normal );
             Box3dDataPtr bbox = new Box3dData;
             StringDataPtr stackOrder = new StringData;
 
-            cache.loadAgentClothMesh( frame, agentId, meshName, p->writable(), n->writable() );
+            cacheP.clear();
+            cacheN.clear();
+            cache.loadAgentClothMesh( frame, agentId, meshName, cacheP, cacheN );
+            p->writable().assign( cacheP.begin(), cacheP.end() );
+            n->writable().assign( cacheN.begin(), cacheN.end() );
             cache.loadAgentClothMeshBoundingBox( frame, agentId, meshName, bbox->writable() );
             stackOrder->writable() = cache.getAgentClothMeshStackOrder( frame, agentId, meshName );
 
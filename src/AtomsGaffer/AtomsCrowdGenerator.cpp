@@ -36,17 +36,42 @@
 
 #include <AtomsUtils/Logger.h>
 #include "AtomsGaffer/AtomsCrowdGenerator.h"
+#include "AtomsGaffer/AtomsAgentPager.h"
+#include "AtomsGaffer/AtomsSkinning.h"
+#include "AtomsGaffer/AtomsCrowdCapsule.h"
 
 #include "Atoms/GlobalNames.h"
 
+#include "GafferScene/Private/IECoreScenePreview/Renderer.h"
+
 #include "IECoreScene/PointsPrimitive.h"
 #include "IECoreScene/MeshPrimitive.h"
+#include "IECoreScene/CurvesPrimitive.h"
 
 #include "IECore/NullObject.h"
 #include "IECore/BlindDataHolder.h"
+#include "IECore/Canceller.h"
+#include "IECore/DataAlgo.h"
+#include "IECore/TypeTraits.h"
 
+#include "ImathBoxAlgo.h"
 #include "ImathEuler.h"
 
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_reduce.h"
+#include "tbb/task_arena.h"
+#include "tbb/task_group.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <type_traits>
+#include <unordered_map>
+
 IE_CORE_DEFINERUNTIMETYPED( AtomsGaffer::AtomsCrowdGenerator );
 
 using namespace IECore;
@@ -55,1165 +80,4268 @@ using namespace Gaffer;
 using namespace GafferScene;
 using namespace AtomsGaffer;
 
-size_t AtomsCrowdGenerator::g_firstPlugIndex = 0;
+//////////////////////////////////////////////////////////////////////////
+// Agent attribute conversion
+//////////////////////////////////////////////////////////////////////////
 
-AtomsCrowdGenerator::AtomsCrowdGenerator( const std::string &name )
-	:	BranchCreator( name )
+namespace
 {
-	storeIndexOfNextChild( g_firstPlugIndex );
-
-	addChild( new StringPlug( "name", Plug::In, "agents" ) );
-	addChild( new ScenePlug( "variations" ) );
-	addChild( new BoolPlug( "useInstances" ) );
-	addChild( new FloatPlug( "boundingBoxPadding" ) );
-
-    addChild( new ScenePlug( "clothCache" ) );
-
-	addChild( new AtomicCompoundDataPlug( "__agentChildNames", Plug::Out, new CompoundData ) );
-}
 
-Gaffer::StringPlug *AtomsCrowdGenerator::namePlug()
+// Describes how a single atoms metadata or point primitive variable is
+// converted into a gaffer attribute. Crowds share the same metadata and
+// primitive variables for every agent, so the type dispatch and the
+// attribute names are resolved once per crowd rather than once per agent.
+struct AttributeConversion
 {
-	return getChild<StringPlug>( g_firstPlugIndex );
-}
-
-const Gaffer::StringPlug *AtomsCrowdGenerator::namePlug() const
+	enum Kind
+	{
+		Copy,
+		Double,
+		V2d,
+		V3d,
+		Quatd,
+		M44d,
+		BoolVector,
+		IntVector,
+		FloatVector,
+		StringVector,
+		V2fVector,
+		V3fVector,
+		M44fVector,
+		QuatfVector,
+		Unsupported
+	};
+
+	InternedString name;
+	Kind kind;
+	// Only used by the primitive variables
+	const Data *data;
+	// Only used by the metadata, the type the conversion was chosen for
+	IECore::TypeId typeId;
+};
+
+using MetadataPlan = std::map<InternedString, AttributeConversion>;
+using PrimVarPlan = std::vector<AttributeConversion>;
+
+AttributeConversion metadataConversion( const InternedString &name, const Data *data )
 {
-	return getChild<StringPlug>( g_firstPlugIndex );
+	AttributeConversion result;
+	// All the data are trasfered to the renderer, so add "user:" as prefix
+	result.name = "user:atoms:" + name.string();
+	result.data = nullptr;
+	result.typeId = data->typeId();
+	// Atoms store all the data in double, while gaffer use floats, so convert them
+	switch( data->typeId() )
+	{
+		case IECore::TypeId::DoubleDataTypeId : result.kind = AttributeConversion::Double; break;
+		case IECore::TypeId::V2dDataTypeId : result.kind = AttributeConversion::V2d; break;
+		case IECore::TypeId::V3dDataTypeId : result.kind = AttributeConversion::V3d; break;
+		case IECore::TypeId::QuatdDataTypeId : result.kind = AttributeConversion::Quatd; break;
+		case IECore::TypeId::M44dDataTypeId : result.kind = AttributeConversion::M44d; break;
+		default : result.kind = AttributeConversion::Copy; break;
+	}
+	return result;
 }
 
-ScenePlug *AtomsCrowdGenerator::variationsPlug()
+MetadataPlan metadataPlan( const CompoundData *metadata )
 {
-	return getChild<ScenePlug>( g_firstPlugIndex + 1 );
-}
+	MetadataPlan result;
+	if( !metadata )
+	{
+		return result;
+	}
 
-const ScenePlug *AtomsCrowdGenerator::variationsPlug() const
-{
-	return getChild<ScenePlug>( g_firstPlugIndex + 1 );
+	for( const auto &member : metadata->readable() )
+	{
+		result.emplace( member.first, metadataConversion( member.first, member.second.get() ) );
+	}
+	return result;
 }
 
-Gaffer::BoolPlug *AtomsCrowdGenerator::useInstancesPlug()
+AttributeConversion::Kind primVarKind( const Data *data )
 {
-    return getChild<BoolPlug>( g_firstPlugIndex + 2 );
+	switch( data->typeId() )
+	{
+		case IECore::TypeId::BoolVectorDataTypeId : return AttributeConversion::BoolVector;
+		case IECore::TypeId::IntVectorDataTypeId : return AttributeConversion::IntVector;
+		case IECore::TypeId::FloatVectorDataTypeId : return AttributeConversion::FloatVector;
+		case IECore::TypeId::StringVectorDataTypeId : return AttributeConversion::StringVector;
+		case IECore::TypeId::V2fVectorDataTypeId : return AttributeConversion::V2fVector;
+		case IECore::TypeId::V3fVectorDataTypeId : return AttributeConversion::V3fVector;
+		case IECore::TypeId::M44fVectorDataTypeId : return AttributeConversion::M44fVector;
+		case IECore::TypeId::QuatfVectorDataTypeId : return AttributeConversion::QuatfVector;
+		default : return AttributeConversion::Unsupported;
+	}
 }
 
-const Gaffer::BoolPlug *AtomsCrowdGenerator::useInstancesPlug() const
+// Only the prim vars that has "atoms:" as prefix are converted
+PrimVarPlan primVarPlan( const PointsPrimitive *points )
 {
-    return getChild<BoolPlug>( g_firstPlugIndex + 2 );
-}
+	PrimVarPlan result;
+	if( !points )
+	{
+		return result;
+	}
 
-Gaffer::FloatPlug *AtomsCrowdGenerator::boundingBoxPaddingPlug()
-{
-	return getChild<FloatPlug>( g_firstPlugIndex + 3 );
-}
+	for( const auto &primVar : points->variables )
+	{
+		if( primVar.first.find( "atoms:" ) != 0 )
+		{
+			continue;
+		}
 
-const Gaffer::FloatPlug *AtomsCrowdGenerator::boundingBoxPaddingPlug() const
-{
-	return getChild<FloatPlug>( g_firstPlugIndex + 3 );
+		AttributeConversion conversion;
+		conversion.name = "user:" + primVar.first;
+		conversion.data = primVar.second.data.get();
+		conversion.typeId = conversion.data->typeId();
+		conversion.kind = primVarKind( conversion.data );
+		if( conversion.kind == AttributeConversion::Unsupported )
+		{
+			IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "Unable to set " + primVar.first +
+			" prim var of type: " +  conversion.data->typeName() );
+			continue;
+		}
+		result.push_back( conversion );
+	}
+	return result;
 }
 
-GafferScene::ScenePlug *AtomsCrowdGenerator::clothCachePlug()
+template<typename T>
+typename T::ValueType::value_type primVarValue( const Data *data, int pointIndex )
 {
-    return getChild<ScenePlug>( g_firstPlugIndex + 4 );
+	return static_cast<const T *>( data )->readable()[pointIndex];
 }
 
-const GafferScene::ScenePlug *AtomsCrowdGenerator::clothCachePlug() const
+ObjectPtr convertMetadata( const AttributeConversion &conversion, const Data *data )
 {
-    return getChild<ScenePlug>( g_firstPlugIndex + 4 );
+	switch( conversion.kind )
+	{
+		case AttributeConversion::Double :
+			return new FloatData( static_cast<const DoubleData *>( data )->readable() );
+		case AttributeConversion::V2d :
+			return new V2fData( Imath::V2f( static_cast<const V2dData *>( data )->readable() ) );
+		case AttributeConversion::V3d :
+			return new V3fData( Imath::V3f( static_cast<const V3dData *>( data )->readable() ) );
+		case AttributeConversion::Quatd :
+			return new QuatfData( Imath::Quatf( static_cast<const QuatdData *>( data )->readable() ) );
+		case AttributeConversion::M44d :
+			return new M44fData( Imath::M44f( static_cast<const M44dData *>( data )->readable() ) );
+		default :
+			return const_cast<Data *>( data );
+	}
 }
 
-Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::agentChildNamesPlug()
+ObjectPtr convertPrimVar( const AttributeConversion &conversion, int pointIndex )
 {
-    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 5 );
+	switch( conversion.kind )
+	{
+		case AttributeConversion::BoolVector :
+			return new BoolData( primVarValue<BoolVectorData>( conversion.data, pointIndex ) );
+		case AttributeConversion::IntVector :
+			return new IntData( primVarValue<IntVectorData>( conversion.data, pointIndex ) );
+		case AttributeConversion::FloatVector :
+			return new FloatData( primVarValue<FloatVectorData>( conversion.data, pointIndex ) );
+		case AttributeConversion::StringVector :
+			return new StringData( primVarValue<StringVectorData>( conversion.data, pointIndex ) );
+		case AttributeConversion::V2fVector :
+			return new V2fData( primVarValue<V2fVectorData>( conversion.data, pointIndex ) );
+		case AttributeConversion::V3fVector :
+			return new V3fData( primVarValue<V3fVectorData>( conversion.data, pointIndex ) );
+		case AttributeConversion::M44fVector :
+			return new M44fData( primVarValue<M44fVectorData>( conversion.data, pointIndex ) );
+		case AttributeConversion::QuatfVector :
+		{
+			Imath::Eulerf euler;
+			euler.extract( primVarValue<QuatfVectorData>( conversion.data, pointIndex ) );
+			return new V3fData( Imath::V3f( euler.x * 180.0 / M_PI, euler.y * 180.0 / M_PI, euler.z * 180.0 / M_PI ) );
+		}
+		default :
+			return nullptr;
+	}
 }
 
-const Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::agentChildNamesPlug() const
+void appendPrimVarValue( const AttributeConversion &conversion, int pointIndex, MurmurHash &h )
 {
-    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 5 );
+	switch( conversion.kind )
+	{
+		case AttributeConversion::BoolVector :
+			h.append( primVarValue<BoolVectorData>( conversion.data, pointIndex ) ? 1 : 0 ); break;
+		case AttributeConversion::IntVector :
+			h.append( primVarValue<IntVectorData>( conversion.data, pointIndex ) ); break;
+		case AttributeConversion::FloatVector :
+			h.append( primVarValue<FloatVectorData>( conversion.data, pointIndex ) ); break;
+		case AttributeConversion::StringVector :
+			h.append( primVarValue<StringVectorData>( conversion.data, pointIndex ) ); break;
+		case AttributeConversion::V2fVector :
+			h.append( primVarValue<V2fVectorData>( conversion.data, pointIndex ) ); break;
+		case AttributeConversion::V3fVector :
+			h.append( primVarValue<V3fVectorData>( conversion.data, pointIndex ) ); break;
+		case AttributeConversion::M44fVector :
+			h.append( primVarValue<M44fVectorData>( conversion.data, pointIndex ) ); break;
+		case AttributeConversion::QuatfVector :
+			h.append( primVarValue<QuatfVectorData>( conversion.data, pointIndex ) ); break;
+		default :
+			break;
+	}
 }
 
-void AtomsCrowdGenerator::affects( const Plug *input, AffectedPlugsContainer &outputs ) const
+// Builds the attributes of the "/agents/<agentType>/<variation>/<id>" location from the
+// agent metadata stored in the atoms cache and from the prim vars of the agent point.
+CompoundObjectPtr buildAgentAttributes(
+	const CompoundData *metadata, const MetadataPlan &metadataPlan,
+	const PrimVarPlan &primVarPlan, int pointIndex
+)
 {
-	BranchCreator::affects( input, outputs );
+	CompoundObjectPtr result = new CompoundObject;
+	auto &objMap = result->members();
 
-	if(
-		input == inPlug()->objectPlug() ||
-        input == inPlug()->attributesPlug() ||
-		input == variationsPlug()->childNamesPlug()
-	)
+	if( metadata )
 	{
-		outputs.push_back( agentChildNamesPlug() );
+		for( const auto &member : metadata->readable() )
+		{
+			auto planIt = metadataPlan.find( member.first );
+			if( planIt != metadataPlan.end() && planIt->second.typeId == member.second->typeId() )
+			{
+				objMap[planIt->second.name] = convertMetadata( planIt->second, member.second.get() );
+			}
+			else
+			{
+				// This agent doesn't share the metadata layout the plan was built from,
+				// either missing the member or storing it with a different type
+				const AttributeConversion conversion = metadataConversion( member.first, member.second.get() );
+				objMap[conversion.name] = convertMetadata( conversion, member.second.get() );
+			}
+		}
 	}
 
-	if(
-		input == namePlug() ||
-		input == agentChildNamesPlug() ||
-		input == variationsPlug()->childNamesPlug()
-	)
+	if( pointIndex < 0 )
 	{
-		outputs.push_back( outPlug()->childNamesPlug() );
+		return result;
 	}
 
-	if(
-		input == inPlug()->objectPlug() ||
-		input == inPlug()->attributesPlug() ||
-		input == namePlug() ||
-		input == variationsPlug()->boundPlug() ||
-		input == variationsPlug()->transformPlug() ||
-		input == agentChildNamesPlug() ||
-		input == boundingBoxPaddingPlug() ||
-		input == clothCachePlug()->objectPlug()
-	)
+	for( const auto &conversion : primVarPlan )
 	{
-		outputs.push_back( outPlug()->boundPlug() );
+		objMap[conversion.name] = convertPrimVar( conversion, pointIndex );
 	}
 
-	if(
-		input == inPlug()->objectPlug() ||
-		input == inPlug()->attributesPlug() ||
-		input == variationsPlug()->transformPlug()
-	)
+	return result;
+}
+
+int pointIndexFromTable( const CompoundData *table, int agentId )
+{
+	auto pointIndicesData = table->member<const IntVectorData>( "pointIndices" );
+	if( !pointIndicesData )
 	{
-		outputs.push_back( outPlug()->transformPlug() );
+		return -1;
 	}
+	const auto& pointIndices = pointIndicesData->readable();
 
-	if(
-		input == variationsPlug()->attributesPlug() ||
-		input == inPlug()->objectPlug() ||
-		input == inPlug()->attributesPlug()
-	)
+	if( auto minIdData = table->member<const IntData>( "minId" ) )
 	{
-		outputs.push_back( outPlug()->attributesPlug() );
+		const int64_t offset = (int64_t)agentId - (int64_t)minIdData->readable();
+		if( offset < 0 || offset >= (int64_t)pointIndices.size() )
+		{
+			return -1;
+		}
+		return pointIndices[offset];
 	}
 
-    if( input == variationsPlug()->objectPlug() ||
-        input == variationsPlug()->attributesPlug() ||
-        input == inPlug()->objectPlug() ||
-        input == inPlug()->attributesPlug() ||
-        input == clothCachePlug()->objectPlug()
-        )
-    {
-        outputs.push_back( outPlug()->objectPlug() );
-    }
+	auto idsData = table->member<const IntVectorData>( "ids" );
+	if( !idsData )
+	{
+		return -1;
+	}
+	const auto& ids = idsData->readable();
+	auto it = std::lower_bound( ids.begin(), ids.end(), agentId );
+	if( it == ids.end() || *it != agentId )
+	{
+		return -1;
+	}
+	return pointIndices[it - ids.begin()];
 }
 
-void AtomsCrowdGenerator::hash( const Gaffer::ValuePlug *output, const Gaffer::Context *context, MurmurHash &h ) const
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+// Agent mesh merging
+//////////////////////////////////////////////////////////////////////////
+
+namespace
 {
-	BranchCreator::hash( output, context, h );
 
-	if( output == agentChildNamesPlug() )
-	{
-		inPlug()->objectPlug()->hash( h );
-        inPlug()->attributesPlug()->hash( h );
-		h.append( variationsPlug()->childNamesHash( ScenePath() ) );
-		useInstancesPlug()->hash( h );
-	}
+// Calls f( i ) for every mesh in parallel. Each call runs isolated, so the tasks
+// it spawns, such as the skinning chunks of a big mesh, can't have the thread
+// waiting for them pick up another mesh in the middle of the call.
+template<typename F>
+void parallelForEachMesh( size_t numMeshes, F &&f )
+{
+	tbb::task_group_context taskGroupContext( tbb::task_group_context::isolated );
+	tbb::parallel_for(
+		tbb::blocked_range<size_t>( 0, numMeshes ),
+		[&f]( const tbb::blocked_range<size_t> &range )
+		{
+			for( size_t i = range.begin(); i != range.end(); ++i )
+			{
+				tbb::this_task_arena::isolate( [&f, i] { f( i ); } );
+			}
+		},
+		taskGroupContext
+	);
 }
 
-void AtomsCrowdGenerator::compute( Gaffer::ValuePlug *output, const Gaffer::Context *context ) const
+// Concatenates the data of a primitive variable of all the merged meshes,
+// each one starting at its offset in the result.
+struct DataConcatenator
 {
-	// The agentChildNamesPlug is evaluated in a context in which
-	// scene:path holds the parent path for a branch.
-	if( output == agentChildNamesPlug() )
+
+	template<typename T>
+	DataPtr operator()(
+		const T *data, const std::vector<const Data *> &allData, const std::vector<size_t> &offsets,
+		typename std::enable_if<TypeTraits::IsVectorTypedData<T>::value>::type *enabler = nullptr
+	) const
 	{
-		// Here we compute and cache the child names for all of
-		// the /agents/<agentType>/<variation> locations at once. We
-		// could instead compute them one at a time in
-		// computeBranchChildNames() but that would require N
-		// passes over the input points, where N is the number
-		// of instances.
+		typename T::Ptr result = new T;
+		result->writable().resize( offsets.back() );
+		auto copy = [&]( size_t i )
+		{
+			const auto &in = static_cast<const T *>( allData[i] )->readable();
+			std::copy( in.begin(), in.end(), result->writable().begin() + offsets[i] );
+		};
 
-		ConstPointsPrimitivePtr crowd = runTimeCast<const PointsPrimitive>( inPlug()->objectPlug()->getValue() );
-		if( !crowd )
+		// The elements of a std::vector<bool> can't be written concurrently
+		if( std::is_same<typename T::ValueType::value_type, bool>::value )
 		{
-			throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive Object." );
+			for( size_t i = 0; i < allData.size(); ++i )
+			{
+				copy( i );
+			}
+		}
+		else
+		{
+			parallelForEachMesh( allData.size(), copy );
 		}
 
-		// Get the agentId variable that contains the agent cache id
-        const auto agentId = crowd->variables.find( "atoms:agentId" );
-        if( agentId == crowd->variables.end() )
-        {
-            throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive containing an \"atoms:agentId\" vertex variable" );
-        }
+		setGeometricInterpretation( result.get(), getGeometricInterpretation( data ) );
+		return result;
+	}
 
-        auto agentIdData = runTimeCast<const IntVectorData>( agentId->second.data );
-        if ( !agentIdData )
-        {
-            throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive containing an \"atoms:agentId\" vertex variable" );
-        }
-        const std::vector<int>& agentIdVec = agentIdData->readable();
+	template<typename T>
+	DataPtr operator()(
+		const T *data, const std::vector<const Data *> &allData, const std::vector<size_t> &offsets,
+		typename std::enable_if<!TypeTraits::IsVectorTypedData<T>::value>::type *enabler = nullptr
+	) const
+	{
+		return nullptr;
+	}
 
+};
 
-        const std::vector<std::string>* agentTypeVec = nullptr;
-        const std::vector<std::string>* agentVariationVec = nullptr;
-        const std::vector<std::string>* agentLodVec = nullptr;
-        std::string agentTypeDefault;
-        std::string variationDefault;
-        std::string lodDefault;
+// Returns the index of the group of a merged mesh location, or -1 if
+// the name isn't one of a merged mesh.
+int mergedMeshGroupIndex( const InternedString &name )
+{
+	const std::string &s = name.string();
+	if( s.compare( 0, 6, "merged" ) != 0 || s.size() == 6 )
+	{
+		return -1;
+	}
 
-        // Extract the agent type from the prim var
-		const auto agentType = crowd->variables.find( "atoms:agentType" );
-		if( agentType == crowd->variables.end() )
+	for( size_t i = 6; i < s.size(); ++i )
+	{
+		if( !std::isdigit( s[i] ) )
 		{
-			throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive containing an \"atoms:agentType\" vertex variable" );
+			return -1;
 		}
+	}
+	return std::atoi( s.c_str() + 6 );
+}
 
-        if ( agentType->second.interpolation == PrimitiveVariable::Vertex )
-        {
-            auto agentTypesData = runTimeCast<const StringVectorData>( agentType->second.data );
-            if ( agentTypesData )
-                agentTypeVec = &agentTypesData->readable();
-        }
-        else if ( agentType->second.interpolation == PrimitiveVariable::Constant )
-        {
-            auto agentTypesData = runTimeCast<const StringData>( agentType->second.data );
-            if ( agentTypesData )
-                agentTypeDefault = agentTypesData->readable();
-        }
+// Concatenates the agent meshes into a single mesh, moving each by its matrix, and
+// adds an "atoms:agentId" uniform primitive variable holding the agent of every face.
+// Only the primitive variables found on all the meshes with the same interpolation
+// and type are kept. A variable indexed on some meshes only, like the normals of the
+// cloth meshes, is expanded on all of them and merged unindexed.
+MeshPrimitivePtr mergeAgentMeshes( const std::vector<ConstMeshPrimitivePtr> &meshes, const std::vector<Imath::M44f> &matrices, const std::vector<int> &agentIds )
+{
+	const size_t numMeshes = meshes.size();
+	std::vector<size_t> pointOffsets( numMeshes + 1, 0 );
+	std::vector<size_t> faceOffsets( numMeshes + 1, 0 );
+	std::vector<size_t> vertexOffsets( numMeshes + 1, 0 );
+	for( size_t i = 0; i < numMeshes; ++i )
+	{
+		pointOffsets[i + 1] = pointOffsets[i] + meshes[i]->variableSize( PrimitiveVariable::Vertex );
+		faceOffsets[i + 1] = faceOffsets[i] + meshes[i]->numFaces();
+		vertexOffsets[i + 1] = vertexOffsets[i] + meshes[i]->vertexIds()->readable().size();
+	}
 
-        // Extract the agent variation from the prim var
-		const auto agentVariation = crowd->variables.find( "atoms:variation" );
-		if( agentVariation == crowd->variables.end() )
+	IntVectorDataPtr verticesPerFaceData = new IntVectorData;
+	auto &verticesPerFace = verticesPerFaceData->writable();
+	verticesPerFace.resize( faceOffsets.back() );
+	IntVectorDataPtr vertexIdsData = new IntVectorData;
+	auto &vertexIds = vertexIdsData->writable();
+	vertexIds.resize( vertexOffsets.back() );
+	IntVectorDataPtr agentIdData = new IntVectorData;
+	auto &agentIdValues = agentIdData->writable();
+	agentIdValues.resize( faceOffsets.back() );
+
+	parallelForEachMesh(
+		numMeshes,
+		[&]( size_t i )
 		{
-			throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive containing an \"atoms:variation\" vertex variable" );
+			const auto &inVerticesPerFace = meshes[i]->verticesPerFace()->readable();
+			std::copy( inVerticesPerFace.begin(), inVerticesPerFace.end(), verticesPerFace.begin() + faceOffsets[i] );
+
+			const int pointOffset = pointOffsets[i];
+			const auto &inVertexIds = meshes[i]->vertexIds()->readable();
+			std::transform(
+				inVertexIds.begin(), inVertexIds.end(), vertexIds.begin() + vertexOffsets[i],
+				[pointOffset]( int id ) { return id + pointOffset; }
+			);
+
+			std::fill( agentIdValues.begin() + faceOffsets[i], agentIdValues.begin() + faceOffsets[i + 1], agentIds[i] );
 		}
+	);
 
-        if ( agentVariation->second.interpolation == PrimitiveVariable::Vertex )
-        {
-            auto agentVariationData = runTimeCast<const StringVectorData>( agentVariation->second.data );
-            if ( agentVariationData )
-                agentVariationVec = &agentVariationData->readable();
-        }
-        else if ( agentVariation->second.interpolation == PrimitiveVariable::Constant )
-        {
-            auto agentVariationData = runTimeCast<const StringData>(agentVariation->second.data);
-            if ( agentVariationData )
-                variationDefault = agentVariationData->readable();
-        }
+	MeshPrimitivePtr result = new MeshPrimitive( verticesPerFaceData, vertexIdsData, meshes.front()->interpolation() );
 
-        // Extract the agent lod from the prim var
-		const auto agentLod = crowd->variables.find( "atoms:lod" );
-		if( agentLod == crowd->variables.end() )
+	std::vector<const PrimitiveVariable *> allVariables( numMeshes );
+	std::vector<ConstDataPtr> expandedData( numMeshes );
+	std::vector<const Data *> allData( numMeshes );
+	std::vector<const IntVectorData *> allIndices( numMeshes );
+	std::vector<size_t> dataOffsets( numMeshes + 1, 0 );
+	for( const auto &variable : meshes.front()->variables )
+	{
+		bool compatible = true;
+		bool indexed = false;
+		bool unindexed = false;
+		for( size_t i = 0; i < numMeshes && compatible; ++i )
 		{
-			throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive containing an \"atoms:lod\" vertex variable" );
+			auto it = meshes[i]->variables.find( variable.first );
+			compatible =
+				it != meshes[i]->variables.end() &&
+				it->second.interpolation == variable.second.interpolation &&
+				it->second.data->typeId() == variable.second.data->typeId()
+			;
+			if( compatible )
+			{
+				allVariables[i] = &it->second;
+				indexed |= (bool)it->second.indices;
+				unindexed |= !it->second.indices;
+			}
 		}
 
-		if ( agentLod->second.interpolation == PrimitiveVariable::Vertex )
-		{
-            auto agentLodData = runTimeCast<const StringVectorData>( agentLod->second.data );
-            if ( agentLodData )
-                agentLodVec = &agentLodData->readable();
-        }
-		else if ( agentLod->second.interpolation == PrimitiveVariable::Constant )
+		if( !compatible )
 		{
-            auto agentLodData = runTimeCast<const StringData>( agentLod->second.data );
-            if ( agentLodData )
-                lodDefault = agentLodData->readable();
-        }
-
+			continue;
+		}
 
-		// Agent map continig per every agent type the list of variation used
-		// and for every variation the list of agent id
-		std::map<std::string, std::map<std::string, std::vector<int>>> agentVariationMap;
+		const bool expand = indexed && unindexed;
+		for( size_t i = 0; i < numMeshes; ++i )
+		{
+			if( expand && allVariables[i]->indices )
+			{
+				expandedData[i] = allVariables[i]->expandedData();
+				allData[i] = expandedData[i].get();
+				allIndices[i] = nullptr;
+			}
+			else
+			{
+				allData[i] = allVariables[i]->data.get();
+				allIndices[i] = expand ? nullptr : allVariables[i]->indices.get();
+			}
+			dataOffsets[i + 1] = dataOffsets[i] + IECore::size( allData[i] );
+		}
 
-        for( size_t agId = 0; agId < agentIdVec.size(); ++agId )
-        {
-            std::string agentTypeName = agentTypeDefault;
-            if (agentTypeVec)
-                agentTypeName = ( *agentTypeVec )[agId];
-
-            std::string variationName = variationDefault;
-            if (agentVariationVec)
-                variationName = ( *agentVariationVec )[agId];
-
-            if ( variationName.empty() )
-                continue;
-
-            std::string lodName = lodDefault;
-            if ( agentLodVec )
-                lodName = ( *agentLodVec )[agId];
-
-        	if ( !lodName.empty())
-        	{
-				variationName = variationName + ':' + lodName;
-			}
-
-			agentVariationMap[agentTypeName][variationName].push_back( agentIdVec[agId] );
-        }
-
-        // Convert the variaion map in compound data
-        CompoundDataPtr result = new CompoundData;
-        auto& resultData = result->writable();
-        for( auto typeIt = agentVariationMap.begin(); typeIt != agentVariationMap.end(); ++typeIt )
-        {
-            CompoundDataPtr variationResult = new CompoundData;
-            auto& variationResultData = variationResult->writable();
-            for( auto varIt = typeIt->second.begin(); varIt != typeIt->second.end(); ++varIt )
-            {
-                InternedStringVectorDataPtr idsData = new InternedStringVectorData;
-                auto& idsStrVec = idsData->writable();
-                idsStrVec.reserve( varIt->second.size() );
-                for ( const auto agId: varIt->second )
-                {
-                    idsStrVec.emplace_back( std::to_string( agId ) );
-                }
-
-                variationResultData[varIt->first] = idsData;
-            }
-
-            resultData[typeIt->first] = variationResult;
-        }
-
-		static_cast<AtomicCompoundDataPlug *>( output )->setValue( result );
-		return;
-	}
-
-	BranchCreator::compute( output, context );
-}
-
-void AtomsCrowdGenerator::hashBranchBound( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
-{
-	if( branchPath.size() < 4 )
-	{
-		// "/" or "/agents"
-		ScenePath path = parentPath;
-		path.insert( path.end(), branchPath.begin(), branchPath.end() );
-		if( branchPath.empty() )
+		if( variable.second.interpolation == PrimitiveVariable::Constant )
 		{
-			path.push_back( namePlug()->getValue() );
+			result->variables[variable.first] = variable.second;
+			continue;
 		}
-		h = hashOfTransformedChildBounds( path, outPlug() );
-	}
 
-	else if( branchPath.size() == 4 )
-	{
-		// "/agents/<agentType>/<variation>/<id>"
-		BranchCreator::hashBranchBound( parentPath, branchPath, context, h );
-
-		inPlug()->attributesPlug()->hash( h );
-        inPlug()->objectPlug()->hash( h );
-        boundingBoxPaddingPlug()->hash( h );
-		agentChildNamesHash( parentPath, context, h );
-		h.append( branchPath.back() );
+		DataPtr data = dispatch( variable.second.data.get(), DataConcatenator(), allData, dataOffsets );
+		if( !data )
 		{
-			AgentScope scope( context, branchPath );
-			variationsPlug()->transformPlug()->hash( h );
-			variationsPlug()->boundPlug()->hash( h );
+			continue;
 		}
-	}
-	else
-	{
-		// "/agents/<agentType>/<variation>/<id>/..."
-        clothCachePlug()->objectPlug()->hash( h );
-		AgentScope instanceScope( context, branchPath );
-		variationsPlug()->boundPlug()->hash( h );
-        boundingBoxPaddingPlug()->hash( h );
-        inPlug()->boundPlug()->hash( h );
-        inPlug()->attributesPlug()->hash( h );
-        inPlug()->objectPlug()->hash( h );
-	}
-}
 
-Imath::Box3f AtomsCrowdGenerator::computeBranchBound( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
-{
-	if( branchPath.size() < 4 )
-	{
-		// "/" or "/agents"
-		ScenePath path = parentPath;
-		path.insert( path.end(), branchPath.begin(), branchPath.end() );
-		if( branchPath.empty() )
+		IntVectorDataPtr indicesData;
+		if( indexed && !expand )
 		{
-			path.push_back( namePlug()->getValue() );
+			std::vector<size_t> indexOffsets( numMeshes + 1, 0 );
+			for( size_t i = 0; i < numMeshes; ++i )
+			{
+				indexOffsets[i + 1] = indexOffsets[i] + allIndices[i]->readable().size();
+			}
+
+			indicesData = new IntVectorData;
+			auto &indices = indicesData->writable();
+			indices.resize( indexOffsets.back() );
+			parallelForEachMesh(
+				numMeshes,
+				[&]( size_t i )
+				{
+					const int dataOffset = dataOffsets[i];
+					const auto &inIndices = allIndices[i]->readable();
+					std::transform(
+						inIndices.begin(), inIndices.end(), indices.begin() + indexOffsets[i],
+						[dataOffset]( int index ) { return index + dataOffset; }
+					);
+				}
+			);
 		}
-		return unionOfTransformedChildBounds( path, outPlug() );
-	}
-	else if ( branchPath.size() >= 4 )
-    {
-        // "/agents/<agentType>/<variation>/<id>/..."
 
-        // If there is any cloth extract the bounding box
-        Imath::Box3d agentClothBBox;
-		ConstCompoundObjectPtr crowd;
+		// Move the points, the normals and the velocities of every mesh into the space of the merged mesh
+		auto vectorData = runTimeCast<V3fVectorData>( data.get() );
+		if( vectorData && ( variable.first == "P" || variable.first == "N" || variable.first == "velocity" ) )
 		{
-			ScenePlug::PathScope scope(context, parentPath);
-			crowd = runTimeCast<const CompoundObject>(inPlug()->attributesPlug()->getValue());
-            agentClothBBox = agentClothBoudingBox( parentPath, branchPath );
+			const bool normals = variable.first == "N";
+			const bool velocities = variable.first == "velocity";
+			auto &vectors = vectorData->writable();
+			parallelForEachMesh(
+				numMeshes,
+				[&]( size_t i )
+				{
+					if( normals )
+					{
+						Imath::M44f normalMatrix = matrices[i].inverse();
+						normalMatrix.transpose();
+						for( size_t j = dataOffsets[i]; j < dataOffsets[i + 1]; ++j )
+						{
+							Imath::V3f n;
+							normalMatrix.multDirMatrix( vectors[j], n );
+							vectors[j] = n.normalized();
+						}
+					}
+					else if( velocities )
+					{
+						for( size_t j = dataOffsets[i]; j < dataOffsets[i + 1]; ++j )
+						{
+							Imath::V3f v;
+							matrices[i].multDirMatrix( vectors[j], v );
+							vectors[j] = v;
+						}
+					}
+					else
+					{
+						for( size_t j = dataOffsets[i]; j < dataOffsets[i + 1]; ++j )
+						{
+							vectors[j] = vectors[j] * matrices[i];
+						}
+					}
+				}
+			);
 		}
 
+		result->variables[variable.first] = PrimitiveVariable( variable.second.interpolation, data, indicesData );
+	}
 
-        // Extract the bound from the agent bound stored inside the atoms cache
-        // This bound is computed from the agent joints and not from the skinned mesh,
-        // so it's not 100% right
-        if( !crowd )
-        {
-            throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a Compound Object." );
-        }
-
-        // The atoms:agents contain the atoms cache, so extract the bounding box from it
-        auto atomsData = crowd->member<const BlindDataHolder>( "atoms:agents" );
-        if( !atomsData )
-        {
-            throw InvalidArgumentException( "AtomsCrowdGenerator :  computeBranchBound : No agents data found." );
-        }
+	result->variables["atoms:agentId"] = PrimitiveVariable( PrimitiveVariable::Uniform, agentIdData );
+	return result;
+}
 
-        auto agentsData = atomsData->blindData();
-        if( !agentsData )
-        {
-            throw InvalidArgumentException( "AtomsCrowdGenerator : computeBranchBound : No agents data found." );
-        }
+} // namespace
 
-        // Extract the current agent
-        auto agentData = agentsData->member<const CompoundData>( branchPath[3].string() );
-        if( !agentData )
-        {
-            throw InvalidArgumentException( "AtomsCrowdGenerator : computeBranchBound : No agent found." );
-        }
+//////////////////////////////////////////////////////////////////////////
+// Deformation
+//////////////////////////////////////////////////////////////////////////
 
-        // Extract the agent root matrix
-        Imath::M44d rootInvMatrix;
-        auto poseData = agentData->member<const M44dData>( "rootMatrix" );
-        if ( poseData ) {
-            rootInvMatrix = poseData->readable();
-            rootInvMatrix.invert();
-        }
+namespace
+{
 
+// Returns the skinning matrices of the agent at another time, relative to its root at the
+// current time, so the motion of the root is part of the deformation. Returns an empty
+// vector if the agent doesn't exist at either time.
+std::vector<Imath::M44d> sampleWorldMatrices( const CompoundData *agentData, const CompoundData *sampleAgentData )
+{
+    std::vector<Imath::M44d> result;
+    if ( !agentData || !sampleAgentData )
+    {
+        return result;
+    }
 
-        auto boxData = agentData->member<const Box3dData>( "boundingBox" );
-        Imath::Box3f result;
-        if ( boxData )
-        {
-            float padding  = boundingBoxPaddingPlug()->getValue();
-            Imath::Box3d agentBox = boxData->readable();
-            if ( !agentClothBBox.isEmpty() )
-            {
-                // The cloth bounding box is in world space. Convert in local space
-                agentBox.extendBy( agentClothBBox.min * rootInvMatrix );
-                agentBox.extendBy( agentClothBBox.max * rootInvMatrix );
-            }
-            result.extendBy( agentBox.min - Imath::V3f(padding, padding, padding) );
-            result.extendBy( agentBox.max + Imath::V3f(padding, padding, padding) );
-        }
-        else
-        {
-            throw InvalidArgumentException( "AtomsCrowdGenerator : No boundingBox or rootMatrix data found." );
-        }
+    auto rootData = agentData->member<const M44dData>( "rootMatrix" );
+    auto sampleRootData = sampleAgentData->member<const M44dData>( "rootMatrix" );
+    auto samplePoseData = sampleAgentData->member<const M44dVectorData>( "poseWorldMatrices" );
+    if ( !rootData || !sampleRootData || !samplePoseData )
+    {
         return result;
     }
-}
 
-void AtomsCrowdGenerator::hashBranchTransform( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
-{
+    const Imath::M44d toRoot = sampleRootData->readable() * rootData->readable().inverse();
+    result = samplePoseData->readable();
+    for ( auto &matrix : result )
+    {
+        matrix = matrix * toRoot;
+    }
 
-	if( branchPath.size() < 4 )
-	{
-		// "/" or "/agents" or "/agents/<agentType> or "/agents/<agentType>/<variation>"
-		BranchCreator::hashBranchTransform( parentPath, branchPath, context, h );
-	}
-	else if( branchPath.size() == 4 )
-	{
-		// "/agents/<agentType>/<variation>/<id>"
-		inPlug()->objectPlug()->hash( h );
-        inPlug()->attributesPlug()->hash( h );
-		h.append( branchPath[3] );
-	}
-	else
-	{
-		// "/agents/<agentType>/<variation>/<id>/..."
-		AgentScope scope( context, branchPath );
-		variationsPlug()->transformPlug()->hash(h);
-		inPlug()->attributesPlug()->hash(h);
-        inPlug()->objectPlug()->hash( h );
-        h.append( branchPath[3] );
-	}
+    return result;
 }
 
-Imath::M44f AtomsCrowdGenerator::computeBranchTransform( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
+// Returns the normals of the mesh to skin together with its points, or null if it has
+// none. normalPointIds is set to the point of every normal, or to null when the normals
+// are per point.
+std::vector<Imath::V3f> *skinnedNormals( MeshPrimitive *mesh, std::vector<int> &uniqueNormalPointIds, const std::vector<int> *&normalPointIds )
 {
-    // In atoms all the meshes have identity transformations, so here just return the default matrix
-	if( branchPath.size() < 4 )
-	{
-		// "/" or "/agents" or "/agents/<agentName>"
-		return Imath::M44f();
-	}
-	else if( branchPath.size() == 4 )
-	{
-		// "/agents/<agentType>/<variaiton>/<id>"
-		return agentRootMatrix( parentPath, branchPath, context );
-	}
-	else
-	{
-		// "/agents/<agentName>/<variaiton>/<id>/..."
-		AgentScope scope( context, branchPath );
-		return variationsPlug()->transformPlug()->getValue();
-	}
-}
+    normalPointIds = nullptr;
+    auto nVarIt = mesh->variables.find( "N" );
+    if ( nVarIt == mesh->variables.end() )
+    {
+        return nullptr;
+    }
 
-void AtomsCrowdGenerator::hashBranchAttributes( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
-{
-	if( branchPath.size() < 1 )
-	{
-        // "/" or "/agents"
-		h = outPlug()->attributesPlug()->defaultValue()->Object::hash();
-	}
-	else if ( branchPath.size() == 2 )
+    auto nData = runTimeCast<V3fVectorData>( nVarIt->second.data );
+    if ( nData && nVarIt->second.interpolation == PrimitiveVariable::FaceVarying && nVarIt->second.indices )
     {
-        // "/agents/<agentType>"
-        AgentScope instanceScope( context, branchPath );
-        variationsPlug()->attributesPlug()->hash( h );
+        // Indexed normals are unique per point, so each of them is skinned
+        // once with the matrices of the point it belongs to
+        auto& indices = nVarIt->second.indices->readable();
+        auto& vertexIds = mesh->vertexIds()->readable();
+        uniqueNormalPointIds.resize( nData->readable().size() );
+        for ( size_t vtxId = 0; vtxId < indices.size(); ++vtxId )
+        {
+            uniqueNormalPointIds[indices[vtxId]] = vertexIds[vtxId];
+        }
+        normalPointIds = &uniqueNormalPointIds;
+        return &nData->writable();
     }
-    else if ( branchPath.size() == 3 )
+    else if ( nData && nVarIt->second.interpolation == PrimitiveVariable::FaceVarying )
     {
-        // "/agents/<agentType>/<variation>"
-        AgentScope instanceScope( context, branchPath );
-        variationsPlug()->attributesPlug()->hash( h );
+        normalPointIds = &mesh->vertexIds()->readable();
+        return &nData->writable();
     }
-    else if( branchPath.size() == 4 )
+    else if ( nData && nVarIt->second.interpolation == PrimitiveVariable::Vertex )
     {
-        BranchCreator::hashBranchAttributes( parentPath, branchPath, context, h );
-        {
-            AgentScope instanceScope( context, branchPath );
-            variationsPlug()->attributesPlug()->hash( h );
-        }
+        return &nData->writable();
+    }
 
-        // Some of the attributes are stored as prim var on the input point cloud
-        inPlug()->objectPlug()->hash( h );
+    return nullptr;
+}
 
-        // The other attributes are stored inside the agent metadata map inside the cache
-        auto agentData = agentCacheData(branchPath);
-        auto metadataData = agentData->member<const CompoundData>( "metadata" );
-        auto& metadataMap = metadataData->readable();
-        for (auto memberIt = metadataMap.cbegin(); memberIt != metadataMap.cend(); ++memberIt)
+// Appends the non zero differences between the target and the base vectors, as
+// indices into the base and deltas, and ends the target in the offsets.
+void appendBlendShapeDeltas(
+    const std::vector<Imath::V3f> &base, const V3fVectorData *targetData,
+    std::vector<int> &offsets, std::vector<int> &indices, std::vector<Imath::V3f> &deltas
+)
+{
+    if ( targetData && targetData->readable().size() == base.size() )
+    {
+        const auto &target = targetData->readable();
+        for ( size_t i = 0; i < base.size(); ++i )
         {
-            memberIt->second->hash( h );
+            const Imath::V3f delta = target[i] - base[i];
+            if ( delta != Imath::V3f( 0.0f ) )
+            {
+                indices.push_back( i );
+                deltas.push_back( delta );
+            }
         }
     }
-	else
-	{
-		// "/agents/<agentName>/<id>/...
-		AgentScope instanceScope( context, branchPath );
-		variationsPlug()->attributesPlug()->hash( h );
-	}
+    offsets.push_back( indices.size() );
 }
 
-ConstCompoundObjectPtr AtomsCrowdGenerator::computeBranchAttributes( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
+// Compiles the "blendShape_<id>_P" and "blendShape_<id>_N" targets of a variation
+// mesh into sparse deltas from its points and normals, most targets only moving a
+// small part of the mesh. The deltas of target i are in [offsets[i], offsets[i + 1]).
+// The names of the weights of the targets are stored as well, so they don't need
+// to be built for every agent.
+CompoundDataPtr compileBlendShapes( const MeshPrimitive *mesh, const ScenePlug::ScenePath &meshPath )
 {
-	if( branchPath.size() < 2 )
-	{
-		// "/" or "/agents" or "/agents/<agentName>"
-		return outPlug()->attributesPlug()->defaultValue();
-	}
-    else if ( branchPath.size() == 2 )
+    CompoundDataPtr result = new CompoundData;
+    if ( !mesh || meshPath.empty() )
     {
-        // "/agents/<agentType>"
-        AgentScope scope(context, branchPath);
-        return variationsPlug()->attributesPlug()->getValue();
+        return result;
     }
-    else if ( branchPath.size() == 3 )
+
+    auto countIt = mesh->variables.find( "blendShapeCount" );
+    auto countData = countIt != mesh->variables.end() ? runTimeCast<const IntData>( countIt->second.data.get() ) : nullptr;
+    auto pIt = mesh->variables.find( "P" );
+    auto pData = pIt != mesh->variables.end() ? runTimeCast<const V3fVectorData>( pIt->second.data.get() ) : nullptr;
+    if ( !countData || !pData )
     {
-        // "/agents/<agentType>/<variation>"
-        AgentScope scope(context, branchPath);
-        return variationsPlug()->attributesPlug()->getValue();
+        return result;
     }
-	else if( branchPath.size() == 4 )
-	{
-		// "/agents/<agentType>/<variation>/<id>"
-		CompoundObjectPtr baseAttributes = new CompoundObject;
-        auto& objMap = baseAttributes->members();
 
-        // Get the agent metadata and convert them in gaffer attributes
-        auto agentData = agentCacheData(branchPath);
-        auto metadataData = agentData->member<const CompoundData>( "metadata" );
+    static const std::vector<Imath::V3f> g_noNormals;
+    auto nIt = mesh->variables.find( "N" );
+    auto nData = nIt != mesh->variables.end() ? runTimeCast<const V3fVectorData>( nIt->second.data.get() ) : nullptr;
+    const std::vector<Imath::V3f> &normals = nData ? nData->readable() : g_noNormals;
+
+    InternedStringVectorDataPtr weightNamesData = new InternedStringVectorData;
+    InternedStringVectorDataPtr variablesData = new InternedStringVectorData;
+    IntVectorDataPtr pointOffsetsData = new IntVectorData( std::vector<int>( 1, 0 ) );
+    IntVectorDataPtr pointIndicesData = new IntVectorData;
+    V3fVectorDataPtr pointDeltasData = new V3fVectorData;
+    IntVectorDataPtr normalOffsetsData = new IntVectorData( std::vector<int>( 1, 0 ) );
+    IntVectorDataPtr normalIndicesData = new IntVectorData;
+    V3fVectorDataPtr normalDeltasData = new V3fVectorData;
+
+    // The weights are named after the agent type and the mesh
+    const std::string weightPrefix = meshPath.front().string() + "_" + meshPath.back().string() + "_";
+    variablesData->writable().push_back( "blendShapeCount" );
+    for ( int blendId = 0; blendId < countData->readable(); ++blendId )
+    {
+        weightNamesData->writable().push_back( weightPrefix + std::to_string( blendId ) );
+
+        const std::string targetPrefix = "blendShape_" + std::to_string( blendId );
+        const InternedString pName = targetPrefix + "_P";
+        const InternedString nName = targetPrefix + "_N";
+        variablesData->writable().push_back( pName );
+        variablesData->writable().push_back( nName );
+
+        auto targetPIt = mesh->variables.find( pName );
+        appendBlendShapeDeltas(
+            pData->readable(), targetPIt != mesh->variables.end() ? runTimeCast<const V3fVectorData>( targetPIt->second.data.get() ) : nullptr,
+            pointOffsetsData->writable(), pointIndicesData->writable(), pointDeltasData->writable()
+        );
+
+        auto targetNIt = mesh->variables.find( nName );
+        appendBlendShapeDeltas(
+            normals, targetNIt != mesh->variables.end() ? runTimeCast<const V3fVectorData>( targetNIt->second.data.get() ) : nullptr,
+            normalOffsetsData->writable(), normalIndicesData->writable(), normalDeltasData->writable()
+        );
+    }
 
-        auto& metadataMap = metadataData->readable();
-        for (auto memberIt = metadataMap.cbegin(); memberIt != metadataMap.cend(); ++memberIt)
-        {
-            std::string variableName = "user:atoms:" + memberIt->first.string();
-            // Atoms store all the data in double, while gaffer use floats, so convert them
-            switch ( memberIt->second->typeId() )
-            {
-                case IECore::TypeId::DoubleDataTypeId:
-                {
-                    FloatDataPtr fData = new FloatData;
-                    fData->writable() = runTimeCast<const DoubleData>( memberIt->second )->readable();
-                    objMap[variableName] = fData;
-                    break;
-                }
-                case IECore::TypeId ::V2dDataTypeId:
-                {
-                    V2fDataPtr fData = new V2fData;
-                    fData->writable() = Imath::V2f( runTimeCast<const V2dData>( memberIt->second )->readable() );
-                    objMap[variableName] = fData;
-                    break;
-                }
-                case IECore::TypeId ::V3dDataTypeId:
-                {
-                    V3fDataPtr fData = new V3fData;
-                    fData->writable() = Imath::V3f( runTimeCast<const V3dData>( memberIt->second )->readable() );
-                    objMap[variableName] = fData;
-                    break;
-                }
-                case IECore::TypeId ::QuatdDataTypeId:
-                {
-                    QuatfDataPtr fData = new QuatfData;
-                    fData->writable() = Imath::Quatf( runTimeCast<const QuatdData>( memberIt->second )->readable() );
-                    objMap[variableName] = fData;
-                    break;
-                }
-                case IECore::TypeId ::M44dDataTypeId:
-                {
-                    M44fDataPtr fData = new M44fData;
-                    fData->writable() = Imath::M44f( runTimeCast<const M44dData>( memberIt->second )->readable() );
-                    objMap[variableName] = fData;
-                    break;
-                }
-                default:
-                {
-                    objMap[variableName] = memberIt->second;
-                }
-            }
-        }
+    auto &members = result->writable();
+    members["weightNames"] = weightNamesData;
+    members["variables"] = variablesData;
+    members["pointOffsets"] = pointOffsetsData;
+    members["pointIndices"] = pointIndicesData;
+    members["pointDeltas"] = pointDeltasData;
+    members["normalOffsets"] = normalOffsetsData;
+    members["normalIndices"] = normalIndicesData;
+    members["normalDeltas"] = normalDeltasData;
+    return result;
+}
 
+// Returns the points or normals of a cloth mesh. The cloth reader stores them as float,
+// and the double precision vectors of older payloads are converted into `converted`.
+const std::vector<Imath::V3f> *clothVectors( const Data *data, std::vector<Imath::V3f> &converted )
+{
+    if ( auto floatData = runTimeCast<const V3fVectorData>( data ) )
+    {
+        return &floatData->readable();
+    }
 
-        // Now extract the agent metadata saved on the point cloud prim var
-        // Convert only the prim vars that has "atoms:" as prefix
-        int currentAgentIndex = std::atoi( branchPath[3].string().c_str() );
+    auto doubleData = runTimeCast<const V3dVectorData>( data );
+    if ( !doubleData )
+    {
+        return nullptr;
+    }
 
-        int agentIdPointIndex = -1;
-        ScenePlug::PathScope scope( context, parentPath );
-        auto points = runTimeCast<const PointsPrimitive>( inPlug()->objectPlug()->getValue() );
+    converted.assign( doubleData->readable().begin(), doubleData->readable().end() );
+    return &converted;
+}
 
-        if ( !points )
+// Gathers the "atoms:" primitive variables of the crowd points, without their prefix
+void atomsPointVariables( const PointsPrimitive *points, CompoundDataMap &variables )
+{
+    for ( auto it = points->variables.cbegin(); it != points->variables.cend(); ++it )
+    {
+        size_t atomsIndex = it->first.find("atoms:");
+        if ( atomsIndex == 0 )
         {
-            return baseAttributes;
+            variables[it->first.substr( atomsIndex + 6,
+                                        it->first.size() - 6 )] = it->second.data;
         }
+    }
+}
 
-        const auto agentId = points->variables.find( "atoms:agentId" );
-        if ( agentId == points->variables.end() )
-        {
-            throw InvalidArgumentException(
-                    "AtomsCrowdGenerator : Input must be a PointsPrimitive containing an \"atoms:agentId\" vertex variable" );
-        }
+} // namespace
 
-        auto agentIdData = runTimeCast<const IntVectorData>( agentId->second.data );
-        if ( !agentIdData ) {
-            throw InvalidArgumentException(
-                    "AtomsCrowdGenerator : Input must be a PointsPrimitive containing an \"atoms:agentId\" vertex variable" );
-        }
+//////////////////////////////////////////////////////////////////////////
+// Agent grouping
+//////////////////////////////////////////////////////////////////////////
 
-        // Need to find with point has the data of the current agent
-        std::vector<int> agentIdVec = agentIdData->readable();
-        for ( size_t i = 0; i < agentIdVec.size(); ++i )
-        {
-            if ( agentIdVec[i] == currentAgentIndex )
-            {
-                agentIdPointIndex = i;
-                break;
-            }
-        }
+namespace
+{
 
-        for ( auto primIt = points->variables.cbegin(); primIt != points->variables.cend(); ++primIt )
-        {
-            size_t atomsIndex = primIt->first.find("atoms:");
-            if ( atomsIndex != 0 ) {
-                continue;
-            }
+// The agents are grouped by the strings of their type, variation and lod,
+// which are compared in place rather than copied for every agent
+struct AgentGroupKey
+{
+	const std::string *type;
+	const std::string *variation;
+	const std::string *lod;
 
-            // All the data are trasfered to the renderer, so add "user:" as prefix
-            std::string variableName = "user:" + primIt->first;
+	bool operator==( const AgentGroupKey &other ) const
+	{
+		return *type == *other.type && *variation == *other.variation && *lod == *other.lod;
+	}
+};
 
-            switch( primIt->second.data->typeId() )
-            {
-                case IECore::TypeId::BoolVectorDataTypeId:
-                {
-                    auto data = runTimeCast<const BoolVectorData>( primIt->second.data );
-                    BoolDataPtr outData = new BoolData();
-                    outData->writable() = data->readable()[agentIdPointIndex];
-                    objMap[variableName] = outData;
-                    break;
-                }
+struct AgentGroupKeyHash
+{
+	size_t operator()( const AgentGroupKey &key ) const
+	{
+		std::hash<std::string> h;
+		size_t result = h( *key.type );
+		result = result * 31 + h( *key.variation );
+		return result * 31 + h( *key.lod );
+	}
+};
 
-                case IECore::TypeId::IntVectorDataTypeId:
-                {
-                    auto data = runTimeCast<const IntVectorData>( primIt->second.data );
-                    IntDataPtr outData = new IntData();
-                    outData->writable() = data->readable()[agentIdPointIndex];
-                    objMap[variableName] = outData;
-                    break;
-                }
+using AgentGroupTable = std::unordered_map<AgentGroupKey, int, AgentGroupKeyHash>;
 
-                case IECore::TypeId::FloatVectorDataTypeId:
-                {
-                    auto data = runTimeCast<const FloatVectorData>( primIt->second.data );
-                    FloatDataPtr outData = new FloatData();
-                    outData->writable() = data->readable()[agentIdPointIndex];
-                    objMap[variableName] = outData;
-                    break;
-                }
+// Returns the name of an agent location, formatting the id in place rather than
+// through a temporary string. The names are held by the child names computed from
+// them, rather than by a cache of their own outliving the compute cache.
+InternedString agentName( int agentId )
+{
+	char buffer[16];
+	const int length = snprintf( buffer, sizeof( buffer ), "%d", agentId );
+	return InternedString( buffer, length );
+}
 
-                case IECore::TypeId::StringVectorDataTypeId:
-                {
-                    auto data = runTimeCast<const StringVectorData>( primIt->second.data );
-                    StringDataPtr outData = new StringData();
-                    outData->writable() = data->readable()[agentIdPointIndex];
-                    objMap[variableName] = outData;
-                    break;
-                }
+} // namespace
 
-                case IECore::TypeId::V2fVectorDataTypeId:
-                {
-                    auto data = runTimeCast<const V2fVectorData>( primIt->second.data );
-                    V2fDataPtr outData = new V2fData();
-                    outData->writable() = data->readable()[agentIdPointIndex];
-                    objMap[variableName] = outData;
-                    break;
-                }
+//////////////////////////////////////////////////////////////////////////
+// Agent bounds
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+
+// Returns the world space bound of the cloth simulated for the agent, or
+// an empty box if there is none
+Imath::Box3d clothAgentBound( const BlindDataHolder *cloth, const InternedString &agentName )
+{
+    Imath::Box3d result;
+    if ( !cloth || !cloth->blindData() )
+    {
+        return result;
+    }
+
+    auto& clothData = cloth->blindData()->readable();
+    auto clothAgentIt = clothData.find( agentName );
+    if ( clothAgentIt == clothData.cend() )
+    {
+        return result;
+    }
+
+    auto clothAgent = runTimeCast<const CompoundData>( clothAgentIt->second );
+    if ( !clothAgent )
+    {
+        return result;
+    }
+
+    auto clothMeshIt = clothAgent->readable().find( "boundingBox" );
+    if ( clothMeshIt == clothAgent->readable().cend() )
+    {
+        return result;
+    }
+
+    auto boxData = runTimeCast<const Box3dData>( clothMeshIt->second );
+    if ( boxData )
+        result = boxData->readable();
+    return result;
+}
+
+// Returns the joint bounds of the variation, or null if its meshes can't be bound by them
+const Box3fVectorData *variationJointBounds( const CompoundData *jointBounds, const InternedString &agentType, const InternedString &variation )
+{
+    auto typeJointBounds = jointBounds ? jointBounds->member<const CompoundData>( agentType ) : nullptr;
+    return typeJointBounds ? typeJointBounds->member<const Box3fVectorData>( variation ) : nullptr;
+}
+
+// Returns the bound of the agent in its own space, from its joint bounds
+// and from the cloth bound. The joint bounds of the variation bound the
+// skinned points, so transforming them by the skinning matrices gives a
+// tight and conservative bound. Without them the bound of the joint
+// positions is used, which doesn't account for the meshes, so it's not
+// 100% right
+Imath::Box3f agentLocalBound( const CompoundData *agentData, const Box3fVectorData *jointBounds, const Imath::Box3d &clothBound, float padding )
+{
+    // Extract the agent root matrix
+    Imath::M44d rootInvMatrix;
+    auto poseData = agentData->member<const M44dData>( "rootMatrix" );
+    if ( poseData ) {
+        rootInvMatrix = poseData->readable();
+        rootInvMatrix.invert();
+    }
+
+    Imath::Box3d agentBox;
+    auto matricesData = agentData->member<const M44dVectorData>( "poseWorldMatrices" );
+    if ( jointBounds && matricesData && matricesData->readable().size() >= jointBounds->readable().size() )
+    {
+        const auto &bounds = jointBounds->readable();
+        const auto &matrices = matricesData->readable();
+        for ( size_t j = 0; j < bounds.size(); ++j )
+        {
+            if ( !bounds[j].isEmpty() )
+            {
+                agentBox.extendBy( Imath::transform( Imath::Box3d( bounds[j].min, bounds[j].max ), matrices[j] ) );
+            }
+        }
+    }
+    else
+    {
+        auto boxData = agentData->member<const Box3dData>( "boundingBox" );
+        if ( !boxData )
+        {
+            throw InvalidArgumentException( "AtomsCrowdGenerator : No boundingBox or rootMatrix data found." );
+        }
+        agentBox = boxData->readable();
+    }
+
+    Imath::Box3f result;
+    if ( !clothBound.isEmpty() )
+    {
+        // The cloth bounding box is in world space. Convert in local space
+        agentBox.extendBy( clothBound.min * rootInvMatrix );
+        agentBox.extendBy( clothBound.max * rootInvMatrix );
+    }
+    result.extendBy( agentBox.min - Imath::V3f(padding, padding, padding) );
+    result.extendBy( agentBox.max + Imath::V3f(padding, padding, padding) );
+    return result;
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+// Motion blur
+//////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+
+// Returns the times of the samples the blur of a location is output at, from its
+// "gaffer:<kind>Blur" and "gaffer:<kind>BlurSegments" attributes, or no times when the
+// blur is off. The shutter is null when the blur is off for the whole render.
+std::vector<float> shutterSampleTimes( const CompoundObject *attributes, const char *blurName, const char *segmentsName, const Imath::V2f *shutter, float frame )
+{
+	std::vector<float> result;
+	auto blurData = attributes->member<const BoolData>( blurName );
+	auto segmentsData = attributes->member<const IntData>( segmentsName );
+	const int segments = segmentsData ? segmentsData->readable() : 1;
+	if( !shutter || ( blurData && !blurData->readable() ) || segments <= 0 )
+	{
+		return result;
+	}
+
+	for( int i = 0; i <= segments; ++i )
+	{
+		result.push_back( frame + shutter->x + ( shutter->y - shutter->x ) * (float)i / (float)segments );
+	}
+	return result;
+}
+
+} // namespace
+
+size_t AtomsCrowdGenerator::g_firstPlugIndex = 0;
+
+namespace
+{
+
+// The hashes of the deformed agent mesh locations, and the meshes actually
+// deformed. Gaffer only hashes a location again when its hash isn't cached,
+// so the requests count the lookups of the deformed mesh cache rather than
+// every use of a mesh. Locations sharing a deformed mesh only count as
+// requests. The samples deformed for a capsule bypass the hashes and the
+// cache, and count as a request and a miss.
+std::atomic<uint64_t> g_deformedMeshRequests( 0 );
+std::atomic<uint64_t> g_deformedMeshComputes( 0 );
+
+} // namespace
+
+AtomsCrowdGenerator::AtomsCrowdGenerator( const std::string &name )
+	:	BranchCreator( name )
+{
+	storeIndexOfNextChild( g_firstPlugIndex );
+
+	addChild( new StringPlug( "name", Plug::In, "agents" ) );
+	addChild( new ScenePlug( "variations" ) );
+	addChild( new BoolPlug( "useInstances" ) );
+	addChild( new FloatPlug( "boundingBoxPadding" ) );
+
+    addChild( new ScenePlug( "clothCache" ) );
+
+	addChild( new AtomicCompoundDataPlug( "__agentChildNames", Plug::Out, new CompoundData ) );
+	addChild( new AtomicCompoundDataPlug( "__agentIdToPointIndex", Plug::Out, new CompoundData ) );
+	addChild( new ObjectPlug( "__agentAttributes", Plug::Out, new CompoundObject ) );
+
+	addChild( new FloatPlug( "poseTolerance", Plug::In, 0.0f, 0.0f ) );
+	addChild( new StringPlug( "poseToleranceCamera" ) );
+	addChild( new AtomicCompoundDataPlug( "__poseClusters", Plug::Out, new CompoundData ) );
+	addChild( new IntPlug( "encapsulate", Plug::In, 0, 0, 2 ) );
+	addChild( new IntPlug( "mergeMeshes", Plug::In, 0, 0, 2 ) );
+	addChild( new IntPlug( "displayMode", Plug::In, 0, 0, 3 ) );
+	addChild( new AtomicCompoundDataPlug( "__containerBounds", Plug::Out, new CompoundData ) );
+	addChild( new AtomicCompoundDataPlug( "__jointBounds", Plug::Out, new CompoundData ) );
+	addChild( new BoolPlug( "velocity" ) );
+	addChild( new AtomicCompoundDataPlug( "__blendShapes", Plug::Out, new CompoundData ) );
+	addChild( new AtomicCompoundDataPlug( "__agentHashes", Plug::Out, new CompoundData ) );
+}
+
+Gaffer::StringPlug *AtomsCrowdGenerator::namePlug()
+{
+	return getChild<StringPlug>( g_firstPlugIndex );
+}
+
+const Gaffer::StringPlug *AtomsCrowdGenerator::namePlug() const
+{
+	return getChild<StringPlug>( g_firstPlugIndex );
+}
+
+ScenePlug *AtomsCrowdGenerator::variationsPlug()
+{
+	return getChild<ScenePlug>( g_firstPlugIndex + 1 );
+}
+
+const ScenePlug *AtomsCrowdGenerator::variationsPlug() const
+{
+	return getChild<ScenePlug>( g_firstPlugIndex + 1 );
+}
+
+Gaffer::BoolPlug *AtomsCrowdGenerator::useInstancesPlug()
+{
+    return getChild<BoolPlug>( g_firstPlugIndex + 2 );
+}
+
+const Gaffer::BoolPlug *AtomsCrowdGenerator::useInstancesPlug() const
+{
+    return getChild<BoolPlug>( g_firstPlugIndex + 2 );
+}
+
+Gaffer::FloatPlug *AtomsCrowdGenerator::boundingBoxPaddingPlug()
+{
+	return getChild<FloatPlug>( g_firstPlugIndex + 3 );
+}
+
+const Gaffer::FloatPlug *AtomsCrowdGenerator::boundingBoxPaddingPlug() const
+{
+	return getChild<FloatPlug>( g_firstPlugIndex + 3 );
+}
+
+GafferScene::ScenePlug *AtomsCrowdGenerator::clothCachePlug()
+{
+    return getChild<ScenePlug>( g_firstPlugIndex + 4 );
+}
+
+const GafferScene::ScenePlug *AtomsCrowdGenerator::clothCachePlug() const
+{
+    return getChild<ScenePlug>( g_firstPlugIndex + 4 );
+}
+
+Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::agentChildNamesPlug()
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 5 );
+}
+
+const Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::agentChildNamesPlug() const
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 5 );
+}
+
+Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::agentIdToPointIndexPlug()
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 6 );
+}
+
+const Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::agentIdToPointIndexPlug() const
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 6 );
+}
+
+Gaffer::ObjectPlug *AtomsCrowdGenerator::agentAttributesPlug()
+{
+    return getChild<ObjectPlug>( g_firstPlugIndex + 7 );
+}
+
+const Gaffer::ObjectPlug *AtomsCrowdGenerator::agentAttributesPlug() const
+{
+    return getChild<ObjectPlug>( g_firstPlugIndex + 7 );
+}
+
+Gaffer::FloatPlug *AtomsCrowdGenerator::poseTolerancePlug()
+{
+    return getChild<FloatPlug>( g_firstPlugIndex + 8 );
+}
+
+const Gaffer::FloatPlug *AtomsCrowdGenerator::poseTolerancePlug() const
+{
+    return getChild<FloatPlug>( g_firstPlugIndex + 8 );
+}
+
+Gaffer::StringPlug *AtomsCrowdGenerator::poseToleranceCameraPlug()
+{
+    return getChild<StringPlug>( g_firstPlugIndex + 9 );
+}
+
+const Gaffer::StringPlug *AtomsCrowdGenerator::poseToleranceCameraPlug() const
+{
+    return getChild<StringPlug>( g_firstPlugIndex + 9 );
+}
+
+Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::poseClustersPlug()
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 10 );
+}
+
+const Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::poseClustersPlug() const
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 10 );
+}
+
+Gaffer::IntPlug *AtomsCrowdGenerator::encapsulatePlug()
+{
+    return getChild<IntPlug>( g_firstPlugIndex + 11 );
+}
+
+const Gaffer::IntPlug *AtomsCrowdGenerator::encapsulatePlug() const
+{
+    return getChild<IntPlug>( g_firstPlugIndex + 11 );
+}
+
+Gaffer::IntPlug *AtomsCrowdGenerator::mergeMeshesPlug()
+{
+    return getChild<IntPlug>( g_firstPlugIndex + 12 );
+}
+
+const Gaffer::IntPlug *AtomsCrowdGenerator::mergeMeshesPlug() const
+{
+    return getChild<IntPlug>( g_firstPlugIndex + 12 );
+}
+
+Gaffer::IntPlug *AtomsCrowdGenerator::displayModePlug()
+{
+    return getChild<IntPlug>( g_firstPlugIndex + 13 );
+}
+
+const Gaffer::IntPlug *AtomsCrowdGenerator::displayModePlug() const
+{
+    return getChild<IntPlug>( g_firstPlugIndex + 13 );
+}
+
+Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::containerBoundsPlug()
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 14 );
+}
+
+const Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::containerBoundsPlug() const
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 14 );
+}
+
+Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::jointBoundsPlug()
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 15 );
+}
+
+const Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::jointBoundsPlug() const
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 15 );
+}
+
+Gaffer::BoolPlug *AtomsCrowdGenerator::velocityPlug()
+{
+    return getChild<BoolPlug>( g_firstPlugIndex + 16 );
+}
+
+const Gaffer::BoolPlug *AtomsCrowdGenerator::velocityPlug() const
+{
+    return getChild<BoolPlug>( g_firstPlugIndex + 16 );
+}
+
+Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::blendShapesPlug()
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 17 );
+}
+
+const Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::blendShapesPlug() const
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 17 );
+}
+
+Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::agentHashesPlug()
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 18 );
+}
+
+const Gaffer::AtomicCompoundDataPlug *AtomsCrowdGenerator::agentHashesPlug() const
+{
+    return getChild<AtomicCompoundDataPlug>( g_firstPlugIndex + 18 );
+}
+
+void AtomsCrowdGenerator::affects( const Plug *input, AffectedPlugsContainer &outputs ) const
+{
+	BranchCreator::affects( input, outputs );
+
+	if(
+		input == inPlug()->objectPlug() ||
+        input == inPlug()->attributesPlug() ||
+		input == variationsPlug()->childNamesPlug()
+	)
+	{
+		outputs.push_back( agentChildNamesPlug() );
+	}
+
+	if( input == inPlug()->objectPlug() )
+	{
+		outputs.push_back( agentIdToPointIndexPlug() );
+	}
+
+	if(
+		input == inPlug()->objectPlug() ||
+		input == inPlug()->attributesPlug() ||
+		input == agentIdToPointIndexPlug()
+	)
+	{
+		outputs.push_back( agentAttributesPlug() );
+	}
+
+	if(
+		input == inPlug()->objectPlug() ||
+		input == inPlug()->attributesPlug() ||
+		input == inPlug()->transformPlug() ||
+		input == agentChildNamesPlug() ||
+		input == agentIdToPointIndexPlug() ||
+		input == clothCachePlug()->objectPlug() ||
+		input == poseTolerancePlug() ||
+		input == poseToleranceCameraPlug()
+	)
+	{
+		outputs.push_back( poseClustersPlug() );
+	}
+
+	if(
+		input == agentChildNamesPlug() ||
+		input == variationsPlug()->attributesPlug() ||
+		input == variationsPlug()->childNamesPlug()
+	)
+	{
+		outputs.push_back( jointBoundsPlug() );
+	}
+
+	if( input == variationsPlug()->objectPlug() )
+	{
+		outputs.push_back( blendShapesPlug() );
+	}
+
+	if(
+		input == inPlug()->objectPlug() ||
+		input == inPlug()->attributesPlug()
+	)
+	{
+		outputs.push_back( agentHashesPlug() );
+	}
+
+	if(
+		input == inPlug()->attributesPlug() ||
+		input == agentChildNamesPlug() ||
+		input == jointBoundsPlug() ||
+		input == boundingBoxPaddingPlug() ||
+		input == clothCachePlug()->objectPlug()
+	)
+	{
+		outputs.push_back( containerBoundsPlug() );
+	}
+
+	if(
+		input == namePlug() ||
+		input == agentChildNamesPlug() ||
+		input == variationsPlug()->childNamesPlug() ||
+		input == variationsPlug()->objectPlug() ||
+		input == variationsPlug()->attributesPlug() ||
+		input == encapsulatePlug() ||
+		input == mergeMeshesPlug() ||
+		input == displayModePlug()
+	)
+	{
+		outputs.push_back( outPlug()->childNamesPlug() );
+	}
+
+	if(
+		input == inPlug()->objectPlug() ||
+		input == inPlug()->attributesPlug() ||
+		input == namePlug() ||
+		input == variationsPlug()->boundPlug() ||
+		input == variationsPlug()->transformPlug() ||
+		input == variationsPlug()->attributesPlug() ||
+		input == variationsPlug()->childNamesPlug() ||
+		input == agentChildNamesPlug() ||
+		input == boundingBoxPaddingPlug() ||
+		input == clothCachePlug()->objectPlug() ||
+		input == containerBoundsPlug() ||
+		input == jointBoundsPlug() ||
+		input == encapsulatePlug() ||
+		input == mergeMeshesPlug() ||
+		input == displayModePlug() ||
+		input == velocityPlug() ||
+		input == agentIdToPointIndexPlug() ||
+		input == agentHashesPlug()
+	)
+	{
+		outputs.push_back( outPlug()->boundPlug() );
+	}
+
+	if(
+		input == inPlug()->objectPlug() ||
+		input == inPlug()->attributesPlug() ||
+		input == variationsPlug()->transformPlug() ||
+		input == variationsPlug()->attributesPlug() ||
+		input == variationsPlug()->childNamesPlug() ||
+		input == clothCachePlug()->objectPlug() ||
+		input == mergeMeshesPlug() ||
+		input == displayModePlug() ||
+		input == velocityPlug() ||
+		input == agentIdToPointIndexPlug() ||
+		input == agentHashesPlug()
+	)
+	{
+		outputs.push_back( outPlug()->transformPlug() );
+	}
+
+	if(
+		input == variationsPlug()->attributesPlug() ||
+		input == inPlug()->objectPlug() ||
+		input == inPlug()->attributesPlug() ||
+		input == agentIdToPointIndexPlug() ||
+		input == agentAttributesPlug() ||
+		input == variationsPlug()->childNamesPlug() ||
+		input == variationsPlug()->objectPlug() ||
+		input == mergeMeshesPlug() ||
+		input == displayModePlug() ||
+		input == agentHashesPlug()
+	)
+	{
+		outputs.push_back( outPlug()->attributesPlug() );
+	}
+
+    if( input == variationsPlug()->objectPlug() ||
+        input == variationsPlug()->attributesPlug() ||
+        input == variationsPlug()->childNamesPlug() ||
+        input == inPlug()->objectPlug() ||
+        input == inPlug()->attributesPlug() ||
+        input == clothCachePlug()->objectPlug() ||
+        input == agentIdToPointIndexPlug() ||
+        input == useInstancesPlug() ||
+        input == poseClustersPlug() ||
+        input == encapsulatePlug() ||
+        input == mergeMeshesPlug() ||
+        input == displayModePlug() ||
+        input == velocityPlug() ||
+        input == blendShapesPlug() ||
+        input == agentHashesPlug() ||
+        input == boundingBoxPaddingPlug() ||
+        input == namePlug()
+        )
+    {
+        outputs.push_back( outPlug()->objectPlug() );
+    }
+
+	if(
+		input == variationsPlug()->setPlug() ||
+		input == variationsPlug()->objectPlug() ||
+		input == variationsPlug()->attributesPlug() ||
+		input == variationsPlug()->childNamesPlug() ||
+		input == agentChildNamesPlug() ||
+		input == namePlug() ||
+		input == encapsulatePlug() ||
+		input == mergeMeshesPlug() ||
+		input == displayModePlug()
+	)
+	{
+		outputs.push_back( outPlug()->setPlug() );
+	}
+}
+
+void AtomsCrowdGenerator::hash( const Gaffer::ValuePlug *output, const Gaffer::Context *context, MurmurHash &h ) const
+{
+	BranchCreator::hash( output, context, h );
+
+	if( output == agentChildNamesPlug() )
+	{
+		inPlug()->objectPlug()->hash( h );
+        inPlug()->attributesPlug()->hash( h );
+		h.append( variationsPlug()->childNamesHash( ScenePath() ) );
+		useInstancesPlug()->hash( h );
+	}
+	else if( output == agentIdToPointIndexPlug() )
+	{
+		inPlug()->objectPlug()->hash( h );
+	}
+	else if( output == agentAttributesPlug() )
+	{
+		inPlug()->objectPlug()->hash( h );
+		inPlug()->attributesPlug()->hash( h );
+		agentIdToPointIndexPlug()->hash( h );
+	}
+	else if( output == poseClustersPlug() )
+	{
+		const float tolerance = poseTolerancePlug()->getValue();
+		h.append( tolerance );
+		if( tolerance > 0.0f )
+		{
+			inPlug()->attributesPlug()->hash( h );
+			agentChildNamesPlug()->hash( h );
+			agentIdToPointIndexPlug()->hash( h );
+			clothCachePlug()->objectPlug()->hash( h );
+			const std::string camera = poseToleranceCameraPlug()->getValue();
+			if( !camera.empty() )
+			{
+				ScenePath cameraPath;
+				ScenePlug::stringToPath( camera, cameraPath );
+				// A missing camera is hashed by name too, so its warning isn't lost to the cache
+				h.append( camera );
+				if( inPlug()->exists( cameraPath ) )
+				{
+					h.append( inPlug()->fullTransformHash( cameraPath ) );
+					h.append( inPlug()->fullTransformHash( context->get<ScenePath>( ScenePlug::scenePathContextName ) ) );
+				}
+			}
+		}
+	}
+	else if( output == jointBoundsPlug() )
+	{
+		ConstCompoundDataPtr childNames = agentChildNamesPlug()->getValue();
+		h.append( childNames->Object::hash() );
+		for( const auto &type : childNames->readable() )
+		{
+			auto typeVariations = runTimeCast<const CompoundData>( type.second );
+			if( !typeVariations )
+			{
+				continue;
+			}
+			for( const auto &variation : typeVariations->readable() )
+			{
+				std::vector<ScenePath> toVisit( 1, ScenePath( { type.first, variation.first } ) );
+				while( !toVisit.empty() )
+				{
+					const ScenePath path = toVisit.back();
+					toVisit.pop_back();
+
+					h.append( variationsPlug()->attributesHash( path ) );
+					ConstInternedStringVectorDataPtr children = variationsPlug()->childNames( path );
+					h.append( children->Object::hash() );
+					for( const auto &child : children->readable() )
+					{
+						toVisit.push_back( path );
+						toVisit.back().push_back( child );
+					}
+				}
+			}
+		}
+	}
+	else if( output == blendShapesPlug() )
+	{
+		// The weight names depend on the agent type and the mesh name
+		variationsPlug()->objectPlug()->hash( h );
+		const ScenePath &meshPath = context->get<ScenePath>( ScenePlug::scenePathContextName );
+		if( !meshPath.empty() )
+		{
+			h.append( meshPath.front() );
+			h.append( meshPath.back() );
+		}
+	}
+	else if( output == agentHashesPlug() )
+	{
+		inPlug()->objectPlug()->hash( h );
+		inPlug()->attributesPlug()->hash( h );
+	}
+	else if( output == containerBoundsPlug() )
+	{
+		inPlug()->attributesPlug()->hash( h );
+		agentChildNamesPlug()->hash( h );
+		jointBoundsPlug()->hash( h );
+		boundingBoxPaddingPlug()->hash( h );
+		clothCachePlug()->objectPlug()->hash( h );
+	}
+}
+
+void AtomsCrowdGenerator::compute( Gaffer::ValuePlug *output, const Gaffer::Context *context ) const
+{
+	// The agentChildNamesPlug is evaluated in a context in which
+	// scene:path holds the parent path for a branch.
+	if( output == agentChildNamesPlug() )
+	{
+		// Here we compute and cache the child names for all of
+		// the /agents/<agentType>/<variation> locations at once. We
+		// could instead compute them one at a time in
+		// computeBranchChildNames() but that would require N
+		// passes over the input points, where N is the number
+		// of instances.
+
+		ConstPointsPrimitivePtr crowd = runTimeCast<const PointsPrimitive>( inPlug()->objectPlug()->getValue() );
+		if( !crowd )
+		{
+			throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive Object." );
+		}
+
+		// Get the agentId variable that contains the agent cache id
+        const auto agentId = crowd->variables.find( "atoms:agentId" );
+        if( agentId == crowd->variables.end() )
+        {
+            throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive containing an \"atoms:agentId\" vertex variable" );
+        }
+
+        auto agentIdData = runTimeCast<const IntVectorData>( agentId->second.data );
+        if ( !agentIdData )
+        {
+            throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive containing an \"atoms:agentId\" vertex variable" );
+        }
+        const std::vector<int>& agentIdVec = agentIdData->readable();
+
+
+        const std::vector<std::string>* agentTypeVec = nullptr;
+        const std::vector<std::string>* agentVariationVec = nullptr;
+        const std::vector<std::string>* agentLodVec = nullptr;
+        std::string agentTypeDefault;
+        std::string variationDefault;
+        std::string lodDefault;
+
+        // Extract the agent type from the prim var
+		const auto agentType = crowd->variables.find( "atoms:agentType" );
+		if( agentType == crowd->variables.end() )
+		{
+			throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive containing an \"atoms:agentType\" vertex variable" );
+		}
+
+        if ( agentType->second.interpolation == PrimitiveVariable::Vertex )
+        {
+            auto agentTypesData = runTimeCast<const StringVectorData>( agentType->second.data );
+            if ( agentTypesData )
+                agentTypeVec = &agentTypesData->readable();
+        }
+        else if ( agentType->second.interpolation == PrimitiveVariable::Constant )
+        {
+            auto agentTypesData = runTimeCast<const StringData>( agentType->second.data );
+            if ( agentTypesData )
+                agentTypeDefault = agentTypesData->readable();
+        }
+
+        // Extract the agent variation from the prim var
+		const auto agentVariation = crowd->variables.find( "atoms:variation" );
+		if( agentVariation == crowd->variables.end() )
+		{
+			throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive containing an \"atoms:variation\" vertex variable" );
+		}
+
+        if ( agentVariation->second.interpolation == PrimitiveVariable::Vertex )
+        {
+            auto agentVariationData = runTimeCast<const StringVectorData>( agentVariation->second.data );
+            if ( agentVariationData )
+                agentVariationVec = &agentVariationData->readable();
+        }
+        else if ( agentVariation->second.interpolation == PrimitiveVariable::Constant )
+        {
+            auto agentVariationData = runTimeCast<const StringData>(agentVariation->second.data);
+            if ( agentVariationData )
+                variationDefault = agentVariationData->readable();
+        }
+
+        // Extract the agent lod from the prim var
+		const auto agentLod = crowd->variables.find( "atoms:lod" );
+		if( agentLod == crowd->variables.end() )
+		{
+			throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive containing an \"atoms:lod\" vertex variable" );
+		}
+
+		if ( agentLod->second.interpolation == PrimitiveVariable::Vertex )
+		{
+            auto agentLodData = runTimeCast<const StringVectorData>( agentLod->second.data );
+            if ( agentLodData )
+                agentLodVec = &agentLodData->readable();
+        }
+		else if ( agentLod->second.interpolation == PrimitiveVariable::Constant )
+		{
+            auto agentLodData = runTimeCast<const StringData>( agentLod->second.data );
+            if ( agentLodData )
+                lodDefault = agentLodData->readable();
+        }
+
+
+		// The agents are grouped in parallel chunks, each one giving its own
+		// indices to the groups it finds, which are then merged
+		const size_t numAgents = agentIdVec.size();
+		const size_t chunkSize = 16384;
+		const size_t numChunks = ( numAgents + chunkSize - 1 ) / chunkSize;
+		std::vector<AgentGroupTable> chunkGroups( numChunks );
+		std::vector<int> agentGroups( numAgents );
+
+		tbb::task_group_context taskGroupContext( tbb::task_group_context::isolated );
+		tbb::parallel_for(
+			tbb::blocked_range<size_t>( 0, numChunks ),
+			[&]( const tbb::blocked_range<size_t> &range )
+			{
+				for( size_t chunk = range.begin(); chunk != range.end(); ++chunk )
+				{
+					Canceller::check( context->canceller() );
+
+					AgentGroupTable &groups = chunkGroups[chunk];
+					const size_t end = std::min( numAgents, ( chunk + 1 ) * chunkSize );
+					for( size_t agId = chunk * chunkSize; agId < end; ++agId )
+					{
+						const std::string &variationName = agentVariationVec ? ( *agentVariationVec )[agId] : variationDefault;
+						if( variationName.empty() )
+						{
+							agentGroups[agId] = -1;
+							continue;
+						}
+
+						const AgentGroupKey key = {
+							agentTypeVec ? &( *agentTypeVec )[agId] : &agentTypeDefault,
+							&variationName,
+							agentLodVec ? &( *agentLodVec )[agId] : &lodDefault
+						};
+						agentGroups[agId] = groups.emplace( key, (int)groups.size() ).first->second;
+					}
+				}
+			},
+			taskGroupContext
+		);
+
+		// Every group is given the location of its variation, and groups whose variation and lod
+		// join into the same name share it, as the lod is appended to the variation name
+		std::map<std::pair<InternedString, InternedString>, int> variationIndices;
+		std::vector<std::pair<InternedString, InternedString>> variations;
+		std::vector<std::vector<int>> chunkToVariation( numChunks );
+		for( size_t chunk = 0; chunk < numChunks; ++chunk )
+		{
+			chunkToVariation[chunk].resize( chunkGroups[chunk].size() );
+			for( const auto &group : chunkGroups[chunk] )
+			{
+				const AgentGroupKey &key = group.first;
+				std::pair<InternedString, InternedString> names(
+					*key.type, key.lod->empty() ? *key.variation : *key.variation + ':' + *key.lod
+				);
+				auto inserted = variationIndices.emplace( names, (int)variations.size() );
+				if( inserted.second )
+				{
+					variations.push_back( names );
+				}
+				chunkToVariation[chunk][group.second] = inserted.first->second;
+			}
+		}
+
+		// A counting sort then gathers the agents of every variation, in the
+		// order of the points
+		std::vector<size_t> offsets( variations.size() + 1, 0 );
+		for( size_t agId = 0; agId < numAgents; ++agId )
+		{
+			int &group = agentGroups[agId];
+			if( group >= 0 )
+			{
+				group = chunkToVariation[agId / chunkSize][group];
+				offsets[group + 1]++;
+			}
+		}
+		for( size_t i = 0; i < variations.size(); ++i )
+		{
+			offsets[i + 1] += offsets[i];
+		}
+
+		std::vector<int> sortedAgentIds( offsets.back() );
+		std::vector<size_t> cursors( offsets.begin(), offsets.end() - 1 );
+		for( size_t agId = 0; agId < numAgents; ++agId )
+		{
+			const int group = agentGroups[agId];
+			if( group >= 0 )
+			{
+				sortedAgentIds[cursors[group]++] = agentIdVec[agId];
+			}
+		}
+
+		std::vector<InternedStringVectorDataPtr> variationIds( variations.size() );
+		tbb::parallel_for(
+			tbb::blocked_range<size_t>( 0, variations.size() ),
+			[&]( const tbb::blocked_range<size_t> &range )
+			{
+				for( size_t i = range.begin(); i != range.end(); ++i )
+				{
+					Canceller::check( context->canceller() );
+
+					InternedStringVectorDataPtr idsData = new InternedStringVectorData;
+					auto& idsStrVec = idsData->writable();
+					idsStrVec.reserve( offsets[i + 1] - offsets[i] );
+					for( size_t j = offsets[i]; j < offsets[i + 1]; ++j )
+					{
+						idsStrVec.push_back( agentName( sortedAgentIds[j] ) );
+					}
+					variationIds[i] = idsData;
+				}
+			},
+			taskGroupContext
+		);
+
+		// Convert the variation groups in compound data
+		CompoundDataPtr result = new CompoundData;
+		auto& resultData = result->writable();
+		for( size_t i = 0; i < variations.size(); ++i )
+		{
+			DataPtr &typeData = resultData[variations[i].first];
+			if( !typeData )
+			{
+				typeData = new CompoundData;
+			}
+			static_cast<CompoundData *>( typeData.get() )->writable()[variations[i].second] = variationIds[i];
+		}
+
+		static_cast<AtomicCompoundDataPlug *>( output )->setValue( result );
+		return;
+	}
+
+	// Like the agentChildNamesPlug, this is evaluated with scene:path
+	// holding the parent path for a branch.
+	if( output == agentIdToPointIndexPlug() )
+	{
+		// Every agent location needs the point holding its primitive variables.
+		// Building the table once per input points object turns the lookups
+		// into constant time operations instead of a scan of the whole crowd.
+		ConstPointsPrimitivePtr crowd = runTimeCast<const PointsPrimitive>( inPlug()->objectPlug()->getValue() );
+		if( !crowd )
+		{
+			throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive Object." );
+		}
+
+		const auto agentId = crowd->variables.find( "atoms:agentId" );
+		if( agentId == crowd->variables.end() )
+		{
+			throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive containing an \"atoms:agentId\" vertex variable" );
+		}
+
+		auto agentIdData = runTimeCast<const IntVectorData>( agentId->second.data );
+		if( !agentIdData )
+		{
+			throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive containing an \"atoms:agentId\" vertex variable" );
+		}
+		const std::vector<int>& agentIdVec = agentIdData->readable();
+
+		CompoundDataPtr result = new CompoundData;
+		if( agentIdVec.empty() )
+		{
+			static_cast<AtomicCompoundDataPlug *>( output )->setValue( result );
+			return;
+		}
+
+		const auto minMax = std::minmax_element( agentIdVec.begin(), agentIdVec.end() );
+		const int minId = *minMax.first;
+		const size_t range = (size_t)( (int64_t)*minMax.second - (int64_t)minId ) + 1;
+
+		IntVectorDataPtr pointIndicesData = new IntVectorData;
+		auto& pointIndices = pointIndicesData->writable();
+
+		// Atoms ids are usually compact, in which case a dense table indexed
+		// by id is the cheapest option. Sparse ids fall back to a sorted id
+		// list that is binary searched.
+		if( range <= 2 * agentIdVec.size() + 1024 )
+		{
+			pointIndices.resize( range, -1 );
+			for( size_t i = 0; i < agentIdVec.size(); ++i )
+			{
+				int &pointIndex = pointIndices[agentIdVec[i] - minId];
+				// Keep the first point for duplicated ids, like the previous linear search did
+				if( pointIndex < 0 )
+				{
+					pointIndex = i;
+				}
+			}
+			result->writable()["minId"] = new IntData( minId );
+		}
+		else
+		{
+			std::vector<int> order( agentIdVec.size() );
+			for( size_t i = 0; i < order.size(); ++i )
+			{
+				order[i] = i;
+			}
+			std::stable_sort(
+				order.begin(), order.end(),
+				[&agentIdVec]( int a, int b ) { return agentIdVec[a] < agentIdVec[b]; }
+			);
+
+			IntVectorDataPtr idsData = new IntVectorData;
+			auto& ids = idsData->writable();
+			ids.reserve( order.size() );
+			pointIndices.reserve( order.size() );
+			for( const int i : order )
+			{
+				if( !ids.empty() && ids.back() == agentIdVec[i] )
+				{
+					continue;
+				}
+				ids.push_back( agentIdVec[i] );
+				pointIndices.push_back( i );
+			}
+			result->writable()["ids"] = idsData;
+		}
+
+		result->writable()["pointIndices"] = pointIndicesData;
+		static_cast<AtomicCompoundDataPlug *>( output )->setValue( result );
+		return;
+	}
+
+	// Evaluated with scene:path holding the parent path for a branch.
+	if( output == poseClustersPlug() )
+	{
+		// Agents of the same type and variation whose poses are within the tolerance are
+		// grouped in clusters, and all the agents of a cluster share the deformed meshes of
+		// its first agent. The clusters are the cells of a grid over the skinning matrices
+		// and blend shape weights, the cell size being the tolerance of the agent rounded
+		// down to a power of two, so the clustering is linear and deterministic.
+		CompoundDataPtr result = new CompoundData;
+		const float tolerance = poseTolerancePlug()->getValue();
+		if( tolerance <= 0.0f )
+		{
+			static_cast<AtomicCompoundDataPlug *>( output )->setValue( result );
+			return;
+		}
+
+		ConstPointsPrimitivePtr crowd = runTimeCast<const PointsPrimitive>( inPlug()->objectPlug()->getValue() );
+		ConstCompoundObjectPtr crowdAttributes = inPlug()->attributesPlug()->getValue();
+		auto atomsData = crowdAttributes->member<const BlindDataHolder>( "atoms:agents" );
+		if( !crowd || !atomsData || !atomsData->blindData() )
+		{
+			static_cast<AtomicCompoundDataPlug *>( output )->setValue( result );
+			return;
+		}
+		const CompoundData *agentsData = atomsData->blindData();
+		const size_t numPoints = crowd->variableSize( PrimitiveVariable::Vertex );
+
+		ConstCompoundDataPtr childNames = agentChildNamesPlug()->getValue();
+		ConstCompoundDataPtr pointIndexTable = agentIdToPointIndexPlug()->getValue();
+
+		// Cloth meshes are simulated per agent, so those agents are never clustered
+		const CompoundData *clothData = nullptr;
+		auto cloth = runTimeCast<const BlindDataHolder>( clothCachePlug()->objectPlug()->getValue() );
+		if( cloth )
+		{
+			clothData = cloth->blindData();
+		}
+
+		// The tolerance can grow with the distance of the agent from a camera
+		bool useCamera = false;
+		Imath::V3f cameraPosition( 0 );
+		Imath::M44f crowdMatrix;
+		const std::string camera = poseToleranceCameraPlug()->getValue();
+		if( !camera.empty() )
+		{
+			ScenePath cameraPath;
+			ScenePlug::stringToPath( camera, cameraPath );
+			if( inPlug()->exists( cameraPath ) )
+			{
+				cameraPosition = inPlug()->fullTransform( cameraPath ).translation();
+				crowdMatrix = inPlug()->fullTransform( context->get<ScenePath>( ScenePlug::scenePathContextName ) );
+				useCamera = true;
+			}
+			else
+			{
+				// Cluster with the constant tolerance rather than with the transform of a missing location
+				IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "Pose tolerance camera \"" + camera + "\" doesn't exist" );
+			}
+		}
+
+		// Gather the agents of every type and variation
+		std::vector<int> agentIds;
+		std::vector<int> groups;
+		int numGroups = 0;
+		for( const auto &type : childNames->readable() )
+		{
+			auto variations = runTimeCast<const CompoundData>( type.second );
+			if( !variations )
+			{
+				continue;
+			}
+			for( const auto &variation : variations->readable() )
+			{
+				auto ids = runTimeCast<const InternedStringVectorData>( variation.second );
+				if( !ids )
+				{
+					continue;
+				}
+				for( const auto &id : ids->readable() )
+				{
+					if( clothData && clothData->readable().count( id ) )
+					{
+						continue;
+					}
+					agentIds.push_back( std::atoi( id.c_str() ) );
+					groups.push_back( numGroups );
+				}
+				++numGroups;
+			}
+		}
+
+		// Compute the cell of every agent in parallel
+		std::vector<MurmurHash> cells( agentIds.size() );
+		std::vector<char> valid( agentIds.size(), 0 );
+		const Canceller *canceller = context->canceller();
+		tbb::task_group_context taskGroupContext( tbb::task_group_context::isolated );
+		tbb::parallel_for(
+			tbb::blocked_range<size_t>( 0, agentIds.size() ),
+			[&]( const tbb::blocked_range<size_t> &range )
+			{
+				Canceller::check( canceller );
+				for( size_t i = range.begin(); i != range.end(); ++i )
+				{
+					const std::string name = std::to_string( agentIds[i] );
+					auto agentData = AtomsAgentPager::instance().agentData( agentsData, name );
+					if( !agentData )
+					{
+						continue;
+					}
+
+					auto poseData = agentData->member<const M44dVectorData>( "poseWorldMatrices" );
+					auto agentType = agentData->member<const StringData>( "agentType" );
+					if( !poseData || !agentType )
+					{
+						continue;
+					}
+
+					double agentTolerance = tolerance;
+					if( useCamera )
+					{
+						Imath::V3f position( 0 );
+						if( auto rootData = agentData->member<const M44dData>( "rootMatrix" ) )
+						{
+							position = Imath::V3f( rootData->readable().translation() ) * crowdMatrix;
+						}
+						agentTolerance *= ( position - cameraPosition ).length();
+					}
+					if( agentTolerance <= 0.0 )
+					{
+						continue;
+					}
+
+					const int level = (int)std::floor( std::log2( agentTolerance ) );
+					const double cellSize = std::ldexp( 1.0, level );
+
+					MurmurHash h;
+					h.append( groups[i] );
+					h.append( level );
+					for( const auto &matrix : poseData->readable() )
+					{
+						const double *v = matrix.getValue();
+						for( int k = 0; k < 16; ++k )
+						{
+							h.append( (int64_t)std::floor( v[k] / cellSize ) );
+						}
+					}
+
+					// The blend shape weights are named after the agent type
+					const std::string blendWeightPrefix = agentType->readable() + "_";
+					if( auto metadataData = agentData->member<const CompoundData>( "metadata" ) )
+					{
+						for( const auto &member : metadataData->readable() )
+						{
+							auto weight = runTimeCast<const DoubleData>( member.second.get() );
+							if( weight && member.first.string().compare( 0, blendWeightPrefix.size(), blendWeightPrefix ) == 0 )
+							{
+								h.append( member.first );
+								h.append( (int64_t)std::floor( weight->readable() / cellSize ) );
+							}
+						}
+					}
+
+					const int pointIndex = pointIndexFromTable( pointIndexTable.get(), agentIds[i] );
+					if( pointIndex >= 0 )
+					{
+						const std::string primVarPrefix = "atoms:" + blendWeightPrefix;
+						for( const auto &primVar : crowd->variables )
+						{
+							auto weights = runTimeCast<const FloatVectorData>( primVar.second.data.get() );
+							if( weights && primVar.first.compare( 0, primVarPrefix.size(), primVarPrefix ) == 0 )
+							{
+								h.append( primVar.first );
+								h.append( (int64_t)std::floor( weights->readable()[pointIndex] / cellSize ) );
+							}
+						}
+					}
+
+					cells[i] = h;
+					valid[i] = 1;
+				}
+			},
+			taskGroupContext
+		);
+
+		// The first agent of every cell represents the cluster
+		IntVectorDataPtr representativesData = new IntVectorData;
+		auto &representatives = representativesData->writable();
+		representatives.resize( numPoints, -1 );
+		std::map<MurmurHash, int> clusters;
+		for( size_t i = 0; i < agentIds.size(); ++i )
+		{
+			if( !valid[i] )
+			{
+				continue;
+			}
+
+			const int pointIndex = pointIndexFromTable( pointIndexTable.get(), agentIds[i] );
+			if( pointIndex < 0 || pointIndex >= (int)numPoints )
+			{
+				continue;
+			}
+
+			auto inserted = clusters.emplace( cells[i], agentIds[i] );
+			representatives[pointIndex] = inserted.first->second;
+		}
+
+		result->writable()["representatives"] = representativesData;
+		result->writable()["clusterCount"] = new IntData( clusters.size() );
+		static_cast<AtomicCompoundDataPlug *>( output )->setValue( result );
+		return;
+	}
+
+	// Evaluated with scene:path holding the path of a variation mesh, as set by the AgentScope.
+	if( output == blendShapesPlug() )
+	{
+		ConstMeshPrimitivePtr mesh = runTimeCast<const MeshPrimitive>( variationsPlug()->objectPlug()->getValue() );
+		static_cast<AtomicCompoundDataPlug *>( output )->setValue(
+			compileBlendShapes( mesh.get(), context->get<ScenePath>( ScenePlug::scenePathContextName ) )
+		);
+		return;
+	}
+
+	// Evaluated with scene:path holding the parent path for a branch.
+	if( output == jointBoundsPlug() )
+	{
+		// Here we merge the bind space joint bounds of all the meshes of every
+		// variation, so an agent can be bounded with one box transform per joint.
+		// The variations holding a mesh without joint bounds are left out, and
+		// their agents fall back to the bounds of their joints.
+		ConstCompoundDataPtr childNames = agentChildNamesPlug()->getValue();
+		CompoundDataPtr result = new CompoundData;
+		for( const auto &type : childNames->readable() )
+		{
+			auto typeVariations = runTimeCast<const CompoundData>( type.second );
+			if( !typeVariations )
+			{
+				continue;
+			}
+
+			CompoundDataPtr typeResult = new CompoundData;
+			for( const auto &variation : typeVariations->readable() )
+			{
+				Canceller::check( context->canceller() );
+
+				Box3fVectorDataPtr boundsData = new Box3fVectorData;
+				auto &bounds = boundsData->writable();
+				bool valid = true;
+				std::vector<ScenePath> toVisit( 1, ScenePath( { type.first, variation.first } ) );
+				while( valid && !toVisit.empty() )
+				{
+					const ScenePath path = toVisit.back();
+					toVisit.pop_back();
+
+					ConstInternedStringVectorDataPtr children = variationsPlug()->childNames( path );
+					ConstCompoundObjectPtr attributes = variationsPlug()->attributes( path );
+					if( auto meshBounds = attributes->member<const Box3fVectorData>( "jointBounds" ) )
+					{
+						if( meshBounds->readable().size() > bounds.size() )
+						{
+							bounds.resize( meshBounds->readable().size() );
+						}
+						for( size_t i = 0; i < meshBounds->readable().size(); ++i )
+						{
+							bounds[i].extendBy( meshBounds->readable()[i] );
+						}
+					}
+					else if( path.size() > 2 && children->readable().empty() )
+					{
+						valid = false;
+					}
+
+					for( const auto &child : children->readable() )
+					{
+						toVisit.push_back( path );
+						toVisit.back().push_back( child );
+					}
+				}
+
+				if( valid && !bounds.empty() )
+				{
+					typeResult->writable()[variation.first] = boundsData;
+				}
+			}
+			result->writable()[type.first] = typeResult;
+		}
+
+		static_cast<AtomicCompoundDataPlug *>( output )->setValue( result );
+		return;
+	}
+
+	// Evaluated with scene:path holding the parent path for a branch.
+	if( output == containerBoundsPlug() )
+	{
+		// The bounds of "/agents" and of all the agent type and variation locations
+		// are the unions of the bounds of their agents, moved by the agent root
+		// matrices. Here we reduce them all in a single parallel pass over the
+		// agents, instead of visiting every agent location once per level.
+		ConstCompoundDataPtr childNames = agentChildNamesPlug()->getValue();
+
+		ConstCompoundDataPtr jointBounds = jointBoundsPlug()->getValue();
+
+		std::vector<std::pair<InternedString, InternedString>> variations;
+		std::vector<const Box3fVectorData *> variationsJointBounds;
+		std::vector<InternedString> agentNames;
+		std::vector<size_t> agentVariations;
+		for( const auto &type : childNames->readable() )
+		{
+			auto typeVariations = runTimeCast<const CompoundData>( type.second );
+			if( !typeVariations )
+			{
+				continue;
+			}
+			for( const auto &variation : typeVariations->readable() )
+			{
+				auto ids = runTimeCast<const InternedStringVectorData>( variation.second );
+				if( !ids )
+				{
+					continue;
+				}
+				for( const auto &id : ids->readable() )
+				{
+					agentNames.push_back( id );
+					agentVariations.push_back( variations.size() );
+				}
+				variations.emplace_back( type.first, variation.first );
+				variationsJointBounds.push_back( variationJointBounds( jointBounds.get(), type.first, variation.first ) );
+			}
+		}
+
+		std::vector<Imath::Box3f> variationBounds( variations.size() );
+		if( !agentNames.empty() )
+		{
+			ConstCompoundObjectPtr crowdAttributes = inPlug()->attributesPlug()->getValue();
+			auto atomsData = crowdAttributes->member<const BlindDataHolder>( "atoms:agents" );
+			if( !atomsData || !atomsData->blindData() )
+			{
+				throw InvalidArgumentException( "AtomsCrowdGenerator : computeBranchBound : No agents data found." );
+			}
+			const CompoundData *agentsData = atomsData->blindData();
+			auto cloth = runTimeCast<const BlindDataHolder>( clothCachePlug()->objectPlug()->getValue() );
+			const float padding = boundingBoxPaddingPlug()->getValue();
+
+			const Canceller *canceller = context->canceller();
+			tbb::task_group_context taskGroupContext( tbb::task_group_context::isolated );
+			variationBounds = tbb::parallel_reduce(
+				tbb::blocked_range<size_t>( 0, agentNames.size() ),
+				variationBounds,
+				[&]( const tbb::blocked_range<size_t> &range, std::vector<Imath::Box3f> bounds )
+				{
+					Canceller::check( canceller );
+					for( size_t i = range.begin(); i != range.end(); ++i )
+					{
+						auto agentData = AtomsAgentPager::instance().agentData( agentsData, agentNames[i].string() );
+						if( !agentData )
+						{
+							throw InvalidArgumentException( "AtomsCrowdGenerator : computeBranchBound : No agent found." );
+						}
+
+						auto rootData = agentData->member<const M44dData>( "rootMatrix" );
+						if( !rootData )
+						{
+							throw InvalidArgumentException( "AtomsCrowdGenerator : No rootMatrix data found." );
+						}
+						const Imath::M44f rootMatrix( rootData->readable() );
+
+						// The agent root is included for the point proxies
+						Imath::Box3f &bound = bounds[agentVariations[i]];
+						bound.extendBy(
+							Imath::transform(
+								agentLocalBound(
+									agentData.get(), variationsJointBounds[agentVariations[i]],
+									clothAgentBound( cloth.get(), agentNames[i] ), padding
+								),
+								rootMatrix
+							)
+						);
+						bound.extendBy( rootMatrix.translation() );
+					}
+					return bounds;
+				},
+				[]( std::vector<Imath::Box3f> a, const std::vector<Imath::Box3f> &b )
+				{
+					for( size_t i = 0; i < a.size(); ++i )
+					{
+						a[i].extendBy( b[i] );
+					}
+					return a;
+				},
+				taskGroupContext
+			);
+		}
+
+		CompoundDataPtr result = new CompoundData;
+		CompoundDataPtr typeBoundsData = new CompoundData;
+		CompoundDataPtr variationBoundsData = new CompoundData;
+		Imath::Box3f bound;
+		for( size_t i = 0; i < variations.size(); ++i )
+		{
+			const InternedString &type = variations[i].first;
+			CompoundDataPtr typeVariationBounds = runTimeCast<CompoundData>( variationBoundsData->writable()[type] );
+			if( !typeVariationBounds )
+			{
+				typeVariationBounds = new CompoundData;
+				variationBoundsData->writable()[type] = typeVariationBounds;
+			}
+			typeVariationBounds->writable()[variations[i].second] = new Box3fData( variationBounds[i] );
+
+			Box3fDataPtr typeBound = runTimeCast<Box3fData>( typeBoundsData->writable()[type] );
+			if( !typeBound )
+			{
+				typeBound = new Box3fData;
+				typeBoundsData->writable()[type] = typeBound;
+			}
+			typeBound->writable().extendBy( variationBounds[i] );
+			bound.extendBy( variationBounds[i] );
+		}
+
+		result->writable()["bound"] = new Box3fData( bound );
+		result->writable()["types"] = typeBoundsData;
+		result->writable()["variations"] = variationBoundsData;
+		static_cast<AtomicCompoundDataPlug *>( output )->setValue( result );
+		return;
+	}
+
+	// Evaluated with scene:path holding the parent path for a branch.
+	if( output == agentHashesPlug() )
+	{
+		// Here we hash the input data of every agent in a single parallel pass. The
+		// agent locations append these hashes instead of the hashes of the whole input
+		// crowd, so an edit touching some of the agents leaves the hashes of the other
+		// locations unchanged, and their cached values are reused.
+		CompoundDataPtr result = new CompoundData;
+
+		ConstPointsPrimitivePtr crowd = runTimeCast<const PointsPrimitive>( inPlug()->objectPlug()->getValue() );
+		ConstCompoundObjectPtr crowdAttributes = inPlug()->attributesPlug()->getValue();
+		auto atomsData = crowdAttributes->member<const BlindDataHolder>( "atoms:agents" );
+		const IntVectorData *agentIdData = nullptr;
+		if( crowd )
+		{
+			const auto agentId = crowd->variables.find( "atoms:agentId" );
+			if( agentId != crowd->variables.end() )
+			{
+				agentIdData = runTimeCast<const IntVectorData>( agentId->second.data.get() );
+			}
+		}
+		if( !agentIdData || !atomsData || !atomsData->blindData() )
+		{
+			// The locations fall back to the hashes of the whole crowd
+			static_cast<AtomicCompoundDataPlug *>( output )->setValue( result );
+			return;
+		}
+		const CompoundData *agentsData = atomsData->blindData();
+		const std::vector<int>& agentIdVec = agentIdData->readable();
+
+		// The "atoms:" prim vars end up in the agent attributes and blend shape weights.
+		// Those not holding a value per point are shared by all the agents.
+		MurmurHash sharedHash;
+		PrimVarPlan pointPrimVars;
+		for( const auto &primVar : crowd->variables )
+		{
+			if( primVar.first.find( "atoms:" ) != 0 || !primVar.second.data )
+			{
+				continue;
+			}
+
+			sharedHash.append( primVar.first );
+			AttributeConversion conversion;
+			conversion.data = primVar.second.data.get();
+			conversion.kind = primVarKind( conversion.data );
+			if( conversion.kind != AttributeConversion::Unsupported && IECore::size( conversion.data ) == agentIdVec.size() )
+			{
+				pointPrimVars.push_back( conversion );
+			}
+			else
+			{
+				conversion.data->hash( sharedHash );
+			}
+		}
+
+		UInt64VectorDataPtr hashesData = new UInt64VectorData;
+		std::vector<uint64_t> &hashes = hashesData->writable();
+		hashes.resize( agentIdVec.size() * 2 );
+
+		const Canceller *canceller = context->canceller();
+		tbb::task_group_context taskGroupContext( tbb::task_group_context::isolated );
+		tbb::parallel_for(
+			tbb::blocked_range<size_t>( 0, agentIdVec.size() ),
+			[&]( const tbb::blocked_range<size_t> &range )
+			{
+				Canceller::check( canceller );
+				for( size_t i = range.begin(); i != range.end(); ++i )
+				{
+					MurmurHash agentHash = sharedHash;
+					for( const auto &conversion : pointPrimVars )
+					{
+						appendPrimVarValue( conversion, i, agentHash );
+					}
+
+					if( auto agentData = AtomsAgentPager::instance().agentData( agentsData, std::to_string( agentIdVec[i] ) ) )
+					{
+						agentData->hash( agentHash );
+					}
+
+					hashes[i * 2] = agentHash.h1();
+					hashes[i * 2 + 1] = agentHash.h2();
+				}
+			},
+			taskGroupContext
+		);
+
+		result->writable()["hashes"] = hashesData;
+		static_cast<AtomicCompoundDataPlug *>( output )->setValue( result );
+		return;
+	}
+
+	if( output == agentAttributesPlug() )
+	{
+		// Here we convert the attributes of all the agents in a single parallel
+		// pass, so the /agents/<agentType>/<variation>/<id> locations only have
+		// to look up their prebuilt CompoundObject.
+		CompoundObjectPtr result = new CompoundObject;
+
+		ConstPointsPrimitivePtr crowd = runTimeCast<const PointsPrimitive>( inPlug()->objectPlug()->getValue() );
+		ConstCompoundObjectPtr crowdAttributes = inPlug()->attributesPlug()->getValue();
+		auto atomsData = crowdAttributes->member<const BlindDataHolder>( "atoms:agents" );
+		if( !crowd || !atomsData || !atomsData->blindData() )
+		{
+			// Leave the locations to report the problem
+			static_cast<ObjectPlug *>( output )->setValue( result );
+			return;
+		}
+		const CompoundData *agentsData = atomsData->blindData();
+
+		const auto agentId = crowd->variables.find( "atoms:agentId" );
+		auto agentIdData = agentId != crowd->variables.end() ? runTimeCast<const IntVectorData>( agentId->second.data ) : nullptr;
+		if( !agentIdData )
+		{
+			throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a PointsPrimitive containing an \"atoms:agentId\" vertex variable" );
+		}
+		const std::vector<int>& agentIdVec = agentIdData->readable();
+		ConstCompoundDataPtr pointIndexTable = agentIdToPointIndexPlug()->getValue();
+
+		const PrimVarPlan primVars = primVarPlan( crowd.get() );
+		// The metadata plan is built from the first agent, the agents of other types
+		// fall back to a per member conversion where their layout differs
+		MetadataPlan metadata;
+		if( !agentIdVec.empty() )
+		{
+			if( auto firstAgent = AtomsAgentPager::instance().agentData( agentsData, std::to_string( agentIdVec[0] ) ) )
+			{
+				metadata = metadataPlan( firstAgent->member<const CompoundData>( "metadata" ) );
+			}
+		}
+
+		std::vector<InternedString> names( agentIdVec.size() );
+		std::vector<CompoundObjectPtr> attributes( agentIdVec.size() );
+
+		const Canceller *canceller = context->canceller();
+		tbb::task_group_context taskGroupContext( tbb::task_group_context::isolated );
+		tbb::parallel_for(
+			tbb::blocked_range<size_t>( 0, agentIdVec.size() ),
+			[&]( const tbb::blocked_range<size_t> &range )
+			{
+				Canceller::check( canceller );
+				for( size_t i = range.begin(); i != range.end(); ++i )
+				{
+					// Duplicated ids map to the same location, which uses the first point
+					if( pointIndexFromTable( pointIndexTable.get(), agentIdVec[i] ) != (int)i )
+					{
+						continue;
+					}
+
+					const std::string name = std::to_string( agentIdVec[i] );
+					auto agentData = AtomsAgentPager::instance().agentData( agentsData, name );
+					if( !agentData )
+					{
+						continue;
+					}
+
+					names[i] = name;
+					attributes[i] = buildAgentAttributes(
+						agentData->member<const CompoundData>( "metadata" ), metadata, primVars, i
+					);
+				}
+			},
+			taskGroupContext
+		);
+
+		auto &members = result->members();
+		for( size_t i = 0; i < attributes.size(); ++i )
+		{
+			if( attributes[i] )
+			{
+				members[names[i]] = attributes[i];
+			}
+		}
+
+		static_cast<ObjectPlug *>( output )->setValue( result );
+		return;
+	}
+
+	BranchCreator::compute( output, context );
+}
+
+Gaffer::ValuePlug::CachePolicy AtomsCrowdGenerator::computeCachePolicy( const Gaffer::ValuePlug *output ) const
+{
+	if(
+		output == agentChildNamesPlug() || output == agentAttributesPlug() || output == agentHashesPlug() ||
+		output == poseClustersPlug() || output == containerBoundsPlug() || output == outPlug()->objectPlug() ||
+		output == outPlug()->setPlug()
+	)
+	{
+		// These computes spawn TBB tasks, the deformers splitting the big
+		// meshes in parallel chunks, so they must be isolated from the
+		// tasks of the other threads waiting on them
+		return ValuePlug::CachePolicy::TaskIsolation;
+	}
+	return BranchCreator::computeCachePolicy( output );
+}
+
+void AtomsCrowdGenerator::hashBranchBound( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
+{
+	if( branchPath.size() > 1 && branchPath.size() == capsuleDepth() )
+	{
+		// "/agents/<agentType>" or "/agents/<agentType>/<variation>" holding a capsule
+		containerBoundHash( parentPath, branchPath, context, h );
+	}
+	else if( branchPath.size() == 3 && proxyMode() )
+	{
+		// "/agents/<agentType>/<variation>" holding the agent proxies
+		outPlug()->objectPlug()->hash( h );
+	}
+	else if( branchPath.size() == 4 && mergingMeshes() )
+	{
+		// "/agents/<agentType>/<variation>/<mergedMesh>"
+		containerBoundHash( parentPath, ScenePath( branchPath.begin(), branchPath.begin() + 3 ), context, h );
+	}
+	else if( branchPath.size() < 4 )
+	{
+		// "/" or "/agents" or "/agents/<agentType>" or "/agents/<agentType>/<variation>"
+		containerBoundHash( parentPath, branchPath, context, h );
+	}
+
+	else if( branchPath.size() == 4 )
+	{
+		// "/agents/<agentType>/<variation>/<id>"
+		BranchCreator::hashBranchBound( parentPath, branchPath, context, h );
+		agentBoundHash( parentPath, branchPath, context, h );
+	}
+	else
+	{
+		// "/agents/<agentType>/<variation>/<id>/..."
+		rigidJointHash( parentPath, branchPath, context, h );
+		if( rigidJoint( parentPath, branchPath, context ) >= 0 )
+		{
+			AgentScope instanceScope( context, branchPath );
+			variationsPlug()->boundPlug()->hash( h );
+		}
+		else
+		{
+			agentBoundHash( parentPath, branchPath, context, h );
+		}
+	}
+}
+
+Imath::Box3f AtomsCrowdGenerator::computeBranchBound( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
+{
+	if( branchPath.size() > 1 && branchPath.size() == capsuleDepth() )
+	{
+		// "/agents/<agentType>" or "/agents/<agentType>/<variation>" holding a capsule
+		return containerBound( parentPath, branchPath, context );
+	}
+	else if( branchPath.size() == 3 && proxyMode() )
+	{
+		// "/agents/<agentType>/<variation>" holding the agent proxies
+		auto proxies = runTimeCast<const Primitive>( outPlug()->objectPlug()->getValue() );
+		return proxies ? proxies->bound() : Imath::Box3f();
+	}
+	else if( branchPath.size() == 4 && mergingMeshes() )
+	{
+		// "/agents/<agentType>/<variation>/<mergedMesh>"
+		return containerBound( parentPath, ScenePath( branchPath.begin(), branchPath.begin() + 3 ), context );
+	}
+	else if( branchPath.size() < 4 )
+	{
+		// "/" or "/agents" or "/agents/<agentType>" or "/agents/<agentType>/<variation>".
+		// Evaluating the bounds location by location would visit every agent once per
+		// level, so the bounds of all the containers are reduced at once instead.
+		return containerBound( parentPath, branchPath, context );
+	}
+	else if ( branchPath.size() >= 4 )
+    {
+        // "/agents/<agentType>/<variation>/<id>/..."
+
+        // Rigid meshes are output untouched, so their bound is the variation one
+        if ( branchPath.size() > 4 && rigidJoint( parentPath, branchPath, context ) >= 0 )
+        {
+            AgentScope scope( context, branchPath );
+            return variationsPlug()->boundPlug()->getValue();
+        }
+
+        return agentBound( parentPath, branchPath, context );
+    }
+}
+
+void AtomsCrowdGenerator::agentBoundHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
+{
+	agentContentHash( parentPath, branchPath, context, h );
+    boundingBoxPaddingPlug()->hash( h );
+    clothCachePlug()->objectPlug()->hash( h );
+	{
+		ScenePlug::PathScope scope( context, parentPath );
+		jointBoundsPlug()->hash( h );
+	}
+	h.append( branchPath[1] );
+	h.append( branchPath[2] );
+	h.append( branchPath.back() );
+	{
+		AgentScope scope( context, branchPath );
+		variationsPlug()->transformPlug()->hash( h );
+		variationsPlug()->boundPlug()->hash( h );
+	}
+}
+
+Imath::Box3f AtomsCrowdGenerator::agentBound( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
+{
+    // If there is any cloth extract the bounding box
+    Imath::Box3d agentClothBBox;
+    ConstCompoundObjectPtr crowd;
+    {
+        ScenePlug::PathScope scope(context, parentPath);
+        crowd = runTimeCast<const CompoundObject>(inPlug()->attributesPlug()->getValue());
+        agentClothBBox = agentClothBoudingBox( parentPath, branchPath );
+    }
+
+    if( !crowd )
+    {
+        throw InvalidArgumentException( "AtomsCrowdGenerator : Input crowd must be a Compound Object." );
+    }
+
+    // The atoms:agents contain the atoms cache, so extract the bounding box from it
+    auto atomsData = crowd->member<const BlindDataHolder>( "atoms:agents" );
+    if( !atomsData )
+    {
+        throw InvalidArgumentException( "AtomsCrowdGenerator :  computeBranchBound : No agents data found." );
+    }
+
+    auto agentsData = atomsData->blindData();
+    if( !agentsData )
+    {
+        throw InvalidArgumentException( "AtomsCrowdGenerator : computeBranchBound : No agents data found." );
+    }
+
+    // Extract the current agent
+    auto agentData = AtomsAgentPager::instance().agentData( agentsData, branchPath[3].string() );
+    if( !agentData )
+    {
+        throw InvalidArgumentException( "AtomsCrowdGenerator : computeBranchBound : No agent found." );
+    }
+
+    ConstCompoundDataPtr jointBounds;
+    {
+        ScenePlug::PathScope scope( context, parentPath );
+        jointBounds = jointBoundsPlug()->getValue();
+    }
+
+    return agentLocalBound(
+        agentData.get(), variationJointBounds( jointBounds.get(), branchPath[1], branchPath[2] ),
+        agentClothBBox, boundingBoxPaddingPlug()->getValue()
+    );
+}
+
+void AtomsCrowdGenerator::hashBranchTransform( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
+{
+
+	if( branchPath.size() < 4 || ( branchPath.size() == 4 && mergingMeshes() ) )
+	{
+		// "/" or "/agents" or "/agents/<agentType> or "/agents/<agentType>/<variation>"
+		// or "/agents/<agentType>/<variation>/<mergedMesh>"
+		BranchCreator::hashBranchTransform( parentPath, branchPath, context, h );
+	}
+	else if( branchPath.size() == 4 )
+	{
+		// "/agents/<agentType>/<variation>/<id>"
+		agentContentHash( parentPath, branchPath, context, h );
+		h.append( branchPath[3] );
+	}
+	else
+	{
+		// "/agents/<agentType>/<variation>/<id>/..."
+		rigidJointHash( parentPath, branchPath, context, h );
+		agentContentHash( parentPath, branchPath, context, h );
+		h.append( branchPath[3] );
+		AgentScope scope( context, branchPath );
+		variationsPlug()->transformPlug()->hash( h );
+	}
+}
+
+Imath::M44f AtomsCrowdGenerator::computeBranchTransform( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
+{
+    // In atoms all the meshes have identity transformations, so here just return the default matrix
+	if( branchPath.size() < 4 || ( branchPath.size() == 4 && mergingMeshes() ) )
+	{
+		// "/" or "/agents" or "/agents/<agentName>" or "/agents/<agentType>/<variation>/<mergedMesh>"
+		return Imath::M44f();
+	}
+	else if( branchPath.size() == 4 )
+	{
+		// "/agents/<agentType>/<variaiton>/<id>"
+		return agentRootMatrix( parentPath, branchPath, context );
+	}
+	else
+	{
+		// "/agents/<agentName>/<variaiton>/<id>/..."
+		const int joint = rigidJoint( parentPath, branchPath, context );
+		if ( joint < 0 )
+		{
+			AgentScope scope( context, branchPath );
+			return variationsPlug()->transformPlug()->getValue();
+		}
+
+		// Rigid meshes are moved by their joint skinning matrix instead of being deformed
+		ConstCompoundDataPtr agentData;
+		{
+			ScenePlug::PathScope scope( context, parentPath );
+			agentData = agentCacheData( branchPath );
+		}
+
+		AgentScope scope( context, branchPath );
+		const Imath::M44f transform = variationsPlug()->transformPlug()->getValue();
+		auto poseData = agentData->member<const M44dVectorData>( "poseWorldMatrices" );
+		if ( !poseData || joint >= (int)poseData->readable().size() )
+		{
+			IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "No poseWorldMatrices found" );
+			return transform;
+		}
+
+		return Imath::M44f( poseData->readable()[joint] ) * transform;
+	}
+}
+
+void AtomsCrowdGenerator::hashBranchAttributes( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
+{
+	if( branchPath.size() < 1 )
+	{
+        // "/" or "/agents"
+		h = outPlug()->attributesPlug()->defaultValue()->Object::hash();
+	}
+	else if ( branchPath.size() == 2 )
+    {
+        // "/agents/<agentType>"
+        AgentScope instanceScope( context, branchPath );
+        variationsPlug()->attributesPlug()->hash( h );
+    }
+    else if ( branchPath.size() == 3 )
+    {
+        // "/agents/<agentType>/<variation>"
+        AgentScope instanceScope( context, branchPath );
+        variationsPlug()->attributesPlug()->hash( h );
+    }
+    else if( branchPath.size() == 4 && mergingMeshes() )
+    {
+        // "/agents/<agentType>/<variation>/<mergedMesh>"
+        BranchCreator::hashBranchAttributes( parentPath, branchPath, context, h );
+        mergedMeshGroupsHash( branchPath, h );
+        h.append( branchPath.back() );
+    }
+    else if( branchPath.size() == 4 )
+    {
+        BranchCreator::hashBranchAttributes( parentPath, branchPath, context, h );
+        {
+            AgentScope instanceScope( context, branchPath );
+            variationsPlug()->attributesPlug()->hash( h );
+        }
+
+        // The attributes come from the prim vars on the input point cloud and from
+        // the agent metadata inside the cache, which are all covered by the agent hash
+        agentContentHash( parentPath, branchPath, context, h );
+        h.append( branchPath[3] );
+    }
+	else
+	{
+		// "/agents/<agentName>/<id>/...
+		AgentScope instanceScope( context, branchPath );
+		variationsPlug()->attributesPlug()->hash( h );
+	}
+}
+
+ConstCompoundObjectPtr AtomsCrowdGenerator::computeBranchAttributes( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
+{
+	if( branchPath.size() < 2 )
+	{
+		// "/" or "/agents" or "/agents/<agentName>"
+		return outPlug()->attributesPlug()->defaultValue();
+	}
+    else if ( branchPath.size() == 2 )
+    {
+        // "/agents/<agentType>"
+        AgentScope scope(context, branchPath);
+        return variationsPlug()->attributesPlug()->getValue();
+    }
+    else if ( branchPath.size() == 3 )
+    {
+        // "/agents/<agentType>/<variation>"
+        AgentScope scope(context, branchPath);
+        return variationsPlug()->attributesPlug()->getValue();
+    }
+	else if( branchPath.size() == 4 && mergingMeshes() )
+	{
+		// "/agents/<agentType>/<variation>/<mergedMesh>"
+		std::vector<std::vector<ScenePath>> groups;
+		std::vector<ConstCompoundObjectPtr> groupAttributes;
+		mergedMeshGroups( branchPath, groups, groupAttributes );
+		const int groupIndex = mergedMeshGroupIndex( branchPath.back() );
+		if( groupIndex < 0 || groupIndex >= (int)groupAttributes.size() )
+		{
+			return outPlug()->attributesPlug()->defaultValue();
+		}
+		return groupAttributes[groupIndex];
+	}
+	else if( branchPath.size() == 4 )
+	{
+		// "/agents/<agentType>/<variation>/<id>"
+		// The attributes of all the agents are converted at once by the agentAttributesPlug
+		ConstCompoundObjectPtr allAttributes = agentAttributes( parentPath, context );
+		if( allAttributes )
+		{
+			if( auto attributes = allAttributes->member<const CompoundObject>( branchPath[3] ) )
+			{
+				return attributes;
+			}
+		}
+
+		// The agent isn't part of the prebuilt attributes, so convert it on its own
+		auto agentData = agentCacheData(branchPath);
+		auto metadataData = agentData->member<const CompoundData>( "metadata" );
+
+		ScenePlug::PathScope scope( context, parentPath );
+		auto points = runTimeCast<const PointsPrimitive>( inPlug()->objectPlug()->getValue() );
+		const int agentIdPointIndex = points ? agentPointIndex( parentPath, std::atoi( branchPath[3].c_str() ), context ) : -1;
+
+		return buildAgentAttributes( metadataData, MetadataPlan(), primVarPlan( points.get() ), agentIdPointIndex );
+	}
+	else
+	{
+		// "/agents/<agentName>/<id>/...
+		AgentScope scope( context, branchPath );
+        CompoundObjectPtr outAttributes = variationsPlug()->attributesPlug()->getValue()->copy();
+        // Remove the skin weights data
+        outAttributes->members().erase("jointIndexCount");
+        outAttributes->members().erase("jointIndices");
+        outAttributes->members().erase("jointWeights");
+        outAttributes->members().erase("jointBounds");
+        outAttributes->members().erase("rigidJointIndex");
+        return outAttributes;
+	}
+}
+
+void AtomsCrowdGenerator::hashBranchObject( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
+{
+	if( branchPath.size() > 1 && branchPath.size() == capsuleDepth() )
+	{
+		// "/agents/<agentType>" or "/agents/<agentType>/<variation>" holding a capsule.
+		// Hashing all the agent locations would cost as much as expanding them, so like
+		// the GafferScene::Encapsulate node, the capsule is hashed from the dirty count of
+		// the inputs and from the context instead.
+		h.append( reinterpret_cast<uint64_t>( this ) );
+		h.append( inPlug()->dirtyCount() );
+		h.append( variationsPlug()->dirtyCount() );
+		h.append( clothCachePlug()->dirtyCount() );
+		namePlug()->hash( h );
+		useInstancesPlug()->hash( h );
+		boundingBoxPaddingPlug()->hash( h );
+		poseTolerancePlug()->hash( h );
+		poseToleranceCameraPlug()->hash( h );
+		velocityPlug()->hash( h );
+		h.append( context->hash() );
+	}
+	else if( branchPath.size() == 3 && proxyMode() )
+	{
+		// "/agents/<agentType>/<variation>" holding the agent proxies
+		agentProxiesHash( parentPath, branchPath, context, h );
+	}
+	else if( branchPath.size() == 4 && mergingMeshes() )
+	{
+		// "/agents/<agentType>/<variation>/<mergedMesh>"
+		mergedMeshHash( parentPath, branchPath, context, h );
+	}
+	else if( branchPath.size() <= 4 )
+	{
+		// "/" or "/agents" or "/agents/<agentType>" or "/agents/<agentType>/<variation> or "/agents/<agentType>/<variation>/<id>"
+		h = outPlug()->objectPlug()->defaultValue()->Object::hash();
+	}
+	else
+	{
+		// "/agents/<agentType>/<variation>/<id>/...
+		if ( rigidJoint( parentPath, branchPath, context ) >= 0 )
+		{
+			// Rigid meshes are shared untouched by all the agents
+			AgentScope instanceScope( context, branchPath );
+			variationsPlug()->objectPlug()->hash( h );
+			h.append( "rigid" );
+			return;
+		}
+
+		g_deformedMeshRequests++;
+		const bool velocity = velocityPlug()->getValue();
+		if ( velocity )
+		{
+			// The velocities depend on the pose at the next frame
+			h.append( "velocity" );
+			h.append( context->getFramesPerSecond() );
+			Context::EditableScope nextFrameScope( context );
+			nextFrameScope.setFrame( context->getFrame() + 1.0f );
+			agentContentHash( parentPath, branchPath, Context::current(), h );
+		}
+
+		if ( useInstancesPlug()->getValue() && !velocity )
+		{
+			// The deformed mesh only depends on the variation mesh, the pose, the blend
+			// shape weights and the cloth, so agents sharing them share the same mesh
+			// across the crowd and the frame range. Cloth meshes are simulated per
+			// agent, so they can't be shared. Agents with a pose close enough to another
+			// one share the meshes of the agent representing their pose cluster.
+			const ScenePath agentPath = poseRepresentative( parentPath, branchPath, context );
+			if ( agentClothMeshData( parentPath, agentPath ) )
+			{
+				clothCachePlug()->objectPlug()->hash( h );
+				h.append( agentPath[3] );
+			}
+
+			AgentScope instanceScope( context, agentPath );
+			atomsPoseHash( parentPath, agentPath, context, h );
+			variationsPlug()->objectPlug()->hash( h );
+			variationsPlug()->attributesPlug()->hash( h );
+			return;
+		}
+
+        clothCachePlug()->objectPlug()->hash( h );
+        agentContentHash( parentPath, branchPath, context, h );
+        h.append( branchPath[3] );
+        AgentScope instanceScope( context, branchPath );
+        variationsPlug()->objectPlug()->hash( h );
+        variationsPlug()->attributesPlug()->hash( h );
+	}
+}
+
+ConstObjectPtr AtomsCrowdGenerator::computeBranchObject( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
+{
+	if( branchPath.size() > 1 && branchPath.size() == capsuleDepth() )
+	{
+		// "/agents/<agentType>" or "/agents/<agentType>/<variation>" holding a capsule
+		MurmurHash h;
+		hashBranchObject( parentPath, branchPath, context, h );
+		return new AtomsCrowdCapsule( this, parentPath, branchPath, *context, h, outPlug()->boundPlug()->getValue() );
+	}
+
+	if( branchPath.size() == 3 && proxyMode() )
+	{
+		// "/agents/<agentType>/<variation>" holding the agent proxies
+		return agentProxies( parentPath, branchPath, context );
+	}
+
+	if( branchPath.size() == 4 && mergingMeshes() )
+	{
+		// "/agents/<agentType>/<variation>/<mergedMesh>"
+		return mergedMesh( parentPath, branchPath, context );
+	}
+
+	if( branchPath.size() <= 4 )
+	{
+		// "/" or "/agents" or "/agents/<agentName>"
+		return outPlug()->objectPlug()->defaultValue();
+	}
+
+    if ( rigidJoint( parentPath, branchPath, context ) >= 0 )
+    {
+        // The joint transform is applied by computeBranchTransform()
+        AgentScope scope( context, branchPath );
+        return variationsPlug()->objectPlug()->getValue();
+    }
+
+    // The velocities differ even between agents sharing the same pose
+    const bool velocity = velocityPlug()->getValue();
+    if ( useInstancesPlug()->getValue() && !velocity )
+    {
+        // Deform the meshes of the agent representing the pose cluster instead
+        const ScenePath agentPath = poseRepresentative( parentPath, branchPath, context );
+        if ( agentPath[3] != branchPath[3] )
+        {
+            return computeBranchObject( parentPath, agentPath, context );
+        }
+    }
+
+    ConstPointsPrimitivePtr points;
+    CompoundData pointVariables;
+    int currentAgentIndex = std::atoi( branchPath[3].string().c_str() );
+
+    auto& pointVariablesData = pointVariables.writable();
+    {
+        ScenePlug::PathScope scope(context, parentPath);
+        points = runTimeCast<const PointsPrimitive>(inPlug()->objectPlug()->getValue());
+    }
+
+    if ( !points )
+    {
+        IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "No input point clound found" );
+        return variationsPlug()->objectPlug()->getValue();
+    }
+
+    // Get the point id that contain the agent data
+    // We need this only to get blend shapes weights information
+    const int agentIdPointIndex = agentPointIndex( parentPath, currentAgentIndex, context );
+
+    atomsPointVariables( points.get(), pointVariablesData );
+
+    g_deformedMeshComputes++;
+
+    // Extract cloth data
+    auto cloth = agentClothMeshData( parentPath, branchPath );
+    Imath::M44f rootMatrix = agentRootMatrix( parentPath, branchPath, context );
+    std::vector<Imath::M44d> nextWorldMatrices;
+    if ( velocity && !cloth )
+    {
+        nextWorldMatrices = sampleWorldMatrices(
+            agentDataAtFrame( parentPath, branchPath, context->getFrame(), context ).get(),
+            agentDataAtFrame( parentPath, branchPath, context->getFrame() + 1.0f, context ).get()
+        );
+    }
+
+    // "/agents/<agentType>/<variation>/<id>/...
+    AgentScope scope( context, branchPath );
+    auto meshPrim = runTimeCast<const MeshPrimitive>( variationsPlug()->objectPlug()->getValue() );
+    auto meshAttributes = runTimeCast<const CompoundObject>( variationsPlug()->attributesPlug()->getValue() );
+    if ( !meshPrim || !meshAttributes )
+    {
+        return variationsPlug()->objectPlug()->getValue();
+    }
+
+    auto agentData = agentCacheData( branchPath );
+    auto metadataData = agentData->member<const CompoundData>( "metadata" );
+
+    // Extract the pose matricies. Every matrix must be worldBindPoseInverseMatrix * worldMatrix * rootMatrixInverse
+    auto poseData = agentData->member<const M44dVectorData>( "poseWorldMatrices" );
+    if ( !poseData )
+    {
+
+        IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "No poseWorldMatrices found" );
+        return variationsPlug()->objectPlug()->getValue();
+    }
+
+    auto poseNormalData = agentData->member<const M44dVectorData>( "poseNormalWorldMatrices" );
+    if ( !poseNormalData )
+    {
+        IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "No poseNormalWorldMatrices found" );
+        return variationsPlug()->objectPlug()->getValue();
+    }
+    auto& worldMatrices = poseData->readable();
+    auto& worldNormalMatrices = poseNormalData->readable();
+    if ( worldMatrices.empty() || worldNormalMatrices.empty() )
+    {
+        IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "Empty poseWorldMatrices or poseNormalWorldMatrices attribute" );
+        return variationsPlug()->objectPlug()->getValue();
+    }
+
+
+    MeshPrimitivePtr result = meshPrim->copy();
+
+    auto pVarIt = result->variables.find( "P" );
+    if ( pVarIt == result->variables.end() )
+    {
+        IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "No P variable found" );
+        return variationsPlug()->objectPlug()->getValue();
+    }
+
+    if ( cloth )
+    {
+        // Check the cloth stack order
+        std::string stackOrder = "last";
+        auto& clothData = cloth->readable();
+        auto clothIt = clothData.find( "stackOrder" );
+        if ( clothIt != clothData.cend() )
+        {
+            auto clothStackOrderData = runTimeCast<StringData>( clothIt->second );
+            if ( clothStackOrderData )
+            {
+                stackOrder = clothStackOrderData->readable();
+            }
+        }
+
+        // If the stack order is "first" then it contains transformation in T pose,
+        // so the root matrix should be null
+        if ( stackOrder == "first" )
+        {
+            rootMatrix = Imath::M44f();
+        }
+
+        // Apply the cloth deformation
+        if ( !applyClothDeformer( branchPath, result, cloth, rootMatrix ) )
+        {
+            return variationsPlug()->objectPlug()->getValue();
+        }
+
+        if ( stackOrder == "first" )
+        {
+            // It's a first stack order mesh, so apply the skinning
+            applySkinDeformer( branchPath, result, meshPrim, meshAttributes, worldMatrices );
+        }
+    }
+    else
+    {
+        // Apply blend shapes
+        ConstCompoundDataPtr blendShapes = blendShapesPlug()->getValue();
+        applyBlendShapesDeformer( branchPath, result, blendShapes.get(), metadataData, pointVariablesData, agentIdPointIndex );
+        // Apply skinning
+        if ( velocity )
+        {
+            applySkinDeformer( branchPath, result, meshPrim, meshAttributes, worldMatrices, &nextWorldMatrices, context->getFramesPerSecond() );
+        }
+        else
+        {
+            applySkinDeformer( branchPath, result, meshPrim, meshAttributes, worldMatrices );
+        }
+    }
+
+    return result;
+}
+
+void AtomsCrowdGenerator::hashBranchChildNames( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
+{
+	if( branchPath.empty() )
+	{
+		// "/"
+		BranchCreator::hashBranchChildNames( parentPath, branchPath, context, h );
+		namePlug()->hash( h );
+	}
+	else if( branchPath.size() == 1 )
+	{
+		// "/agents"
+        BranchCreator::hashBranchChildNames( parentPath, branchPath, context, h );
+        agentChildNamesHash( parentPath, context, h );
+        h.append( branchPath.back() );
+	}
+	else if( branchPath.size() <= 3 )
+	{
+		// "/agents/<agentType>" or "/agents/<agentType>/<variation>"
+		BranchCreator::hashBranchChildNames( parentPath, branchPath, context, h );
+		agentChildNamesHash( parentPath, context, h );
+		encapsulatePlug()->hash( h );
+		mergeMeshesPlug()->hash( h );
+		displayModePlug()->hash( h );
+		if( branchPath.size() == 3 && mergingMeshes() )
+		{
+			mergedMeshGroupsHash( branchPath, h );
+		}
+		h.append( branchPath.back() );
+	}
+	else if( branchPath.size() == 4 && mergingMeshes() )
+	{
+		// "/agents/<agentType>/<variation>/<mergedMesh>"
+		h = outPlug()->childNamesPlug()->defaultValue()->Object::hash();
+	}
+	else
+	{
+		// "/agents/<agentName>/<id>/..."
+		AgentScope scope( context, branchPath );
+		h = variationsPlug()->childNamesPlug()->hash();
+	}
+}
+
+ConstInternedStringVectorDataPtr AtomsCrowdGenerator::computeBranchChildNames( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
+{
+
+	if( branchPath.empty() )
+	{
+		// "/"
+		std::string name = namePlug()->getValue();
+		if( name.empty() )
+		{
+            throw InvalidArgumentException( "AtomsCrowdGenerator : Input name attribute is empty" );
+		}
+		InternedStringVectorDataPtr result = new InternedStringVectorData();
+		result->writable().emplace_back( name );
+        return result;
+	}
+	else if( branchPath.size() == 1 )
+	{
+		// "/agents"
+        IECore::ConstCompoundDataPtr children = agentChildNames( parentPath, context );
+        auto& varData = children->readable();
+        InternedStringVectorDataPtr result = new InternedStringVectorData();
+        auto& names = result->writable();
+        for ( auto it = varData.cbegin(); it != varData.cend(); ++it )
+        {
+            names.push_back( it->first );
+        }
+        return result;
+	}
+	else if( branchPath.size() == capsuleDepth() )
+	{
+		// "/agents/<agentType>" or "/agents/<agentType>/<variation>" holding a capsule
+		return outPlug()->childNamesPlug()->defaultValue();
+	}
+	else if( branchPath.size() == 2 )
+	{
+		// "/agents/<agentType>"
+		IECore::ConstCompoundDataPtr children = agentChildNames( parentPath, context );
+
+		auto variationsData = children->member<CompoundData>( branchPath.back() );
+        InternedStringVectorDataPtr result = new InternedStringVectorData();
+
+        auto& names = result->writable();
+        if ( variationsData )
+        {
+            auto& varData = variationsData->readable();
+            for (auto it = varData.cbegin(); it != varData.cend(); ++it)
+            {
+                names.push_back(it->first);
+            }
+        }
+        return result;
+	}
+    else if( branchPath.size() == 3 && proxyMode() )
+    {
+        // "/agents/<agentType>/<variation>" holding the agent proxies
+        return outPlug()->childNamesPlug()->defaultValue();
+    }
+    else if( branchPath.size() == 3 && mergingMeshes() )
+    {
+        // "/agents/<agentType>/<variation>" holding merged meshes
+        std::vector<std::vector<ScenePath>> groups;
+        std::vector<ConstCompoundObjectPtr> groupAttributes;
+        mergedMeshGroups( branchPath, groups, groupAttributes );
+        InternedStringVectorDataPtr result = new InternedStringVectorData();
+        for( size_t i = 0; i < groups.size(); ++i )
+        {
+            result->writable().push_back( "merged" + std::to_string( i ) );
+        }
+        return result;
+    }
+    else if( branchPath.size() == 3 )
+    {
+        // "/agents/<agentType>/variation"
+        IECore::ConstCompoundDataPtr children = agentChildNames( parentPath, context );
+        auto variationsData = children->member<CompoundData>( branchPath[1] );
+        InternedStringVectorDataPtr result = new InternedStringVectorData();
+        if ( variationsData )
+        {
+            return variationsData->member<InternedStringVectorData>( branchPath.back() );
+        }
+        return result;
+    }
+	else if( branchPath.size() == 4 && mergingMeshes() )
+	{
+		// "/agents/<agentType>/<variation>/<mergedMesh>"
+		return outPlug()->childNamesPlug()->defaultValue();
+	}
+	else
+	{
+		// "/agents/<agentType>/<variation>/<id>/..."
+		AgentScope scope( context, branchPath );
+		return variationsPlug()->childNamesPlug()->getValue();
+	}
+}
+
+void AtomsCrowdGenerator::hashBranchSetNames( const ScenePath &parentPath, const Gaffer::Context *context, MurmurHash &h ) const
+{
+	h = variationsPlug()->setNamesPlug()->hash();
+}
+
+ConstInternedStringVectorDataPtr AtomsCrowdGenerator::computeBranchSetNames( const ScenePath &parentPath, const Gaffer::Context *context ) const
+{
+	return variationsPlug()->setNamesPlug()->getValue();
+}
+
+void AtomsCrowdGenerator::hashBranchSet( const ScenePath &parentPath, const InternedString &setName, const Gaffer::Context *context, MurmurHash &h ) const
+{
+	BranchCreator::hashBranchSet( parentPath, setName, context, h );
 
-                case IECore::TypeId::V3fVectorDataTypeId:
-                {
-                    auto data = runTimeCast<const V3fVectorData>( primIt->second.data );
-                    V3fDataPtr outData = new V3fData();
-                    outData->writable() = data->readable()[agentIdPointIndex];
-                    objMap[variableName] = outData;
-                    break;
-                }
+	h.append( variationsPlug()->childNamesHash( ScenePath() ) );
+	agentChildNamesHash( parentPath, context, h );
+	variationsPlug()->setPlug()->hash( h );
+	namePlug()->hash( h );
+	encapsulatePlug()->hash( h );
+	mergeMeshesPlug()->hash( h );
+	displayModePlug()->hash( h );
 
-                case IECore::TypeId::M44fVectorDataTypeId:
-                {
-                    auto data = runTimeCast<const M44fVectorData>( primIt->second.data );
-                    M44fDataPtr outData = new M44fData();
-                    outData->writable() = data->readable()[agentIdPointIndex];
-                    objMap[variableName] = outData;
-                    break;
-                }
+	if( mergingMeshes() )
+	{
+		// The membership of the meshes goes to the merged meshes holding them
+		IECore::ConstCompoundDataPtr instanceChildNames = agentChildNames( parentPath, context );
+		ScenePath variationPath( 3 );
+		for( const auto &agentType : instanceChildNames->readable() )
+		{
+			auto variationNamesData = runTimeCast<const CompoundData>( agentType.second.get() );
+			if ( !variationNamesData )
+				continue;
 
-                case IECore::TypeId::QuatfVectorDataTypeId:
-                {
-                    auto data = runTimeCast<const QuatfVectorData>( primIt->second.data );
-                    V3fDataPtr outData = new V3fData();
-                    auto quat = data->readable()[agentIdPointIndex];
-                    Imath::Eulerf euler;
-                    euler.extract(quat);
-                    outData->writable() = Imath::V3f(euler.x * 180.0 / M_PI, euler.y * 180.0 / M_PI, euler.z * 180.0 / M_PI);
-                    objMap[variableName] = outData;
-                    break;
-                }
+			variationPath[1] = agentType.first;
+			for( const auto &variation : variationNamesData->readable() )
+			{
+				variationPath[2] = variation.first;
+				mergedMeshGroupsHash( variationPath, h );
+			}
+		}
+	}
+}
 
-                default:
-                {
-                    IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "Unable to set " + primIt->first +
-                    " prim var of type: " +  primIt->second.data->typeName() );
-                    break;
-                }
-            }
-        }
+ConstPathMatcherDataPtr AtomsCrowdGenerator::computeBranchSet( const ScenePath &parentPath, const InternedString &setName, const Gaffer::Context *context ) const
+{
+	ConstInternedStringVectorDataPtr agentNames = variationsPlug()->childNames( ScenePath() );
+	IECore::ConstCompoundDataPtr instanceChildNames = agentChildNames( parentPath, context );
+	ConstPathMatcherDataPtr inputSet = variationsPlug()->setPlug()->getValue();
+
+	// Every variation in the set gets the paths of its agents
+	struct VariationSet
+	{
+		InternedString agentName;
+		InternedString variationName;
+		PathMatcher variationInstanceSet;
+		const std::vector<InternedString> *childNames;
+		PathMatcher agentsSet;
+	};
+
+	std::vector<VariationSet> variationSets;
+	std::vector<InternedString> agentPath( 1 );
+	for( const auto &agentName : agentNames->readable() )
+	{
+		auto variationNamesData = instanceChildNames->member<CompoundData>( agentName );
+		if ( !variationNamesData )
+			continue;
+
+		agentPath.back() = agentName;
+		PathMatcher instanceSet = inputSet->readable().subTree( agentPath );
+		if ( instanceSet.isEmpty() )
+			continue;
+
+		for( const auto &variation : variationNamesData->readable() )
+		{
+			auto childNamesData = runTimeCast<InternedStringVectorData>( variation.second );
+			if ( !childNamesData )
+				continue;
+
+			PathMatcher variationInstanceSet = instanceSet.subTree( variation.first );
+			if ( variationInstanceSet.isEmpty() )
+				continue;
 
-		return baseAttributes;
+			variationSets.push_back( { agentName, variation.first, variationInstanceSet, &childNamesData->readable(), PathMatcher() } );
+		}
 	}
-	else
+
+	PathMatcherDataPtr outputSetData = new PathMatcherData;
+	PathMatcher &outputSet = outputSetData->writable();
+	std::vector<InternedString> branchPath( 3 );
+	branchPath[0] = namePlug()->getValue();
+
+	// Neither the agents nor their meshes exist when the variations hold proxies or
+	// merged meshes, so their membership goes to the locations standing for them
+	if( proxyMode() || mergingMeshes() )
 	{
-		// "/agents/<agentName>/<id>/...
-		AgentScope scope( context, branchPath );
-        CompoundObjectPtr outAttributes = variationsPlug()->attributesPlug()->getValue()->copy();
-        // Remove the skin weights data
-        outAttributes->members().erase("jointIndexCount");
-        outAttributes->members().erase("jointIndices");
-        outAttributes->members().erase("jointWeights");
-        return outAttributes;
+		for( const auto &variationSet : variationSets )
+		{
+			branchPath[1] = variationSet.agentName;
+			branchPath[2] = variationSet.variationName;
+			if( proxyMode() )
+			{
+				outputSet.addPath( branchPath );
+				continue;
+			}
+
+			std::vector<std::vector<ScenePath>> groups;
+			std::vector<ConstCompoundObjectPtr> groupAttributes;
+			mergedMeshGroups( branchPath, groups, groupAttributes );
+			for( size_t i = 0; i < groups.size(); ++i )
+			{
+				for( const auto &meshPath : groups[i] )
+				{
+					if( variationSet.variationInstanceSet.match( meshPath ) & ( PathMatcher::ExactMatch | PathMatcher::AncestorMatch ) )
+					{
+						ScenePath mergedPath = branchPath;
+						mergedPath.push_back( "merged" + std::to_string( i ) );
+						outputSet.addPath( mergedPath );
+						break;
+					}
+				}
+			}
+		}
+
+		return outputSetData;
+	}
+
+	// The agents of a variation all reference the nodes of the same subtree,
+	// which PathMatcher::addPaths() shares rather than copying, and the
+	// variations are filled in parallel
+	tbb::task_group_context taskGroupContext( tbb::task_group_context::isolated );
+	tbb::parallel_for(
+		tbb::blocked_range<size_t>( 0, variationSets.size() ),
+		[&]( const tbb::blocked_range<size_t> &range )
+		{
+			std::vector<InternedString> instancePath( 1 );
+			for( size_t i = range.begin(); i != range.end(); ++i )
+			{
+				Canceller::check( context->canceller() );
+
+				VariationSet &variationSet = variationSets[i];
+				for( const auto &instanceChildName : *variationSet.childNames )
+				{
+					instancePath.back() = instanceChildName;
+					variationSet.agentsSet.addPaths( variationSet.variationInstanceSet, instancePath );
+				}
+			}
+		},
+		taskGroupContext
+	);
+
+	for( const auto &variationSet : variationSets )
+	{
+		branchPath[1] = variationSet.agentName;
+		branchPath[2] = variationSet.variationName;
+		outputSet.addPaths( variationSet.agentsSet, branchPath );
 	}
+
+	return outputSetData;
 }
 
-void AtomsCrowdGenerator::hashBranchObject( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
+IECore::ConstCompoundDataPtr AtomsCrowdGenerator::agentChildNames( const ScenePath &parentPath, const Gaffer::Context *context ) const
 {
-	if( branchPath.size() <= 4 )
+	ScenePlug::PathScope scope( context, parentPath );
+	return agentChildNamesPlug()->getValue();
+}
+
+void AtomsCrowdGenerator::agentChildNamesHash( const ScenePath &parentPath, const Gaffer::Context *context, IECore::MurmurHash &h ) const
+{
+	ScenePlug::PathScope scope( context, parentPath );
+	agentChildNamesPlug()->hash( h );
+}
+
+int AtomsCrowdGenerator::agentPointIndex( const ScenePath &parentPath, int agentId, const Gaffer::Context *context ) const
+{
+	ScenePlug::PathScope scope( context, parentPath );
+	ConstCompoundDataPtr table = agentIdToPointIndexPlug()->getValue();
+	return pointIndexFromTable( table.get(), agentId );
+}
+
+IECore::ConstCompoundObjectPtr AtomsCrowdGenerator::agentAttributes( const ScenePath &parentPath, const Gaffer::Context *context ) const
+{
+	ScenePlug::PathScope scope( context, parentPath );
+	return runTimeCast<const CompoundObject>( agentAttributesPlug()->getValue() );
+}
+
+void AtomsCrowdGenerator::agentContentHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, IECore::MurmurHash &h ) const
+{
+	ConstCompoundDataPtr agentHashes;
 	{
-		// "/" or "/agents" or "/agents/<agentType>" or "/agents/<agentType>/<variation> or "/agents/<agentType>/<variation>/<id>"
-		h = outPlug()->objectPlug()->defaultValue()->Object::hash();
+		ScenePlug::PathScope scope( context, parentPath );
+		agentHashes = agentHashesPlug()->getValue();
 	}
-	else
+
+	auto hashesData = agentHashes->member<const UInt64VectorData>( "hashes" );
+	const int pointIndex = hashesData ? agentPointIndex( parentPath, std::atoi( branchPath[3].c_str() ), context ) : -1;
+	if( pointIndex >= 0 && (size_t)pointIndex * 2 + 1 < hashesData->readable().size() )
 	{
-		// "/agents/<agentType>/<variation>/<id>/...
-        clothCachePlug()->objectPlug()->hash( h );
-        AgentScope instanceScope( context, branchPath );
-        variationsPlug()->objectPlug()->hash( h );
-        inPlug()->attributesPlug()->hash( h );
-        inPlug()->objectPlug()->hash( h );
-		atomsPoseHash( parentPath, branchPath, context, h );
+		h.append( hashesData->readable()[pointIndex * 2] );
+		h.append( hashesData->readable()[pointIndex * 2 + 1] );
+		return;
 	}
+
+	// The agent isn't held by a point, so it can only be identified by the whole crowd
+	ScenePlug::PathScope scope( context, parentPath );
+	inPlug()->objectPlug()->hash( h );
+	inPlug()->attributesPlug()->hash( h );
 }
 
-ConstObjectPtr AtomsCrowdGenerator::computeBranchObject( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
+AtomsCrowdGenerator::ScenePath AtomsCrowdGenerator::poseRepresentative( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
 {
-	if( branchPath.size() <= 4 )
+	ConstCompoundDataPtr clusters;
 	{
-		// "/" or "/agents" or "/agents/<agentName>"
-		return outPlug()->objectPlug()->defaultValue();
+		ScenePlug::PathScope scope( context, parentPath );
+		clusters = poseClustersPlug()->getValue();
 	}
 
-    ConstPointsPrimitivePtr points;
-    CompoundData pointVariables;
-    int currentAgentIndex = std::atoi( branchPath[3].string().c_str() );
+	auto representativesData = clusters->member<const IntVectorData>( "representatives" );
+	if( !representativesData )
+	{
+		return branchPath;
+	}
 
-    int agentIdPointIndex = -1;
-    auto& pointVariablesData = pointVariables.writable();
-    {
-        ScenePlug::PathScope scope(context, parentPath);
-        points = runTimeCast<const PointsPrimitive>(inPlug()->objectPlug()->getValue());
-    }
+	const int pointIndex = agentPointIndex( parentPath, std::atoi( branchPath[3].c_str() ), context );
+	const auto &representatives = representativesData->readable();
+	if( pointIndex < 0 || pointIndex >= (int)representatives.size() || representatives[pointIndex] < 0 )
+	{
+		return branchPath;
+	}
 
-    if ( !points )
-    {
-        IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "No input point clound found" );
-        return variationsPlug()->objectPlug()->getValue();
-    }
+	ScenePath result = branchPath;
+	result[3] = std::to_string( representatives[pointIndex] );
+	return result;
+}
 
-    const auto agentId = points->variables.find( "atoms:agentId" );
-    if ( agentId == points->variables.end() )
-    {
-        throw InvalidArgumentException(
-                "AtomsAttributes : Input must be a PointsPrimitive containing an \"atoms:agentId\" vertex variable" );
-    }
+AtomsCrowdGenerator::AgentScope::AgentScope( const Gaffer::Context *context, const ScenePath &branchPath )
+	:	EditableScope( context )
+{
+	ScenePath agentPath;
+	agentPath.reserve( 1 + ( branchPath.size() > 4 ? branchPath.size() - 4 : 0 ) );
+    if( branchPath.size() > 1 )
+	    agentPath.push_back( branchPath[1] );
+    if( branchPath.size() > 2 )
+        agentPath.push_back( branchPath[2] );
+	if( branchPath.size() > 4 )
+	{
+		agentPath.insert( agentPath.end(), branchPath.begin() + 4, branchPath.end() );
+	}
 
-    auto agentIdData = runTimeCast<const IntVectorData>( agentId->second.data );
-    if ( !agentIdData ) {
-        throw InvalidArgumentException(
-                "AtomsAttributes : Input must be a PointsPrimitive containing an \"atoms:agentId\" vertex variable" );
-    }
+	set( ScenePlug::scenePathContextName, agentPath );
+}
 
+int AtomsCrowdGenerator::rigidJoint( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
+{
+	// Cloth meshes are always deformed, and so are all the meshes when they need velocities
+	if( velocityPlug()->getValue() || agentClothMeshData( parentPath, branchPath ) )
+	{
+		return -1;
+	}
 
-    // Get the point id that contain the agent data
-    // We need this only to get blend shapes weights information
-    std::vector<int> agentIdVec = agentIdData->readable();
+	AgentScope scope( context, branchPath );
+	ConstCompoundObjectPtr attributes = variationsPlug()->attributesPlug()->getValue();
+	auto jointData = attributes->member<const IntData>( "rigidJointIndex" );
+	if( !jointData )
+	{
+		return -1;
+	}
 
-    for ( size_t i = 0; i < agentIdVec.size(); ++i )
-    {
-        if ( agentIdVec[i] == currentAgentIndex )
-        {
-            agentIdPointIndex = i;
-            break;
-        }
-    }
+	// Transforming a location would move its children as well
+	if( !variationsPlug()->childNamesPlug()->getValue()->readable().empty() )
+	{
+		return -1;
+	}
 
-    for ( auto it = points->variables.cbegin(); it != points->variables.cend(); ++it )
-    {
-        size_t atomsIndex = it->first.find("atoms:");
-        if ( atomsIndex == 0 )
-        {
-            pointVariablesData[it->first.substr( atomsIndex + 6,
-                                                it->first.size() - 6 )] = it->second.data;
-        }
-    }
+	return jointData->readable();
+}
 
-    // Extract cloth data
-    auto cloth = agentClothMeshData( parentPath, branchPath );
-    Imath::M44f rootMatrix = agentRootMatrix( parentPath, branchPath, context );
+void AtomsCrowdGenerator::rigidJointHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
+{
+	velocityPlug()->hash( h );
+	clothCachePlug()->objectPlug()->hash( h );
+	AgentScope scope( context, branchPath );
+	variationsPlug()->attributesPlug()->hash( h );
+	variationsPlug()->childNamesPlug()->hash( h );
+}
 
-    // "/agents/<agentType>/<variation>/<id>/...
-    AgentScope scope( context, branchPath );
-    auto meshPrim = runTimeCast<const MeshPrimitive>( variationsPlug()->objectPlug()->getValue() );
-    auto meshAttributes = runTimeCast<const CompoundObject>( variationsPlug()->attributesPlug()->getValue() );
-    if ( !meshPrim || !meshAttributes )
-    {
-        return variationsPlug()->objectPlug()->getValue();
-    }
+size_t AtomsCrowdGenerator::capsuleDepth() const
+{
+	const int encapsulate = encapsulatePlug()->getValue();
+	return encapsulate > 0 ? encapsulate + 1 : 0;
+}
 
-    auto agentData = agentCacheData( branchPath );
-    auto metadataData = agentData->member<const CompoundData>( "metadata" );
+bool AtomsCrowdGenerator::mergingMeshes() const
+{
+	// The capsules output the agents themselves, so they take precedence
+	return mergeMeshesPlug()->getValue() && !capsuleDepth() && !proxyMode();
+}
 
-    // Extract the pose matricies. Every matrix must be worldBindPoseInverseMatrix * worldMatrix * rootMatrixInverse
-    auto poseData = agentData->member<const M44dVectorData>( "poseWorldMatrices" );
-    if ( !poseData )
-    {
+Imath::Box3f AtomsCrowdGenerator::containerBound( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
+{
+	ConstCompoundDataPtr bounds;
+	{
+		ScenePlug::PathScope scope( context, parentPath );
+		bounds = containerBoundsPlug()->getValue();
+	}
 
-        IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "No poseWorldMatrices found" );
-        return variationsPlug()->objectPlug()->getValue();
-    }
+	const Box3fData *bound = nullptr;
+	if( branchPath.size() < 2 )
+	{
+		// "/" or "/agents"
+		bound = bounds->member<const Box3fData>( "bound" );
+	}
+	else if( branchPath.size() == 2 )
+	{
+		// "/agents/<agentType>"
+		if( auto typeBounds = bounds->member<const CompoundData>( "types" ) )
+		{
+			bound = typeBounds->member<const Box3fData>( branchPath[1] );
+		}
+	}
+	else if( auto variationBounds = bounds->member<const CompoundData>( "variations" ) )
+	{
+		// "/agents/<agentType>/<variation>"
+		if( auto typeVariationBounds = variationBounds->member<const CompoundData>( branchPath[1] ) )
+		{
+			bound = typeVariationBounds->member<const Box3fData>( branchPath[2] );
+		}
+	}
 
-    auto poseNormalData = agentData->member<const M44dVectorData>( "poseNormalWorldMatrices" );
-    if ( !poseNormalData )
-    {
-        IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "No poseNormalWorldMatrices found" );
-        return variationsPlug()->objectPlug()->getValue();
-    }
-    auto& worldMatrices = poseData->readable();
-    auto& worldNormalMatrices = poseNormalData->readable();
-    if ( worldMatrices.empty() || worldNormalMatrices.empty() )
-    {
-        IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "Empty poseWorldMatrices or poseNormalWorldMatrices attribute" );
-        return variationsPlug()->objectPlug()->getValue();
-    }
+	return bound ? bound->readable() : Imath::Box3f();
+}
+
+void AtomsCrowdGenerator::containerBoundHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
+{
+	{
+		ScenePlug::PathScope scope( context, parentPath );
+		containerBoundsPlug()->hash( h );
+	}
+
+	const size_t depth = std::min( branchPath.size(), (size_t)3 );
+	h.append( (uint64_t)depth );
+	for( size_t i = 1; i < depth; ++i )
+	{
+		h.append( branchPath[i] );
+	}
+}
+
+std::vector<AtomsCrowdGenerator::ScenePath> AtomsCrowdGenerator::locationAgents( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
+{
+	std::vector<ScenePath> result;
+	IECore::ConstCompoundDataPtr children = agentChildNames( parentPath, context );
+	auto variationsData = children->member<CompoundData>( branchPath[1] );
+	if( !variationsData )
+	{
+		return result;
+	}
+
+	for( const auto &variation : variationsData->readable() )
+	{
+		if( branchPath.size() > 2 && variation.first != branchPath[2] )
+		{
+			continue;
+		}
+
+		auto agentNames = runTimeCast<const InternedStringVectorData>( variation.second.get() );
+		if( !agentNames )
+		{
+			continue;
+		}
+
+		for( const auto &agent : agentNames->readable() )
+		{
+			result.push_back( { branchPath[0], branchPath[1], variation.first, agent } );
+		}
+	}
+	return result;
+}
+
+void AtomsCrowdGenerator::mergedMeshGroups( const ScenePath &branchPath, std::vector<std::vector<ScenePath>> &groups, std::vector<ConstCompoundObjectPtr> &groupAttributes ) const
+{
+	const bool byAttributes = mergeMeshesPlug()->getValue() == 2;
+	std::vector<MurmurHash> groupHashes;
+
+	// Visit the locations of the variation depth first, so the meshes are merged
+	// in the order of the hierarchy
+	ScenePath variationPath( { branchPath[1], branchPath[2] } );
+	std::vector<ScenePath> toVisit( 1 );
+	while( !toVisit.empty() )
+	{
+		const ScenePath relativePath = toVisit.back();
+		toVisit.pop_back();
 
+		ScenePath path = variationPath;
+		path.insert( path.end(), relativePath.begin(), relativePath.end() );
 
-    MeshPrimitivePtr result = meshPrim->copy();
+		if( !relativePath.empty() && runTimeCast<const MeshPrimitive>( variationsPlug()->object( path ).get() ) )
+		{
+			size_t groupIndex = 0;
+			if( byAttributes )
+			{
+				// The skin data isn't output, so it doesn't split the groups
+				CompoundObjectPtr attributes = variationsPlug()->attributes( path )->copy();
+				attributes->members().erase( "jointIndexCount" );
+				attributes->members().erase( "jointIndices" );
+				attributes->members().erase( "jointWeights" );
+				attributes->members().erase( "jointBounds" );
+				attributes->members().erase( "rigidJointIndex" );
+
+				const MurmurHash attributesHash = attributes->Object::hash();
+				groupIndex = std::find( groupHashes.begin(), groupHashes.end(), attributesHash ) - groupHashes.begin();
+				if( groupIndex == groupHashes.size() )
+				{
+					groupHashes.push_back( attributesHash );
+					groupAttributes.push_back( attributes );
+					groups.emplace_back();
+				}
+			}
+			else if( groups.empty() )
+			{
+				groupAttributes.push_back( outPlug()->attributesPlug()->defaultValue() );
+				groups.emplace_back();
+			}
 
-    auto pVarIt = result->variables.find( "P" );
-    if ( pVarIt == result->variables.end() )
-    {
-        IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "No P variable found" );
-        return variationsPlug()->objectPlug()->getValue();
-    }
+			groups[groupIndex].push_back( relativePath );
+		}
 
-    if ( cloth )
-    {
-        // Check the cloth stack order
-        std::string stackOrder = "last";
-        auto& clothData = cloth->readable();
-        auto clothIt = clothData.find( "stackOrder" );
-        if ( clothIt != clothData.cend() )
-        {
-            auto clothStackOrderData = runTimeCast<StringData>( clothIt->second );
-            if ( clothStackOrderData )
-            {
-                stackOrder = clothStackOrderData->readable();
-            }
-        }
+		ConstInternedStringVectorDataPtr childNames = variationsPlug()->childNames( path );
+		for( auto it = childNames->readable().rbegin(); it != childNames->readable().rend(); ++it )
+		{
+			toVisit.push_back( relativePath );
+			toVisit.back().push_back( *it );
+		}
+	}
+}
 
-        // If the stack order is "first" then it contains transformation in T pose,
-        // so the root matrix should be null
-        if ( stackOrder == "first" )
-        {
-            rootMatrix = Imath::M44f();
-        }
+void AtomsCrowdGenerator::mergedMeshGroupsHash( const ScenePath &branchPath, MurmurHash &h ) const
+{
+	mergeMeshesPlug()->hash( h );
 
-        // Apply the cloth deformation
-        if ( !applyClothDeformer( branchPath, result, cloth, rootMatrix ) )
-        {
-            return variationsPlug()->objectPlug()->getValue();
-        }
+	ScenePath variationPath( { branchPath[1], branchPath[2] } );
+	std::vector<ScenePath> toVisit( 1, variationPath );
+	while( !toVisit.empty() )
+	{
+		const ScenePath path = toVisit.back();
+		toVisit.pop_back();
+
+		h.append( variationsPlug()->objectHash( path ) );
+		h.append( variationsPlug()->attributesHash( path ) );
+		ConstInternedStringVectorDataPtr childNames = variationsPlug()->childNames( path );
+		h.append( childNames->Object::hash() );
+		for( auto it = childNames->readable().rbegin(); it != childNames->readable().rend(); ++it )
+		{
+			toVisit.push_back( path );
+			toVisit.back().push_back( *it );
+		}
+	}
+}
 
-        if ( stackOrder == "first" )
-        {
-            // It's a first stack order mesh, so apply the skinning
-            applySkinDeformer( branchPath, result, meshPrim, meshAttributes, worldMatrices );
-        }
-    }
-    else
-    {
-        // Apply blend shapes
-        applyBlendShapesDeformer( branchPath, result, metadataData, pointVariablesData, agentIdPointIndex );
-        // Apply skinning
-        applySkinDeformer( branchPath, result, meshPrim, meshAttributes, worldMatrices );
-    }
+void AtomsCrowdGenerator::mergedMeshHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
+{
+	std::vector<std::vector<ScenePath>> groups;
+	std::vector<ConstCompoundObjectPtr> groupAttributes;
+	mergedMeshGroups( branchPath, groups, groupAttributes );
+	mergedMeshGroupsHash( branchPath, h );
+	h.append( branchPath.back() );
+
+	const int groupIndex = mergedMeshGroupIndex( branchPath.back() );
+	if( groupIndex < 0 || groupIndex >= (int)groups.size() )
+	{
+		return;
+	}
 
-    return result;
+	// Hash the meshes of every agent in parallel, and combine them in order
+	const std::vector<ScenePath> agents = locationAgents( parentPath, ScenePath( branchPath.begin(), branchPath.begin() + 3 ), context );
+	const std::vector<ScenePath> &meshPaths = groups[groupIndex];
+	std::vector<MurmurHash> agentHashes( agents.size() );
+	parallelForEachMesh(
+		agents.size(),
+		[&]( size_t i )
+		{
+			// The agent locations don't exist when merging, so the agent transform
+			// is hashed here rather than by hashBranchTransform()
+			agentContentHash( parentPath, agents[i], context, agentHashes[i] );
+			agentHashes[i].append( agents[i][3] );
+
+			for( const auto &meshPath : meshPaths )
+			{
+				ScenePath path = agents[i];
+				path.insert( path.end(), meshPath.begin(), meshPath.end() );
+				for( size_t depth = 5; depth <= path.size(); ++depth )
+				{
+					const ScenePath locationPath( path.begin(), path.begin() + depth );
+					ScenePath fullPath = parentPath;
+					fullPath.insert( fullPath.end(), locationPath.begin(), locationPath.end() );
+					ScenePlug::PathScope scope( context, fullPath );
+					hashBranchTransform( parentPath, locationPath, Context::current(), agentHashes[i] );
+				}
+
+				ScenePath fullPath = parentPath;
+				fullPath.insert( fullPath.end(), path.begin(), path.end() );
+				ScenePlug::PathScope scope( context, fullPath );
+				hashBranchObject( parentPath, path, Context::current(), agentHashes[i] );
+			}
+		}
+	);
+
+	for( const auto &agentHash : agentHashes )
+	{
+		h.append( agentHash );
+	}
 }
 
-void AtomsCrowdGenerator::hashBranchChildNames( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
+IECore::ConstObjectPtr AtomsCrowdGenerator::mergedMesh( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
 {
-	if( branchPath.empty() )
+	std::vector<std::vector<ScenePath>> groups;
+	std::vector<ConstCompoundObjectPtr> groupAttributes;
+	mergedMeshGroups( branchPath, groups, groupAttributes );
+	const int groupIndex = mergedMeshGroupIndex( branchPath.back() );
+	if( groupIndex < 0 || groupIndex >= (int)groups.size() )
 	{
-		// "/"
-		BranchCreator::hashBranchChildNames( parentPath, branchPath, context, h );
-		namePlug()->hash( h );
+		return outPlug()->objectPlug()->defaultValue();
 	}
-	else if( branchPath.size() == 1 )
+
+	// Deform the meshes of every agent in parallel, and find where they sit in the variation
+	const std::vector<ScenePath> agents = locationAgents( parentPath, ScenePath( branchPath.begin(), branchPath.begin() + 3 ), context );
+	const std::vector<ScenePath> &meshPaths = groups[groupIndex];
+	const size_t numMeshes = agents.size() * meshPaths.size();
+	std::vector<ConstMeshPrimitivePtr> meshes( numMeshes );
+	std::vector<Imath::M44f> matrices( numMeshes );
+	std::vector<int> agentIds( numMeshes );
+	parallelForEachMesh(
+		numMeshes,
+		[&]( size_t i )
+		{
+			Canceller::check( context->canceller() );
+
+			const ScenePath &agentPath = agents[i / meshPaths.size()];
+			const ScenePath &meshPath = meshPaths[i % meshPaths.size()];
+			ScenePath path = agentPath;
+			path.insert( path.end(), meshPath.begin(), meshPath.end() );
+
+			matrices[i] = agentRootMatrix( parentPath, agentPath, context );
+			for( size_t depth = 5; depth <= path.size(); ++depth )
+			{
+				const ScenePath locationPath( path.begin(), path.begin() + depth );
+				ScenePath fullPath = parentPath;
+				fullPath.insert( fullPath.end(), locationPath.begin(), locationPath.end() );
+				ScenePlug::PathScope scope( context, fullPath );
+				matrices[i] = computeBranchTransform( parentPath, locationPath, Context::current() ) * matrices[i];
+			}
+
+			ScenePath fullPath = parentPath;
+			fullPath.insert( fullPath.end(), path.begin(), path.end() );
+			ScenePlug::PathScope scope( context, fullPath );
+			meshes[i] = runTimeCast<const MeshPrimitive>( computeBranchObject( parentPath, path, Context::current() ) );
+			agentIds[i] = std::atoi( agentPath[3].c_str() );
+		}
+	);
+
+	// Skip anything that didn't come out as a mesh
+	size_t numMerged = 0;
+	for( size_t i = 0; i < numMeshes; ++i )
 	{
-		// "/agents"
-        BranchCreator::hashBranchChildNames( parentPath, branchPath, context, h );
-        agentChildNamesHash( parentPath, context, h );
-        h.append( branchPath.back() );
+		if( meshes[i] )
+		{
+			meshes[numMerged] = meshes[i];
+			matrices[numMerged] = matrices[i];
+			agentIds[numMerged] = agentIds[i];
+			++numMerged;
+		}
 	}
-	else if( branchPath.size() <= 3 )
+	meshes.resize( numMerged );
+	matrices.resize( numMerged );
+	agentIds.resize( numMerged );
+
+	if( meshes.empty() )
 	{
-		// "/agents/<agentType>" or "/agents/<agentType>/<variation>"
-		BranchCreator::hashBranchChildNames( parentPath, branchPath, context, h );
-		agentChildNamesHash( parentPath, context, h );
-		h.append( branchPath.back() );
+		return outPlug()->objectPlug()->defaultValue();
 	}
-	else
+
+	return mergeAgentMeshes( meshes, matrices, agentIds );
+}
+
+int AtomsCrowdGenerator::proxyMode() const
+{
+	// The capsules output the agents themselves, so they take precedence
+	return capsuleDepth() ? 0 : displayModePlug()->getValue();
+}
+
+void AtomsCrowdGenerator::agentProxiesHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
+{
+	const int mode = proxyMode();
+	h.append( mode );
+	h.append( branchPath[1] );
+	h.append( branchPath[2] );
+
+	// Only the agents of this variation contribute to the proxies
+	for( const auto &agent : locationAgents( parentPath, branchPath, context ) )
 	{
-		// "/agents/<agentName>/<id>/..."
-		AgentScope scope( context, branchPath );
-		h = variationsPlug()->childNamesPlug()->hash();
+		h.append( agent[3] );
+		agentContentHash( parentPath, agent, context, h );
+	}
+
+	if( mode == 1 )
+	{
+		boundingBoxPaddingPlug()->hash( h );
+		clothCachePlug()->objectPlug()->hash( h );
+		ScenePlug::PathScope scope( context, parentPath );
+		jointBoundsPlug()->hash( h );
 	}
 }
 
-ConstInternedStringVectorDataPtr AtomsCrowdGenerator::computeBranchChildNames( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
+IECore::ConstObjectPtr AtomsCrowdGenerator::agentProxies( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context ) const
 {
+	const int mode = proxyMode();
+	const std::vector<ScenePath> agents = locationAgents( parentPath, branchPath, context );
+	if( agents.empty() )
+	{
+		return outPlug()->objectPlug()->defaultValue();
+	}
 
-	if( branchPath.empty() )
+	ConstCompoundObjectPtr crowd;
 	{
-		// "/"
-		std::string name = namePlug()->getValue();
-		if( name.empty() )
+		ScenePlug::PathScope scope( context, parentPath );
+		crowd = inPlug()->attributesPlug()->getValue();
+	}
+
+	auto atomsData = crowd->member<const BlindDataHolder>( "atoms:agents" );
+	if( !atomsData || !atomsData->blindData() )
+	{
+		throw InvalidArgumentException( "AtomsCrowdGenerator : agentProxies : No agents data found." );
+	}
+	const CompoundData *agentsData = atomsData->blindData();
+
+	// Gather the agents and count the elements they output, so the proxies
+	// can then be filled in parallel straight into their final place
+	const size_t numAgents = agents.size();
+	std::vector<ConstCompoundDataPtr> agentData( numAgents );
+	std::vector<Imath::M44f> rootMatrices( numAgents );
+	std::vector<Imath::Box3f> bounds( mode == 1 ? numAgents : 0 );
+	std::vector<size_t> offsets( numAgents + 1, 0 );
+	parallelForEachMesh(
+		numAgents,
+		[&]( size_t i )
 		{
-            throw InvalidArgumentException( "AtomsCrowdGenerator : Input name attribute is empty" );
+			Canceller::check( context->canceller() );
+			Context::Scope scope( context );
+
+			agentData[i] = AtomsAgentPager::instance().agentData( agentsData, agents[i][3].string() );
+			if( !agentData[i] )
+			{
+				throw InvalidArgumentException( "AtomsCrowdGenerator : agentProxies : No agent found." );
+			}
+
+			if( auto rootData = agentData[i]->member<const M44dData>( "rootMatrix" ) )
+			{
+				rootMatrices[i] = Imath::M44f( rootData->readable() );
+			}
+
+			if( mode == 1 )
+			{
+				bounds[i] = agentBound( parentPath, agents[i], context );
+				offsets[i + 1] = bounds[i].isEmpty() ? 0 : 1;
+			}
+			else if( mode == 2 )
+			{
+				// One line per joint linked to a valid parent
+				auto parentsData = agentData[i]->member<const IntVectorData>( "jointParents" );
+				auto positionsData = agentData[i]->member<const V3fVectorData>( "jointPositions" );
+				if( parentsData && positionsData && parentsData->readable().size() == positionsData->readable().size() )
+				{
+					const int numJoints = parentsData->readable().size();
+					offsets[i + 1] = std::count_if(
+						parentsData->readable().begin(), parentsData->readable().end(),
+						[numJoints]( int parent ) { return parent >= 0 && parent < numJoints; }
+					);
+				}
+			}
+			else
+			{
+				offsets[i + 1] = 1;
+			}
 		}
-		InternedStringVectorDataPtr result = new InternedStringVectorData();
-		result->writable().emplace_back( name );
-        return result;
-	}
-	else if( branchPath.size() == 1 )
+	);
+
+	for( size_t i = 0; i < numAgents; ++i )
 	{
-		// "/agents"
-        IECore::ConstCompoundDataPtr children = agentChildNames( parentPath, context );
-        auto& varData = children->readable();
-        InternedStringVectorDataPtr result = new InternedStringVectorData();
-        auto& names = result->writable();
-        for ( auto it = varData.cbegin(); it != varData.cend(); ++it )
-        {
-            names.push_back( it->first );
-        }
-        return result;
+		offsets[i + 1] += offsets[i];
 	}
+	const size_t numElements = offsets.back();
 
-	else if( branchPath.size() == 2 )
+	IntVectorDataPtr agentIdData = new IntVectorData;
+	auto &agentIds = agentIdData->writable();
+	V3fVectorDataPtr pData = new V3fVectorData;
+	auto &p = pData->writable();
+	pData->setInterpretation( GeometricData::Point );
+
+	if( mode == 1 )
 	{
-		// "/agents/<agentType>"
-		IECore::ConstCompoundDataPtr children = agentChildNames( parentPath, context );
+		// A box mesh oriented like every agent, the corners indexed by their
+		// x, y and z bits and the faces wound outwards
+		static const int boxFaces[6][4] = {
+			{ 0, 4, 6, 2 }, { 1, 3, 7, 5 }, { 0, 1, 5, 4 },
+			{ 2, 6, 7, 3 }, { 0, 2, 3, 1 }, { 4, 5, 7, 6 }
+		};
+
+		IntVectorDataPtr verticesPerFaceData = new IntVectorData;
+		IntVectorDataPtr vertexIdsData = new IntVectorData;
+		auto &verticesPerFace = verticesPerFaceData->writable();
+		auto &vertexIds = vertexIdsData->writable();
+		verticesPerFace.resize( numElements * 6, 4 );
+		vertexIds.resize( numElements * 24 );
+		p.resize( numElements * 8 );
+		agentIds.resize( numElements * 6 );
+
+		parallelForEachMesh(
+			numAgents,
+			[&]( size_t i )
+			{
+				if( offsets[i + 1] == offsets[i] )
+				{
+					return;
+				}
+
+				const size_t box = offsets[i];
+				const Imath::Box3f &bound = bounds[i];
+				for( int corner = 0; corner < 8; ++corner )
+				{
+					const Imath::V3f position(
+						corner & 1 ? bound.max.x : bound.min.x,
+						corner & 2 ? bound.max.y : bound.min.y,
+						corner & 4 ? bound.max.z : bound.min.z
+					);
+					p[box * 8 + corner] = position * rootMatrices[i];
+				}
+
+				const int agentId = std::atoi( agents[i][3].c_str() );
+				for( int face = 0; face < 6; ++face )
+				{
+					for( int vertex = 0; vertex < 4; ++vertex )
+					{
+						vertexIds[box * 24 + face * 4 + vertex] = box * 8 + boxFaces[face][vertex];
+					}
+					agentIds[box * 6 + face] = agentId;
+				}
+			}
+		);
 
-		auto variationsData = children->member<CompoundData>( branchPath.back() );
-        InternedStringVectorDataPtr result = new InternedStringVectorData();
+		MeshPrimitivePtr result = new MeshPrimitive( verticesPerFaceData, vertexIdsData, "linear", pData );
+		result->variables["atoms:agentId"] = PrimitiveVariable( PrimitiveVariable::Uniform, agentIdData );
+		return result;
+	}
+	else if( mode == 2 )
+	{
+		IntVectorDataPtr verticesPerCurveData = new IntVectorData;
+		verticesPerCurveData->writable().resize( numElements, 2 );
+		p.resize( numElements * 2 );
+		agentIds.resize( numElements );
+
+		parallelForEachMesh(
+			numAgents,
+			[&]( size_t i )
+			{
+				if( offsets[i + 1] == offsets[i] )
+				{
+					return;
+				}
+
+				const auto &parents = agentData[i]->member<const IntVectorData>( "jointParents" )->readable();
+				const auto &positions = agentData[i]->member<const V3fVectorData>( "jointPositions" )->readable();
+				const int agentId = std::atoi( agents[i][3].c_str() );
+				size_t line = offsets[i];
+				for( size_t joint = 0; joint < parents.size(); ++joint )
+				{
+					// Roots and corrupt parents are skipped, as when counting the lines
+					if( parents[joint] < 0 || parents[joint] >= (int)positions.size() )
+					{
+						continue;
+					}
+
+					p[line * 2] = positions[parents[joint]] * rootMatrices[i];
+					p[line * 2 + 1] = positions[joint] * rootMatrices[i];
+					agentIds[line] = agentId;
+					++line;
+				}
+			}
+		);
 
-        auto& names = result->writable();
-        if ( variationsData )
-        {
-            auto& varData = variationsData->readable();
-            for (auto it = varData.cbegin(); it != varData.cend(); ++it)
-            {
-                names.push_back(it->first);
-            }
-        }
-        return result;
+		CurvesPrimitivePtr result = new CurvesPrimitive( verticesPerCurveData, CubicBasisf::linear(), false, pData );
+		result->variables["atoms:agentId"] = PrimitiveVariable( PrimitiveVariable::Uniform, agentIdData );
+		return result;
 	}
-    else if( branchPath.size() == 3 )
-    {
-        // "/agents/<agentType>/variation"
-        IECore::ConstCompoundDataPtr children = agentChildNames( parentPath, context );
-        auto variationsData = children->member<CompoundData>( branchPath[1] );
-        InternedStringVectorDataPtr result = new InternedStringVectorData();
-        if ( variationsData )
-        {
-            return variationsData->member<InternedStringVectorData>( branchPath.back() );
-        }
-        return result;
-    }
 	else
 	{
-		// "/agents/<agentType>/<variation>/<id>/..."
-		AgentScope scope( context, branchPath );
-		return variationsPlug()->childNamesPlug()->getValue();
+		p.resize( numElements );
+		agentIds.resize( numElements );
+		parallelForEachMesh(
+			numAgents,
+			[&]( size_t i )
+			{
+				p[i] = rootMatrices[i].translation();
+				agentIds[i] = std::atoi( agents[i][3].c_str() );
+			}
+		);
+
+		PointsPrimitivePtr result = new PointsPrimitive( pData );
+		result->variables["atoms:agentId"] = PrimitiveVariable( PrimitiveVariable::Vertex, agentIdData );
+		return result;
 	}
 }
 
-void AtomsCrowdGenerator::hashBranchSetNames( const ScenePath &parentPath, const Gaffer::Context *context, MurmurHash &h ) const
+void AtomsCrowdGenerator::renderCapsule( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, IECoreScenePreview::Renderer *renderer ) const
 {
-	h = variationsPlug()->setNamesPlug()->hash();
-}
+	Context::Scope scope( context );
 
-ConstInternedStringVectorDataPtr AtomsCrowdGenerator::computeBranchSetNames( const ScenePath &parentPath, const Gaffer::Context *context ) const
-{
-	return variationsPlug()->setNamesPlug()->getValue();
-}
+	// The objects output by a procedural don't inherit the attributes of its location,
+	// so they start from the full attributes of the capsule location
+	ScenePath capsulePath = parentPath;
+	capsulePath.insert( capsulePath.end(), branchPath.begin(), branchPath.end() );
+	ConstCompoundObjectPtr capsuleAttributes = outPlug()->fullAttributes( capsulePath );
 
-void AtomsCrowdGenerator::hashBranchSet( const ScenePath &parentPath, const InternedString &setName, const Gaffer::Context *context, MurmurHash &h ) const
-{
-	BranchCreator::hashBranchSet( parentPath, setName, context, h );
+	const std::vector<ScenePath> agents = locationAgents( parentPath, branchPath, context );
 
-	h.append( variationsPlug()->childNamesHash( ScenePath() ) );
-	agentChildNamesHash( parentPath, context, h );
-	variationsPlug()->setPlug()->hash( h );
-	namePlug()->hash( h );
+	// The agents don't exist in the scene the renderer is given, so the capsule
+	// outputs their deformation and transform blur itself
+	Imath::V2f shutter( -0.25f, 0.25f );
+	bool deformationBlur = false;
+	bool transformBlur = false;
+	{
+		ScenePlug::GlobalScope globalScope( context );
+		ConstCompoundObjectPtr globals = outPlug()->globalsPlug()->getValue();
+		auto deformationBlurData = globals->member<const BoolData>( "option:render:deformationBlur" );
+		deformationBlur = deformationBlurData && deformationBlurData->readable();
+		auto transformBlurData = globals->member<const BoolData>( "option:render:transformBlur" );
+		transformBlur = transformBlurData && transformBlurData->readable();
+		if( auto shutterData = globals->member<const V2fData>( "option:render:shutter" ) )
+		{
+			shutter = shutterData->readable();
+		}
+	}
+
+	// The variation attributes are shared by all their agents
+	std::map<InternedString, ConstCompoundObjectPtr> variationAttributes;
+	for( const auto &agentPath : agents )
+	{
+		ConstCompoundObjectPtr &attributes = variationAttributes[agentPath[2]];
+		if( attributes )
+		{
+			continue;
+		}
+
+		if( branchPath.size() > 2 )
+		{
+			attributes = capsuleAttributes;
+			continue;
+		}
+
+		const ScenePath variationPath( agentPath.begin(), agentPath.begin() + 3 );
+		CompoundObjectPtr merged = new CompoundObject;
+		merged->members() = capsuleAttributes->members();
+		for( const auto &attribute : computeBranchAttributes( parentPath, variationPath, context )->members() )
+		{
+			merged->members()[attribute.first] = attribute.second;
+		}
+		attributes = merged;
+	}
+
+	// The objects are output relative to the capsule
+	const std::vector<Imath::M44f> capsuleTransforms( 1, Imath::M44f() );
+	const std::vector<float> capsuleTimes( 1, context->getFrame() );
+
+	// Every agent is deformed and output by its own task, without going
+	// through the hash and the cache of the scene locations. The agent runs
+	// isolated, so a thread waiting on the tasks spawned while deforming
+	// its meshes can't start another agent in the middle of it.
+	tbb::task_group_context taskGroupContext( tbb::task_group_context::isolated );
+	tbb::parallel_for(
+		tbb::blocked_range<size_t>( 0, agents.size() ),
+		[&]( const tbb::blocked_range<size_t> &range )
+		{
+			for( size_t i = range.begin(); i != range.end(); ++i )
+			{
+				tbb::this_task_arena::isolate(
+					[&]
+					{
+						renderCapsuleLocation(
+							parentPath, agents[i], variationAttributes.at( agents[i][2] ).get(), capsuleTransforms, capsuleTimes,
+							deformationBlur ? &shutter : nullptr, transformBlur ? &shutter : nullptr, context, renderer
+						);
+					}
+				);
+			}
+		},
+		taskGroupContext
+	);
 }
 
-ConstPathMatcherDataPtr AtomsCrowdGenerator::computeBranchSet( const ScenePath &parentPath, const InternedString &setName, const Gaffer::Context *context ) const
+void AtomsCrowdGenerator::renderCapsuleLocation(
+	const ScenePath &parentPath, const ScenePath &branchPath, const IECore::CompoundObject *parentAttributes,
+	const std::vector<Imath::M44f> &parentTransforms, const std::vector<float> &parentTimes,
+	const Imath::V2f *deformationShutter, const Imath::V2f *transformShutter,
+	const Gaffer::Context *context, IECoreScenePreview::Renderer *renderer
+) const
 {
-	ConstInternedStringVectorDataPtr agentNames = variationsPlug()->childNames( ScenePath() );
-	IECore::ConstCompoundDataPtr instanceChildNames = agentChildNames( parentPath, context );
-	ConstPathMatcherDataPtr inputSet = variationsPlug()->setPlug()->getValue();
-
-	PathMatcherDataPtr outputSetData = new PathMatcherData;
-	PathMatcher &outputSet = outputSetData->writable();
+	ScenePath path = parentPath;
+	path.insert( path.end(), branchPath.begin(), branchPath.end() );
+	ScenePlug::PathScope scope( context, path );
+	const Context *locationContext = Context::current();
+
+	CompoundObjectPtr attributes = new CompoundObject;
+	attributes->members() = parentAttributes->members();
+	for( const auto &attribute : computeBranchAttributes( parentPath, branchPath, locationContext )->members() )
+	{
+		attributes->members()[attribute.first] = attribute.second;
+	}
 
-	std::vector<InternedString> branchPath( { namePlug()->getValue() } );
-	std::vector<InternedString> agentPath( 1 );
+	auto visibleData = attributes->member<const BoolData>( "scene:visible" );
+	if( visibleData && !visibleData->readable() )
+	{
+		return;
+	}
 
-	for( const auto &agentName : agentNames->readable() )
+	// The transform is sampled at the times of its parent when both move, and like the
+	// renderer does for the scene locations, a single sample moves with all the others
+	const float frame = locationContext->getFrame();
+	std::vector<float> localTimes = shutterSampleTimes( attributes.get(), "gaffer:transformBlur", "gaffer:transformBlurSegments", transformShutter, frame );
+	if( localTimes.empty() )
 	{
-		agentPath.back() = agentName;
+		localTimes.push_back( frame );
+	}
+	else if( parentTimes.size() > 1 )
+	{
+		localTimes = parentTimes;
+	}
 
-        std::vector<std::string> paths;
-        inputSet->readable().paths( paths );
+	const std::vector<Imath::M44f> localTransforms = transformSamples( parentPath, branchPath, localTimes, locationContext );
+	std::vector<Imath::M44f> transforms;
+	std::vector<float> transformTimes;
+	if( localTransforms.size() == 1 )
+	{
+		for( const auto &parentTransform : parentTransforms )
+		{
+			transforms.push_back( localTransforms.front() * parentTransform );
+		}
+		transformTimes = parentTimes;
+	}
+	else
+	{
+		for( size_t i = 0; i < localTransforms.size(); ++i )
+		{
+			transforms.push_back( localTransforms[i] * parentTransforms[parentTransforms.size() > 1 ? i : 0] );
+		}
+		transformTimes = localTimes;
+	}
 
-		PathMatcher instanceSet = inputSet->readable().subTree( agentPath );
-		auto variationNamesData = instanceChildNames->member<CompoundData>( agentName );
-		if ( !variationNamesData )
-			continue;
+	// The agent meshes are deformed for all the samples of the shutter at once
+	std::vector<ConstObjectPtr> samples;
+	std::vector<float> times;
+	if( branchPath.size() > 4 )
+	{
+		times = shutterSampleTimes( attributes.get(), "gaffer:deformationBlur", "gaffer:deformationBlurSegments", deformationShutter, frame );
+	}
 
-		auto variationNames = variationNamesData->readable();
+	if( !times.empty() )
+	{
+		samples = deformedMeshSamples( parentPath, branchPath, times, locationContext );
+	}
+	else
+	{
+		samples.push_back( computeBranchObject( parentPath, branchPath, locationContext ) );
+	}
 
-		for( auto it = variationNames.cbegin(); it != variationNames.cend(); ++it )
+	if( !runTimeCast<const NullObject>( samples.front().get() ) )
+	{
+		std::string name;
+		ScenePlug::pathToString( path, name );
+		IECoreScenePreview::Renderer::AttributesInterfacePtr rendererAttributes = renderer->attributes( attributes.get() );
+		IECoreScenePreview::Renderer::ObjectInterfacePtr rendererObject;
+		if( samples.size() > 1 )
 		{
-			branchPath.resize( 2 );
-			branchPath.back() = agentName;
-            PathMatcher variationInstanceSet = instanceSet.subTree( it->first );
-
-
-			auto childNamesData = runTimeCast<InternedStringVectorData>( it->second );
-			if ( !childNamesData )
-				continue;
+			std::vector<const Object *> rawSamples;
+			for( const auto &sample : samples )
+			{
+				rawSamples.push_back( sample.get() );
+			}
+			rendererObject = renderer->object( name, rawSamples, times, rendererAttributes.get() );
+		}
+		else
+		{
+			rendererObject = renderer->object( name, samples.front().get(), rendererAttributes.get() );
+		}
 
-			const std::vector<InternedString> &childNames = childNamesData->readable();
-			branchPath.emplace_back( InternedString() );
-			branchPath.back() = it->first;
-			branchPath.emplace_back( InternedString() );
-            for( const auto &instanceChildName : childNames )
-            {
-                branchPath.back() = instanceChildName;
-                outputSet.addPaths( variationInstanceSet, branchPath );
-            }
+		if( rendererObject && transforms.size() > 1 )
+		{
+			rendererObject->transform( transforms, transformTimes );
+		}
+		else if( rendererObject )
+		{
+			rendererObject->transform( transforms.front() );
 		}
 	}
-	return outputSetData;
-}
 
-IECore::ConstCompoundDataPtr AtomsCrowdGenerator::agentChildNames( const ScenePath &parentPath, const Gaffer::Context *context ) const
-{
-	ScenePlug::PathScope scope( context, parentPath );
-	return agentChildNamesPlug()->getValue();
-}
-
-void AtomsCrowdGenerator::agentChildNamesHash( const ScenePath &parentPath, const Gaffer::Context *context, IECore::MurmurHash &h ) const
-{
-	ScenePlug::PathScope scope( context, parentPath );
-	agentChildNamesPlug()->hash( h );
-}
-
-AtomsCrowdGenerator::AgentScope::AgentScope( const Gaffer::Context *context, const ScenePath &branchPath )
-	:	EditableScope( context )
-{
-	ScenePath agentPath;
-	agentPath.reserve( 1 + ( branchPath.size() > 4 ? branchPath.size() - 4 : 0 ) );
-    if( branchPath.size() > 1 )
-	    agentPath.push_back( branchPath[1] );
-    if( branchPath.size() > 2 )
-        agentPath.push_back( branchPath[2] );
-	if( branchPath.size() > 4 )
+	ConstInternedStringVectorDataPtr childNames = computeBranchChildNames( parentPath, branchPath, locationContext );
+	ScenePath childPath = branchPath;
+	childPath.push_back( InternedString() );
+	for( const auto &childName : childNames->readable() )
 	{
-		agentPath.insert( agentPath.end(), branchPath.begin() + 4, branchPath.end() );
+		childPath.back() = childName;
+		renderCapsuleLocation(
+			parentPath, childPath, attributes.get(), transforms, transformTimes,
+			deformationShutter, transformShutter, locationContext, renderer
+		);
 	}
-
-	set( ScenePlug::scenePathContextName, agentPath );
 }
 
 void AtomsCrowdGenerator::atomsPoseHash( const ScenePath &parentPath, const ScenePath &branchPath, const Gaffer::Context *context, MurmurHash &h ) const
 {
-    if ( !useInstancesPlug()->getValue() )
+    auto agentData = agentCacheData( branchPath );
+
+    // The skinning matrices are quantized, so agents whose poses only differ
+    // by floating point noise still share their deformed meshes
+    auto poseData = agentData->member<const M44dVectorData>( "poseWorldMatrices" );
+    if ( poseData )
+    {
+        const double quantum = 1e-5;
+        for ( const auto& matrix : poseData->readable() )
+        {
+            const double *v = matrix.getValue();
+            for ( int i = 0; i < 16; ++i )
+            {
+                h.append( (int64_t)std::llround( v[i] / quantum ) );
+            }
+        }
+    }
+    else
     {
         h.append( branchPath[3] );
-        return;
     }
-    auto meshAttributes = runTimeCast<const CompoundObject>( variationsPlug()->attributesPlug()->getValue() );
-    if ( meshAttributes )
+
+    // The blend shape weights are stored in the agent metadata or on the input points,
+    // named after the agent type and the mesh
+    const std::string blendWeightPrefix = branchPath[1].string() + "_" + branchPath.back().string() + "_";
+    auto metadataData = agentData->member<const CompoundData>( "metadata" );
+    if ( metadataData )
     {
-        auto agentData = agentCacheData(branchPath);
-        auto hashPoseData = agentData->member<const UInt64Data>( "hash" );
-        if ( hashPoseData )
+        for ( const auto& member : metadataData->readable() )
         {
-            h.append( hashPoseData->readable() );
-            return;
+            if ( member.first.string().compare( 0, blendWeightPrefix.size(), blendWeightPrefix ) == 0 )
+            {
+                h.append( member.first );
+                member.second->hash( h );
+            }
+        }
+    }
+
+    ConstPointsPrimitivePtr points;
+    {
+        ScenePlug::PathScope scope( context, parentPath );
+        points = runTimeCast<const PointsPrimitive>( inPlug()->objectPlug()->getValue() );
+    }
+    if ( points )
+    {
+        const std::string primVarPrefix = "atoms:" + blendWeightPrefix;
+        int pointIndex = -2;
+        for ( const auto& primVar : points->variables )
+        {
+            if ( primVar.first.compare( 0, primVarPrefix.size(), primVarPrefix ) != 0 )
+            {
+                continue;
+            }
+
+            auto weightsData = runTimeCast<const FloatVectorData>( primVar.second.data );
+            if ( !weightsData )
+            {
+                continue;
+            }
+
+            if ( pointIndex == -2 )
+            {
+                pointIndex = agentPointIndex( parentPath, std::atoi( branchPath[3].c_str() ), context );
+            }
+            if ( pointIndex >= 0 )
+            {
+                h.append( primVar.first );
+                h.append( weightsData->readable()[pointIndex] );
+            }
         }
     }
-    h.append( branchPath[3] );
+
+}
+
+IECore::CompoundDataPtr AtomsCrowdGenerator::deformedMeshStatistics()
+{
+    const uint64_t requests = g_deformedMeshRequests;
+    const uint64_t computes = g_deformedMeshComputes;
+
+    CompoundDataPtr result = new CompoundData;
+    result->writable()["requests"] = new UInt64Data( requests );
+    result->writable()["misses"] = new UInt64Data( computes );
+    result->writable()["hits"] = new UInt64Data( requests > computes ? requests - computes : 0 );
+    return result;
+}
+
+void AtomsCrowdGenerator::resetDeformedMeshStatistics()
+{
+    g_deformedMeshRequests = 0;
+    g_deformedMeshComputes = 0;
 }
 
 ConstCompoundDataPtr AtomsCrowdGenerator::agentCacheData(const ScenePath &branchPath) const
@@ -1236,7 +4364,7 @@ ConstCompoundDataPtr AtomsCrowdGenerator::agentCacheData(const ScenePath &branch
         throw InvalidArgumentException( "AtomsCrowdGenerator :  No agents data found." );
     }
 
-    auto agentData = agentsData->member<const CompoundData>( branchPath[3].string() );
+    auto agentData = AtomsAgentPager::instance().agentData( agentsData, branchPath[3].string() );
     if( !agentData )
     {
         throw InvalidArgumentException( "AtomsCrowdGenerator : No agent found." );
@@ -1289,42 +4417,8 @@ ConstCompoundDataPtr AtomsCrowdGenerator::agentClothMeshData( const ScenePath &p
 
 Imath::Box3d AtomsCrowdGenerator::agentClothBoudingBox( const ScenePath &parentPath, const ScenePath &branchPath ) const
 {
-    Imath::Box3d result;
     auto cloth = runTimeCast<const BlindDataHolder>( clothCachePlug()->objectPlug()->getValue() );
-    if ( !cloth )
-    {
-        return result;
-    }
-
-    auto clothBlindData = cloth->blindData();
-    if ( !clothBlindData )
-    {
-        return result;
-    }
-
-    auto& clothData = clothBlindData->readable();
-    auto clothAgentIt = clothData.find( branchPath[3] );
-    if ( clothAgentIt == clothData.cend() )
-    {
-        return result;
-    }
-
-    auto clothAgent = runTimeCast<const CompoundData>( clothAgentIt->second );
-    if ( !clothAgent )
-    {
-        return result;
-    }
-
-    auto clothMeshIt = clothAgent->readable().find( "boundingBox" );
-    if ( clothMeshIt == clothAgent->readable().cend() )
-    {
-        return result;
-    }
-
-    auto boxData = runTimeCast<const Box3dData>( clothMeshIt->second );
-    if ( boxData )
-        result = boxData->readable();
-    return result;
+    return clothAgentBound( cloth.get(), branchPath[3] );
 }
 
 void AtomsCrowdGenerator::applySkinDeformer(
@@ -1332,7 +4426,9 @@ void AtomsCrowdGenerator::applySkinDeformer(
         MeshPrimitivePtr& result,
         ConstMeshPrimitivePtr& meshPrim,
         ConstCompoundObjectPtr& meshAttributes,
-        const std::vector<Imath::M44d>& worldMatrices
+        const std::vector<Imath::M44d>& worldMatrices,
+        const std::vector<Imath::M44d>* nextWorldMatrices,
+        float velocityScale
         ) const
 {
     auto jointIndexCountData = meshAttributes->member<const IntVectorData>( "jointIndexCount" );
@@ -1344,14 +4440,6 @@ void AtomsCrowdGenerator::applySkinDeformer(
         return;
     }
 
-    auto& vertexIds = vertexIdsData->readable();
-    auto &jointIndexCountVec = jointIndexCountData->readable();
-    auto &jointIndicesVec = jointIndicesData->readable();
-    auto &jointWeightsVec = jointWeightsData->readable();
-
-    std::vector<size_t> offsetData( jointIndexCountVec.size() );
-    size_t counter = 0;
-
     auto pVarIt = result->variables.find( "P" );
     if ( pVarIt == result->variables.end() )
         return;
@@ -1364,6 +4452,7 @@ void AtomsCrowdGenerator::applySkinDeformer(
     }
 
     auto &pointsData = pData->writable();
+    auto &jointIndexCountVec = jointIndexCountData->readable();
 
     if ( jointIndexCountVec.size() != pointsData.size() )
     {
@@ -1372,232 +4461,330 @@ void AtomsCrowdGenerator::applySkinDeformer(
                                         ". ALl points must be skinned, please check your setup scene" );
     }
 
-    Imath::V4d newP, currentPoint;
-    for ( size_t vId = 0; vId < jointIndexCountVec.size(); ++vId )
+    // The normals are skinned together with the points, so they can reuse
+    // the blended joint matrices
+    const std::vector<int> *normalPointIds = nullptr;
+    std::vector<int> uniqueNormalPointIds;
+    std::vector<Imath::V3f> *normals = skinnedNormals( result.get(), uniqueNormalPointIds, normalPointIds );
+
+    if ( !nextWorldMatrices )
+    {
+        Skinning::skin(
+            worldMatrices, jointIndexCountVec, jointIndicesData->readable(), jointWeightsData->readable(),
+            pointsData, normals, normalPointIds
+        );
+        return;
+    }
+
+    V3fVectorDataPtr velocityData = new V3fVectorData;
+    velocityData->setInterpretation( GeometricData::Vector );
+    auto &velocities = velocityData->writable();
+    if ( nextWorldMatrices->size() == worldMatrices.size() )
+    {
+        Skinning::skinWithVelocity(
+            worldMatrices, *nextWorldMatrices, velocityScale, jointIndexCountVec, jointIndicesData->readable(), jointWeightsData->readable(),
+            pointsData, velocities, normals, normalPointIds
+        );
+    }
+    else
     {
-        offsetData[vId] = counter;
-        Imath::V3f& inPoint = pointsData[vId];
-        newP.x = 0.0;
-        newP.y = 0.0;
-        newP.z = 0.0;
-        newP.w = 1.0;
+        // The agent doesn't exist at the next frame
+        Skinning::skin(
+            worldMatrices, jointIndexCountVec, jointIndicesData->readable(), jointWeightsData->readable(),
+            pointsData, normals, normalPointIds
+        );
+        velocities.resize( pointsData.size(), Imath::V3f( 0.0f ) );
+    }
 
-        currentPoint.x = inPoint.x;
-        currentPoint.y = inPoint.y;
-        currentPoint.z = inPoint.z;
-        currentPoint.w = 1.0;
+    result->variables["velocity"] = PrimitiveVariable( PrimitiveVariable::Vertex, velocityData );
+}
 
-        for ( size_t jId = 0; jId < jointIndexCountVec[vId]; ++jId, ++counter )
-        {
-            int jointId = jointIndicesVec[counter];
-            newP += currentPoint * jointWeightsVec[counter] * worldMatrices[jointId];
-        }
+ConstCompoundDataPtr AtomsCrowdGenerator::agentDataAtFrame( const ScenePath &parentPath, const ScenePath &branchPath, float frame, const Gaffer::Context *context ) const
+{
+    ConstCompoundObjectPtr crowd;
+    {
+        ScenePlug::PathScope scope( context, parentPath );
+        scope.setFrame( frame );
+        crowd = runTimeCast<const CompoundObject>( inPlug()->attributesPlug()->getValue() );
+    }
 
-        inPoint.x = newP.x;
-        inPoint.y = newP.y;
-        inPoint.z = newP.z;
+    auto atomsData = crowd ? crowd->member<const BlindDataHolder>( "atoms:agents" ) : nullptr;
+    if ( !atomsData || !atomsData->blindData() )
+    {
+        return nullptr;
     }
 
+    return AtomsAgentPager::instance().agentData( atomsData->blindData(), branchPath[3].string() );
+}
 
-    auto nVarIt = result->variables.find( "N" );
-    if ( nVarIt == result->variables.end() ) {
-        return;
+std::vector<ConstObjectPtr> AtomsCrowdGenerator::deformedMeshSamples( const ScenePath &parentPath, const ScenePath &branchPath, const std::vector<float> &times, const Gaffer::Context *context ) const
+{
+    // Rigid meshes are moved by their transform, which is sampled by the transform blur,
+    // and cloth meshes are only cached per frame, so they have a single sample
+    std::vector<ConstObjectPtr> result;
+    if ( times.size() < 2 || rigidJoint( parentPath, branchPath, context ) >= 0 || agentClothMeshData( parentPath, branchPath ) )
+    {
+        result.push_back( computeBranchObject( parentPath, branchPath, context ) );
+        return result;
     }
 
-    auto nData = runTimeCast<V3fVectorData>( nVarIt->second.data );
-    if ( !nData )
+    ConstMeshPrimitivePtr meshPrim;
+    ConstCompoundObjectPtr meshAttributes;
+    ConstCompoundDataPtr blendShapes;
     {
-        return;
+        AgentScope scope( context, branchPath );
+        meshPrim = runTimeCast<const MeshPrimitive>( variationsPlug()->objectPlug()->getValue() );
+        meshAttributes = runTimeCast<const CompoundObject>( variationsPlug()->attributesPlug()->getValue() );
+        blendShapes = blendShapesPlug()->getValue();
+    }
+
+    if ( !meshPrim || !meshAttributes || meshPrim->variables.find( "P" ) == meshPrim->variables.end() )
+    {
+        result.push_back( computeBranchObject( parentPath, branchPath, context ) );
+        return result;
+    }
+
+    g_deformedMeshRequests++;
+    g_deformedMeshComputes++;
+
+    // Every sample is a copy of the variation mesh sharing its topology, uvs and skinning
+    // weights, only the points and the normals being copied when they are deformed. Like
+    // the mesh of the location at the time of the sample, it is relative to the agent root
+    // at that time, the motion of the root being output by the transform blur.
+    const int agentId = std::atoi( branchPath[3].c_str() );
+    std::vector<MeshPrimitivePtr> samples;
+    std::vector<std::vector<Imath::M44d>> worldMatrices( times.size() );
+    for ( size_t i = 0; i < times.size(); ++i )
+    {
+        ConstCompoundDataPtr sampleAgentData = agentDataAtFrame( parentPath, branchPath, times[i], context );
+        auto samplePoseData = sampleAgentData ? sampleAgentData->member<const M44dVectorData>( "poseWorldMatrices" ) : nullptr;
+        if ( samplePoseData )
+        {
+            worldMatrices[i] = samplePoseData->readable();
+        }
+
+        if ( worldMatrices[i].empty() || worldMatrices[i].size() != worldMatrices[0].size() )
+        {
+            // The agent doesn't exist during the whole shutter
+            result.push_back( computeBranchObject( parentPath, branchPath, context ) );
+            return result;
+        }
+
+        // The blend shape weights are sampled as well
+        Context::EditableScope timeScope( context );
+        timeScope.setFrame( times[i] );
+        const Context *timeContext = Context::current();
+
+        ConstPointsPrimitivePtr points;
+        {
+            ScenePlug::PathScope scope( timeContext, parentPath );
+            points = runTimeCast<const PointsPrimitive>( inPlug()->objectPlug()->getValue() );
+        }
+
+        CompoundDataMap pointVariablesData;
+        if ( points )
+        {
+            atomsPointVariables( points.get(), pointVariablesData );
+        }
+
+        MeshPrimitivePtr sample = meshPrim->copy();
+        applyBlendShapesDeformer(
+            branchPath, sample, blendShapes.get(), sampleAgentData->member<const CompoundData>( "metadata" ),
+            pointVariablesData, agentPointIndex( parentPath, agentId, timeContext )
+        );
+        samples.push_back( sample );
     }
 
-    auto &normals = nData->writable();
-    for ( size_t vtxId = 0; vtxId < vertexIds.size(); ++vtxId )
+    applySkinDeformerSamples( branchPath, samples, meshAttributes.get(), worldMatrices );
+
+    result.insert( result.end(), samples.begin(), samples.end() );
+    return result;
+}
+
+std::vector<Imath::M44f> AtomsCrowdGenerator::transformSamples( const ScenePath &parentPath, const ScenePath &branchPath, const std::vector<float> &times, const Gaffer::Context *context ) const
+{
+    // The agent roots move with the points of the crowd and the rigid meshes with
+    // the skinning matrices of their joint, both of them sampled at every time
+    std::vector<Imath::M44f> result;
+    bool moving = false;
+    for ( size_t i = 0; i < times.size(); ++i )
     {
-        int pointId = vertexIds[vtxId];
-        size_t offset = offsetData[pointId];
+        if ( times.size() < 2 || ( branchPath.size() > 3 && !agentDataAtFrame( parentPath, branchPath, times[i], context ) ) )
+        {
+            // Not blurred, or the agent doesn't exist during the whole shutter
+            moving = false;
+            break;
+        }
 
-        Imath::V3f &inNormal = normals[vtxId];
+        Context::EditableScope timeScope( context );
+        timeScope.setFrame( times[i] );
+        result.push_back( computeBranchTransform( parentPath, branchPath, Context::current() ) );
+        moving = moving || result[i] != result[0];
+    }
+
+    if ( !moving )
+    {
+        result.clear();
+        result.push_back( computeBranchTransform( parentPath, branchPath, context ) );
+    }
+    return result;
+}
 
-        newP.x = 0.0;
-        newP.y = 0.0;
-        newP.z = 0.0;
-        newP.w = 0.0;
+void AtomsCrowdGenerator::applySkinDeformerSamples(
+        const ScenePath &branchPath,
+        std::vector<MeshPrimitivePtr>& samples,
+        const CompoundObject* meshAttributes,
+        const std::vector<std::vector<Imath::M44d>>& worldMatrices
+        ) const
+{
+    auto jointIndexCountData = meshAttributes->member<const IntVectorData>( "jointIndexCount" );
+    auto jointIndicesData = meshAttributes->member<const IntVectorData>( "jointIndices" );
+    auto jointWeightsData = meshAttributes->member<const FloatVectorData>( "jointWeights" );
+    if ( !jointIndexCountData || !jointIndicesData || !jointWeightsData )
+    {
+        return;
+    }
 
-        currentPoint.x = inNormal.x;
-        currentPoint.y = inNormal.y;
-        currentPoint.z = inNormal.z;
-        currentPoint.w = 0.0;
+    std::vector<const std::vector<Imath::M44d>*> sampleMatrices;
+    std::vector<std::vector<Imath::V3f>*> samplePoints;
+    std::vector<std::vector<Imath::V3f>*> sampleNormals;
+    std::vector<int> uniqueNormalPointIds;
+    const std::vector<int> *normalPointIds = nullptr;
+    for ( size_t i = 0; i < samples.size(); ++i )
+    {
+        auto pData = runTimeCast<V3fVectorData>( samples[i]->variables["P"].data );
+        if ( !pData )
+        {
+            IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "No points found" );
+            return;
+        }
 
-        for (size_t jId = 0; jId < jointIndexCountVec[pointId]; ++jId) {
-            int jointId = jointIndicesVec[offset];
-            newP += currentPoint * jointWeightsVec[offset] * worldMatrices[jointId];
+        if ( jointIndexCountData->readable().size() != pData->readable().size() )
+        {
+            throw InvalidArgumentException( "AtomsAttributes : " + branchPath[3].string() + "Invalid jointIndexCount data of length " +
+                                            std::to_string( jointIndexCountData->readable().size() ) + ", expected " + std::to_string( pData->readable().size() ) +
+                                            ". ALl points must be skinned, please check your setup scene" );
         }
 
-        inNormal.x = newP.x;
-        inNormal.y = newP.y;
-        inNormal.z = newP.z;
-        inNormal.normalize();
+        sampleMatrices.push_back( &worldMatrices[i] );
+        samplePoints.push_back( &pData->writable() );
+        sampleNormals.push_back( skinnedNormals( samples[i].get(), uniqueNormalPointIds, normalPointIds ) );
     }
+
+    Skinning::skinSamples(
+        sampleMatrices, jointIndexCountData->readable(), jointIndicesData->readable(), jointWeightsData->readable(),
+        samplePoints, sampleNormals.front() ? &sampleNormals : nullptr, normalPointIds
+    );
 }
 
 void AtomsCrowdGenerator::applyBlendShapesDeformer(
         const ScenePath &branchPath,
         MeshPrimitivePtr& result,
+        const IECore::CompoundData* blendShapes,
         const IECore::CompoundData* metadataData,
         const CompoundDataMap& pointVariablesData,
         const int agentIdPointIndex
         ) const
 {
-    auto pVarIt = result->variables.find( "P" );
-    if ( pVarIt == result->variables.end() )
+    auto weightNamesData = blendShapes->member<const InternedStringVectorData>( "weightNames" );
+    if ( !weightNamesData )
     {
         return;
     }
 
-    auto meshPointData = runTimeCast<V3fVectorData>( pVarIt->second.data );
-    auto blendShapeCountDataIt = result->variables.find( "blendShapeCount" );
-    if ( blendShapeCountDataIt == result->variables.end() || !metadataData || !meshPointData )
+    // The targets are only needed here, so they are removed before any of them
+    // is copied by the deformation
+    for ( const auto &variable : blendShapes->member<const InternedStringVectorData>( "variables" )->readable() )
     {
-        return;
+        result->variables.erase( variable );
     }
 
-    auto &points = meshPointData->writable();
-    auto &metadataMap = metadataData->readable();
-    auto blendShapeCountData = runTimeCast<IntData>( blendShapeCountDataIt->second.data );
-    int numBlendShapes = blendShapeCountData->readable();
-
-    std::vector<const std::vector<Imath::V3f>*> blendPoints;
-    std::vector<double> blendWeights;
-    for ( size_t blendId = 0; blendId < numBlendShapes; ++blendId )
+    // Only the targets with a weight are applied
+    std::vector<std::pair<size_t, float>> activeTargets;
+    const auto &weightNames = weightNamesData->readable();
+    for ( size_t blendId = 0; blendId < weightNames.size(); ++blendId )
     {
         double weight = 0.0;
-        std::string blendWeightMetaName = std::string( branchPath[1].c_str()) +
-                                          "_" + std::string( branchPath.back().c_str()) + "_" +
-                                          std::to_string(blendId);
-
-        auto pointsVariableIt = pointVariablesData.find(blendWeightMetaName);
-        if ( ( agentIdPointIndex != -1 ) && ( pointsVariableIt != pointVariablesData.end() ) &&
-            ( pointsVariableIt->second->typeId() == FloatVectorData::staticTypeId() ) )
+        auto pointsVariableIt = pointVariablesData.find( weightNames[blendId] );
+        auto primWeightsData = pointsVariableIt != pointVariablesData.end() ? runTimeCast<const FloatVectorData>( pointsVariableIt->second.get() ) : nullptr;
+        if ( ( agentIdPointIndex != -1 ) && primWeightsData )
         {
-            auto &primWeightVec = runTimeCast<FloatVectorData>(pointsVariableIt->second)->readable();
-            weight = primWeightVec[agentIdPointIndex];
+            weight = primWeightsData->readable()[agentIdPointIndex];
         }
         else
         {
-            auto blendWeightDataIt = metadataMap.find(blendWeightMetaName);
-            if (blendWeightDataIt == metadataMap.cend())
-                continue;
-
-            auto blendWeightData = runTimeCast<const DoubleData>(blendWeightDataIt->second);
-            if (!blendWeightData)
+            auto blendWeightData = metadataData ? metadataData->member<const DoubleData>( weightNames[blendId] ) : nullptr;
+            if ( !blendWeightData )
                 continue;
 
             weight = blendWeightData->readable();
         }
 
-        if (weight < 0.00001)
-            continue;
-
-        auto blendPointsData = runTimeCast<V3fVectorData>(
-                result->variables["blendShape_" + std::to_string(blendId) + "_P"].data);
-        if (!blendPointsData)
-            continue;
-
-
-        auto &blendPointsVec = blendPointsData->readable();
-
-        if (blendPointsVec.size() != points.size())
+        if ( weight < 0.00001 )
             continue;
 
-        blendPoints.push_back(&blendPointsVec);
-        blendWeights.push_back(weight);
+        activeTargets.push_back( std::make_pair( blendId, (float)weight ) );
     }
 
-
-    Imath::V3f currentPoint;
-    for ( size_t ptId = 0; ptId < points.size(); ++ptId )
+    if ( activeTargets.empty() )
     {
-        auto& meshPoint = points[ptId];
-        currentPoint.x = meshPoint.x;
-        currentPoint.y = meshPoint.y;
-        currentPoint.z = meshPoint.z;
+        return;
+    }
 
-        for ( size_t blendId = 0; blendId < blendPoints.size(); blendId++ )
+    auto pVarIt = result->variables.find( "P" );
+    auto meshPointData = pVarIt != result->variables.end() ? runTimeCast<V3fVectorData>( pVarIt->second.data ) : nullptr;
+    if ( meshPointData )
+    {
+        auto &points = meshPointData->writable();
+        const auto &offsets = blendShapes->member<const IntVectorData>( "pointOffsets" )->readable();
+        const auto &indices = blendShapes->member<const IntVectorData>( "pointIndices" )->readable();
+        const auto &deltas = blendShapes->member<const V3fVectorData>( "pointDeltas" )->readable();
+        for ( const auto &target : activeTargets )
         {
-            auto& blendP = *blendPoints[blendId];
-            double weight = blendWeights[blendId];
-            currentPoint.x += (blendP[ptId].x - points[ptId].x) * weight;
-            currentPoint.y += (blendP[ptId].y - points[ptId].y) * weight;
-            currentPoint.z += (blendP[ptId].z - points[ptId].z) * weight;
+            const float weight = target.second;
+            for ( int i = offsets[target.first]; i < offsets[target.first + 1]; ++i )
+            {
+                points[indices[i]] += deltas[i] * weight;
+            }
         }
-
-        meshPoint.x = currentPoint.x;
-        meshPoint.y = currentPoint.y;
-        meshPoint.z = currentPoint.z;
     }
 
+    // The normals are averaged between the blended normal of every target,
+    // which only moves the normals touched by a target
     auto nVarIt = result->variables.find( "N" );
-    if ( nVarIt != result->variables.end() )
+    auto meshNormalData = nVarIt != result->variables.end() ? runTimeCast<V3fVectorData>( nVarIt->second.data ) : nullptr;
+    if ( meshNormalData )
     {
-        auto meshNormalData = runTimeCast<V3fVectorData>( nVarIt->second.data );
-        if (meshNormalData) {
-            std::vector<const std::vector<Imath::V3f> *> blendNormals;
-            auto &normals = meshNormalData->writable();
-            for (size_t blendId = 0; blendId < numBlendShapes; ++blendId) {
-                auto blendNormalsData = runTimeCast<V3fVectorData>(
-                        result->variables["blendShape_" + std::to_string(blendId) + "_N"].data);
-                if (!blendNormalsData)
-                    continue;
-
-                auto &blendNormalsVec = blendNormalsData->readable();
-                if (blendNormalsVec.size() != normals.size())
-                    continue;
-
-                blendNormals.push_back(&blendNormalsVec);
+        const auto &offsets = blendShapes->member<const IntVectorData>( "normalOffsets" )->readable();
+        const auto &indices = blendShapes->member<const IntVectorData>( "normalIndices" )->readable();
+        const auto &deltas = blendShapes->member<const V3fVectorData>( "normalDeltas" )->readable();
+        bool touched = false;
+        for ( const auto &target : activeTargets )
+        {
+            touched = touched || offsets[target.first] != offsets[target.first + 1];
+        }
 
+        if ( touched )
+        {
+            auto &normals = meshNormalData->writable();
+            const float scale = 1.0f / (float)activeTargets.size();
+            std::vector<int> touchedNormals;
+            for ( const auto &target : activeTargets )
+            {
+                const float weight = target.second * scale;
+                for ( int i = offsets[target.first]; i < offsets[target.first + 1]; ++i )
+                {
+                    normals[indices[i]] += deltas[i] * weight;
+                    touchedNormals.push_back( indices[i] );
+                }
             }
 
-            Imath::V3f currentNormal;
-            if (blendWeights.size() > 0 && blendNormals.size() == blendWeights.size()) {
-                for (size_t ptId = 0; ptId < normals.size(); ++ptId) {
-                    auto &meshNormal = normals[ptId];
-                    currentNormal.x = meshNormal.x;
-                    currentNormal.y = meshNormal.y;
-                    currentNormal.z = meshNormal.z;
-
-                    Imath::V3f pNormals(currentNormal.x, currentNormal.y, currentNormal.z);
-                    Imath::V3f blendNormal(0.0, 0.0, 0.0);
-                    size_t counterN = 0;
-
-                    for (size_t blendId = 0; blendId < blendNormals.size(); blendId++) {
-                        auto &blendN = *blendNormals[blendId];
-                        double weight = blendWeights[blendId];
-                        blendNormal += pNormals * (1.0f - weight) + blendN[ptId] * weight;
-                        counterN++;
-                    }
-                    if (counterN > 0) {
-                        blendNormal = blendNormal / static_cast<float>( counterN );
-                        blendNormal.normalize();
-                        currentNormal.x = blendNormal.x;
-                        currentNormal.y = blendNormal.y;
-                        currentNormal.z = blendNormal.z;
-                    }
-
-                    meshNormal.x = currentNormal.x;
-                    meshNormal.y = currentNormal.y;
-                    meshNormal.z = currentNormal.z;
-                }
+            for ( int normalId : touchedNormals )
+            {
+                normals[normalId].normalize();
             }
         }
     }
-
-    // remove blend shape data
-    result->variables.erase("blendShapeCount");
-    for (int blendId = 0; blendId < numBlendShapes; ++blendId)
-    {
-        result->variables.erase("blendShape_" + std::to_string( blendId ) + "_P");
-        result->variables.erase("blendShape_" + std::to_string( blendId ) + "_N");
-    }
 }
 
 Imath::M44f AtomsCrowdGenerator::agentRootMatrix(
@@ -1629,7 +4816,7 @@ Imath::M44f AtomsCrowdGenerator::agentRootMatrix(
         throw InvalidArgumentException( "AtomsCrowdGenerator : computeBranchTransform : No agents data found." );
     }
 
-    auto agentData = agentsData->member<const CompoundData>( branchPath[3].string() );
+    auto agentData = AtomsAgentPager::instance().agentData( agentsData, branchPath[3].string() );
     if( !agentData )
     {
         throw InvalidArgumentException( "AtomsCrowdGenerator : computeBranchTransform : No agent found." );
@@ -1656,44 +4843,38 @@ bool AtomsCrowdGenerator::applyClothDeformer(
     Imath::M44f rootInvMatrix = rootMatrix.inverse();
     Imath::M44f rootNormalMatrix = rootMatrix.transposed();
     auto pVarIt = result->variables.find( "P" );
-    auto pData = runTimeCast<V3fVectorData>( pVarIt->second.data );
     auto& clothData = cloth->readable();
     auto clothPIt = clothData.find( "P" );
     if ( clothPIt == clothData.cend() ) {
         return false;
     }
 
-    auto pClothData = runTimeCast<V3dVectorData>( clothPIt->second );
-    if ( !pClothData )
+    std::vector<Imath::V3f> convertedP;
+    auto inputP = clothVectors( clothPIt->second.get(), convertedP );
+    if ( !inputP )
     {
         return false;
     }
 
-    auto& outputP = pData->writable();
-    auto& inputP = pClothData->readable();
-    if ( outputP.size() != inputP.size() )
+    if ( result->variableSize( PrimitiveVariable::Vertex ) != inputP->size() )
     {
         IECore::msg( IECore::Msg::Warning, "AtomsCrowdGenerator", "Invalid cloth mesh points" );
         return false;
     }
 
-    for ( size_t pId = 0; pId < outputP.size(); ++pId )
-    {
-        outputP[pId] = inputP[pId] * rootInvMatrix;
-    }
+    // The simulated points replace those of the variation mesh, so they are
+    // written to new data rather than to a copy of the variation points
+    V3fVectorDataPtr pData = new V3fVectorData;
+    pData->setInterpretation( GeometricData::Point );
+    Skinning::transformPoints( rootInvMatrix, *inputP, pData->writable() );
+    pVarIt->second = PrimitiveVariable( PrimitiveVariable::Vertex, pData );
 
     auto nVarIt = result->variables.find( "N" );
     auto vertexIdsData = result->vertexIds();
     if ( !vertexIdsData )
         return true;
 
-    if ( nVarIt == result->variables.end() )
-    {
-        return true;
-    }
-
-    auto nData = runTimeCast<V3fVectorData>( nVarIt->second.data );
-    if ( !nData )
+    if ( nVarIt == result->variables.end() || !runTimeCast<const V3fVectorData>( nVarIt->second.data.get() ) )
     {
         return true;
     }
@@ -1705,48 +4886,31 @@ bool AtomsCrowdGenerator::applyClothDeformer(
         return true;
     }
 
-    auto nClothData = runTimeCast<V3dVectorData>(clothNIt->second);
-    if ( !nClothData )
+    std::vector<Imath::V3f> convertedN;
+    auto inputN = clothVectors( clothNIt->second.get(), convertedN );
+    if ( !inputN )
     {
         return true;
     }
 
-    auto &outputN = nData->writable();
-    auto &inputN = nClothData->readable();
-    // Check if the normals are as Vertex or FaceVarying interpolation
-    if ( inputN.size() == pData->writable().size() )
-    {
-        for (size_t vId = 0; vId < vertexIds.size(); ++vId) {
-            size_t nId = vertexIds[vId];
-            const auto &currentN = inputN[nId];
-            auto &outN = outputN[vId];
-            Imath::V4f newN(currentN.x, currentN.y, currentN.z, 0.0);
-            newN = newN * rootNormalMatrix;
-            outN.x = newN.x;
-            outN.y = newN.y;
-            outN.z = newN.z;
-            outN.normalize();
-        }
-    }
-    else if ( inputN.size() == vertexIds.size() )
+    // Check if the normals are as Vertex or FaceVarying interpolation. Either way the
+    // cloth normals are per face vertex, so the normals can't stay indexed.
+    const std::vector<int> *normalIds = nullptr;
+    if ( inputN->size() == inputP->size() )
     {
-        for ( size_t nId = 0; nId < outputN.size(); ++nId )
-        {
-            const auto &currentN = inputN[nId];
-            auto &outN = outputN[nId];
-            Imath::V4f newN(currentN.x, currentN.y, currentN.z, 0.0);
-            newN = newN * rootNormalMatrix;
-            outN.x = newN.x;
-            outN.y = newN.y;
-            outN.z = newN.z;
-            outN.normalize();
-        }
+        normalIds = &vertexIds;
     }
-    else
+    else if ( inputN->size() != vertexIds.size() )
     {
         IECore::msg(IECore::Msg::Warning, "AtomsCrowdGenerator", "Agent " + branchPath[3].string() +
         "Invalid cloth mesh normals");
+        return true;
     }
 
+    V3fVectorDataPtr nData = new V3fVectorData;
+    nData->setInterpretation( GeometricData::Normal );
+    Skinning::transformNormals( rootNormalMatrix, *inputN, nData->writable(), normalIds );
+    nVarIt->second = PrimitiveVariable( PrimitiveVariable::FaceVarying, nData );
+
     return true;
 }
@@ -36,11 +36,13 @@
 
 #include "AtomsGaffer/AtomsCrowdReader.h"
 #include "AtomsGaffer/AtomsMetadataTranslator.h"
+#include "AtomsGaffer/AtomsAgentPager.h"
 
 #include "IECoreScene/PointsPrimitive.h"
 
 #include "IECore/NullObject.h"
 #include "IECore/BlindDataHolder.h"
+#include "IECore/Canceller.h"
 
 #include "AtomsUtils/PathSolver.h"
 #include "AtomsUtils/Utils.h"
@@ -69,6 +71,14 @@
 #include "AtomsCore/Metadata/PoseMetadata.h"
 #include "AtomsCore/Poser.h"
 
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
 
 
 IE_CORE_DEFINERUNTIMETYPED( AtomsGaffer::AtomsCrowdReader );
@@ -79,16 +89,45 @@ using namespace Gaffer;
 using namespace GafferScene;
 using namespace AtomsGaffer;
 
+namespace
+{
+
+// Returns the path of the scratch file storing the agents of an engine. The name holds
+// the modification time and the size of the simulation file, so an edited cache is never
+// served from an old scratch file, and a token unique to this process, so the names of
+// the scratch files of concurrent sessions sharing a directory never collide.
+std::string scratchFileName( const std::string &scratchDirectory, const std::string &simFile, const IECore::MurmurHash &engineHash )
+{
+    static const std::string processToken =
+        std::to_string( getpid() ) + "_" + std::to_string( std::chrono::system_clock::now().time_since_epoch().count() );
+
+    IECore::MurmurHash h = engineHash;
+    struct stat fileStat;
+    if ( stat( AtomsUtils::solvePath( simFile ).c_str(), &fileStat ) == 0 )
+    {
+        h.append( (uint64_t)fileStat.st_mtime );
+        h.append( (uint64_t)fileStat.st_size );
+    }
+
+    return scratchDirectory + "/atomsGaffer_" + h.toString() + "_" + processToken + ".fio";
+}
+
+} // namespace
+
 class AtomsCrowdReader::EngineData : public Data
 {
 
 public :
 
-    EngineData( const std::string& filePath, float frame, const std::string& agentIdsStr ):
+    EngineData(
+            const std::string& filePath, float frame, const std::string& agentIdsStr,
+            float previewFraction = 1.0f, bool previewStratified = false, const IECore::Canceller *canceller = nullptr
+    ):
             m_filePath( filePath ),
             m_frame( frame )
     {
         m_frame = frame;
+        computeMemoryStatistics( std::map<std::string, AgentTypeCount>(), 1 );
 
         if ( filePath.empty() )
             return;
@@ -116,6 +155,22 @@ public :
         std::vector<int> agentsIds;
         // Filter the agnet id based on the input expression
         parseVisibleAgents( agentsIds, AtomsUtils::eraseFromString( agentIdsStr, ' ' ) );
+
+        // Sample the preview agents before loading the frame, so only the poses of the selected agents are decoded
+        if ( previewFraction < 1.0f )
+        {
+            if ( agentsIds.empty() )
+            {
+                agentsIds = m_cache.agentIds( cacheFrame );
+            }
+
+            samplePreviewAgents( agentsIds, previewFraction, previewStratified );
+            if ( agentsIds.empty() )
+            {
+                return;
+            }
+        }
+
         if ( !agentsIds.empty() ) {
             m_cache.setAgentsToLoad( agentsIds );
             m_agentIds = agentsIds;
@@ -130,14 +185,24 @@ public :
         if ( frameReminder > 0.0 )
             m_cache.loadNextFrame( cacheFrame + 1 );
 
-        // Load the agent types in memory
+        // Load the agent types in memory, bucketing the agents by type for the memory statistics
+        std::map<std::string, AgentTypeCount> agentTypeCounts;
         for( size_t i = 0; i < m_agentIds.size(); ++i )
         {
+            Canceller::check( canceller );
+
             int agentId = m_agentIds[i];
             // load in memory the agent type since you need the skeleton to extract the world matrices from the pose
             const std::string &agentTypeName = m_cache.agentType( m_frame, agentId );
-            m_cache.loadAgentType( agentTypeName, false );
+            AgentTypeCount &agentTypeCount = agentTypeCounts[agentTypeName];
+            if ( agentTypeCount.count++ == 0 )
+            {
+                agentTypeCount.sampleAgentId = agentId;
+                m_cache.loadAgentType( agentTypeName, false );
+            }
         }
+
+        computeMemoryStatistics( agentTypeCounts, frameReminder > 0.0 ? 2 : 1 );
     }
 
     void hash( MurmurHash &h ) const override
@@ -161,6 +226,266 @@ public :
         return m_cache;
     }
 
+    // Builds the data of a single agent: the skinning matrices, the root matrix, the bound and the translated metadata
+    CompoundDataPtr buildAgentData( int agentId ) const
+    {
+        auto& atomsCache = m_cache;
+        double frame = m_frame;
+        auto& atomsAgentTypes = atomsCache.agentTypes();
+        auto& translator = AtomsMetadataTranslator::instance();
+
+        CompoundDataPtr agentCompoundData = new CompoundData;
+        auto &agentCompound = agentCompoundData->writable();
+
+        // load in memory the agent type since the cache need this to interpolate the pose
+        const std::string &agentTypeName = atomsCache.agentType( frame, agentId );
+        auto agentTypePtr = atomsAgentTypes.agentType( agentTypeName );
+
+        AtomsPtr<AtomsCore::PoseMetadata> posePtr( new AtomsCore::PoseMetadata );
+        atomsCache.loadAgentPose( frame, agentId, posePtr->get() );
+        AtomsPtr<AtomsCore::MapMetadata> metadataPtr( new AtomsCore::MapMetadata );
+        atomsCache.loadAgentMetadata( frame, agentId, *metadataPtr.get() );
+
+        Box3dDataPtr agentBBox = new Box3dData;
+        auto& agentBBoxData = agentBBox->writable();
+        if ( agentTypePtr )
+        {
+            AtomsCore::Poser poser( &agentTypePtr->skeleton() );
+            M44dVectorDataPtr matricesData = new M44dVectorData;
+            M44dVectorDataPtr normalMatricesData = new M44dVectorData;
+
+            // get the root world matrix
+            auto rootMatrix = poser.getWorldMatrix( posePtr->get(), 0 );
+            // now for all the detached joint multiply transform in root local space
+            AtomsCore::Matrix rootInverseMatrix = rootMatrix.inverse();
+            const std::vector<unsigned short>& detachedJoints = agentTypePtr->skeleton().detachedJoints();
+            for ( unsigned int ii = 0; ii < agentTypePtr->skeleton().detachedJoints().size(); ii++ )
+            {
+                poser.setWorldMatrix( posePtr->get(), poser.getWorldMatrix( posePtr->get(), detachedJoints[ii] ) * rootInverseMatrix, detachedJoints[ii] );
+            }
+
+            auto& outMatrices = matricesData->writable();
+            auto& outNormalMatrices = normalMatricesData->writable();
+            outMatrices = poser.getAllWorldMatrix( posePtr->get() );
+            outNormalMatrices.resize( outMatrices.size() );
+
+            //update the position metadata
+            auto positionMeta = metadataPtr->getTypedEntry<AtomsCore::Vector3Metadata>( ATOMS_AGENT_POSITION );
+            if ( positionMeta )
+            {
+                positionMeta->set( rootMatrix.translation() );
+            }
+
+            const AtomsCore::MapMetadata& metadata = agentTypePtr->metadata();
+            AtomsPtr<const AtomsCore::MatrixArrayMetadata> bindPosesInvPtr = metadata.getTypedEntry<const AtomsCore::MatrixArrayMetadata>( "worldBindPoseInverseMatrices" );
+            if ( !bindPosesInvPtr )
+            {
+                throw InvalidArgumentException( "AtomsCrowdReader : No worldBindPoseInverseMatrices metadata found on agent type: " +  agentTypeName );
+            }
+
+            const std::vector<AtomsCore::Matrix>& bindPosesInv = bindPosesInvPtr->get();
+
+            // The joint positions and parents are used to draw the skeleton proxies.
+            // Detached joints aren't linked to their parent.
+            V3fVectorDataPtr jointPositionsData = new V3fVectorData;
+            IntVectorDataPtr jointParentsData = new IntVectorData;
+            auto& jointPositions = jointPositionsData->writable();
+            auto& jointParents = jointParentsData->writable();
+            jointPositions.resize( outMatrices.size() );
+            jointParents.resize( outMatrices.size() );
+
+            // Store the matrices for the skinning
+            for ( unsigned int j = 0; j < outMatrices.size(); j++ )
+            {
+                AtomsCore::Matrix &jMtx = outMatrices[j];
+                agentBBoxData.extendBy(jMtx.translation());
+                jointPositions[j] = Imath::V3f( jMtx.translation() );
+                jointParents[j] = agentTypePtr->skeleton().joint( j ).parent();
+                jMtx = bindPosesInv[j] * jMtx;
+                outNormalMatrices[j] = jMtx.inverse().transpose();
+            }
+
+            agentCompound["poseWorldMatrices"] = matricesData;
+            agentCompound["poseNormalWorldMatrices"] = normalMatricesData;
+
+            for ( const unsigned short detachedJoint : detachedJoints )
+            {
+                jointParents[detachedJoint] = -1;
+            }
+            agentCompound["jointPositions"] = jointPositionsData;
+            agentCompound["jointParents"] = jointParentsData;
+
+            M44dDataPtr rootMatrixData = new M44dData( rootMatrix );
+            agentCompound["rootMatrix"] = rootMatrixData;
+
+            // This is an hash of the agent pose in local space
+            UInt64DataPtr hashData = new UInt64Data( posePtr->get().hash() );
+            agentCompound["hash"] = hashData;
+        }
+        else
+        {
+            throw InvalidArgumentException( "AtomsCrowdReader: Invalid agent type " + agentTypeName );
+        }
+
+        agentCompound["metadata"] = translator.translate( metadataPtr );
+
+        agentCompound["boundingBox"] = agentBBox;
+
+        StringDataPtr aTypeData = new StringData();
+        aTypeData->writable() = agentTypeName;
+        agentCompound["agentType"] = aTypeData;
+
+        return agentCompoundData;
+    }
+
+    // Returns the data of all the agents, keyed by agent id. It is built on first use and then
+    // shared by every reader using this engine. The agents are built without holding the lock,
+    // which only guards publishing them, so readers racing for them may build them twice but
+    // never wait on each other.
+    ConstCompoundDataPtr agentsData( const IECore::Canceller *canceller ) const
+    {
+        {
+            std::lock_guard<std::mutex> lock( m_agentsDataMutex );
+            if ( m_agentsData )
+            {
+                return m_agentsData;
+            }
+        }
+
+        CompoundDataPtr agentsData = new CompoundData;
+        auto& agentsDataMap = agentsData->writable();
+        for ( int agentId : m_agentIds )
+        {
+            // Every agent decodes a full pose, so poll the canceller on each iteration
+            Canceller::check( canceller );
+            agentsDataMap[ std::to_string( agentId ) ] = buildAgentData( agentId );
+        }
+
+        {
+            std::lock_guard<std::mutex> lock( m_agentsDataMutex );
+            if ( m_agentsData )
+            {
+                return m_agentsData;
+            }
+            m_agentsData = agentsData;
+        }
+
+        // The agents are kept alive by the shared engine, so they count towards its cost
+        addSharedCost( agentsData->Object::memoryUsage() );
+        return agentsData;
+    }
+
+    // Returns the estimated footprint of the engine, split by component
+    ConstCompoundDataPtr memoryStatistics() const
+    {
+        return m_memoryStatistics;
+    }
+
+    void memoryUsage( Object::MemoryAccumulator &accumulator ) const override
+    {
+        Data::memoryUsage( accumulator );
+        accumulator.accumulate( m_memoryStatistics->member<UInt64Data>( "total" )->readable() );
+
+        // The lock is only held to publish the agents, never while building them
+        std::lock_guard<std::mutex> lock( m_agentsDataMutex );
+        if ( m_agentsData )
+        {
+            accumulator.accumulate( m_agentsData.get() );
+        }
+    }
+
+    // Returns the engine for the given parameters, sharing it with all the other readers of the
+    // process that are evaluating the same file at the same frame with the same filters. The engines
+    // are immutable once built, and are kept alive in least recently used order until the total
+    // memory of the shared engines exceeds a limit. The engine is built without holding any lock,
+    // and only published under the cache lock. Readers of the same node are deduplicated by the
+    // compute cache of the engine plug, while different readers racing for the same engine may
+    // both build it, the first one published being shared.
+    static ConstEngineDataPtr acquire(
+            const std::string& filePath, float frame, const std::string& agentIdsStr, int refreshCount,
+            float previewFraction, bool previewStratified, const IECore::Canceller *canceller
+    )
+    {
+        if ( filePath.empty() )
+        {
+            return new EngineData( filePath, frame, agentIdsStr, previewFraction, previewStratified, canceller );
+        }
+
+        MurmurHash key;
+        key.append( AtomsUtils::solvePath( filePath ) );
+        key.append( frame );
+        key.append( AtomsUtils::eraseFromString( agentIdsStr, ' ' ) );
+        key.append( refreshCount );
+        key.append( previewFraction );
+        key.append( previewStratified );
+
+        EngineCache& cache = engineCache();
+        {
+            std::lock_guard<std::mutex> lock( cache.mutex );
+            auto entryIt = cache.entries.find( key );
+            if ( entryIt != cache.entries.end() )
+            {
+                cache.lru.splice( cache.lru.begin(), cache.lru, entryIt->second.lruIt );
+                return entryIt->second.engine;
+            }
+        }
+
+        EngineDataPtr engine = new EngineData( filePath, frame, agentIdsStr, previewFraction, previewStratified, canceller );
+        engine->m_cacheKey = key;
+        const size_t cost = engine->Object::memoryUsage();
+
+        std::lock_guard<std::mutex> lock( cache.mutex );
+        auto inserted = cache.entries.insert( std::make_pair( key, EngineCacheEntry() ) );
+        EngineCacheEntry &entry = inserted.first->second;
+        if ( !inserted.second )
+        {
+            // Another reader published the same engine while this one was building it
+            cache.lru.splice( cache.lru.begin(), cache.lru, entry.lruIt );
+            return entry.engine;
+        }
+
+        cache.lru.push_front( key );
+        entry.engine = engine;
+        entry.cost = cost;
+        entry.lruIt = cache.lru.begin();
+        cache.memoryUsage += cost;
+        evict( cache );
+
+        return engine;
+    }
+
+    static void setSharedMemoryLimit( size_t bytes )
+    {
+        EngineCache& cache = engineCache();
+        std::lock_guard<std::mutex> lock( cache.mutex );
+        cache.memoryLimit = bytes;
+        evict( cache );
+    }
+
+    static size_t getSharedMemoryLimit()
+    {
+        EngineCache& cache = engineCache();
+        std::lock_guard<std::mutex> lock( cache.mutex );
+        return cache.memoryLimit;
+    }
+
+    static size_t sharedMemoryUsage()
+    {
+        EngineCache& cache = engineCache();
+        std::lock_guard<std::mutex> lock( cache.mutex );
+        return cache.memoryUsage;
+    }
+
+    // Releases all the shared engines. The readers still holding one keep it alive.
+    static void clearShared()
+    {
+        EngineCache& cache = engineCache();
+        std::lock_guard<std::mutex> lock( cache.mutex );
+        cache.entries.clear();
+        cache.lru.clear();
+        cache.memoryUsage = 0;
+    }
+
     void getAtomsCacheName( const std::string& filePath, std::string& cachePath, std::string& cacheName, const std::string& extension ) const
     {
         size_t found = filePath.find_last_of( "/\\" );
@@ -190,6 +515,59 @@ public :
         }
     }
 
+    static double previewSampleValue( int agentId )
+    {
+        // Map the agent id to a uniformly distributed value in [0, 1), which doesn't depend on the
+        // other agents of the crowd. An agent is kept if its value is lower than the preview fraction,
+        // so the agents of a small fraction are always a subset of the agents of a larger one.
+        MurmurHash h;
+        h.append( agentId );
+        return static_cast<double>( h.h1() >> 11 ) / static_cast<double>( 1ull << 53 );
+    }
+
+    void samplePreviewAgents( std::vector<int>& agentsIds, float previewFraction, bool stratified )
+    {
+        if ( !stratified )
+        {
+            agentsIds.erase(
+                    std::remove_if(
+                            agentsIds.begin(), agentsIds.end(),
+                            [previewFraction]( int agentId ) { return previewSampleValue( agentId ) >= previewFraction; }
+                    ),
+                    agentsIds.end()
+            );
+            return;
+        }
+
+        // Keep the same fraction of every agent type, taking the agents with the lowest sample values.
+        // Every agent type keeps at least one agent, so rare types are still represented in the preview.
+        // This relies on the frame header, since the frame itself hasn't been loaded yet.
+        std::map<std::string, std::vector<std::pair<double, int>>> agentsByType;
+        for ( int agentId : agentsIds )
+        {
+            agentsByType[m_cache.agentType( m_frame, agentId )].emplace_back( previewSampleValue( agentId ), agentId );
+        }
+
+        agentsIds.clear();
+        if ( previewFraction <= 0.0f )
+        {
+            return;
+        }
+
+        for ( auto& typeAgents : agentsByType )
+        {
+            auto& samples = typeAgents.second;
+            std::sort( samples.begin(), samples.end() );
+            size_t numSamples = static_cast<size_t>( std::round( previewFraction * samples.size() ) );
+            numSamples = std::min( std::max<size_t>( numSamples, 1 ), samples.size() );
+            for ( size_t i = 0; i < numSamples; ++i )
+            {
+                agentsIds.push_back( samples[i].second );
+            }
+        }
+        std::sort( agentsIds.begin(), agentsIds.end() );
+    }
+
     void parseVisibleAgents( std::vector<int>& agentsFiltered, const std::string& agentIdsStr )
     {
         // The input filter accept '-' to set a range of ids, and ! to exclude an id or a range of ids
@@ -284,6 +662,130 @@ public :
 
 protected :
 
+    struct EngineCacheEntry
+    {
+        ConstEngineDataPtr engine;
+        size_t cost = 0;
+        std::list<MurmurHash>::iterator lruIt;
+    };
+
+    // Only held to look up and publish the engines, never while building them
+    struct EngineCache
+    {
+        std::mutex mutex;
+        std::map<MurmurHash, EngineCacheEntry> entries;
+        std::list<MurmurHash> lru;
+        size_t memoryUsage = 0;
+        size_t memoryLimit = size_t( 4 ) * 1024 * 1024 * 1024;
+    };
+
+    static EngineCache& engineCache()
+    {
+        static EngineCache cache;
+        return cache;
+    }
+
+    // Releases the least recently used engines until the cache fits in its limit,
+    // always keeping the most recent one. Must be called with the cache mutex held.
+    static void evict( EngineCache& cache )
+    {
+        while ( cache.memoryUsage > cache.memoryLimit && cache.lru.size() > 1 )
+        {
+            auto evictedIt = cache.entries.find( cache.lru.back() );
+            cache.memoryUsage -= evictedIt->second.cost;
+            cache.entries.erase( evictedIt );
+            cache.lru.pop_back();
+        }
+    }
+
+    // Adds memory allocated by the engine after it was shared to the cost of its
+    // cache entry, unless the engine has been evicted in the meantime.
+    void addSharedCost( size_t cost ) const
+    {
+        EngineCache& cache = engineCache();
+        std::lock_guard<std::mutex> lock( cache.mutex );
+        auto entryIt = cache.entries.find( m_cacheKey );
+        if ( entryIt == cache.entries.end() || entryIt->second.engine.get() != this )
+        {
+            return;
+        }
+
+        entryIt->second.cost += cost;
+        cache.memoryUsage += cost;
+        evict( cache );
+    }
+
+    // The number of agents of a type, and the first of them
+    struct AgentTypeCount
+    {
+        size_t count = 0;
+        int sampleAgentId = -1;
+    };
+
+    void computeMemoryStatistics( const std::map<std::string, AgentTypeCount>& agentTypeCounts, size_t numFrames )
+    {
+        // The atoms cache doesn't expose its footprint, so we estimate it from the joint count of every agent type
+        // and from the decoded metadata of one sample agent per type. The figures are only estimates, as every agent
+        // of a type is assumed to carry as much metadata as its sample. Gaffer uses this value to evict the engine
+        // from its compute cache, so it's better to slightly overestimate than to report nothing at all.
+        size_t posesBytes = 0;
+        size_t metadataBytes = 0;
+        size_t agentTypesBytes = 0;
+        const size_t jointBytes = 2 * sizeof( Imath::V3d ) + sizeof( Imath::Quatd );
+
+        auto& atomsAgentTypes = m_cache.agentTypes();
+        for( const auto& agentTypeCount : agentTypeCounts )
+        {
+            auto agentTypePtr = atomsAgentTypes.agentType( agentTypeCount.first );
+            if ( !agentTypePtr )
+            {
+                continue;
+            }
+
+            const AtomsCore::MapMetadata& agentTypeMetadata = agentTypePtr->metadata();
+            size_t numJoints = 0;
+            auto bindPosesInvPtr = agentTypeMetadata.getTypedEntry<const AtomsCore::MatrixArrayMetadata>( "worldBindPoseInverseMatrices" );
+            if ( bindPosesInvPtr )
+            {
+                numJoints = bindPosesInvPtr->get().size();
+            }
+
+            agentTypesBytes += mapMetadataMemoryUsage( agentTypeMetadata ) + numJoints * ( jointBytes + 2 * sizeof( AtomsCore::Matrix ) );
+            posesBytes += numFrames * agentTypeCount.second.count * numJoints * jointBytes;
+
+            AtomsCore::MapMetadata sampleMetadata;
+            m_cache.loadAgentMetadata( m_frame, agentTypeCount.second.sampleAgentId, sampleMetadata );
+            metadataBytes += numFrames * agentTypeCount.second.count * mapMetadataMemoryUsage( sampleMetadata );
+        }
+
+        const size_t agentIdsBytes = m_agentIds.capacity() * sizeof( int );
+
+        CompoundDataPtr statistics = new CompoundData;
+        auto& members = statistics->writable();
+        members["agentPoses"] = new UInt64Data( posesBytes );
+        members["agentMetadata"] = new UInt64Data( metadataBytes );
+        members["agentTypes"] = new UInt64Data( agentTypesBytes );
+        members["agentIds"] = new UInt64Data( agentIdsBytes );
+        members["total"] = new UInt64Data( posesBytes + metadataBytes + agentTypesBytes + agentIdsBytes );
+        m_memoryStatistics = statistics;
+    }
+
+    static size_t mapMetadataMemoryUsage( const AtomsCore::MapMetadata& metadata )
+    {
+        auto& translator = AtomsMetadataTranslator::instance();
+        size_t result = 0;
+        for( auto it = metadata.cbegin(); it != metadata.cend(); ++it )
+        {
+            result += it->first.capacity();
+            DataPtr data = translator.translate( it->second );
+            if ( data )
+            {
+                result += data->memoryUsage();
+            }
+        }
+        return result;
+    }
+
     void copyFrom( const Object *other, CopyContext *context ) override
     {
         Data::copyFrom( other, context );
@@ -311,6 +813,14 @@ private :
     std::vector<int> m_agentIds;
 
     float m_frame;
+
+    ConstCompoundDataPtr m_memoryStatistics;
+
+    mutable std::mutex m_agentsDataMutex;
+    mutable ConstCompoundDataPtr m_agentsData;
+
+    // The key of the engine in the shared engine cache
+    MurmurHash m_cacheKey;
 };
 
 size_t AtomsCrowdReader::g_firstPlugIndex = 0;
@@ -325,6 +835,10 @@ AtomsCrowdReader::AtomsCrowdReader( const std::string &name )
     addChild( new FloatPlug( "timeOffset" ) );
 	addChild( new IntPlug( "refreshCount" ) );
     addChild( new ObjectPlug( "__engine", Plug::Out, NullObject::defaultNullObject() ) );
+    addChild( new BoolPlug( "outOfCore" ) );
+    addChild( new StringPlug( "scratchDirectory" ) );
+    addChild( new FloatPlug( "previewFraction", Plug::In, 1.0f, 0.0f, 1.0f ) );
+    addChild( new BoolPlug( "previewStratified" ) );
 }
 
 StringPlug* AtomsCrowdReader::atomsSimFilePlug()
@@ -377,21 +891,102 @@ const Gaffer::ObjectPlug *AtomsCrowdReader::enginePlug() const
     return getChild<ObjectPlug>( g_firstPlugIndex + 4 );
 }
 
+Gaffer::BoolPlug *AtomsCrowdReader::outOfCorePlug()
+{
+    return getChild<BoolPlug>( g_firstPlugIndex + 5 );
+}
+
+const Gaffer::BoolPlug *AtomsCrowdReader::outOfCorePlug() const
+{
+    return getChild<BoolPlug>( g_firstPlugIndex + 5 );
+}
+
+Gaffer::StringPlug *AtomsCrowdReader::scratchDirectoryPlug()
+{
+    return getChild<StringPlug>( g_firstPlugIndex + 6 );
+}
+
+const Gaffer::StringPlug *AtomsCrowdReader::scratchDirectoryPlug() const
+{
+    return getChild<StringPlug>( g_firstPlugIndex + 6 );
+}
+
+Gaffer::FloatPlug *AtomsCrowdReader::previewFractionPlug()
+{
+    return getChild<FloatPlug>( g_firstPlugIndex + 7 );
+}
+
+const Gaffer::FloatPlug *AtomsCrowdReader::previewFractionPlug() const
+{
+    return getChild<FloatPlug>( g_firstPlugIndex + 7 );
+}
+
+Gaffer::BoolPlug *AtomsCrowdReader::previewStratifiedPlug()
+{
+    return getChild<BoolPlug>( g_firstPlugIndex + 8 );
+}
+
+const Gaffer::BoolPlug *AtomsCrowdReader::previewStratifiedPlug() const
+{
+    return getChild<BoolPlug>( g_firstPlugIndex + 8 );
+}
+
+void AtomsCrowdReader::setOutOfCoreMemoryLimit( size_t bytes )
+{
+    AtomsAgentPager::instance().setMemoryLimit( bytes );
+}
+
+size_t AtomsCrowdReader::getOutOfCoreMemoryLimit()
+{
+    return AtomsAgentPager::instance().getMemoryLimit();
+}
+
+void AtomsCrowdReader::setSharedEngineMemoryLimit( size_t bytes )
+{
+    EngineData::setSharedMemoryLimit( bytes );
+}
+
+size_t AtomsCrowdReader::getSharedEngineMemoryLimit()
+{
+    return EngineData::getSharedMemoryLimit();
+}
+
+size_t AtomsCrowdReader::sharedEngineMemoryUsage()
+{
+    return EngineData::sharedMemoryUsage();
+}
+
+void AtomsCrowdReader::clearSharedEngines()
+{
+    EngineData::clearShared();
+}
+
+IECore::CompoundDataPtr AtomsCrowdReader::engineMemoryUsage() const
+{
+    ConstEngineDataPtr engineData = boost::static_pointer_cast<const EngineData>( enginePlug()->getValue() );
+    return engineData->memoryStatistics()->copy();
+}
+
 void AtomsCrowdReader::affects( const Plug *input, AffectedPlugsContainer &outputs ) const
 {
 
 	ObjectSource::affects( input, outputs );
 
 	if( input == atomsSimFilePlug() || input == refreshCountPlug() ||
-	    input == agentIdsPlug() || input == timeOffsetPlug() )
+	    input == agentIdsPlug() || input == timeOffsetPlug() ||
+	    input == previewFractionPlug() || input == previewStratifiedPlug() )
     {
 	    outputs.push_back( enginePlug() );
     }
 
+	if ( input == enginePlug() || input == outOfCorePlug() || input == scratchDirectoryPlug() )
+	{
+        outputs.push_back( outPlug()->attributesPlug() );
+	}
+
 	if ( input == enginePlug() )
 	{
         outputs.push_back( sourcePlug() );
-        outputs.push_back( outPlug()->attributesPlug() );
 	}
 }
 
@@ -401,6 +996,8 @@ void AtomsCrowdReader::hashSource( const Gaffer::Context *context, MurmurHash &h
 	refreshCountPlug()->hash( h );
 	timeOffsetPlug()->hash( h );
     agentIdsPlug()->hash( h );
+    previewFractionPlug()->hash( h );
+    previewStratifiedPlug()->hash( h );
 	outPlug()->attributesPlug()->hash( h );
 	h.append( context->getFrame() );
 }
@@ -475,6 +1072,8 @@ ConstObjectPtr AtomsCrowdReader::computeSource( const Gaffer::Context *context )
     auto& atomsAgentTypes = atomsCache.agentTypes();
     for( size_t i = 0; i < numAgents; ++i )
     {
+        Canceller::check( context->canceller() );
+
         CompoundDataPtr agentCompoundData = new CompoundData;
         auto &agentCompound = agentCompoundData->writable();
         int agentId = agentIds[i];
@@ -572,6 +1171,10 @@ void AtomsCrowdReader::hashAttributes( const ScenePath &path, const Gaffer::Cont
     refreshCountPlug()->hash( h );
     timeOffsetPlug()->hash( h );
     agentIdsPlug()->hash( h );
+    previewFractionPlug()->hash( h );
+    previewStratifiedPlug()->hash( h );
+    outOfCorePlug()->hash( h );
+    scratchDirectoryPlug()->hash( h );
     h.append( context->getFrame() );
 }
 
@@ -588,114 +1191,43 @@ IECore::ConstCompoundObjectPtr AtomsCrowdReader::computeAttributes( const SceneN
         return result;
     }
 
-    auto& atomsCache = engineData->cache();
-    double frame = engineData->frame();
-
-    auto& agentIds = engineData->agentIds();
-    size_t numAgents = agentIds.size();
-
-    auto& translator = AtomsMetadataTranslator::instance();
-
-    Box3dDataPtr cacheBox = new Box3dData;
-    atomsCache.loadBoundingBox( frame, cacheBox->writable() );
-    //members["atoms:boundingBox"] = cacheBox;
-
-    IntVectorDataPtr agentIndices = new IntVectorData;
-    agentIndices->writable() = agentIds;
-    //members["atoms:agentIds"] = agentIndices;
-
     CompoundDataPtr agentsCompound = new CompoundData;
     auto &agentsCompoundData = agentsCompound->writable();
 
-    auto& atomsAgentTypes = atomsCache.agentTypes();
-    for( size_t i = 0; i < numAgents; ++i )
+    if ( outOfCorePlug()->getValue() )
     {
-        CompoundDataPtr agentCompoundData = new CompoundData;
-        auto &agentCompound = agentCompoundData->writable();
-        int agentId = agentIds[i];
-
-        // load in memory the agent type since the cache need this to interpolate the pose
-        const std::string &agentTypeName = atomsCache.agentType( frame, agentId );
-        auto agentTypePtr = atomsAgentTypes.agentType( agentTypeName );
-
-        AtomsPtr<AtomsCore::PoseMetadata> posePtr( new AtomsCore::PoseMetadata );
-        atomsCache.loadAgentPose( frame, agentId, posePtr->get() );
-        AtomsPtr<AtomsCore::MapMetadata> metadataPtr( new AtomsCore::MapMetadata );
-        atomsCache.loadAgentMetadata( frame, agentId, *metadataPtr.get() );
-
-        Box3dDataPtr agentBBox = new Box3dData;
-        auto& agentBBoxData = agentBBox->writable();
-        if ( agentTypePtr )
+        // When running out of core the agents are streamed to a scratch file in ascending id order, one chunk at a time,
+        // and the payload only stores the index of that file. The scratch file is named after the engine hash, so
+        // this process reuses it if it has already been written for the same frame. It's unlinked as soon as it's
+        // created, so it never outlives the process, and only registered once complete, so it's never a partial one.
+        std::string scratchDirectory = scratchDirectoryPlug()->getValue();
+        if ( scratchDirectory.empty() )
         {
-            AtomsCore::Poser poser( &agentTypePtr->skeleton() );
-            M44dVectorDataPtr matricesData = new M44dVectorData;
-            M44dVectorDataPtr normalMatricesData = new M44dVectorData;
-
-            // get the root world matrix
-            auto rootMatrix = poser.getWorldMatrix( posePtr->get(), 0 );
-            // now for all the detached joint multiply transform in root local space
-            AtomsCore::Matrix rootInverseMatrix = rootMatrix.inverse();
-            const std::vector<unsigned short>& detachedJoints = agentTypePtr->skeleton().detachedJoints();
-            for ( unsigned int ii = 0; ii < agentTypePtr->skeleton().detachedJoints().size(); ii++ )
-            {
-                poser.setWorldMatrix( posePtr->get(), poser.getWorldMatrix( posePtr->get(), detachedJoints[ii] ) * rootInverseMatrix, detachedJoints[ii] );
-            }
-
-            auto& outMatrices = matricesData->writable();
-            auto& outNormalMatrices = normalMatricesData->writable();
-            outMatrices = poser.getAllWorldMatrix( posePtr->get() );
-            outNormalMatrices.resize( outMatrices.size() );
-
-            //update the position metadata
-            auto positionMeta = metadataPtr->getTypedEntry<AtomsCore::Vector3Metadata>( ATOMS_AGENT_POSITION );
-            if ( positionMeta )
-            {
-                positionMeta->set( rootMatrix.translation() );
-            }
-
-            const AtomsCore::MapMetadata& metadata = agentTypePtr->metadata();
-            AtomsPtr<const AtomsCore::MatrixArrayMetadata> bindPosesInvPtr = metadata.getTypedEntry<const AtomsCore::MatrixArrayMetadata>( "worldBindPoseInverseMatrices" );
-            if ( !bindPosesInvPtr )
-            {
-                throw InvalidArgumentException( "AtomsCrowdReader : No worldBindPoseInverseMatrices metadata found on agent type: " +  agentTypeName );
-            }
-
-            const std::vector<AtomsCore::Matrix>& bindPosesInv = bindPosesInvPtr->get();
+            const char *tmpDir = getenv( "TMPDIR" );
+            scratchDirectory = tmpDir ? tmpDir : "/tmp";
+        }
 
-            // Store the matrices for the skinning
-            for ( unsigned int j = 0; j < outMatrices.size(); j++ )
+        const std::string fileName = scratchFileName( scratchDirectory, atomsSimFilePlug()->getValue(), enginePlug()->hash() );
+        if ( !AtomsAgentPager::instance().hasFile( fileName ) )
+        {
+            AtomsAgentPager::ChunkWriter chunkWriter( fileName );
+            std::vector<int> sortedAgentIds = engineData->agentIds();
+            std::sort( sortedAgentIds.begin(), sortedAgentIds.end() );
+            for( int agentId : sortedAgentIds )
             {
-                AtomsCore::Matrix &jMtx = outMatrices[j];
-                agentBBoxData.extendBy(jMtx.translation());
-                jMtx = bindPosesInv[j] * jMtx;
-                outNormalMatrices[j] = jMtx.inverse().transpose();
+                // Every agent decodes a full pose, so poll the canceller on each iteration
+                Canceller::check( context->canceller() );
+                chunkWriter.addAgent( agentId, engineData->buildAgentData( agentId ) );
             }
-
-            agentCompound["poseWorldMatrices"] = matricesData;
-            agentCompound["poseNormalWorldMatrices"] = normalMatricesData;
-
-            M44dDataPtr rootMatrixData = new M44dData( rootMatrix );
-            agentCompound["rootMatrix"] = rootMatrixData;
-
-            // This is an hash of the agent pose in local space
-            UInt64DataPtr hashData = new UInt64Data( posePtr->get().hash() );
-            agentCompound["hash"] = hashData;
-        }
-        else
-        {
-            throw InvalidArgumentException( "AtomsCrowdReader: Invalid agent type " + agentTypeName );
+            chunkWriter.commit();
         }
-
-        agentCompound["metadata"] = translator.translate( metadataPtr );
-
-        agentCompound["boundingBox"] = agentBBox;
-
-        StringDataPtr aTypeData = new StringData();
-        aTypeData->writable() = agentTypeName;
-        agentCompound["agentType"] = aTypeData;
-
-        //members[ "atoms:agent:" + std::to_string( agentId ) ] = agentCompoundData;
-        agentsCompoundData[ std::to_string( agentId ) ] =  agentCompoundData;
+        AtomsAgentPager::instance().addIndex( fileName, agentsCompound.get() );
+    }
+    else
+    {
+        // The agents are shared by all the readers using the same engine, so only the
+        // map is copied here and the agent data itself is referenced.
+        agentsCompoundData = engineData->agentsData( context->canceller() )->readable();
     }
 
     // Store the frame offset, this is used by the cloth reader to mantain the 2 caches in synch
@@ -717,6 +1249,8 @@ void AtomsCrowdReader::hash( const Gaffer::ValuePlug *output, const Gaffer::Cont
         refreshCountPlug()->hash( h );
         timeOffsetPlug()->hash( h );
         agentIdsPlug()->hash( h );
+        previewFractionPlug()->hash( h );
+        previewStratifiedPlug()->hash( h );
         h.append(context->getFrame());
     }
 
@@ -728,13 +1262,29 @@ void AtomsCrowdReader::hash( const Gaffer::ValuePlug *output, const Gaffer::Cont
     ObjectSource::hash( output, context, h );
 }
 
+Gaffer::ValuePlug::CachePolicy AtomsCrowdReader::computeCachePolicy( const Gaffer::ValuePlug *output ) const
+{
+    if ( output == enginePlug() )
+    {
+        // Only one thread builds the engine of a given context, the others waiting on
+        // it, and the engine is built isolated from the tasks of the waiting threads
+        return ValuePlug::CachePolicy::TaskIsolation;
+    }
+    return ObjectSource::computeCachePolicy( output );
+}
+
 void AtomsCrowdReader::compute( Gaffer::ValuePlug *output, const Gaffer::Context *context ) const
 {
     if ( output == enginePlug() )
     {
-        static_cast<ObjectPlug *>( output )->setValue(
-                new EngineData( atomsSimFilePlug()->getValue(), context->getFrame() + timeOffsetPlug()->getValue(), agentIdsPlug()->getValue() )
-                );
+        // The engine is immutable, so we can safely share it with the other readers
+        ConstEngineDataPtr engineData = EngineData::acquire(
+                atomsSimFilePlug()->getValue(), context->getFrame() + timeOffsetPlug()->getValue(),
+                agentIdsPlug()->getValue(), refreshCountPlug()->getValue(),
+                previewFractionPlug()->getValue(), previewStratifiedPlug()->getValue(),
+                context->canceller()
+        );
+        static_cast<ObjectPlug *>( output )->setValue( engineData );
         return;
     }
 
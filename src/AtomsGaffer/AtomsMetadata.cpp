@@ -35,6 +35,7 @@
 //////////////////////////////////////////////////////////////////////////
 
 #include "AtomsGaffer/AtomsMetadata.h"
+#include "AtomsGaffer/AtomsAgentPager.h"
 
 #include "IECoreScene/PointsPrimitive.h"
 
@@ -271,7 +272,7 @@ void AtomsMetadata::setMetadataOnPoints(
                     continue;
                 }
 
-                auto agentData = agentsData->member<const CompoundData>( std::to_string( agentId ) );
+                auto agentData = AtomsAgentPager::instance().agentData( agentsData, std::to_string( agentId ) );
                 if ( !agentData )
                 {
                     continue;
@@ -0,0 +1,440 @@
+//////////////////////////////////////////////////////////////////////////
+//
+//  Copyright (c) 2018, Toolchefs Ltd. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//
+//      * Redistributions of source code must retain the above
+//        copyright notice, this list of conditions and the following
+//        disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following
+//        disclaimer in the documentation and/or other materials provided with
+//        the distribution.
+//
+//      * Neither the name of John Haddon nor the names of
+//        any other contributors to this software may be used to endorse or
+//        promote products derived from this software without specific prior
+//        written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+//  IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+//  THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+//  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+//  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+//  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+//  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+//  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+//  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "AtomsGaffer/AtomsSkinning.h"
+
+using namespace AtomsGaffer;
+
+namespace
+{
+
+// Row major 3x4 affine matrix. Row i holds the coefficients producing
+// the i component of the transformed point, the last column being the
+// translation.
+struct Matrix34
+{
+	float m[12];
+};
+
+template<typename T>
+void convertMatrix( const Imath::Matrix44<T> &in, Matrix34 &out )
+{
+	// Imath transforms row vectors, so the columns of the 4x4 matrix are
+	// the rows of the 3x4 one
+	for( int i = 0; i < 3; ++i )
+	{
+		out.m[i * 4 + 0] = in[0][i];
+		out.m[i * 4 + 1] = in[1][i];
+		out.m[i * 4 + 2] = in[2][i];
+		out.m[i * 4 + 3] = in[3][i];
+	}
+}
+
+// The scratch buffers of a single deformation. They are allocated per call rather
+// than kept per thread, so they are released as soon as the mesh is skinned, and a
+// thread stealing another deformation while waiting on its chunks can't clobber them.
+struct Scratch
+{
+	std::vector<Matrix34> matrices;
+	std::vector<Matrix34> nextMatrices;
+	std::vector<Matrix34> blended;
+	std::vector<size_t> offsets;
+};
+
+inline void blendMatrices(
+	const Matrix34 *matrices, const int *indices, const float *weights, int count, Matrix34 &result
+)
+{
+	float b[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	for( int j = 0; j < count; ++j )
+	{
+		const float w = weights[j];
+		const float *m = matrices[indices[j]].m;
+		for( int k = 0; k < 12; ++k )
+		{
+			b[k] += w * m[k];
+		}
+	}
+	for( int k = 0; k < 12; ++k )
+	{
+		result.m[k] = b[k];
+	}
+}
+
+inline Imath::V3f transformPoint( const Matrix34 &b, const Imath::V3f &p )
+{
+	return Imath::V3f(
+		b.m[0] * p.x + b.m[1] * p.y + b.m[2] * p.z + b.m[3],
+		b.m[4] * p.x + b.m[5] * p.y + b.m[6] * p.z + b.m[7],
+		b.m[8] * p.x + b.m[9] * p.y + b.m[10] * p.z + b.m[11]
+	);
+}
+
+inline Imath::V3f transformNormal( const Matrix34 &b, const Imath::V3f &n )
+{
+	Imath::V3f result(
+		b.m[0] * n.x + b.m[1] * n.y + b.m[2] * n.z,
+		b.m[4] * n.x + b.m[5] * n.y + b.m[6] * n.z,
+		b.m[8] * n.x + b.m[9] * n.y + b.m[10] * n.z
+	);
+	return result.normalize();
+}
+
+// The default kernel. When nextWorldMatrices is given, they are blended
+// with the same influences to output the velocities.
+void skinPoints(
+	const std::vector<Imath::M44d> &worldMatrices,
+	const std::vector<Imath::M44d> *nextWorldMatrices,
+	float velocityScale,
+	const std::vector<int> &jointIndexCount,
+	const std::vector<int> &jointIndices,
+	const std::vector<float> &jointWeights,
+	std::vector<Imath::V3f> &points,
+	std::vector<Imath::V3f> *velocities,
+	std::vector<Imath::V3f> *normals,
+	const std::vector<int> *normalPointIds
+)
+{
+	Scratch s;
+	s.matrices.resize( worldMatrices.size() );
+	for( size_t i = 0; i < worldMatrices.size(); ++i )
+	{
+		convertMatrix( worldMatrices[i], s.matrices[i] );
+	}
+
+	if( nextWorldMatrices )
+	{
+		s.nextMatrices.resize( nextWorldMatrices->size() );
+		for( size_t i = 0; i < nextWorldMatrices->size(); ++i )
+		{
+			convertMatrix( ( *nextWorldMatrices )[i], s.nextMatrices[i] );
+		}
+		velocities->resize( points.size() );
+	}
+
+	// The blended matrices are only kept when the normals need them
+	const bool keepBlended = normals && !normals->empty();
+	if( keepBlended )
+	{
+		s.blended.resize( points.size() );
+	}
+
+	// The influences of a point start where those of the previous point end,
+	// so the chunks need the offsets of their first point
+	std::vector<size_t> &offsets = s.offsets;
+	offsets.resize( points.size() );
+	size_t offset = 0;
+	for( size_t pointId = 0; pointId < points.size(); ++pointId )
+	{
+		offsets[pointId] = offset;
+		offset += jointIndexCount[pointId];
+	}
+
+	const Matrix34 *matrices = s.matrices.data();
+	const Matrix34 *nextMatrices = nextWorldMatrices ? s.nextMatrices.data() : nullptr;
+	Matrix34 *blendedMatrices = keepBlended ? s.blended.data() : nullptr;
+	forEachPointRange(
+		points.size(),
+		[&]( size_t begin, size_t end )
+		{
+			Matrix34 blended;
+			Matrix34 nextBlended;
+			for( size_t pointId = begin; pointId < end; ++pointId )
+			{
+				const size_t o = offsets[pointId];
+				Matrix34 &b = blendedMatrices ? blendedMatrices[pointId] : blended;
+				blendMatrices( matrices, jointIndices.data() + o, jointWeights.data() + o, jointIndexCount[pointId], b );
+				if( nextMatrices )
+				{
+					blendMatrices( nextMatrices, jointIndices.data() + o, jointWeights.data() + o, jointIndexCount[pointId], nextBlended );
+					( *velocities )[pointId] = ( transformPoint( nextBlended, points[pointId] ) - transformPoint( b, points[pointId] ) ) * velocityScale;
+				}
+				points[pointId] = transformPoint( b, points[pointId] );
+			}
+		}
+	);
+
+	if( !keepBlended )
+	{
+		return;
+	}
+
+	std::vector<Imath::V3f> &n = *normals;
+	forEachPointRange(
+		n.size(),
+		[&]( size_t begin, size_t end )
+		{
+			for( size_t i = begin; i < end; ++i )
+			{
+				const size_t pointId = normalPointIds ? ( *normalPointIds )[i] : i;
+				n[i] = transformNormal( blendedMatrices[pointId], n[i] );
+			}
+		}
+	);
+}
+
+} // namespace
+
+void Skinning::skin(
+	const std::vector<Imath::M44d> &worldMatrices,
+	const std::vector<int> &jointIndexCount,
+	const std::vector<int> &jointIndices,
+	const std::vector<float> &jointWeights,
+	std::vector<Imath::V3f> &points,
+	std::vector<Imath::V3f> *normals,
+	const std::vector<int> *normalPointIds
+)
+{
+	skinPoints( worldMatrices, nullptr, 0.0f, jointIndexCount, jointIndices, jointWeights, points, nullptr, normals, normalPointIds );
+}
+
+void Skinning::skinWithVelocity(
+	const std::vector<Imath::M44d> &worldMatrices,
+	const std::vector<Imath::M44d> &nextWorldMatrices,
+	float velocityScale,
+	const std::vector<int> &jointIndexCount,
+	const std::vector<int> &jointIndices,
+	const std::vector<float> &jointWeights,
+	std::vector<Imath::V3f> &points,
+	std::vector<Imath::V3f> &velocities,
+	std::vector<Imath::V3f> *normals,
+	const std::vector<int> *normalPointIds
+)
+{
+	skinPoints( worldMatrices, &nextWorldMatrices, velocityScale, jointIndexCount, jointIndices, jointWeights, points, &velocities, normals, normalPointIds );
+}
+
+void Skinning::skinSamples(
+	const std::vector<const std::vector<Imath::M44d> *> &worldMatrices,
+	const std::vector<int> &jointIndexCount,
+	const std::vector<int> &jointIndices,
+	const std::vector<float> &jointWeights,
+	const std::vector<std::vector<Imath::V3f> *> &points,
+	const std::vector<std::vector<Imath::V3f> *> *normals,
+	const std::vector<int> *normalPointIds
+)
+{
+	const size_t numSamples = worldMatrices.size();
+	if( numSamples < 2 )
+	{
+		for( size_t i = 0; i < numSamples; ++i )
+		{
+			skin(
+				*worldMatrices[i], jointIndexCount, jointIndices, jointWeights,
+				*points[i], normals ? ( *normals )[i] : nullptr, normalPointIds
+			);
+		}
+		return;
+	}
+
+	// The matrices of all the samples are stored one after the other
+	Scratch s;
+	const size_t numJoints = worldMatrices.front()->size();
+	s.matrices.resize( numSamples * numJoints );
+	for( size_t i = 0; i < numSamples; ++i )
+	{
+		for( size_t j = 0; j < numJoints; ++j )
+		{
+			convertMatrix( ( *worldMatrices[i] )[j], s.matrices[i * numJoints + j] );
+		}
+	}
+
+	// The blended matrices of every sample are only kept when the normals need them
+	const size_t numPoints = points.front()->size();
+	const bool keepBlended = normals && !( *normals )[0]->empty();
+	if( keepBlended )
+	{
+		s.blended.resize( numSamples * numPoints );
+	}
+
+	std::vector<size_t> &offsets = s.offsets;
+	offsets.resize( numPoints );
+	size_t offset = 0;
+	for( size_t pointId = 0; pointId < numPoints; ++pointId )
+	{
+		offsets[pointId] = offset;
+		offset += jointIndexCount[pointId];
+	}
+
+	const Matrix34 *matrices = s.matrices.data();
+	Matrix34 *blendedMatrices = keepBlended ? s.blended.data() : nullptr;
+	forEachPointRange(
+		numPoints,
+		[&]( size_t begin, size_t end )
+		{
+			Matrix34 blended;
+			for( size_t pointId = begin; pointId < end; ++pointId )
+			{
+				const size_t o = offsets[pointId];
+				const int *indices = jointIndices.data() + o;
+				const float *weights = jointWeights.data() + o;
+				const int count = jointIndexCount[pointId];
+				for( size_t i = 0; i < numSamples; ++i )
+				{
+					Matrix34 &b = blendedMatrices ? blendedMatrices[i * numPoints + pointId] : blended;
+					blendMatrices( matrices + i * numJoints, indices, weights, count, b );
+					Imath::V3f &p = ( *points[i] )[pointId];
+					p = transformPoint( b, p );
+				}
+			}
+		}
+	);
+
+	if( !keepBlended )
+	{
+		return;
+	}
+
+	const size_t numNormals = ( *normals )[0]->size();
+	forEachPointRange(
+		numNormals,
+		[&]( size_t begin, size_t end )
+		{
+			for( size_t n = begin; n < end; ++n )
+			{
+				const size_t pointId = normalPointIds ? ( *normalPointIds )[n] : n;
+				for( size_t i = 0; i < numSamples; ++i )
+				{
+					Imath::V3f &normal = ( *( *normals )[i] )[n];
+					normal = transformNormal( blendedMatrices[i * numPoints + pointId], normal );
+				}
+			}
+		}
+	);
+}
+
+void Skinning::skinReference(
+	const std::vector<Imath::M44d> &worldMatrices,
+	const std::vector<int> &jointIndexCount,
+	const std::vector<int> &jointIndices,
+	const std::vector<float> &jointWeights,
+	std::vector<Imath::V3f> &points,
+	std::vector<Imath::V3f> *normals,
+	const std::vector<int> *normalPointIds
+)
+{
+	std::vector<size_t> offsetData( jointIndexCount.size() );
+	size_t counter = 0;
+
+	Imath::V4d newP, currentPoint;
+	for ( size_t vId = 0; vId < jointIndexCount.size(); ++vId )
+	{
+		offsetData[vId] = counter;
+		Imath::V3f& inPoint = points[vId];
+		newP = Imath::V4d( 0.0, 0.0, 0.0, 1.0 );
+		currentPoint = Imath::V4d( inPoint.x, inPoint.y, inPoint.z, 1.0 );
+
+		for ( int jId = 0; jId < jointIndexCount[vId]; ++jId, ++counter )
+		{
+			int jointId = jointIndices[counter];
+			newP += currentPoint * jointWeights[counter] * worldMatrices[jointId];
+		}
+
+		inPoint.x = newP.x;
+		inPoint.y = newP.y;
+		inPoint.z = newP.z;
+	}
+
+	if( !normals )
+	{
+		return;
+	}
+
+	std::vector<Imath::V3f> &n = *normals;
+	for ( size_t vtxId = 0; vtxId < n.size(); ++vtxId )
+	{
+		const size_t pointId = normalPointIds ? ( *normalPointIds )[vtxId] : vtxId;
+		size_t offset = offsetData[pointId];
+
+		Imath::V3f &inNormal = n[vtxId];
+		newP = Imath::V4d( 0.0, 0.0, 0.0, 0.0 );
+		currentPoint = Imath::V4d( inNormal.x, inNormal.y, inNormal.z, 0.0 );
+
+		for ( int jId = 0; jId < jointIndexCount[pointId]; ++jId, ++offset )
+		{
+			int jointId = jointIndices[offset];
+			newP += currentPoint * jointWeights[offset] * worldMatrices[jointId];
+		}
+
+		inNormal.x = newP.x;
+		inNormal.y = newP.y;
+		inNormal.z = newP.z;
+		inNormal.normalize();
+	}
+}
+
+void Skinning::transformPoints(
+	const Imath::M44f &matrix,
+	const std::vector<Imath::V3f> &points,
+	std::vector<Imath::V3f> &out
+)
+{
+	Matrix34 m;
+	convertMatrix( matrix, m );
+	out.resize( points.size() );
+	forEachPointRange(
+		points.size(),
+		[&]( size_t begin, size_t end )
+		{
+			for( size_t i = begin; i < end; ++i )
+			{
+				out[i] = transformPoint( m, points[i] );
+			}
+		}
+	);
+}
+
+void Skinning::transformNormals(
+	const Imath::M44f &matrix,
+	const std::vector<Imath::V3f> &normals,
+	std::vector<Imath::V3f> &out,
+	const std::vector<int> *normalIds
+)
+{
+	Matrix34 m;
+	convertMatrix( matrix, m );
+	out.resize( normalIds ? normalIds->size() : normals.size() );
+	forEachPointRange(
+		out.size(),
+		[&]( size_t begin, size_t end )
+		{
+			for( size_t i = begin; i < end; ++i )
+			{
+				out[i] = transformNormal( m, normals[normalIds ? ( *normalIds )[i] : i] );
+			}
+		}
+	);
+}
@@ -39,6 +39,7 @@
 
 #include "IECoreScene/MeshPrimitive.h"
 #include "IECore/NullObject.h"
+#include "IECore/Canceller.h"
 #include "IECoreScene/PointsPrimitive.h"
 
 #include "Atoms/Variations.h"
@@ -57,6 +58,8 @@
 #include "AtomsCore/Metadata/DoubleArrayMetadata.h"
 #include "AtomsCore/Metadata/Vector3ArrayMetadata.h"
 
+#include <cmath>
+
 
 IE_CORE_DEFINERUNTIMETYPED( AtomsGaffer::AtomsVariationReader );
 
@@ -81,6 +84,86 @@ IECoreScene::PrimitiveVariable convertNormals( AtomsUtils::Mesh& mesh )
     return PrimitiveVariable( PrimitiveVariable::FaceVarying, normalsData );
 }
 
+// Atoms stores a normal per face vertex, even though most of the face vertices of a
+// point share the same normal. Here the normals are collapsed into their unique values
+// per point, and indexed by face vertex, so the deformers only process each unique
+// normal once. The blend shape normals are indexed together with the normals, so two
+// face vertices only share an index if all their blend shape normals match as well.
+void indexNormals( MeshPrimitive *mesh, int numBlendShapes )
+{
+    auto nIt = mesh->variables.find( "N" );
+    if ( nIt == mesh->variables.end() || nIt->second.indices )
+    {
+        return;
+    }
+
+    auto normalsData = runTimeCast<const V3fVectorData>( nIt->second.data );
+    auto& vertexIds = mesh->vertexIds()->readable();
+    if ( !normalsData || normalsData->readable().size() != vertexIds.size() )
+    {
+        return;
+    }
+    auto& normals = normalsData->readable();
+
+    std::vector<const std::vector<Imath::V3f>*> blendNormals;
+    for ( int blendId = 0; blendId < numBlendShapes; ++blendId )
+    {
+        auto blendIt = mesh->variables.find( "blendShape_" + std::to_string( blendId ) + "_N" );
+        auto blendData = blendIt != mesh->variables.end() ? runTimeCast<const V3fVectorData>( blendIt->second.data ) : nullptr;
+        if ( !blendData || blendData->readable().size() != normals.size() )
+        {
+            // Leave the normals as they are rather than mismatching them with the blend shapes
+            return;
+        }
+        blendNormals.push_back( &blendData->readable() );
+    }
+
+    IntVectorDataPtr indicesData = new IntVectorData;
+    auto& indices = indicesData->writable();
+    indices.resize( normals.size() );
+
+    V3fVectorDataPtr uniqueNormalsData = new V3fVectorData;
+    uniqueNormalsData->setInterpretation( GeometricData::Normal );
+    auto& uniqueNormals = uniqueNormalsData->writable();
+
+    std::vector<V3fVectorDataPtr> uniqueBlendNormalsData;
+    for ( size_t blendId = 0; blendId < blendNormals.size(); ++blendId )
+    {
+        uniqueBlendNormalsData.push_back( new V3fVectorData );
+        uniqueBlendNormalsData.back()->setInterpretation( GeometricData::Normal );
+    }
+
+    std::map<MurmurHash, int> uniqueIndices;
+    for ( size_t vId = 0; vId < normals.size(); ++vId )
+    {
+        MurmurHash h;
+        h.append( vertexIds[vId] );
+        h.append( normals[vId] );
+        for ( const auto blendN : blendNormals )
+        {
+            h.append( ( *blendN )[vId] );
+        }
+
+        auto inserted = uniqueIndices.emplace( h, (int)uniqueNormals.size() );
+        if ( inserted.second )
+        {
+            uniqueNormals.push_back( normals[vId] );
+            for ( size_t blendId = 0; blendId < blendNormals.size(); ++blendId )
+            {
+                uniqueBlendNormalsData[blendId]->writable().push_back( ( *blendNormals[blendId] )[vId] );
+            }
+        }
+        indices[vId] = inserted.first->second;
+    }
+
+    nIt->second = PrimitiveVariable( PrimitiveVariable::FaceVarying, uniqueNormalsData, indicesData );
+    for ( size_t blendId = 0; blendId < blendNormals.size(); ++blendId )
+    {
+        mesh->variables["blendShape_" + std::to_string( blendId ) + "_N"] =
+                PrimitiveVariable( PrimitiveVariable::FaceVarying, uniqueBlendNormalsData[blendId], indicesData );
+    }
+}
+
 IECoreScene::PrimitiveVariable convertUvs( AtomsUtils::Mesh& mesh, AtomsUtils::Mesh::UVData& uvSet )
 {
     auto& inIndices = uvSet.uvIndices;
@@ -132,8 +215,6 @@ MeshPrimitivePtr convertAtomsMesh( AtomsPtr<AtomsCore::MapMetadata>& geoMap, boo
     MeshPrimitivePtr meshPtr = new MeshPrimitive( verticesPerFace, vertexIds, "linear", p );
 
     meshPtr->variables["N"] = convertNormals( mesh );
-    if ( genNref )
-        meshPtr->variables["Nref"] = meshPtr->variables["N"];
     if ( genPref )
         meshPtr->variables["Pref"] = meshPtr->variables["P"];
 
@@ -209,6 +290,10 @@ MeshPrimitivePtr convertAtomsMesh( AtomsPtr<AtomsCore::MapMetadata>& geoMap, boo
         meshPtr->variables["blendShapeCount"] =  PrimitiveVariable( PrimitiveVariable::Constant, blendShapeCount );
     }
 
+    indexNormals( meshPtr.get(), blendShapes ? blendShapes->size() : 0 );
+    if ( genNref )
+        meshPtr->variables["Nref"] = meshPtr->variables["N"];
+
     // Convert the atoms metadata
     auto atomsMap = geoMap->getTypedEntry<const AtomsCore::MapMetadata>( "atoms" );
     if ( atomsMap && atomsMap->size() > 0 )
@@ -232,10 +317,11 @@ class AtomsVariationReader::EngineData : public Data
 
 public :
 
-    EngineData( const std::string& filePath ):
+    EngineData( const std::string& filePath, const IECore::Canceller *canceller = nullptr ):
         m_filePath( filePath )
     {
         m_hierarchy = AtomsPtr<AtomsCore::MapMetadata>( new AtomsCore::MapMetadata );
+        computeMemoryStatistics();
         if ( filePath.empty() )
             return;
 
@@ -263,7 +349,7 @@ public :
             if ( !agentTypePtr )
                 continue;
 
-            loadAgentTypeMesh( agentTypePtr, agentTypeName );
+            loadAgentTypeMesh( agentTypePtr, agentTypeName, canceller );
 
             auto agentTypeIt = m_meshesFileCache.find( agentTypeName );
             if ( agentTypeIt == m_meshesFileCache.end() )
@@ -357,13 +443,18 @@ public :
             auto agentTypeHierarchyData = std::static_pointer_cast<AtomsCore::Metadata>( agentTypeHierarchy );
             m_hierarchy->addEntry( agentTypeNames[aTypeId],agentTypeHierarchyData, false );
         }
+
+        computeMemoryStatistics();
     }
 
-    void loadAgentTypeMesh( Atoms::AgentTypeVariationCPtr agentTypePtr, const std::string& agentTypeName )
+    void loadAgentTypeMesh( Atoms::AgentTypeVariationCPtr agentTypePtr, const std::string& agentTypeName, const IECore::Canceller *canceller )
     {
         auto geoNames = agentTypePtr->getGeometryNames();
         for ( size_t geoId = 0; geoId != geoNames.size(); ++geoId )
         {
+            // Loading a geos file can take a while, so give the user a chance to abort in between
+            Canceller::check( canceller );
+
             auto geoPtr = agentTypePtr->getGeometryPtr( geoNames[geoId] );
             if ( !geoPtr )
                 continue;
@@ -446,8 +537,120 @@ public :
         return m_meshesFileCache;
     }
 
+    // Returns the footprint of the loaded meshes, split by component
+    ConstCompoundDataPtr memoryStatistics() const
+    {
+        return m_memoryStatistics;
+    }
+
+    void memoryUsage( Object::MemoryAccumulator &accumulator ) const override
+    {
+        Data::memoryUsage( accumulator );
+        accumulator.accumulate( m_memoryStatistics->member<UInt64Data>( "total" )->readable() );
+    }
+
 protected :
 
+    template<typename T>
+    static size_t vectorMemoryUsage( const std::vector<T>& v )
+    {
+        return v.capacity() * sizeof( T );
+    }
+
+    void computeMemoryStatistics()
+    {
+        // Walk all the mesh maps loaded from the geos files. Those are the bulk of the engine, the variations
+        // and the hierarchy are tiny in comparison so they aren't accounted for.
+        auto& translator = AtomsMetadataTranslator::instance();
+        size_t meshesBytes = 0;
+        size_t blendShapesBytes = 0;
+        size_t skinBytes = 0;
+        size_t metadataBytes = 0;
+        for( const auto& agentTypeIt : m_meshesFileCache )
+        {
+            for( const auto& geoIt : agentTypeIt.second )
+            {
+                if ( !geoIt.second )
+                    continue;
+
+                for( auto meshIt = geoIt.second->cbegin(); meshIt != geoIt.second->cend(); ++meshIt )
+                {
+                    if ( meshIt->second->typeId() != AtomsCore::MapMetadata::staticTypeId() )
+                        continue;
+
+                    auto geoMap = std::static_pointer_cast<const AtomsCore::MapMetadata>( meshIt->second );
+                    for( const auto& meshKey : { "geo", "cloth" } )
+                    {
+                        auto meshMeta = geoMap->getTypedEntry<const AtomsCore::MeshMetadata>( meshKey );
+                        if ( !meshMeta )
+                            continue;
+
+                        auto& mesh = meshMeta->get();
+                        meshesBytes += vectorMemoryUsage( mesh.points() ) + vectorMemoryUsage( mesh.normals() ) +
+                                vectorMemoryUsage( mesh.indices() ) + vectorMemoryUsage( mesh.vertexCount() ) +
+                                vectorMemoryUsage( mesh.uvs() );
+                        for( const auto& uvSet : mesh.uvSets() )
+                        {
+                            meshesBytes += vectorMemoryUsage( uvSet.uvs ) + vectorMemoryUsage( uvSet.uvIndices );
+                        }
+                    }
+
+                    auto blendShapes = geoMap->getTypedEntry<const AtomsCore::ArrayMetadata>( "blendShapes" );
+                    for( size_t blendId = 0; blendShapes && blendId < blendShapes->size(); ++blendId )
+                    {
+                        auto blendMap = blendShapes->getTypedElement<const AtomsCore::MapMetadata>( blendId );
+                        if ( !blendMap )
+                            continue;
+
+                        for( const auto& blendKey : { "P", "N" } )
+                        {
+                            auto blendData = blendMap->getTypedEntry<const AtomsCore::Vector3ArrayMetadata>( blendKey );
+                            if ( blendData )
+                            {
+                                blendShapesBytes += vectorMemoryUsage( blendData->get() );
+                            }
+                        }
+                    }
+
+                    auto jointWeightsAttr = geoMap->getTypedEntry<const AtomsCore::ArrayMetadata>( "jointWeights" );
+                    auto jointIndicesAttr = geoMap->getTypedEntry<const AtomsCore::ArrayMetadata>( "jointIndices" );
+                    if ( jointWeightsAttr && jointIndicesAttr && jointWeightsAttr->size() == jointIndicesAttr->size() )
+                    {
+                        for( size_t wId = 0; wId < jointWeightsAttr->size(); ++wId )
+                        {
+                            auto jointIndices = jointIndicesAttr->getTypedElement<const AtomsCore::IntArrayMetadata>( wId );
+                            auto jointWeights = jointWeightsAttr->getTypedElement<const AtomsCore::DoubleArrayMetadata>( wId );
+                            skinBytes += jointIndices ? vectorMemoryUsage( jointIndices->get() ) : 0;
+                            skinBytes += jointWeights ? vectorMemoryUsage( jointWeights->get() ) : 0;
+                        }
+                    }
+
+                    for( const auto& metadataKey : { "atoms", "arnold" } )
+                    {
+                        auto attributeMap = geoMap->getTypedEntry<const AtomsCore::MapMetadata>( metadataKey );
+                        if ( !attributeMap )
+                            continue;
+
+                        for( auto attrIt = attributeMap->cbegin(); attrIt != attributeMap->cend(); ++attrIt )
+                        {
+                            auto data = translator.translate( attrIt->second );
+                            metadataBytes += attrIt->first.capacity() + ( data ? data->memoryUsage() : 0 );
+                        }
+                    }
+                }
+            }
+        }
+
+        CompoundDataPtr statistics = new CompoundData;
+        auto& members = statistics->writable();
+        members["meshes"] = new UInt64Data( meshesBytes );
+        members["blendShapes"] = new UInt64Data( blendShapesBytes );
+        members["skinWeights"] = new UInt64Data( skinBytes );
+        members["meshMetadata"] = new UInt64Data( metadataBytes );
+        members["total"] = new UInt64Data( meshesBytes + blendShapesBytes + skinBytes + metadataBytes );
+        m_memoryStatistics = statistics;
+    }
+
     void copyFrom( const Object *other, CopyContext *context ) override
     {
         Data::copyFrom( other, context );
@@ -476,6 +679,8 @@ private :
 
     AtomsPtr<AtomsCore::MapMetadata> m_hierarchy;
 
+    ConstCompoundDataPtr m_memoryStatistics;
+
 };
 
 size_t AtomsVariationReader::g_firstPlugIndex = 0;
@@ -542,6 +747,12 @@ const Gaffer::ObjectPlug *AtomsVariationReader::enginePlug() const
 	return getChild<ObjectPlug>( g_firstPlugIndex + 4 );
 }
 
+IECore::CompoundDataPtr AtomsVariationReader::engineMemoryUsage() const
+{
+    ConstEngineDataPtr engineData = static_pointer_cast<const EngineData>( enginePlug()->getValue() );
+    return engineData->memoryStatistics()->copy();
+}
+
 void AtomsVariationReader::affects( const Plug *input, AffectedPlugsContainer &outputs ) const
 {
 	if( input == atomsVariationFilePlug() || input == refreshCountPlug() ||
@@ -708,6 +919,10 @@ IECore::ConstCompoundObjectPtr AtomsVariationReader::computeAttributes( const Sc
     auto& indices = indicesData->writable();
     FloatVectorDataPtr weightsData = new FloatVectorData;
     auto& weights = weightsData->writable();
+    Box3fVectorDataPtr jointBoundsData = new Box3fVectorData;
+    auto& jointBounds = jointBoundsData->writable();
+    bool jointBoundsValid = true;
+    bool hasBlendShapes = false;
 
     for ( auto meshIt = atomsGeo->cbegin(); meshIt != atomsGeo->cend(); ++meshIt )
     {
@@ -718,6 +933,9 @@ IECore::ConstCompoundObjectPtr AtomsVariationReader::computeAttributes( const Sc
         if ( !geoMap )
             continue;
 
+        auto blendShapes = geoMap->getTypedEntry<const AtomsCore::ArrayMetadata>( "blendShapes" );
+        hasBlendShapes = hasBlendShapes || ( blendShapes && blendShapes->size() > 0 );
+
         // Store the skin data as attributes
         auto jointWeightsAttr = geoMap->getTypedEntry<AtomsCore::ArrayMetadata>("jointWeights");
         auto jointIndicesAttr = geoMap->getTypedEntry<AtomsCore::ArrayMetadata>("jointIndices");
@@ -735,6 +953,83 @@ IECore::ConstCompoundObjectPtr AtomsVariationReader::computeAttributes( const Sc
                 indices.insert(indices.end(), jointIndices->get().begin(), jointIndices->get().end());
                 weights.insert(weights.end(), jointWeights->get().begin(), jointWeights->get().end());
             }
+
+            // Store the bind space bound of the points skinned by every joint, so the crowd
+            // generator can bound the agents with one box transform per joint. Skinning blends
+            // the joint transforms, so a skinned point always lies inside the transformed
+            // bounds of its joints. The blend shapes are added to the points first, with
+            // weights between 0 and 1, so the bounds are grown by their positive and negative
+            // deltas
+            auto meshMeta = geoMap->getTypedEntry<AtomsCore::MeshMetadata>( "geo" );
+            if ( !meshMeta )
+            {
+                meshMeta = geoMap->getTypedEntry<AtomsCore::MeshMetadata>( "cloth" );
+            }
+
+            if ( !meshMeta || meshMeta->get().points().size() != jointIndicesAttr->size() )
+            {
+                jointBoundsValid = false;
+            }
+            else
+            {
+                auto& points = meshMeta->get().points();
+                std::vector<const AtomsCore::Vector3ArrayMetadata*> blendPoints;
+                for ( size_t blendId = 0; blendShapes && blendId < blendShapes->size(); ++blendId )
+                {
+                    auto blendMap = blendShapes->getTypedElement<const AtomsCore::MapMetadata>( blendId );
+                    auto blendP = blendMap ? blendMap->getTypedEntry<const AtomsCore::Vector3ArrayMetadata>( "P" ) : nullptr;
+                    if ( blendP && blendP->get().size() == points.size() )
+                    {
+                        blendPoints.push_back( blendP.get() );
+                    }
+                }
+
+                for ( size_t pId = 0; pId < points.size(); ++pId )
+                {
+                    const Imath::V3f point( points[pId] );
+                    Imath::Box3f pointBound( point );
+                    for ( auto blendP : blendPoints )
+                    {
+                        const Imath::V3f delta = Imath::V3f( blendP->get()[pId] ) - point;
+                        for ( int axis = 0; axis < 3; ++axis )
+                        {
+                            ( delta[axis] < 0.0f ? pointBound.min : pointBound.max )[axis] += delta[axis];
+                        }
+                    }
+
+                    auto jointIndices = jointIndicesAttr->getTypedElement<AtomsCore::IntArrayMetadata>( pId );
+                    auto jointWeights = jointWeightsAttr->getTypedElement<AtomsCore::DoubleArrayMetadata>( pId );
+                    if ( !jointIndices || !jointWeights || jointIndices->get().size() != jointWeights->get().size() )
+                    {
+                        // The point doesn't follow any joint, so no joint bound contains it
+                        jointBoundsValid = false;
+                        break;
+                    }
+
+                    bool influenced = false;
+                    for ( size_t i = 0; i < jointIndices->get().size(); ++i )
+                    {
+                        const int joint = jointIndices->get()[i];
+                        if ( joint < 0 || jointWeights->get()[i] <= 0.0 )
+                        {
+                            continue;
+                        }
+
+                        if ( joint >= (int)jointBounds.size() )
+                        {
+                            jointBounds.resize( joint + 1 );
+                        }
+                        jointBounds[joint].extendBy( pointBound );
+                        influenced = true;
+                    }
+
+                    if ( !influenced )
+                    {
+                        jointBoundsValid = false;
+                        break;
+                    }
+                }
+            }
         }
 
         // Convert the atoms metadata to gaffer attribute
@@ -828,6 +1123,23 @@ IECore::ConstCompoundObjectPtr AtomsVariationReader::computeAttributes( const Sc
         result->members()["jointIndexCount"] = indexCountData;
         result->members()["jointIndices"] = indicesData;
         result->members()["jointWeights"] = weightsData;
+        if ( jointBoundsValid )
+        {
+            result->members()["jointBounds"] = jointBoundsData;
+        }
+
+        // Meshes fully weighted to a single joint are rigid, so the crowd generator
+        // can transform them instead of skinning every point
+        bool rigid = !hasBlendShapes && indices.size() == indexCount.size();
+        for ( size_t i = 0; rigid && i < indices.size(); ++i )
+        {
+            rigid = indexCount[i] == 1 && indices[i] == indices[0] && std::abs( weights[i] - 1.0f ) < 1e-4f;
+        }
+
+        if ( rigid )
+        {
+            result->members()["rigidJointIndex"] = new IntData( indices[0] );
+        }
     }
     return result;
 }
@@ -1151,7 +1463,7 @@ void AtomsVariationReader::compute( Gaffer::ValuePlug *output, const Gaffer::Con
 	// branch.
 	if (output == enginePlug()) {
 
-		static_cast<ObjectPlug *>( output )->setValue(new EngineData(atomsVariationFilePlug()->getValue()));
+		static_cast<ObjectPlug *>( output )->setValue(new EngineData( atomsVariationFilePlug()->getValue(), context->canceller() ));
 		return;
 	}
 
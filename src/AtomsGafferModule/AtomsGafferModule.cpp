@@ -37,20 +37,26 @@
 #include "boost/python.hpp"
 
 #include "IECorePython/RunTimeTypedBinding.h"
+#include "IECorePython/ScopedGILRelease.h"
 
 #include "AtomsGaffer/AtomsCrowdReader.h"
 #include "AtomsGaffer/AtomsVariationReader.h"
 #include "AtomsGaffer/AtomsCrowdGenerator.h"
+#include "AtomsGaffer/AtomsCrowdCapsule.h"
 #include "AtomsGaffer/AtomsAttributes.h"
 #include "AtomsGaffer/AtomsMetadata.h"
 #include "AtomsGaffer/AtomsCrowdClothReader.h"
+#include "AtomsGaffer/AtomsSkinning.h"
 
 #include "GafferBindings/DependencyNodeBinding.h"
 #include "IECore/MessageHandler.h"
+#include "IECore/VectorTypedData.h"
 
 #include "Atoms/Initialize.h"
 #include "AtomsUtils/Logger.h"
 
+#include <algorithm>
+
 using namespace boost::python;
 using namespace GafferScene;
 
@@ -83,6 +89,98 @@ public:
 	}
 };
 
+namespace
+{
+
+IECore::CompoundDataPtr crowdReaderEngineMemoryUsage( const AtomsGaffer::AtomsCrowdReader &reader )
+{
+	IECorePython::ScopedGILRelease gilRelease;
+	return reader.engineMemoryUsage();
+}
+
+IECore::CompoundDataPtr variationReaderEngineMemoryUsage( const AtomsGaffer::AtomsVariationReader &reader )
+{
+	IECorePython::ScopedGILRelease gilRelease;
+	return reader.engineMemoryUsage();
+}
+
+void capsuleRender( const AtomsGaffer::AtomsCrowdCapsule &capsule, IECoreScenePreview::Renderer &renderer )
+{
+	IECorePython::ScopedGILRelease gilRelease;
+	capsule.render( &renderer );
+}
+
+// Skins the points and normals in place, with the default or the reference kernel
+void skinData(
+	bool reference,
+	const IECore::M44dVectorData *worldMatrices, const IECore::IntVectorData *jointIndexCount,
+	const IECore::IntVectorData *jointIndices, const IECore::FloatVectorData *jointWeights,
+	IECore::V3fVectorData *points, IECore::V3fVectorData *normals, const IECore::IntVectorData *normalPointIds
+)
+{
+	IECorePython::ScopedGILRelease gilRelease;
+
+	// The kernels don't check their input, so invalid data is rejected here
+	const size_t numPoints = points->readable().size();
+	const size_t numNormals = normals ? normals->readable().size() : 0;
+	bool valid =
+		jointIndexCount->readable().size() == numPoints &&
+		jointIndices->readable().size() == jointWeights->readable().size() &&
+		( !normalPointIds || normalPointIds->readable().size() == numNormals ) &&
+		( !normals || normalPointIds || numNormals == numPoints );
+
+	size_t numInfluences = 0;
+	for( size_t i = 0; valid && i < numPoints; ++i )
+	{
+		const int count = jointIndexCount->readable()[i];
+		valid = count >= 0;
+		numInfluences += valid ? count : 0;
+	}
+	valid = valid && numInfluences == jointIndices->readable().size();
+
+	for( size_t i = 0; valid && i < numInfluences; ++i )
+	{
+		const int joint = jointIndices->readable()[i];
+		valid = joint >= 0 && joint < (int)worldMatrices->readable().size();
+	}
+
+	for( size_t i = 0; valid && normalPointIds && i < numNormals; ++i )
+	{
+		const int pointId = normalPointIds->readable()[i];
+		valid = pointId >= 0 && pointId < (int)numPoints;
+	}
+
+	if( !valid )
+	{
+		throw IECore::InvalidArgumentException( "AtomsGaffer : The points, normals and influences don't match" );
+	}
+
+	auto skinFunction = reference ? &AtomsGaffer::Skinning::skinReference : &AtomsGaffer::Skinning::skin;
+	skinFunction(
+		worldMatrices->readable(), jointIndexCount->readable(), jointIndices->readable(), jointWeights->readable(),
+		points->writable(), normals ? &normals->writable() : nullptr, normalPointIds ? &normalPointIds->readable() : nullptr
+	);
+}
+
+void skin(
+	const IECore::M44dVectorData *worldMatrices, const IECore::IntVectorData *jointIndexCount,
+	const IECore::IntVectorData *jointIndices, const IECore::FloatVectorData *jointWeights,
+	IECore::V3fVectorData *points, IECore::V3fVectorData *normals, const IECore::IntVectorData *normalPointIds
+)
+{
+	skinData( false, worldMatrices, jointIndexCount, jointIndices, jointWeights, points, normals, normalPointIds );
+}
+
+void skinReference(
+	const IECore::M44dVectorData *worldMatrices, const IECore::IntVectorData *jointIndexCount,
+	const IECore::IntVectorData *jointIndices, const IECore::FloatVectorData *jointWeights,
+	IECore::V3fVectorData *points, IECore::V3fVectorData *normals, const IECore::IntVectorData *normalPointIds
+)
+{
+	skinData( true, worldMatrices, jointIndexCount, jointIndices, jointWeights, points, normals, normalPointIds );
+}
+
+} // namespace
 
 BOOST_PYTHON_MODULE( _AtomsGaffer )
 {
@@ -92,13 +190,30 @@ BOOST_PYTHON_MODULE( _AtomsGaffer )
 	Atoms::initAtoms();
 
 	typedef GafferBindings::DependencyNodeWrapper<AtomsGaffer::AtomsCrowdReader> AtomsCrowdReaderWrapper;
-	GafferBindings::DependencyNodeClass<AtomsGaffer::AtomsCrowdReader, AtomsCrowdReaderWrapper>();
+	GafferBindings::DependencyNodeClass<AtomsGaffer::AtomsCrowdReader, AtomsCrowdReaderWrapper>()
+		.def( "engineMemoryUsage", &crowdReaderEngineMemoryUsage )
+		.def( "setOutOfCoreMemoryLimit", &AtomsGaffer::AtomsCrowdReader::setOutOfCoreMemoryLimit ).staticmethod( "setOutOfCoreMemoryLimit" )
+		.def( "getOutOfCoreMemoryLimit", &AtomsGaffer::AtomsCrowdReader::getOutOfCoreMemoryLimit ).staticmethod( "getOutOfCoreMemoryLimit" )
+		.def( "setSharedEngineMemoryLimit", &AtomsGaffer::AtomsCrowdReader::setSharedEngineMemoryLimit ).staticmethod( "setSharedEngineMemoryLimit" )
+		.def( "getSharedEngineMemoryLimit", &AtomsGaffer::AtomsCrowdReader::getSharedEngineMemoryLimit ).staticmethod( "getSharedEngineMemoryLimit" )
+		.def( "sharedEngineMemoryUsage", &AtomsGaffer::AtomsCrowdReader::sharedEngineMemoryUsage ).staticmethod( "sharedEngineMemoryUsage" )
+		.def( "clearSharedEngines", &AtomsGaffer::AtomsCrowdReader::clearSharedEngines ).staticmethod( "clearSharedEngines" )
+	;
 
 	typedef GafferBindings::DependencyNodeWrapper<AtomsGaffer::AtomsVariationReader> AtomsVariationReaderWrapper;
-	GafferBindings::DependencyNodeClass<AtomsGaffer::AtomsVariationReader, AtomsVariationReaderWrapper>();
+	GafferBindings::DependencyNodeClass<AtomsGaffer::AtomsVariationReader, AtomsVariationReaderWrapper>()
+		.def( "engineMemoryUsage", &variationReaderEngineMemoryUsage )
+	;
 
 	typedef GafferBindings::DependencyNodeWrapper<AtomsGaffer::AtomsCrowdGenerator> AtomsCrowdGeneratorWrapper;
-	GafferBindings::DependencyNodeClass<AtomsGaffer::AtomsCrowdGenerator, AtomsCrowdGeneratorWrapper>();
+	GafferBindings::DependencyNodeClass<AtomsGaffer::AtomsCrowdGenerator, AtomsCrowdGeneratorWrapper>()
+		.def( "deformedMeshStatistics", &AtomsGaffer::AtomsCrowdGenerator::deformedMeshStatistics ).staticmethod( "deformedMeshStatistics" )
+		.def( "resetDeformedMeshStatistics", &AtomsGaffer::AtomsCrowdGenerator::resetDeformedMeshStatistics ).staticmethod( "resetDeformedMeshStatistics" )
+	;
+
+	IECorePython::RunTimeTypedClass<AtomsGaffer::AtomsCrowdCapsule>()
+		.def( "render", &capsuleRender )
+	;
 
 	typedef GafferBindings::DependencyNodeWrapper<AtomsGaffer::AtomsAttributes> AtomsAttributesWrapper;
 	GafferBindings::DependencyNodeClass<AtomsGaffer::AtomsAttributes, AtomsAttributesWrapper>();
@@ -108,4 +223,13 @@ BOOST_PYTHON_MODULE( _AtomsGaffer )
 
 	typedef GafferBindings::DependencyNodeWrapper<AtomsGaffer::AtomsMetadata> AtomsMetadataWrapper;
 	GafferBindings::DependencyNodeClass<AtomsGaffer::AtomsMetadata, AtomsMetadataWrapper>();
+
+	def(
+		"skin", &skin,
+		( arg( "worldMatrices" ), arg( "jointIndexCount" ), arg( "jointIndices" ), arg( "jointWeights" ), arg( "points" ), arg( "normals" ) = object(), arg( "normalPointIds" ) = object() )
+	);
+	def(
+		"skinReference", &skinReference,
+		( arg( "worldMatrices" ), arg( "jointIndexCount" ), arg( "jointIndices" ), arg( "jointWeights" ), arg( "points" ), arg( "normals" ) = object(), arg( "normalPointIds" ) = object() )
+	);
 }